@@ -1,28 +1,178 @@
 /* alloc.c */
 
 #include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
 
 #include "common/alloc.h"
 
 #include "common/error.h"
+#include "common/debug.h"
 
-void *ssh_alloc(size_t size)
+static struct SSH_ALLOC_SITE *site_list;
+static __thread struct SSH_ALLOC_WATCH *cur_watch;
+
+static const char *const subsystems[] = { "common", "crypto", "ssh", "main" };
+
+static void site_register(struct SSH_ALLOC_SITE *site)
+{
+  if (__atomic_exchange_n(&site->registered, 1, __ATOMIC_ACQ_REL))
+    return;
+  site->next = __atomic_load_n(&site_list, __ATOMIC_RELAXED);
+  while (! __atomic_compare_exchange_n(&site_list, &site->next, site, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+}
+
+static void count_alloc(struct SSH_ALLOC_SITE *site, void *p)
+{
+  struct SSH_ALLOC_WATCH *watch = cur_watch;
+
+  if (p == NULL)
+    return;
+
+  if (watch != NULL && watch->num_allocs++ == 0 && site != NULL) {
+    watch->first_file = site->file;
+    watch->first_line = site->line;
+  }
+
+  if (site == NULL)
+    return;
+  site_register(site);
+  __atomic_fetch_add(&site->num_allocs, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&site->bytes_allocated, malloc_usable_size(p), __ATOMIC_RELAXED);
+}
+
+static void count_free(struct SSH_ALLOC_SITE *site, size_t size)
+{
+  if (site == NULL)
+    return;
+
+  site_register(site);
+  __atomic_fetch_add(&site->num_frees, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&site->bytes_freed, size, __ATOMIC_RELAXED);
+}
+
+void *ssh_alloc_at(struct SSH_ALLOC_SITE *site, size_t size)
 {
   void *ret = calloc(1, size);
   if (ret == NULL)
     ssh_set_error("out of memory");
+  count_alloc(site, ret);
   return ret;
 }
 
-void *ssh_realloc(void *p, size_t size)
+/*
+ * Like ssh_alloc(), but don't zero the memory.  Use this only when
+ * the caller will overwrite the whole block anyway.
+ */
+void *ssh_alloc_uninit_at(struct SSH_ALLOC_SITE *site, size_t size)
 {
-  void *ret = realloc(p, size);
+  void *ret = malloc(size);
   if (ret == NULL)
     ssh_set_error("out of memory");
+  count_alloc(site, ret);
   return ret;
 }
 
-void ssh_free(void *p)
+void *ssh_realloc_at(struct SSH_ALLOC_SITE *site, void *p, size_t size)
 {
+  size_t old_size = (site != NULL && p != NULL) ? malloc_usable_size(p) : 0;
+  void *ret = realloc(p, size);
+  if (ret == NULL) {
+    ssh_set_error("out of memory");
+    return NULL;
+  }
+  if (p != NULL)
+    count_free(site, old_size);
+  count_alloc(site, ret);
+  return ret;
+}
+
+void ssh_free_at(struct SSH_ALLOC_SITE *site, void *p)
+{
+  if (p == NULL)
+    return;
+  if (site != NULL)
+    count_free(site, malloc_usable_size(p));
   free(p);
 }
+
+/* ------- statistics ------------------------- */
+
+static int site_in_subsystem(const struct SSH_ALLOC_SITE *site, const char *subsystem)
+{
+  const char *dir;
+  size_t len;
+
+  if (subsystem == NULL)
+    return 1;
+  len = strlen(subsystem);
+
+  // __FILE__ is relative to the top directory ("ssh/kex.c"), but
+  // accept a leading path in case of out-of-tree builds
+  for (dir = site->file; dir != NULL; dir = strchr(dir, '/')) {
+    if (*dir == '/')
+      dir++;
+    if (strncmp(dir, subsystem, len) == 0 && dir[len] == '/')
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * Get totals for all call sites in the given subsystem (directory
+ * name, e.g. "ssh"), or for all call sites if 'subsystem' is NULL.
+ */
+void ssh_alloc_get_stats(struct SSH_ALLOC_STATS *stats, const char *subsystem)
+{
+  struct SSH_ALLOC_SITE *site;
+
+  memset(stats, 0, sizeof(*stats));
+  for (site = __atomic_load_n(&site_list, __ATOMIC_ACQUIRE); site != NULL; site = site->next) {
+    if (! site_in_subsystem(site, subsystem))
+      continue;
+    stats->num_allocs += site->num_allocs;
+    stats->num_frees += site->num_frees;
+    stats->bytes_allocated += site->bytes_allocated;
+    stats->bytes_freed += site->bytes_freed;
+  }
+}
+
+void ssh_alloc_dump_stats(void)
+{
+  struct SSH_ALLOC_SITE *site;
+  struct SSH_ALLOC_STATS stats;
+  int i;
+
+  ssh_log("------------------------------------------------------------------------\n");
+  ssh_log("--- allocations per call site\n");
+  for (site = __atomic_load_n(&site_list, __ATOMIC_ACQUIRE); site != NULL; site = site->next)
+    ssh_log("- %s:%-5d allocs %8lu (%10llu bytes)   frees %8lu (%10llu bytes)\n",
+            site->file, site->line, site->num_allocs, site->bytes_allocated, site->num_frees, site->bytes_freed);
+
+  ssh_log("--- allocations per subsystem\n");
+  for (i = 0; i < sizeof(subsystems)/sizeof(subsystems[0]); i++) {
+    ssh_alloc_get_stats(&stats, subsystems[i]);
+    ssh_log("- %-16s allocs %8lu (%10llu bytes)   frees %8lu (%10llu bytes)\n",
+            subsystems[i], stats.num_allocs, stats.bytes_allocated, stats.num_frees, stats.bytes_freed);
+  }
+  ssh_log("------------------------------------------------------------------------\n");
+}
+
+/*
+ * Add the calling thread's allocations to 'watch' until another one
+ * is set, or stop counting if 'watch' is NULL.  Returns the previous
+ * watch, so code that's not part of what's watched can pause it and
+ * put it back.
+ *
+ * Once a connection is warmed up its data path should not touch the
+ * heap, and since each connection runs its loop in one thread this
+ * counts only that connection's allocations.
+ */
+struct SSH_ALLOC_WATCH *ssh_alloc_set_watch(struct SSH_ALLOC_WATCH *watch)
+{
+  struct SSH_ALLOC_WATCH *prev = cur_watch;
+
+  cur_watch = watch;
+  return prev;
+}
@@ -3,8 +3,83 @@
 #ifndef ALLOC_H_FILE
 #define ALLOC_H_FILE
 
-void *ssh_alloc(size_t size);
-void *ssh_realloc(void *p, size_t size);
-void ssh_free(void *p);
+#include <stddef.h>
+
+/*
+ * Set to 0 to disable allocation accounting.  When enabled, every
+ * call to ssh_alloc(), ssh_realloc() and ssh_free() is counted
+ * against its call site (file and line).
+ */
+#ifndef ENABLE_ALLOC_STATS
+#define ENABLE_ALLOC_STATS 1
+#endif
+
+/*
+ * Pluggable allocator.  Implementations embed this struct as their
+ * first member.  'size' is in/out for alloc and realloc: the
+ * allocator may round it up, and the owner must pass back the
+ * returned size when reallocating or freeing the block.
+ */
+struct SSH_ALLOCATOR;
+
+typedef void *(*ssh_allocator_fn_alloc)(struct SSH_ALLOCATOR *allocator, size_t *size);
+typedef void *(*ssh_allocator_fn_realloc)(struct SSH_ALLOCATOR *allocator, void *p, size_t old_size, size_t *new_size);
+typedef void (*ssh_allocator_fn_free)(struct SSH_ALLOCATOR *allocator, void *p, size_t size);
+
+struct SSH_ALLOCATOR {
+  ssh_allocator_fn_alloc alloc;
+  ssh_allocator_fn_realloc realloc;
+  ssh_allocator_fn_free free;
+};
+
+/* allocation counters for a single call site */
+struct SSH_ALLOC_SITE {
+  const char *file;
+  int line;
+  int registered;
+  unsigned long num_allocs;        // includes reallocs
+  unsigned long num_frees;
+  unsigned long long bytes_allocated;
+  unsigned long long bytes_freed;
+  struct SSH_ALLOC_SITE *next;
+};
+
+/*
+ * Allocations made by one thread (usually one connection's main
+ * loop) while watching, see ssh_alloc_set_watch().
+ */
+struct SSH_ALLOC_WATCH {
+  unsigned long num_allocs;        // includes reallocs
+  const char *first_file;          // call site of the first one (NULL if unknown)
+  int first_line;
+};
+
+struct SSH_ALLOC_STATS {
+  unsigned long num_allocs;
+  unsigned long num_frees;
+  unsigned long long bytes_allocated;
+  unsigned long long bytes_freed;
+};
+
+void *ssh_alloc_at(struct SSH_ALLOC_SITE *site, size_t size);
+void *ssh_alloc_uninit_at(struct SSH_ALLOC_SITE *site, size_t size);
+void *ssh_realloc_at(struct SSH_ALLOC_SITE *site, void *p, size_t size);
+void ssh_free_at(struct SSH_ALLOC_SITE *site, void *p);
+
+#if ENABLE_ALLOC_STATS
+#define SSH_ALLOC_SITE_HERE()                                           \
+  ({ static struct SSH_ALLOC_SITE ssh_alloc_site_ = { __FILE__, __LINE__ }; &ssh_alloc_site_; })
+#else
+#define SSH_ALLOC_SITE_HERE() NULL
+#endif
+
+#define ssh_alloc(size)           ssh_alloc_at(SSH_ALLOC_SITE_HERE(), size)
+#define ssh_alloc_uninit(size)    ssh_alloc_uninit_at(SSH_ALLOC_SITE_HERE(), size)
+#define ssh_realloc(p, size)      ssh_realloc_at(SSH_ALLOC_SITE_HERE(), p, size)
+#define ssh_free(p)               ssh_free_at(SSH_ALLOC_SITE_HERE(), p)
+
+void ssh_alloc_get_stats(struct SSH_ALLOC_STATS *stats, const char *subsystem);
+void ssh_alloc_dump_stats(void);
+struct SSH_ALLOC_WATCH *ssh_alloc_set_watch(struct SSH_ALLOC_WATCH *watch);
 
 #endif /* ALLOC_H_FILE */
@@ -0,0 +1,141 @@
+/* arena.c
+ *
+ * Bump allocator for short-lived data that is all released at the
+ * same time (e.g. everything allocated during key exchange).
+ *
+ * Allocations are not zeroed.  Since arenas are used for key
+ * exchange scratch data, all blocks are wiped when the arena is
+ * released.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "common/arena.h"
+
+#include "common/error.h"
+#include "common/alloc.h"
+
+#define ARENA_ALIGN 16
+#define ARENA_ALIGN_UP(n) (((n) + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1))
+
+struct SSH_ARENA_BLOCK {
+  struct SSH_ARENA_BLOCK *next;
+  size_t size;
+  size_t used;
+};
+
+#define BLOCK_HEADER_SIZE ARENA_ALIGN_UP(sizeof(struct SSH_ARENA_BLOCK))
+#define BLOCK_DATA(b) ((uint8_t *) (b) + BLOCK_HEADER_SIZE)
+
+static void *arena_fn_alloc(struct SSH_ALLOCATOR *allocator, size_t *size);
+static void *arena_fn_realloc(struct SSH_ALLOCATOR *allocator, void *p, size_t old_size, size_t *new_size);
+static void arena_fn_free(struct SSH_ALLOCATOR *allocator, void *p, size_t size);
+
+void ssh_arena_init(struct SSH_ARENA *arena, size_t block_size)
+{
+  arena->allocator.alloc = arena_fn_alloc;
+  arena->allocator.realloc = arena_fn_realloc;
+  arena->allocator.free = arena_fn_free;
+  arena->blocks = NULL;
+  arena->block_size = block_size;
+  arena->last_alloc = NULL;
+}
+
+/* wipe and free all memory allocated from the arena */
+void ssh_arena_release(struct SSH_ARENA *arena)
+{
+  struct SSH_ARENA_BLOCK *block, *next;
+
+  for (block = arena->blocks; block != NULL; block = next) {
+    next = block->next;
+    memset(BLOCK_DATA(block), 0, block->size);
+    ssh_free(block);
+  }
+  arena->blocks = NULL;
+  arena->last_alloc = NULL;
+}
+
+struct SSH_ALLOCATOR *ssh_arena_get_allocator(struct SSH_ARENA *arena)
+{
+  return &arena->allocator;
+}
+
+void *ssh_arena_alloc(struct SSH_ARENA *arena, size_t size)
+{
+  struct SSH_ARENA_BLOCK *block = arena->blocks;
+  size_t alloc_size;
+  void *ret;
+
+  if (size > SIZE_MAX - BLOCK_HEADER_SIZE - ARENA_ALIGN) {
+    ssh_set_error("arena allocation too large");
+    return NULL;
+  }
+  alloc_size = ARENA_ALIGN_UP(size);
+
+  if (block == NULL || block->size - block->used < alloc_size) {
+    size_t block_size = (alloc_size > arena->block_size) ? alloc_size : arena->block_size;
+
+    if ((block = ssh_alloc_uninit(BLOCK_HEADER_SIZE + block_size)) == NULL)
+      return NULL;
+    block->size = block_size;
+    block->used = 0;
+    block->next = arena->blocks;
+    arena->blocks = block;
+  }
+
+  ret = BLOCK_DATA(block) + block->used;
+  block->used += alloc_size;
+  arena->last_alloc = ret;
+  return ret;
+}
+
+static void *arena_fn_alloc(struct SSH_ALLOCATOR *allocator, size_t *size)
+{
+  struct SSH_ARENA *arena = (struct SSH_ARENA *) allocator;
+  void *ret;
+
+  if ((ret = ssh_arena_alloc(arena, *size)) == NULL)
+    return NULL;
+  *size = ARENA_ALIGN_UP(*size);
+  return ret;
+}
+
+static void *arena_fn_realloc(struct SSH_ALLOCATOR *allocator, void *p, size_t old_size, size_t *new_size)
+{
+  struct SSH_ARENA *arena = (struct SSH_ARENA *) allocator;
+  struct SSH_ARENA_BLOCK *block = arena->blocks;
+  void *ret;
+
+  if (p == NULL)
+    return arena_fn_alloc(allocator, new_size);
+
+  // grow in place if this is the most recent allocation
+  if (p == arena->last_alloc && *new_size <= SIZE_MAX - ARENA_ALIGN) {
+    size_t start = (uint8_t *) p - BLOCK_DATA(block);
+    size_t alloc_size = ARENA_ALIGN_UP(*new_size);
+    if (block->size - start >= alloc_size) {
+      block->used = start + alloc_size;
+      *new_size = alloc_size;
+      return p;
+    }
+  }
+
+  if ((ret = arena_fn_alloc(allocator, new_size)) == NULL)
+    return NULL;
+  memcpy(ret, p, (old_size < *new_size) ? old_size : *new_size);
+  return ret;
+}
+
+static void arena_fn_free(struct SSH_ALLOCATOR *allocator, void *p, size_t size)
+{
+  struct SSH_ARENA *arena = (struct SSH_ARENA *) allocator;
+
+  // memory is only reclaimed for the most recent allocation, the
+  // rest is released with the arena
+  if (p != NULL && p == arena->last_alloc) {
+    arena->blocks->used = (uint8_t *) p - BLOCK_DATA(arena->blocks);
+    arena->last_alloc = NULL;
+  }
+}
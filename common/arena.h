@@ -0,0 +1,24 @@
+/* arena.h */
+
+#ifndef ARENA_H_FILE
+#define ARENA_H_FILE
+
+#include <stddef.h>
+
+#include "common/alloc.h"
+
+struct SSH_ARENA_BLOCK;
+
+struct SSH_ARENA {
+  struct SSH_ALLOCATOR allocator;
+  struct SSH_ARENA_BLOCK *blocks;
+  size_t block_size;
+  void *last_alloc;
+};
+
+void ssh_arena_init(struct SSH_ARENA *arena, size_t block_size);
+void ssh_arena_release(struct SSH_ARENA *arena);
+struct SSH_ALLOCATOR *ssh_arena_get_allocator(struct SSH_ARENA *arena);
+void *ssh_arena_alloc(struct SSH_ARENA *arena, size_t size);
+
+#endif /* ARENA_H_FILE */
@@ -1,4 +1,4 @@
-/* packet.c */
+/* buffer.c */
 
 #include <stdlib.h>
 #include <string.h>
@@ -8,7 +8,8 @@
 #include "common/error.h"
 #include "common/alloc.h"
 
-#define BUFFER_GROW_SIZE 256
+#define BUFFER_MIN_SIZE     64   // must be a power of 2
+#define BUFFER_GROW_FACTOR  2
 
 /* check if 'a + b' doesn't overflow, if ok store the result in *ret */
 static int checked_add(size_t *ret, size_t a, size_t b)
@@ -39,18 +40,12 @@ static int check_advance(size_t pos, size_t adv, size_t len)
 
 uint32_t ssh_buf_get_u32(uint8_t *data)
 {
-  return ((  (uint32_t) data[0] << 24)
-          | ((uint32_t) data[1] << 16)
-          | ((uint32_t) data[2] <<  8)
-          | ((uint32_t) data[3]));
+  return ssh_buf_load_be32(data);
 }
 
 void ssh_buf_set_u32(uint8_t *data, uint32_t v)
 {
-  *data++ = v >> 24;
-  *data++ = v >> 16;
-  *data++ = v >> 8;
-  *data++ = v;
+  ssh_buf_store_be32(data, v);
 }
 
 /* --------------------------------------------------------------------- */
@@ -84,6 +79,16 @@ struct SSH_STRING ssh_str_new_empty(void)
   return str;
 }
 
+/* the string is not copied, so it must not be modified */
+struct SSH_STRING ssh_str_new_from_cstring(const char *str)
+{
+  struct SSH_STRING ret = {
+    .str = (uint8_t *) str,
+    .len = strlen(str)
+  };
+  return ret;
+}
+
 int ssh_str_alloc(struct SSH_STRING *new_str, size_t len)
 {
   new_str->len = len;
@@ -156,17 +161,41 @@ struct SSH_BUFFER ssh_buf_new(void)
   struct SSH_BUFFER ret = {
     .data = NULL,
     .len = 0,
-    .cap = 0
+    .cap = 0,
+    .flags = 0,
+    .allocator = NULL
   };
   return ret;
 }
 
-void ssh_buf_free(struct SSH_BUFFER *buf)
+struct SSH_BUFFER ssh_buf_new_with_allocator(struct SSH_ALLOCATOR *allocator)
 {
-  ssh_free(buf->data);
-  buf->data = NULL;
-  buf->len = 0;
-  buf->cap = 0;
+  struct SSH_BUFFER ret = {
+    .data = NULL,
+    .len = 0,
+    .cap = 0,
+    .flags = 0,
+    .allocator = allocator
+  };
+  return ret;
+}
+
+/*
+ * Create an empty buffer that uses the given storage until it needs
+ * to grow past 'size' bytes, at which point the contents are moved
+ * to the heap.  The storage must outlive the buffer (and any copies
+ * of it).
+ */
+struct SSH_BUFFER ssh_buf_new_with_storage(uint8_t *storage, size_t size)
+{
+  struct SSH_BUFFER ret = {
+    .data = storage,
+    .len = 0,
+    .cap = size,
+    .flags = SSH_BUF_FLAG_BORROWED,
+    .allocator = NULL
+  };
+  return ret;
 }
 
 struct SSH_BUFFER ssh_buf_new_from_data(uint8_t *data, size_t len)
@@ -174,43 +203,122 @@ struct SSH_BUFFER ssh_buf_new_from_data(uint8_t *data, size_t len)
   struct SSH_BUFFER ret = {
     .data = data,
     .len = len,
-    .cap = len
+    .cap = len,
+    .flags = SSH_BUF_FLAG_BORROWED,
+    .allocator = NULL
   };
   return ret;
 }
 
-int ssh_buf_ensure_size(struct SSH_BUFFER *buf, size_t new_len)
+static void buf_free_data(struct SSH_BUFFER *buf)
 {
-  if (buf->cap >= new_len)
-    return 0;
+  if (buf->flags & SSH_BUF_FLAG_BORROWED)
+    return;
+  if (buf->allocator != NULL)
+    buf->allocator->free(buf->allocator, buf->data, buf->cap);
+  else
+    ssh_free(buf->data);
+}
 
-  return ssh_buf_grow(buf, new_len - buf->len);
+void ssh_buf_free(struct SSH_BUFFER *buf)
+{
+  buf_free_data(buf);
+  buf->data = NULL;
+  buf->len = 0;
+  buf->cap = 0;
+  buf->flags = 0;
 }
 
-int ssh_buf_grow(struct SSH_BUFFER *buf, size_t add_len)
+/* change capacity to exactly 'new_cap' (or what the allocator rounds it up to) */
+static int buf_realloc(struct SSH_BUFFER *buf, size_t new_cap)
 {
   void *new_data;
+
+  if (buf->flags & SSH_BUF_FLAG_BORROWED) {
+    // move out of borrowed storage
+    if (buf->allocator != NULL)
+      new_data = buf->allocator->alloc(buf->allocator, &new_cap);
+    else
+      new_data = ssh_alloc_uninit(new_cap);
+    if (new_data == NULL)
+      return -1;
+    memcpy(new_data, buf->data, (buf->len < new_cap) ? buf->len : new_cap);
+    buf->flags &= ~SSH_BUF_FLAG_BORROWED;
+  } else {
+    if (buf->allocator != NULL)
+      new_data = buf->allocator->realloc(buf->allocator, buf->data, buf->cap, &new_cap);
+    else
+      new_data = ssh_realloc(buf->data, new_cap);
+    if (new_data == NULL)
+      return -1;
+  }
+
+  buf->data = new_data;
+  buf->cap = new_cap;
+  return 0;
+}
+
+/*
+ * Make sure the buffer has room for at least 'cap' bytes in total.
+ * Unlike ssh_buf_grow(), this allocates exactly what's asked for
+ * (rounded up to BUFFER_MIN_SIZE), so use it when the final size is
+ * known in advance.
+ */
+int ssh_buf_reserve(struct SSH_BUFFER *buf, size_t cap)
+{
   size_t new_cap;
 
-  /* get desired length */
-  if (checked_add(&new_cap, buf->len, add_len) < 0)
-    return -1;
-  if (buf->cap >= new_cap)
+  if (buf->cap >= cap)
     return 0;
-
-  /* round length up */
-  if (checked_add(&new_cap, new_cap, BUFFER_GROW_SIZE+1) < 0)
+  if (checked_add(&new_cap, cap, BUFFER_MIN_SIZE-1) < 0)
     return -1;
-  new_cap = new_cap / BUFFER_GROW_SIZE * BUFFER_GROW_SIZE;
+  new_cap &= ~(size_t)(BUFFER_MIN_SIZE-1);
+  return buf_realloc(buf, new_cap);
+}
+
+/*
+ * Make sure there's room to add 'add_len' bytes.  Capacity grows
+ * geometrically, so appending data a little at a time takes O(1)
+ * amortized reallocs.
+ */
+int ssh_buf_grow(struct SSH_BUFFER *buf, size_t add_len)
+{
+  size_t need_cap, new_cap;
 
-  /* grow to new length */
-  new_data = ssh_realloc(buf->data, new_cap);
-  if (new_data == NULL)
+  if (checked_add(&need_cap, buf->len, add_len) < 0)
     return -1;
+  if (buf->cap >= need_cap)
+    return 0;
 
-  buf->data = new_data;
-  buf->cap = new_cap;
-  return 0;
+  new_cap = (buf->cap < BUFFER_MIN_SIZE) ? BUFFER_MIN_SIZE : buf->cap;
+  while (new_cap < need_cap) {
+    if (new_cap > SIZE_MAX / BUFFER_GROW_FACTOR) {
+      new_cap = need_cap;
+      break;
+    }
+    new_cap *= BUFFER_GROW_FACTOR;
+  }
+  return buf_realloc(buf, new_cap);
+}
+
+/*
+ * Release unused capacity.  Buffers using borrowed storage are left
+ * alone.
+ */
+int ssh_buf_shrink(struct SSH_BUFFER *buf)
+{
+  size_t new_cap;
+
+  if ((buf->flags & SSH_BUF_FLAG_BORROWED) || buf->cap == buf->len)
+    return 0;
+  if (buf->len == 0) {
+    buf_free_data(buf);
+    buf->data = NULL;
+    buf->cap = 0;
+    return 0;
+  }
+  new_cap = buf->len;
+  return buf_realloc(buf, new_cap);
 }
 
 void ssh_buf_clear(struct SSH_BUFFER *buf)
@@ -241,10 +349,8 @@ int ssh_buf_write_u32(struct SSH_BUFFER *buf, uint32_t val)
 {
   if (ssh_buf_grow(buf, 4) < 0)
     return -1;
-  buf->data[buf->len++] = val >> 24;
-  buf->data[buf->len++] = val >> 16;
-  buf->data[buf->len++] = val >> 8;
-  buf->data[buf->len++] = val;
+  ssh_buf_store_be32(buf->data + buf->len, val);
+  buf->len += 4;
   return 0;
 }
 
@@ -396,10 +502,7 @@ int ssh_buf_read_u32(struct SSH_BUF_READER *buf, uint32_t *ret_val)
     return -1;
 
   if (ret_val != NULL)
-    *ret_val = ((  (uint32_t) buf->data[buf->pos  ] << 24)
-                | ((uint32_t) buf->data[buf->pos+1] << 16)
-                | ((uint32_t) buf->data[buf->pos+2] << 8)
-                | ((uint32_t) buf->data[buf->pos+3]));
+    *ret_val = ssh_buf_load_be32(buf->data + buf->pos);
   buf->pos += 4;
   return 0;
 }
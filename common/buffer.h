@@ -6,12 +6,27 @@
 #include <stddef.h>
 #include <stdint.h>
 
+struct SSH_ALLOCATOR;
+
+/* buffer flags */
+#define SSH_BUF_FLAG_BORROWED  (1<<0)   // data is not owned by the buffer
+
 struct SSH_BUFFER {
   uint8_t *data;
   size_t cap;
   size_t len;
+  uint32_t flags;
+  struct SSH_ALLOCATOR *allocator;  // NULL to use ssh_alloc()
 };
 
+/*
+ * Declare a buffer that starts out using 'size' bytes of local
+ * storage and only moves to the heap if it outgrows it.
+ */
+#define SSH_BUF_DECLARE_INLINE(name, size)                              \
+  uint8_t name##_storage_[size];                                        \
+  struct SSH_BUFFER name = ssh_buf_new_with_storage(name##_storage_, sizeof(name##_storage_))
+
 struct SSH_BUF_READER {
   uint8_t *data;
   size_t pos;
@@ -23,11 +38,31 @@ struct SSH_STRING {
   size_t len;
 };
 
+/* unaligned big-endian load/store */
+static inline uint32_t ssh_buf_load_be32(const uint8_t *p)
+{
+  uint32_t v;
+  __builtin_memcpy(&v, p, 4);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  v = __builtin_bswap32(v);
+#endif
+  return v;
+}
+
+static inline void ssh_buf_store_be32(uint8_t *p, uint32_t v)
+{
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  v = __builtin_bswap32(v);
+#endif
+  __builtin_memcpy(p, &v, 4);
+}
+
 uint32_t ssh_buf_get_u32(uint8_t *data);
 void ssh_buf_set_u32(uint8_t *data, uint32_t v);
 
 struct SSH_STRING ssh_str_new(uint8_t *data, size_t len);
 struct SSH_STRING ssh_str_new_empty(void);
+struct SSH_STRING ssh_str_new_from_cstring(const char *str);
 struct SSH_STRING ssh_str_new_from_buffer(struct SSH_BUFFER *buf);
 int ssh_str_alloc(struct SSH_STRING *new_str, size_t len);
 int ssh_str_dup_cstring(struct SSH_STRING *new_str, const char *str);
@@ -38,11 +73,15 @@ int ssh_str_cmp_cstring(const struct SSH_STRING *str, const char *str2);
 void ssh_str_free(struct SSH_STRING *str);
 
 struct SSH_BUFFER ssh_buf_new(void);
+struct SSH_BUFFER ssh_buf_new_with_allocator(struct SSH_ALLOCATOR *allocator);
 struct SSH_BUFFER ssh_buf_new_from_data(uint8_t *data, size_t len);
+struct SSH_BUFFER ssh_buf_new_with_storage(uint8_t *storage, size_t size);
 void ssh_buf_free(struct SSH_BUFFER *buf);
 void ssh_buf_clear(struct SSH_BUFFER *buf);
 int ssh_buf_grow(struct SSH_BUFFER *buf, size_t add_len);
-int ssh_buf_ensure_size(struct SSH_BUFFER *buf, size_t new_len);
+int ssh_buf_reserve(struct SSH_BUFFER *buf, size_t cap);
+int ssh_buf_shrink(struct SSH_BUFFER *buf);
+#define ssh_buf_ensure_size ssh_buf_reserve
 uint8_t *ssh_buf_get_write_pointer(struct SSH_BUFFER *buf, size_t len);
 int ssh_buf_write_u8(struct SSH_BUFFER *buf, uint8_t val);
 int ssh_buf_write_u32(struct SSH_BUFFER *buf, uint32_t val);
@@ -10,6 +10,7 @@
 #define DEBUG_CONN       0
 #define DEBUG_KEX        0
 #define DEBUG_USERAUTH   0
+#define DEBUG_ALLOC      0
 
 void ssh_log(const char *fmt, ...)  __attribute__ ((format (printf, 1, 2)));
 void dump_string(const char *label, const struct SSH_STRING *str);
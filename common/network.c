@@ -9,9 +9,11 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 
 #include "common/network_i.h"
+#include "common/resolver.h"
 
 #include "common/error.h"
 #include "common/debug.h"
@@ -37,6 +39,33 @@ static int make_connection(int sock, const struct sockaddr *addr, socklen_t addr
   }
 }
 
+/*
+ * Connect sending 'data' with the SYN (TCP Fast Open) if the kernel
+ * has a cookie for the server.  Without a cookie, the kernel asks the
+ * server for one and sends the data after the handshake.  Falls back
+ * to a normal connect, with no data sent, where TCP Fast Open is not
+ * available.
+ */
+static int make_fast_open_connection(int sock, const struct sockaddr *addr, socklen_t addrlen, const void *data, size_t len, size_t *ret_sent)
+{
+#ifdef MSG_FASTOPEN
+  while (1) {
+    ssize_t ret = sendto(sock, data, len, MSG_FASTOPEN, addr, addrlen);
+    if (ret >= 0) {
+      *ret_sent = ret;
+      return 0;
+    }
+    if (errno == EINTR)
+      continue;
+    if (errno != EOPNOTSUPP && errno != EINVAL && errno != ENOPROTOOPT)
+      return -1;
+    break;
+  }
+#endif
+  *ret_sent = 0;
+  return make_connection(sock, addr, addrlen);
+}
+
 int ssh_net_set_sock_blocking(int sock, int block)
 {
   int flags;
@@ -65,36 +94,103 @@ int ssh_net_set_sock_blocking(int sock, int block)
   return 0;
 }
 
+/*
+ * Ask the kernel to pace the socket's output at 'rate' bytes per
+ * second (0 for no limit).  Does nothing where SO_MAX_PACING_RATE isn't
+ * available.
+ */
+int ssh_net_set_pacing_rate(int sock, uint64_t rate)
+{
+#ifdef SO_MAX_PACING_RATE
+  uint64_t val = (rate == 0) ? ~0ull : rate;
+
+  // older kernels only take a 32-bit value
+  if (setsockopt(sock, SOL_SOCKET, SO_MAX_PACING_RATE, &val, sizeof(val)) < 0) {
+    unsigned int val32 = (val > 0xffffffffu) ? ~0u : (unsigned int) val;
+    if (setsockopt(sock, SOL_SOCKET, SO_MAX_PACING_RATE, &val32, sizeof(val32)) < 0) {
+      ssh_set_error("can't set socket pacing rate");
+      return -1;
+    }
+  }
+#endif
+  return 0;
+}
+
+/*
+ * Limit the data not yet sent kept by the kernel for the socket, so
+ * it's only reported as writable when there's less than 'len' bytes
+ * waiting.  Does nothing where TCP_NOTSENT_LOWAT isn't available.
+ */
+int ssh_net_set_notsent_lowat(int sock, int len)
+{
+#ifdef TCP_NOTSENT_LOWAT
+  if (setsockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &len, sizeof(len)) < 0) {
+    ssh_set_error("can't set socket TCP_NOTSENT_LOWAT");
+    return -1;
+  }
+#endif
+  return 0;
+}
+
+/*
+ * Return 1 if the server acknowledged data sent in the SYN of the
+ * connected socket.
+ */
+int ssh_net_syn_data_acked(int sock)
+{
+#if defined(TCP_INFO) && defined(TCPI_OPT_SYN_DATA)
+  struct tcp_info info;
+  socklen_t len = sizeof(info);
+
+  if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &len) == 0 && (info.tcpi_options & TCPI_OPT_SYN_DATA) != 0)
+    return 1;
+#endif
+  return 0;
+}
+
 int ssh_net_connect(const char *server, const char *port)
 {
-  struct addrinfo addr_hints;
-  struct addrinfo *addr_result, *addr;
-  int sock, ret;
-  
-  memset(&addr_hints, 0, sizeof(struct addrinfo));
-  addr_hints.ai_family = AF_UNSPEC;    /* IPv4 or IPv6 */
-  addr_hints.ai_socktype = SOCK_STREAM;
-  addr_hints.ai_flags = 0;
-  addr_hints.ai_protocol = 0;
-
-  ret = getaddrinfo(server, port, &addr_hints, &addr_result);
-  if (ret != 0) {
-    ssh_set_error("can't resolve server '%s', port '%s': %s", server, port, gai_strerror(ret));
+  return ssh_net_connect_fast_open(server, port, NULL, 0, NULL);
+}
+
+/*
+ * Connect to the server.  The name is resolved with the shared
+ * resolver (common/resolver.c), so it's only looked up once for
+ * many connections, and not at all if it was prefetched.
+ *
+ * If 'data' is not NULL, try to send it with TCP Fast Open;
+ * '*ret_sent' is set to how much of it was sent, and the caller must
+ * send the rest.
+ */
+int ssh_net_connect_fast_open(const char *server, const char *port, const void *data, size_t len, size_t *ret_sent)
+{
+  const struct SSH_RESOLVER_ADDR *addrs;
+  struct SSH_RESOLVER_QUERY *query;
+  int i, num_addrs, sock;
+
+  if ((query = ssh_resolver_query_start(server, port)) == NULL)
+    return -1;
+  if (ssh_resolver_query_wait(query) < 0
+      || (num_addrs = ssh_resolver_query_get_addrs(query, &addrs)) < 0) {
+    ssh_resolver_query_free(query);
     return -1;
   }
 
   sock = -1;
-  for (addr = addr_result; addr != NULL; addr = addr->ai_next) {
-    sock = make_socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+  for (i = 0; i < num_addrs; i++) {
+    sock = make_socket(addrs[i].family, addrs[i].socktype, addrs[i].protocol);
     if (sock < 0)
       continue;
-    if (make_connection(sock, addr->ai_addr, addr->ai_addrlen) == 0)
+    if (data != NULL) {
+      if (make_fast_open_connection(sock, (const struct sockaddr *) &addrs[i].addr, addrs[i].addr_len, data, len, ret_sent) == 0)
+        break;
+    } else if (make_connection(sock, (const struct sockaddr *) &addrs[i].addr, addrs[i].addr_len) == 0)
       break;
     close(sock);
     sock = -1;
   }
 
-  freeaddrinfo(addr_result);
+  ssh_resolver_query_free(query);
   if (sock < 0)
     ssh_set_error("can't connect to server");
   return sock;
@@ -134,24 +230,34 @@ ssize_t ssh_net_write(int sock, const void *data, size_t len)
 
 ssize_t ssh_net_read(int sock, void *data, size_t len)
 {
-  ssize_t len_left;
+  return ssh_net_read_ahead(sock, data, len, len);
+}
+
+/*
+ * Read at least 'len' bytes (less if the socket would block), and
+ * take up to 'max_len' if that much is already available.  Never
+ * waits for more than 'len' bytes.
+ */
+ssize_t ssh_net_read_ahead(int sock, void *data, size_t len, size_t max_len)
+{
+  size_t done;
   uint8_t *p;
 
-  if (len > SSIZE_MAX) {
+  if (max_len > SSIZE_MAX) {
     ssh_set_error("read too large");
     errno = 0;
     return -1;
   }
 
   p = data;
-  len_left = len;
-  while (len_left > 0) {
-    ssize_t ret = read(sock, p, len_left);
+  done = 0;
+  while (done < len) {
+    ssize_t ret = read(sock, p + done, max_len - done);
     if (ret < 0) {
       if (errno == EINTR)
         continue;
       if (errno == EWOULDBLOCK || errno == EAGAIN)
-        return len - len_left;
+        return done;
       ssh_set_error("read error");
       return -1;
     }
@@ -160,8 +266,7 @@ ssize_t ssh_net_read(int sock, void *data, size_t len)
       errno = 0;
       return -1;
     }
-    p += ret;
-    len_left -= ret;
+    done += ret;
   }
-  return len;
+  return done;
 }
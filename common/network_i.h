@@ -3,10 +3,18 @@
 #ifndef NETWORK_I_H_FILE
 #define NETWORK_I_H_FILE
 
+#include <stdint.h>
+#include <sys/types.h>
+
 int ssh_net_connect(const char *server, const char *port);
+int ssh_net_connect_fast_open(const char *server, const char *port, const void *data, size_t len, size_t *ret_sent);
+int ssh_net_syn_data_acked(int sock);
 int ssh_net_set_sock_blocking(int sock, int block);
+int ssh_net_set_pacing_rate(int sock, uint64_t rate);
+int ssh_net_set_notsent_lowat(int sock, int len);
 ssize_t ssh_net_write(int sock, const void *data, size_t len);
 ssize_t ssh_net_read(int sock, void *data, size_t max_len);
+ssize_t ssh_net_read_ahead(int sock, void *data, size_t len, size_t max_len);
 
 #endif /* NETWORK_I_H_FILE */
 
@@ -0,0 +1,137 @@
+/* pool.c
+ *
+ * Size-class pool for packet buffers.  Blocks are rounded up to the
+ * next size class, and freed blocks are kept in a per-class free
+ * list to be reused by the next buffer that needs the same size.
+ * Blocks larger than the largest class go directly to the heap.
+ *
+ * Packet buffers hold plaintext (including passwords), so blocks are
+ * wiped when freed, before they can be handed out again.  Buffers
+ * only free their blocks when they grow or are destroyed, never in
+ * the steady-state data path, so this costs little.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "common/pool.h"
+
+#include "common/error.h"
+#include "common/alloc.h"
+
+#define POOL_MIN_CLASS_SHIFT   8    // 256 bytes
+#define POOL_CLASS_SHIFT_STEP  2    // each class is 4x the previous
+#define POOL_MAX_FREE_BLOCKS   4    // max cached blocks per class
+
+#define POOL_CLASS_SIZE(c) ((size_t) 1 << (POOL_MIN_CLASS_SHIFT + (c) * POOL_CLASS_SHIFT_STEP))
+
+struct SSH_POOL_FREE_BLOCK {
+  struct SSH_POOL_FREE_BLOCK *next;
+};
+
+static void *pool_fn_alloc(struct SSH_ALLOCATOR *allocator, size_t *size);
+static void *pool_fn_realloc(struct SSH_ALLOCATOR *allocator, void *p, size_t old_size, size_t *new_size);
+static void pool_fn_free(struct SSH_ALLOCATOR *allocator, void *p, size_t size);
+
+static int pool_get_class(size_t size)
+{
+  int c;
+
+  for (c = 0; c < SSH_POOL_NUM_CLASSES; c++)
+    if (size <= POOL_CLASS_SIZE(c))
+      return c;
+  return -1;
+}
+
+void ssh_pool_init(struct SSH_POOL *pool)
+{
+  int c;
+
+  pool->allocator.alloc = pool_fn_alloc;
+  pool->allocator.realloc = pool_fn_realloc;
+  pool->allocator.free = pool_fn_free;
+  for (c = 0; c < SSH_POOL_NUM_CLASSES; c++) {
+    pool->free_list[c] = NULL;
+    pool->num_free[c] = 0;
+  }
+}
+
+/*
+ * Free all cached blocks.  Blocks still owned by buffers must be
+ * freed before calling this.
+ */
+void ssh_pool_destroy(struct SSH_POOL *pool)
+{
+  int c;
+
+  for (c = 0; c < SSH_POOL_NUM_CLASSES; c++) {
+    while (pool->free_list[c] != NULL) {
+      struct SSH_POOL_FREE_BLOCK *block = pool->free_list[c];
+      pool->free_list[c] = block->next;
+      ssh_free(block);
+    }
+    pool->num_free[c] = 0;
+  }
+}
+
+struct SSH_ALLOCATOR *ssh_pool_get_allocator(struct SSH_POOL *pool)
+{
+  return &pool->allocator;
+}
+
+static void *pool_fn_alloc(struct SSH_ALLOCATOR *allocator, size_t *size)
+{
+  struct SSH_POOL *pool = (struct SSH_POOL *) allocator;
+  struct SSH_POOL_FREE_BLOCK *block;
+  int c;
+
+  if ((c = pool_get_class(*size)) < 0)
+    return ssh_alloc_uninit(*size);
+
+  *size = POOL_CLASS_SIZE(c);
+  if ((block = pool->free_list[c]) != NULL) {
+    pool->free_list[c] = block->next;
+    pool->num_free[c]--;
+    return block;
+  }
+  return ssh_alloc_uninit(*size);
+}
+
+static void pool_fn_free(struct SSH_ALLOCATOR *allocator, void *p, size_t size)
+{
+  struct SSH_POOL *pool = (struct SSH_POOL *) allocator;
+  struct SSH_POOL_FREE_BLOCK *block = p;
+  int c;
+
+  if (p == NULL)
+    return;
+  memset(p, 0, size);
+  if ((c = pool_get_class(size)) < 0 || pool->num_free[c] >= POOL_MAX_FREE_BLOCKS) {
+    ssh_free(p);
+    return;
+  }
+  block->next = pool->free_list[c];
+  pool->free_list[c] = block;
+  pool->num_free[c]++;
+}
+
+static void *pool_fn_realloc(struct SSH_ALLOCATOR *allocator, void *p, size_t old_size, size_t *new_size)
+{
+  void *ret;
+
+  if (p == NULL)
+    return pool_fn_alloc(allocator, new_size);
+  if (*new_size <= old_size) {
+    *new_size = old_size;
+    return p;
+  }
+
+  // never realloc() in place: the old block must be wiped, even when
+  // it's too large for the free lists
+  if ((ret = pool_fn_alloc(allocator, new_size)) == NULL)
+    return NULL;
+  memcpy(ret, p, old_size);
+  pool_fn_free(allocator, p, old_size);
+  return ret;
+}
@@ -0,0 +1,25 @@
+/* pool.h */
+
+#ifndef POOL_H_FILE
+#define POOL_H_FILE
+
+#include <stddef.h>
+
+#include "common/alloc.h"
+
+/* size classes: 256, 1K, 4K, 16K, 64K, 256K */
+#define SSH_POOL_NUM_CLASSES 6
+
+struct SSH_POOL_FREE_BLOCK;
+
+struct SSH_POOL {
+  struct SSH_ALLOCATOR allocator;
+  struct SSH_POOL_FREE_BLOCK *free_list[SSH_POOL_NUM_CLASSES];
+  unsigned int num_free[SSH_POOL_NUM_CLASSES];
+};
+
+void ssh_pool_init(struct SSH_POOL *pool);
+void ssh_pool_destroy(struct SSH_POOL *pool);
+struct SSH_ALLOCATOR *ssh_pool_get_allocator(struct SSH_POOL *pool);
+
+#endif /* POOL_H_FILE */
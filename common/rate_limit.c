@@ -0,0 +1,110 @@
+/* rate_limit.c
+ *
+ * Token bucket rate limiter.
+ *
+ * Sending is allowed while there's at least one token, and the whole
+ * message is then taken from the bucket, possibly leaving it negative.
+ * The bucket holds at most RATE_LIMIT_BURST_TIME worth of tokens, so
+ * a message is sent as soon as the bucket recovers, instead of saving
+ * tokens for a burst of whole messages.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "common/rate_limit.h"
+
+#define NS_PER_SEC 1000000000ull
+
+// max rate supported, so the token computation doesn't overflow
+#define RATE_LIMIT_MAX_RATE (16ull*1024*1024*1024)
+
+// tokens accumulated at most, in ns of sending at the full rate
+#define RATE_LIMIT_BURST_TIME (20*1000*1000ull)
+
+uint64_t ssh_rate_limit_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+void ssh_rate_limit_init(struct SSH_RATE_LIMIT *rl, uint64_t rate)
+{
+  rl->rate = 0;
+  rl->burst = 0;
+  rl->tokens = 0;
+  rl->last_update = ssh_rate_limit_now();
+  ssh_rate_limit_set_rate(rl, rate);
+  rl->tokens = rl->burst;
+}
+
+/*
+ * Change the rate.  Tokens already in the bucket are kept, up to the
+ * new burst size.
+ */
+void ssh_rate_limit_set_rate(struct SSH_RATE_LIMIT *rl, uint64_t rate)
+{
+  if (rate > RATE_LIMIT_MAX_RATE)
+    rate = RATE_LIMIT_MAX_RATE;
+  rl->rate = rate;
+  rl->burst = rate * RATE_LIMIT_BURST_TIME / NS_PER_SEC;
+  if (rl->burst < 1)
+    rl->burst = 1;
+  if (rl->tokens > rl->burst)
+    rl->tokens = rl->burst;
+}
+
+static void refill(struct SSH_RATE_LIMIT *rl, uint64_t now)
+{
+  uint64_t elapsed, add;
+
+  if (now <= rl->last_update)
+    return;
+  elapsed = now - rl->last_update;
+  if (elapsed >= NS_PER_SEC) {
+    rl->tokens = rl->burst;
+    rl->last_update = now;
+    return;
+  }
+
+  // only count the time for whole tokens, so frequent calls don't lose
+  // the fractions
+  add = rl->rate * elapsed / NS_PER_SEC;
+  rl->last_update += add * NS_PER_SEC / rl->rate;
+  rl->tokens += (int64_t) add;
+  if (rl->tokens >= rl->burst) {
+    rl->tokens = rl->burst;
+    rl->last_update = now;
+  }
+}
+
+int ssh_rate_limit_can_send(struct SSH_RATE_LIMIT *rl, uint64_t now)
+{
+  if (rl->rate == 0)
+    return 1;
+  refill(rl, now);
+  return rl->tokens > 0;
+}
+
+void ssh_rate_limit_consume(struct SSH_RATE_LIMIT *rl, size_t len)
+{
+  if (rl->rate == 0)
+    return;
+  rl->tokens -= (int64_t) len;
+}
+
+/*
+ * Return the time in ns until sending is allowed again.
+ */
+uint64_t ssh_rate_limit_get_wait(struct SSH_RATE_LIMIT *rl, uint64_t now)
+{
+  if (rl->rate == 0)
+    return 0;
+  refill(rl, now);
+  if (rl->tokens > 0)
+    return 0;
+  return ((uint64_t) (1 - rl->tokens) * NS_PER_SEC + rl->rate - 1) / rl->rate;
+}
@@ -0,0 +1,23 @@
+/* rate_limit.h */
+
+#ifndef RATE_LIMIT_H_FILE
+#define RATE_LIMIT_H_FILE
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct SSH_RATE_LIMIT {
+  uint64_t rate;                   // bytes per second, 0 for no limit
+  int64_t burst;
+  int64_t tokens;                  // negative after sending more than available
+  uint64_t last_update;            // time of last update, in ns
+};
+
+uint64_t ssh_rate_limit_now(void);
+void ssh_rate_limit_init(struct SSH_RATE_LIMIT *rl, uint64_t rate);
+void ssh_rate_limit_set_rate(struct SSH_RATE_LIMIT *rl, uint64_t rate);
+int ssh_rate_limit_can_send(struct SSH_RATE_LIMIT *rl, uint64_t now);
+void ssh_rate_limit_consume(struct SSH_RATE_LIMIT *rl, size_t len);
+uint64_t ssh_rate_limit_get_wait(struct SSH_RATE_LIMIT *rl, uint64_t now);
+
+#endif /* RATE_LIMIT_H_FILE */
@@ -0,0 +1,553 @@
+/* resolver.c
+ *
+ * Asynchronous name resolution with a process-wide cache.
+ *
+ * getaddrinfo() blocks for the whole DNS round trip, so lookups run
+ * in a small pool of threads, started as needed.  A query gives a fd
+ * that becomes readable when the lookup is done, so it can be polled
+ * with other fds, or just waited for.
+ *
+ * Results are cached by name and port, lookups that succeeded for
+ * 'positive_ttl' seconds and names that don't exist for
+ * 'negative_ttl' seconds (getaddrinfo() doesn't give the DNS TTL).
+ * Queries for a name already being looked up wait for that lookup
+ * instead of starting another one.
+ *
+ * Names listed in the configured hosts file are resolved from it,
+ * without asking the system resolver.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netdb.h>
+
+#include "common/resolver.h"
+
+#include "common/network_i.h"
+#include "common/timer_wheel.h"
+#include "common/error.h"
+#include "common/debug.h"
+#include "common/alloc.h"
+
+#define RESOLVER_DEFAULT_THREADS       4
+#define RESOLVER_MAX_THREADS           32
+#define RESOLVER_DEFAULT_POSITIVE_TTL  300
+#define RESOLVER_DEFAULT_NEGATIVE_TTL  10
+
+#define RESOLVER_HASH_SIZE     64
+#define RESOLVER_MAX_NAME_LEN  256
+#define RESOLVER_MAX_PORT_LEN  32
+#define RESOLVER_MAX_FILENAME  1024
+#define RESOLVER_MAX_LINE_LEN  1024
+
+enum RESOLVER_STATUS {
+  RESOLVER_PENDING,
+  RESOLVER_DONE,
+};
+
+struct RESOLVER_ENTRY {
+  struct RESOLVER_ENTRY *next;       // in the hash bucket
+  struct RESOLVER_ENTRY *next_job;   // in the job queue
+  char name[RESOLVER_MAX_NAME_LEN];
+  char port[RESOLVER_MAX_PORT_LEN];
+  enum RESOLVER_STATUS status;
+  uint64_t expires;                  // in ms, when done
+  int error;                         // getaddrinfo() error, 0 if resolved
+  int num_addrs;
+  struct SSH_RESOLVER_ADDR addrs[SSH_RESOLVER_MAX_ADDRS];
+  struct SSH_RESOLVER_QUERY *waiters;
+};
+
+struct SSH_RESOLVER_QUERY {
+  struct SSH_RESOLVER_QUERY *next;   // in the entry's waiters
+  struct RESOLVER_ENTRY *entry;      // NULL when done
+  int done_fds[2];                   // pipe written when done
+  int done;
+  int error;
+  char name[RESOLVER_MAX_NAME_LEN];
+  char port[RESOLVER_MAX_PORT_LEN];
+  int num_addrs;
+  struct SSH_RESOLVER_ADDR addrs[SSH_RESOLVER_MAX_ADDRS];
+};
+
+// everything below is protected by 'lock'
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+static struct RESOLVER_ENTRY *cache[RESOLVER_HASH_SIZE];
+static struct RESOLVER_ENTRY *job_head, *job_tail;
+static pthread_t threads[RESOLVER_MAX_THREADS];
+static int num_threads;
+static int num_idle_threads;
+static int shutting_down;
+static int max_threads = RESOLVER_DEFAULT_THREADS;
+static uint32_t positive_ttl = RESOLVER_DEFAULT_POSITIVE_TTL;
+static uint32_t negative_ttl = RESOLVER_DEFAULT_NEGATIVE_TTL;
+static char hosts_file[RESOLVER_MAX_FILENAME];
+
+static unsigned int resolver_hash(const char *name, const char *port)
+{
+  unsigned int hash = 5381;
+  const char *p;
+
+  for (p = name; *p != '\0'; p++)
+    hash = hash*33 + (*p | 0x20);
+  for (p = port; *p != '\0'; p++)
+    hash = hash*33 + *p;
+  return hash % RESOLVER_HASH_SIZE;
+}
+
+/*
+ * Add the addresses from getaddrinfo() to the end of 'addrs'.
+ */
+static int resolver_getaddrinfo(const char *name, const char *port, int flags, struct SSH_RESOLVER_ADDR *addrs, int *num_addrs)
+{
+  struct addrinfo hints, *result, *ai;
+  int ret;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = flags;
+  if ((ret = getaddrinfo(name, port, &hints, &result)) != 0)
+    return ret;
+
+  for (ai = result; ai != NULL && *num_addrs < SSH_RESOLVER_MAX_ADDRS; ai = ai->ai_next) {
+    struct SSH_RESOLVER_ADDR *addr = &addrs[*num_addrs];
+    if (ai->ai_addrlen > sizeof(addr->addr))
+      continue;
+    addr->family = ai->ai_family;
+    addr->socktype = ai->ai_socktype;
+    addr->protocol = ai->ai_protocol;
+    addr->addr_len = ai->ai_addrlen;
+    memcpy(&addr->addr, ai->ai_addr, ai->ai_addrlen);
+    (*num_addrs)++;
+  }
+  freeaddrinfo(result);
+  return 0;
+}
+
+/*
+ * Look up the name in a hosts(5) file.  Return -1 if the name is not
+ * in the file, or the lookup result.
+ */
+static int resolver_lookup_hosts_file(const char *filename, const char *name, const char *port, struct SSH_RESOLVER_ADDR *addrs, int *num_addrs)
+{
+  char line[RESOLVER_MAX_LINE_LEN];
+  int found = 0, ret = 0;
+  FILE *f;
+
+  if ((f = fopen(filename, "r")) == NULL)
+    return -1;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    char *addr, *host, *save;
+
+    line[strcspn(line, "#")] = '\0';
+    if ((addr = strtok_r(line, " \t\r\n", &save)) == NULL)
+      continue;
+    while ((host = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+      if (strcasecmp(host, name) == 0) {
+        found = 1;
+        ret = resolver_getaddrinfo(addr, port, AI_NUMERICHOST, addrs, num_addrs);
+        break;
+      }
+    }
+    if (ret != 0)
+      break;
+  }
+  fclose(f);
+  return (found) ? ret : -1;
+}
+
+/*
+ * Resolve the name, without holding the lock.  Returns the
+ * getaddrinfo() error, 0 on success.
+ */
+static int resolver_lookup(const char *filename, const char *name, const char *port, struct SSH_RESOLVER_ADDR *addrs, int *num_addrs)
+{
+  int ret;
+
+  *num_addrs = 0;
+  if (filename[0] != '\0' && (ret = resolver_lookup_hosts_file(filename, name, port, addrs, num_addrs)) >= 0)
+    return ret;
+  return resolver_getaddrinfo(name, port, 0, addrs, num_addrs);
+}
+
+static void resolver_finish_query(struct SSH_RESOLVER_QUERY *query, struct RESOLVER_ENTRY *entry)
+{
+  uint8_t b = 0;
+
+  query->entry = NULL;
+  query->done = 1;
+  query->error = entry->error;
+  query->num_addrs = entry->num_addrs;
+  memcpy(query->addrs, entry->addrs, entry->num_addrs * sizeof(struct SSH_RESOLVER_ADDR));
+  if (write(query->done_fds[1], &b, 1) < 0)
+    ssh_log("* WARNING: can't signal resolver query\n");
+}
+
+/*
+ * Store the lookup result in the cache entry and finish the queries
+ * waiting for it.
+ */
+static void resolver_complete(struct RESOLVER_ENTRY *entry, int error, const struct SSH_RESOLVER_ADDR *addrs, int num_addrs)
+{
+  uint64_t now = ssh_timer_now();
+
+  entry->status = RESOLVER_DONE;
+  entry->error = error;
+  entry->num_addrs = num_addrs;
+  if (num_addrs > 0)
+    memcpy(entry->addrs, addrs, num_addrs * sizeof(struct SSH_RESOLVER_ADDR));
+  if (error == 0)
+    entry->expires = now + (uint64_t) positive_ttl * 1000;
+  else if (error == EAI_NONAME || error == EAI_FAIL || error == EAI_SERVICE)
+    entry->expires = now + (uint64_t) negative_ttl * 1000;
+  else
+    entry->expires = now;   // temporary failure: don't cache
+
+  while (entry->waiters != NULL) {
+    struct SSH_RESOLVER_QUERY *query = entry->waiters;
+    entry->waiters = query->next;
+    resolver_finish_query(query, entry);
+  }
+}
+
+static void *resolver_thread(void *arg)
+{
+  struct SSH_RESOLVER_ADDR addrs[SSH_RESOLVER_MAX_ADDRS];
+  char name[RESOLVER_MAX_NAME_LEN];
+  char port[RESOLVER_MAX_PORT_LEN];
+  char filename[RESOLVER_MAX_FILENAME];
+  int error, num_addrs;
+
+  pthread_mutex_lock(&lock);
+  while (1) {
+    struct RESOLVER_ENTRY *entry;
+
+    while (job_head == NULL && ! shutting_down) {
+      num_idle_threads++;
+      pthread_cond_wait(&job_cond, &lock);
+      num_idle_threads--;
+    }
+    if (shutting_down)
+      break;
+    entry = job_head;
+    if ((job_head = entry->next_job) == NULL)
+      job_tail = NULL;
+    strcpy(name, entry->name);
+    strcpy(port, entry->port);
+    strcpy(filename, hosts_file);
+    pthread_mutex_unlock(&lock);
+
+    error = resolver_lookup(filename, name, port, addrs, &num_addrs);
+
+    pthread_mutex_lock(&lock);
+    resolver_complete(entry, error, addrs, num_addrs);
+  }
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+/*
+ * Queue the entry for lookup, starting another thread if all are
+ * busy.  If no thread can be started, resolve it here.
+ */
+static void resolver_queue_job(struct RESOLVER_ENTRY *entry)
+{
+  entry->next_job = NULL;
+  if (job_tail != NULL)
+    job_tail->next_job = entry;
+  else
+    job_head = entry;
+  job_tail = entry;
+
+  if (num_idle_threads == 0 && num_threads < max_threads
+      && pthread_create(&threads[num_threads], NULL, resolver_thread, NULL) == 0)
+    num_threads++;
+
+  if (num_threads == 0) {
+    struct SSH_RESOLVER_ADDR addrs[SSH_RESOLVER_MAX_ADDRS];
+    char filename[RESOLVER_MAX_FILENAME];
+    int error, num_addrs;
+
+    job_head = job_tail = NULL;
+    strcpy(filename, hosts_file);
+    pthread_mutex_unlock(&lock);
+    error = resolver_lookup(filename, entry->name, entry->port, addrs, &num_addrs);
+    pthread_mutex_lock(&lock);
+    resolver_complete(entry, error, addrs, num_addrs);
+    return;
+  }
+  pthread_cond_signal(&job_cond);
+}
+
+/*
+ * Find the cache entry for the name, freeing the expired entries in
+ * its bucket.
+ */
+static struct RESOLVER_ENTRY *resolver_find_entry(const char *name, const char *port, unsigned int hash)
+{
+  struct RESOLVER_ENTRY **p = &cache[hash];
+  struct RESOLVER_ENTRY *found = NULL;
+  uint64_t now = ssh_timer_now();
+
+  while (*p != NULL) {
+    struct RESOLVER_ENTRY *entry = *p;
+    if (entry->status == RESOLVER_DONE && entry->expires <= now) {
+      *p = entry->next;
+      ssh_free(entry);
+      continue;
+    }
+    if (strcasecmp(entry->name, name) == 0 && strcmp(entry->port, port) == 0)
+      found = entry;
+    p = &entry->next;
+  }
+  return found;
+}
+
+static void resolver_free_entries(int keep_pending)
+{
+  int i;
+
+  for (i = 0; i < RESOLVER_HASH_SIZE; i++) {
+    struct RESOLVER_ENTRY **p = &cache[i];
+    while (*p != NULL) {
+      struct RESOLVER_ENTRY *entry = *p;
+      if (keep_pending && entry->status == RESOLVER_PENDING) {
+        p = &entry->next;
+        continue;
+      }
+      *p = entry->next;
+      ssh_free(entry);
+    }
+  }
+}
+
+/*
+ * Configure the resolver.  Changing the hosts file empties the cache.
+ */
+int ssh_resolver_set_config(const struct SSH_RESOLVER_CONFIG *cfg)
+{
+  const char *filename = (cfg->hosts_file != NULL) ? cfg->hosts_file : "";
+
+  if (cfg->num_threads < 0 || cfg->num_threads > RESOLVER_MAX_THREADS) {
+    ssh_set_error("invalid number of resolver threads");
+    return -1;
+  }
+  if (strlen(filename) >= RESOLVER_MAX_FILENAME) {
+    ssh_set_error("hosts file name too long");
+    return -1;
+  }
+
+  pthread_mutex_lock(&lock);
+  max_threads = (cfg->num_threads != 0) ? cfg->num_threads : RESOLVER_DEFAULT_THREADS;
+  positive_ttl = (cfg->positive_ttl != 0) ? cfg->positive_ttl : RESOLVER_DEFAULT_POSITIVE_TTL;
+  negative_ttl = (cfg->negative_ttl != 0) ? cfg->negative_ttl : RESOLVER_DEFAULT_NEGATIVE_TTL;
+  if (strcmp(hosts_file, filename) != 0) {
+    strcpy(hosts_file, filename);
+    resolver_free_entries(1);
+  }
+  pthread_mutex_unlock(&lock);
+  return 0;
+}
+
+/*
+ * Stop the resolver threads and empty the cache.  Queries still
+ * waiting fail.
+ */
+void ssh_resolver_deinit(void)
+{
+  int i;
+
+  pthread_mutex_lock(&lock);
+  shutting_down = 1;
+  pthread_cond_broadcast(&job_cond);
+  pthread_mutex_unlock(&lock);
+  for (i = 0; i < num_threads; i++)
+    pthread_join(threads[i], NULL);
+
+  pthread_mutex_lock(&lock);
+  num_threads = 0;
+  shutting_down = 0;
+  while (job_head != NULL) {
+    struct RESOLVER_ENTRY *entry = job_head;
+    job_head = entry->next_job;
+    resolver_complete(entry, EAI_AGAIN, NULL, 0);
+  }
+  job_tail = NULL;
+  resolver_free_entries(0);
+  pthread_mutex_unlock(&lock);
+}
+
+void ssh_resolver_flush_cache(void)
+{
+  pthread_mutex_lock(&lock);
+  resolver_free_entries(1);
+  pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Start looking up a name to resolve it ahead of time, so that a
+ * later query finds it in the cache or waits for this lookup.
+ */
+int ssh_resolver_prefetch(const char *name, const char *port)
+{
+  struct SSH_RESOLVER_QUERY *query;
+
+  if ((query = ssh_resolver_query_start(name, port)) == NULL)
+    return -1;
+  ssh_resolver_query_free(query);
+  return 0;
+}
+
+/*
+ * Start resolving a name.  The query is done when its fd is
+ * readable; the result is cached, so it may be done right away.
+ */
+struct SSH_RESOLVER_QUERY *ssh_resolver_query_start(const char *name, const char *port)
+{
+  struct SSH_RESOLVER_QUERY *query;
+  struct RESOLVER_ENTRY *entry;
+  unsigned int hash;
+
+  if (strlen(name) >= RESOLVER_MAX_NAME_LEN || strlen(port) >= RESOLVER_MAX_PORT_LEN) {
+    ssh_set_error("name too long");
+    return NULL;
+  }
+  if ((query = ssh_alloc(sizeof(struct SSH_RESOLVER_QUERY))) == NULL)
+    return NULL;
+  if (pipe(query->done_fds) < 0) {
+    ssh_set_error("can't create pipe");
+    ssh_free(query);
+    return NULL;
+  }
+  if (ssh_net_set_sock_blocking(query->done_fds[0], 0) < 0
+      || ssh_net_set_sock_blocking(query->done_fds[1], 0) < 0) {
+    close(query->done_fds[0]);
+    close(query->done_fds[1]);
+    ssh_free(query);
+    return NULL;
+  }
+  strcpy(query->name, name);
+  strcpy(query->port, port);
+
+  hash = resolver_hash(name, port);
+  pthread_mutex_lock(&lock);
+  if ((entry = resolver_find_entry(name, port, hash)) != NULL && entry->status == RESOLVER_DONE) {
+    resolver_finish_query(query, entry);
+    pthread_mutex_unlock(&lock);
+    return query;
+  }
+
+  if (entry == NULL) {
+    if ((entry = ssh_alloc(sizeof(struct RESOLVER_ENTRY))) == NULL) {
+      pthread_mutex_unlock(&lock);
+      ssh_resolver_query_free(query);
+      return NULL;
+    }
+    strcpy(entry->name, name);
+    strcpy(entry->port, port);
+    entry->status = RESOLVER_PENDING;
+    entry->waiters = NULL;
+    entry->next = cache[hash];
+    cache[hash] = entry;
+    query->entry = entry;
+    query->next = NULL;
+    entry->waiters = query;
+    resolver_queue_job(entry);
+  } else {
+    // already being looked up
+    query->entry = entry;
+    query->next = entry->waiters;
+    entry->waiters = query;
+  }
+  pthread_mutex_unlock(&lock);
+  return query;
+}
+
+int ssh_resolver_query_get_fd(struct SSH_RESOLVER_QUERY *query)
+{
+  return query->done_fds[0];
+}
+
+int ssh_resolver_query_is_done(struct SSH_RESOLVER_QUERY *query)
+{
+  int done;
+
+  pthread_mutex_lock(&lock);
+  done = query->done;
+  pthread_mutex_unlock(&lock);
+  return done;
+}
+
+/*
+ * Block until the query is done.
+ */
+int ssh_resolver_query_wait(struct SSH_RESOLVER_QUERY *query)
+{
+  struct pollfd fd;
+
+  fd.fd = query->done_fds[0];
+  fd.events = POLLIN;
+  while (! ssh_resolver_query_is_done(query)) {
+    if (poll(&fd, 1, -1) < 0 && errno != EINTR) {
+      ssh_set_error("poll() failed waiting for resolver");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Get the addresses of a query that is done.  Returns the number of
+ * addresses, or -1 if the name couldn't be resolved.  The addresses
+ * are valid until the query is freed.
+ */
+int ssh_resolver_query_get_addrs(struct SSH_RESOLVER_QUERY *query, const struct SSH_RESOLVER_ADDR **addrs)
+{
+  if (! ssh_resolver_query_is_done(query)) {
+    ssh_set_error("lookup of '%s' not done", query->name);
+    return -1;
+  }
+  if (query->error != 0) {
+    ssh_set_error("can't resolve server '%s', port '%s': %s", query->name, query->port, gai_strerror(query->error));
+    return -1;
+  }
+  if (query->num_addrs == 0) {
+    ssh_set_error("can't resolve server '%s', port '%s': no addresses", query->name, query->port);
+    return -1;
+  }
+  *addrs = query->addrs;
+  return query->num_addrs;
+}
+
+/*
+ * Free the query.  If it's not done, the lookup continues and its
+ * result is cached.
+ */
+void ssh_resolver_query_free(struct SSH_RESOLVER_QUERY *query)
+{
+  pthread_mutex_lock(&lock);
+  if (query->entry != NULL) {
+    struct SSH_RESOLVER_QUERY **p;
+    for (p = &query->entry->waiters; *p != NULL; p = &(*p)->next) {
+      if (*p == query) {
+        *p = query->next;
+        break;
+      }
+    }
+    query->entry = NULL;
+  }
+  pthread_mutex_unlock(&lock);
+
+  close(query->done_fds[0]);
+  close(query->done_fds[1]);
+  ssh_free(query);
+}
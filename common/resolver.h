@@ -0,0 +1,41 @@
+/* resolver.h */
+
+#ifndef RESOLVER_H_FILE
+#define RESOLVER_H_FILE
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#define SSH_RESOLVER_MAX_ADDRS 16
+
+struct SSH_RESOLVER_CONFIG {
+  int num_threads;          // lookups run at the same time (0 for default)
+  uint32_t positive_ttl;    // seconds resolved names are cached (0 for default)
+  uint32_t negative_ttl;    // seconds failed lookups are cached (0 for default)
+  const char *hosts_file;   // hosts(5) file read before the system resolver (NULL for none)
+};
+
+struct SSH_RESOLVER_ADDR {
+  int family;
+  int socktype;
+  int protocol;
+  socklen_t addr_len;
+  struct sockaddr_storage addr;
+};
+
+struct SSH_RESOLVER_QUERY;
+
+int ssh_resolver_set_config(const struct SSH_RESOLVER_CONFIG *cfg);
+void ssh_resolver_deinit(void);
+void ssh_resolver_flush_cache(void);
+int ssh_resolver_prefetch(const char *name, const char *port);
+
+struct SSH_RESOLVER_QUERY *ssh_resolver_query_start(const char *name, const char *port);
+int ssh_resolver_query_get_fd(struct SSH_RESOLVER_QUERY *query);
+int ssh_resolver_query_is_done(struct SSH_RESOLVER_QUERY *query);
+int ssh_resolver_query_wait(struct SSH_RESOLVER_QUERY *query);
+int ssh_resolver_query_get_addrs(struct SSH_RESOLVER_QUERY *query, const struct SSH_RESOLVER_ADDR **addrs);
+void ssh_resolver_query_free(struct SSH_RESOLVER_QUERY *query);
+
+#endif /* RESOLVER_H_FILE */
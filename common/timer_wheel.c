@@ -0,0 +1,275 @@
+/* timer_wheel.c
+ *
+ * Hierarchical timing wheel with 1 ms ticks.
+ *
+ * Level L has SSH_TIMER_WHEEL_SLOTS slots of 64^L ticks each.  A timer
+ * goes in the lowest level where its expiry time and the next tick
+ * share all the bits above the level, in the slot given by the
+ * level's bits of the expiry time; timers too far away for the last
+ * level wait in an overflow list.  Adding and cancelling are O(1).
+ *
+ * When time reaches the start of a slot in a higher level, its timers
+ * are moved down ("cascaded"), and timers in the level 0 slot of the
+ * current tick expire.  A bitmap of occupied slots per level gives
+ * the next tick where something happens, so idle time is skipped
+ * instead of processed tick by tick.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+
+#include "common/timer_wheel.h"
+
+#define LEVELS     SSH_TIMER_WHEEL_LEVELS
+#define SLOT_BITS  SSH_TIMER_WHEEL_SLOT_BITS
+#define SLOT_MASK  (SSH_TIMER_WHEEL_SLOTS-1)
+
+// ticks covered by all levels
+#define WHEEL_SPAN ((uint64_t) 1 << (SLOT_BITS*LEVELS))
+
+#define NO_EVENT   UINT64_MAX
+
+static void link_init(struct SSH_TIMER_LINK *link)
+{
+  link->next = link;
+  link->prev = link;
+}
+
+static int link_is_empty(const struct SSH_TIMER_LINK *head)
+{
+  return head->next == head;
+}
+
+static void link_add_tail(struct SSH_TIMER_LINK *head, struct SSH_TIMER_LINK *link)
+{
+  link->prev = head->prev;
+  link->next = head;
+  head->prev->next = link;
+  head->prev = link;
+}
+
+static void link_remove(struct SSH_TIMER_LINK *link)
+{
+  link->prev->next = link->next;
+  link->next->prev = link->prev;
+  link_init(link);
+}
+
+/*
+ * Move all timers in 'from' to the list 'to'.
+ */
+static void link_move_all(struct SSH_TIMER_LINK *to, struct SSH_TIMER_LINK *from)
+{
+  link_init(to);
+  if (link_is_empty(from))
+    return;
+  to->next = from->next;
+  to->prev = from->prev;
+  to->next->prev = to;
+  to->prev->next = to;
+  link_init(from);
+}
+
+uint64_t ssh_timer_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void ssh_timer_wheel_init(struct SSH_TIMER_WHEEL *wheel, uint64_t now)
+{
+  int level, slot;
+
+  wheel->now = now;
+  for (level = 0; level < LEVELS; level++) {
+    wheel->occupied[level] = 0;
+    for (slot = 0; slot < SSH_TIMER_WHEEL_SLOTS; slot++)
+      link_init(&wheel->slots[level][slot]);
+  }
+  link_init(&wheel->overflow);
+}
+
+static void wheel_insert(struct SSH_TIMER_WHEEL *wheel, struct SSH_TIMER *timer)
+{
+  uint64_t next_tick = wheel->now + 1;
+  uint64_t expires = (timer->expires < next_tick) ? next_tick : timer->expires;
+  int level;
+
+  for (level = 0; level < LEVELS; level++)
+    if ((expires >> (SLOT_BITS*(level+1))) == (next_tick >> (SLOT_BITS*(level+1))))
+      break;
+
+  timer->wheel = wheel;
+  if (level == LEVELS) {
+    timer->level = -1;
+    link_add_tail(&wheel->overflow, &timer->link);
+    return;
+  }
+  timer->level = level;
+  timer->slot = (expires >> (SLOT_BITS*level)) & SLOT_MASK;
+  link_add_tail(&wheel->slots[level][timer->slot], &timer->link);
+  wheel->occupied[level] |= (uint64_t) 1 << timer->slot;
+}
+
+static void wheel_remove(struct SSH_TIMER *timer)
+{
+  struct SSH_TIMER_WHEEL *wheel = timer->wheel;
+
+  link_remove(&timer->link);
+  if (timer->level >= 0 && link_is_empty(&wheel->slots[timer->level][timer->slot]))
+    wheel->occupied[timer->level] &= ~((uint64_t) 1 << timer->slot);
+  timer->wheel = NULL;
+}
+
+/*
+ * Return the next tick where timers expire or must be cascaded.
+ */
+static uint64_t wheel_next_event(const struct SSH_TIMER_WHEEL *wheel)
+{
+  uint64_t next_tick = wheel->now + 1;
+  uint64_t next = NO_EVENT;
+  int level;
+
+  for (level = 0; level < LEVELS; level++) {
+    int shift = SLOT_BITS*level;
+    int cur_slot = (next_tick >> shift) & SLOT_MASK;
+    uint64_t pending = wheel->occupied[level] >> cur_slot;
+
+    if (pending != 0) {
+      uint64_t block = next_tick & ~(((uint64_t) 1 << (shift+SLOT_BITS)) - 1);
+      uint64_t tick = block | ((uint64_t) (cur_slot + __builtin_ctzll(pending)) << shift);
+      if (tick < next_tick)
+        tick = next_tick;
+      if (tick < next)
+        next = tick;
+    }
+  }
+
+  if (! link_is_empty(&wheel->overflow)) {
+    uint64_t tick = (next_tick + WHEEL_SPAN - 1) & ~(WHEEL_SPAN - 1);
+    if (tick < next)
+      next = tick;
+  }
+  return next;
+}
+
+/*
+ * Re-insert all timers of the list, relative to the current time.
+ */
+static void wheel_reinsert(struct SSH_TIMER_WHEEL *wheel, struct SSH_TIMER_LINK *list)
+{
+  struct SSH_TIMER_LINK tmp;
+
+  link_move_all(&tmp, list);
+  while (! link_is_empty(&tmp)) {
+    struct SSH_TIMER *timer = (struct SSH_TIMER *) tmp.next;
+    link_remove(&timer->link);
+    wheel_insert(wheel, timer);
+  }
+}
+
+static int wheel_process_tick(struct SSH_TIMER_WHEEL *wheel, uint64_t tick)
+{
+  struct SSH_TIMER_LINK *head;
+  int level, slot;
+
+  // cascade timers down to the levels of this tick, top first
+  wheel->now = tick - 1;
+  if ((tick & (WHEEL_SPAN - 1)) == 0)
+    wheel_reinsert(wheel, &wheel->overflow);
+  for (level = LEVELS-1; level > 0; level--) {
+    slot = (tick >> (SLOT_BITS*level)) & SLOT_MASK;
+    if ((wheel->occupied[level] & ((uint64_t) 1 << slot)) != 0) {
+      wheel->occupied[level] &= ~((uint64_t) 1 << slot);
+      wheel_reinsert(wheel, &wheel->slots[level][slot]);
+    }
+  }
+
+  // run expired timers; timers added by them go after this tick
+  wheel->now = tick;
+  head = &wheel->slots[0][tick & SLOT_MASK];
+  while (! link_is_empty(head)) {
+    struct SSH_TIMER *timer = (struct SSH_TIMER *) head->next;
+    wheel_remove(timer);
+    if (timer->fn(timer, timer->data) < 0) {
+      // keep the others for the next run
+      wheel->occupied[0] &= ~((uint64_t) 1 << (tick & SLOT_MASK));
+      wheel_reinsert(wheel, head);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Return the poll() timeout until the next timer, or -1 if there are
+ * no timers.  The wait may end before a timer expires, when timers
+ * must be moved between levels.
+ */
+int ssh_timer_wheel_get_timeout(const struct SSH_TIMER_WHEEL *wheel, uint64_t now)
+{
+  uint64_t next = wheel_next_event(wheel);
+
+  if (next == NO_EVENT)
+    return -1;
+  if (next <= now)
+    return 0;
+  if (next - now > INT_MAX)
+    return INT_MAX;
+  return next - now;
+}
+
+/*
+ * Run the timers expired at time 'now'.  Stops at the first timer
+ * function that returns an error.
+ */
+int ssh_timer_wheel_run(struct SSH_TIMER_WHEEL *wheel, uint64_t now)
+{
+  uint64_t tick;
+
+  while ((tick = wheel_next_event(wheel)) <= now) {
+    if (wheel_process_tick(wheel, tick) < 0)
+      return -1;
+  }
+  if (now > wheel->now)
+    wheel->now = now;
+  return 0;
+}
+
+void ssh_timer_init(struct SSH_TIMER *timer, ssh_timer_fn fn, void *data)
+{
+  link_init(&timer->link);
+  timer->wheel = NULL;
+  timer->expires = 0;
+  timer->level = -1;
+  timer->slot = 0;
+  timer->fn = fn;
+  timer->data = data;
+}
+
+/*
+ * Schedule the timer to expire at time 'expires' (in ms, as returned
+ * by ssh_timer_now()), replacing its previous schedule.
+ */
+void ssh_timer_add(struct SSH_TIMER_WHEEL *wheel, struct SSH_TIMER *timer, uint64_t expires)
+{
+  if (timer->wheel != NULL)
+    wheel_remove(timer);
+  timer->expires = expires;
+  wheel_insert(wheel, timer);
+}
+
+void ssh_timer_cancel(struct SSH_TIMER *timer)
+{
+  if (timer->wheel != NULL)
+    wheel_remove(timer);
+}
+
+int ssh_timer_is_pending(const struct SSH_TIMER *timer)
+{
+  return timer->wheel != NULL;
+}
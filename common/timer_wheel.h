@@ -0,0 +1,49 @@
+/* timer_wheel.h */
+
+#ifndef TIMER_WHEEL_H_FILE
+#define TIMER_WHEEL_H_FILE
+
+#include <stdint.h>
+
+#define SSH_TIMER_WHEEL_LEVELS     5
+#define SSH_TIMER_WHEEL_SLOT_BITS  6
+#define SSH_TIMER_WHEEL_SLOTS      (1<<SSH_TIMER_WHEEL_SLOT_BITS)
+
+struct SSH_TIMER;
+
+// return -1 to report an error to the code running the timers
+typedef int (*ssh_timer_fn)(struct SSH_TIMER *timer, void *data);
+
+struct SSH_TIMER_LINK {
+  struct SSH_TIMER_LINK *next;
+  struct SSH_TIMER_LINK *prev;
+};
+
+struct SSH_TIMER {
+  struct SSH_TIMER_LINK link;      // must be the first field
+  struct SSH_TIMER_WHEEL *wheel;   // NULL if not pending
+  uint64_t expires;                // in ms
+  int level;                       // -1 if beyond the last level
+  int slot;
+  ssh_timer_fn fn;
+  void *data;
+};
+
+struct SSH_TIMER_WHEEL {
+  uint64_t now;                    // last tick processed, in ms
+  uint64_t occupied[SSH_TIMER_WHEEL_LEVELS];  // bit set for each slot with timers
+  struct SSH_TIMER_LINK slots[SSH_TIMER_WHEEL_LEVELS][SSH_TIMER_WHEEL_SLOTS];
+  struct SSH_TIMER_LINK overflow;  // timers beyond the last level
+};
+
+uint64_t ssh_timer_now(void);
+void ssh_timer_wheel_init(struct SSH_TIMER_WHEEL *wheel, uint64_t now);
+int ssh_timer_wheel_get_timeout(const struct SSH_TIMER_WHEEL *wheel, uint64_t now);
+int ssh_timer_wheel_run(struct SSH_TIMER_WHEEL *wheel, uint64_t now);
+
+void ssh_timer_init(struct SSH_TIMER *timer, ssh_timer_fn fn, void *data);
+void ssh_timer_add(struct SSH_TIMER_WHEEL *wheel, struct SSH_TIMER *timer, uint64_t expires);
+void ssh_timer_cancel(struct SSH_TIMER *timer);
+int ssh_timer_is_pending(const struct SSH_TIMER *timer);
+
+#endif /* TIMER_WHEEL_H_FILE */
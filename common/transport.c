@@ -0,0 +1,109 @@
+/* transport.c
+ *
+ * Transport backends.  The socket backend reads and writes the socket
+ * directly with the functions in network.c; the io_uring backend is
+ * in transport_uring.c.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+
+#include "common/transport_i.h"
+
+#include "common/network_i.h"
+#include "common/error.h"
+#include "common/debug.h"
+#include "common/alloc.h"
+
+static void sock_free(struct SSH_TRANSPORT *transport)
+{
+  close(transport->sock);
+  ssh_free(transport);
+}
+
+static int sock_set_blocking(struct SSH_TRANSPORT *transport, int block)
+{
+  return ssh_net_set_sock_blocking(transport->sock, block);
+}
+
+static ssize_t sock_read_ahead(struct SSH_TRANSPORT *transport, void *data, size_t len, size_t max_len)
+{
+  return ssh_net_read_ahead(transport->sock, data, len, max_len);
+}
+
+static ssize_t sock_write(struct SSH_TRANSPORT *transport, const void *data, size_t len)
+{
+  return ssh_net_write(transport->sock, data, len);
+}
+
+static int sock_poll_prepare(struct SSH_TRANSPORT *transport, struct pollfd *poll_fd, int want_write, int *timeout)
+{
+  poll_fd->fd = transport->sock;
+  poll_fd->events = POLLIN;
+  if (want_write)
+    poll_fd->events |= POLLOUT;
+  return 0;
+}
+
+static int sock_poll_result(struct SSH_TRANSPORT *transport, const struct pollfd *poll_fd)
+{
+  int flags = 0;
+
+  if ((poll_fd->revents & (POLLIN|POLLHUP|POLLERR)) != 0)
+    flags |= SSH_TRANSPORT_CAN_READ;
+  if ((poll_fd->revents & POLLOUT) != 0)
+    flags |= SSH_TRANSPORT_CAN_WRITE;
+  return flags;
+}
+
+static const struct SSH_TRANSPORT_OPS sock_ops = {
+  "socket",
+  sock_free,
+  sock_set_blocking,
+  sock_read_ahead,
+  sock_write,
+  sock_poll_prepare,
+  sock_poll_result,
+};
+
+static struct SSH_TRANSPORT *sock_new(int sock)
+{
+  struct SSH_TRANSPORT *transport;
+
+  if ((transport = ssh_alloc(sizeof(struct SSH_TRANSPORT))) == NULL)
+    return NULL;
+  transport->ops = &sock_ops;
+  transport->sock = sock;
+  return transport;
+}
+
+/*
+ * Create a transport for a connected socket.  The transport owns the
+ * socket and closes it when freed.
+ */
+struct SSH_TRANSPORT *ssh_transport_new(enum SSH_TRANSPORT_TYPE type, int sock)
+{
+  struct SSH_TRANSPORT *transport;
+
+  switch (type) {
+  case SSH_TRANSPORT_IO_URING:
+    if ((transport = ssh_transport_uring_new(sock)) != NULL)
+      return transport;
+    ssh_log("WARNING: can't use io_uring (%s), using socket transport\n", ssh_get_error());
+    return sock_new(sock);
+
+  case SSH_TRANSPORT_SOCKET:
+    return sock_new(sock);
+  }
+
+  ssh_set_error("invalid transport type: %d", type);
+  return NULL;
+}
+
+void ssh_transport_free(struct SSH_TRANSPORT *transport)
+{
+  if (transport != NULL)
+    transport->ops->free(transport);
+}
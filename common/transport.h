@@ -0,0 +1,24 @@
+/* transport.h */
+
+#ifndef TRANSPORT_H_FILE
+#define TRANSPORT_H_FILE
+
+#include <stdint.h>
+
+enum SSH_TRANSPORT_TYPE {
+  SSH_TRANSPORT_SOCKET,         // read()/write() on the socket, driven by poll()
+  SSH_TRANSPORT_IO_URING,       // io_uring, falls back to SSH_TRANSPORT_SOCKET if not available
+};
+
+/* network conditions emulated by the transport, for testing */
+struct SSH_TRANSPORT_EMU_CONFIG {
+  uint32_t latency_ms;          // one-way delay in each direction
+  uint32_t jitter_ms;           // random extra delay, up to this much
+  uint64_t rate;                // bytes per second in each direction (0 for no limit)
+  uint32_t max_chunk;           // split data in random chunks of up to this size (0 to keep it as is)
+  uint32_t seed;                // for the random delays and chunk sizes
+};
+
+int ssh_transport_emu_parse_config(struct SSH_TRANSPORT_EMU_CONFIG *cfg, const char *spec);
+
+#endif /* TRANSPORT_H_FILE */
@@ -0,0 +1,532 @@
+/* transport_emu.c
+ *
+ * Network emulation transport, wrapping another transport.
+ *
+ * Data in each direction goes through a queue that emulates a link
+ * with the configured latency, jitter and bandwidth: each chunk
+ * leaves the queue when it would have arrived at the other end of
+ * the link.  Chunks never overtake each other (the emulated link is
+ * still a TCP stream), but the data can be split in chunks of random
+ * sizes so the packet code sees arbitrary read and write boundaries.
+ *
+ * All random choices come from a PRNG seeded from the configuration,
+ * so a given seed always produces the same sequence of delays and
+ * chunk sizes.
+ *
+ * The wrapped transport is always non-blocking; blocking mode is
+ * emulated here by waiting for the queues.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+
+#include "common/transport_i.h"
+
+#include "common/rate_limit.h"
+#include "common/buffer.h"
+#include "common/error.h"
+#include "common/debug.h"
+#include "common/alloc.h"
+
+#define EMU_MAX_QUEUED  (4*1024*1024)  // max data queued in each direction
+#define EMU_READ_SIZE   (16*1024)
+
+struct EMU_CHUNK {
+  uint32_t len;
+  uint64_t release_time;               // when it arrives at the other end, in ns
+};
+
+struct EMU_QUEUE {
+  struct SSH_BUFFER data;
+  size_t data_start;
+  struct EMU_CHUNK *chunks;
+  size_t chunks_cap;
+  size_t chunks_start;
+  size_t chunks_end;
+  uint64_t link_free_time;             // when the link finishes sending the queued data
+  uint64_t last_release_time;
+};
+
+struct EMU_TRANSPORT {
+  struct SSH_TRANSPORT transport;
+  struct SSH_TRANSPORT *inner;
+  struct SSH_TRANSPORT_EMU_CONFIG cfg;
+  uint32_t rand_state;
+  int blocking;
+  struct EMU_QUEUE in;
+  struct EMU_QUEUE out;
+  int in_closed;                       // the wrapped transport returned EOF or error...
+  int in_eof;                          // ...and it was EOF
+  uint64_t in_close_time;              // when the close arrives
+};
+
+static uint32_t emu_rand(struct EMU_TRANSPORT *et)
+{
+  // xorshift32
+  uint32_t x = et->rand_state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  et->rand_state = x;
+  return x;
+}
+
+/*
+ * Time for a chunk sent over the link at 'time' to arrive at the
+ * other end.
+ */
+static uint64_t emu_get_release_time(struct EMU_TRANSPORT *et, struct EMU_QUEUE *q, uint64_t time, size_t len)
+{
+  uint64_t release_time;
+
+  if (q->link_free_time > time)
+    time = q->link_free_time;
+  if (et->cfg.rate != 0)
+    time += (uint64_t) len * 1000000000 / et->cfg.rate;
+  q->link_free_time = time;
+
+  release_time = time + (uint64_t) et->cfg.latency_ms * 1000000;
+  if (et->cfg.jitter_ms != 0) {
+    // jitter in us, which may not fit in 32 bits
+    uint64_t r = (uint64_t) emu_rand(et) << 32;
+    r |= emu_rand(et);
+    release_time += r % ((uint64_t) et->cfg.jitter_ms * 1000 + 1) * 1000;
+  }
+  if (release_time < q->last_release_time)
+    release_time = q->last_release_time;
+  q->last_release_time = release_time;
+  return release_time;
+}
+
+static void emu_queue_init(struct EMU_QUEUE *q)
+{
+  q->data = ssh_buf_new();
+  q->data_start = 0;
+  q->chunks = NULL;
+  q->chunks_cap = 0;
+  q->chunks_start = q->chunks_end = 0;
+  q->link_free_time = 0;
+  q->last_release_time = 0;
+}
+
+static void emu_queue_free(struct EMU_QUEUE *q)
+{
+  ssh_buf_free(&q->data);
+  ssh_free(q->chunks);
+}
+
+static size_t emu_queue_len(struct EMU_QUEUE *q)
+{
+  return q->data.len - q->data_start;
+}
+
+static int emu_queue_add_chunk(struct EMU_QUEUE *q, const uint8_t *data, size_t len, uint64_t release_time)
+{
+  struct SSH_ALLOC_WATCH *watch;
+  int ret = -1;
+
+  // the queues stand in for the network, so they're not part of the
+  // data path whose allocations may be watched
+  watch = ssh_alloc_set_watch(NULL);
+  if (q->chunks_end == q->chunks_cap) {
+    if (q->chunks_start > 0) {
+      memmove(q->chunks, q->chunks + q->chunks_start, (q->chunks_end - q->chunks_start) * sizeof(struct EMU_CHUNK));
+      q->chunks_end -= q->chunks_start;
+      q->chunks_start = 0;
+    } else {
+      size_t new_cap = (q->chunks_cap == 0) ? 64 : 2 * q->chunks_cap;
+      struct EMU_CHUNK *new_chunks = ssh_realloc(q->chunks, new_cap * sizeof(struct EMU_CHUNK));
+      if (new_chunks == NULL)
+        goto out;
+      q->chunks = new_chunks;
+      q->chunks_cap = new_cap;
+    }
+  }
+  if (ssh_buf_append_data(&q->data, data, len) < 0)
+    goto out;
+  q->chunks[q->chunks_end].len = len;
+  q->chunks[q->chunks_end].release_time = release_time;
+  q->chunks_end++;
+  ret = 0;
+
+ out:
+  ssh_alloc_set_watch(watch);
+  return ret;
+}
+
+/*
+ * Send data over the emulated link, splitting it in random sized
+ * chunks if configured.
+ */
+static int emu_queue_add(struct EMU_TRANSPORT *et, struct EMU_QUEUE *q, const uint8_t *data, size_t len, uint64_t now)
+{
+  while (len > 0) {
+    size_t chunk_len = len;
+
+    if (et->cfg.max_chunk != 0 && chunk_len > 1) {
+      size_t max_chunk = (et->cfg.max_chunk < chunk_len) ? et->cfg.max_chunk : chunk_len;
+      chunk_len = 1 + emu_rand(et) % max_chunk;
+    }
+    if (emu_queue_add_chunk(q, data, chunk_len, emu_get_release_time(et, q, now, chunk_len)) < 0)
+      return -1;
+    data += chunk_len;
+    len -= chunk_len;
+  }
+  return 0;
+}
+
+/*
+ * Get the data of the first chunk, if it has arrived.
+ */
+static size_t emu_queue_peek(struct EMU_QUEUE *q, uint64_t now, const uint8_t **data)
+{
+  if (q->chunks_start == q->chunks_end || q->chunks[q->chunks_start].release_time > now)
+    return 0;
+  *data = q->data.data + q->data_start;
+  return q->chunks[q->chunks_start].len;
+}
+
+static void emu_queue_consume(struct EMU_QUEUE *q, size_t len)
+{
+  struct EMU_CHUNK *chunk = &q->chunks[q->chunks_start];
+
+  q->data_start += len;
+  chunk->len -= len;
+  if (chunk->len == 0 && ++q->chunks_start == q->chunks_end)
+    q->chunks_start = q->chunks_end = 0;
+
+  if (q->data_start == q->data.len) {
+    ssh_buf_clear(&q->data);
+    q->data_start = 0;
+  } else if (q->data_start >= EMU_READ_SIZE && q->data_start >= q->data.len / 2) {
+    ssh_buf_remove_data(&q->data, 0, q->data_start);
+    q->data_start = 0;
+  }
+}
+
+/*
+ * Time when the first chunk will arrive, 0 if the queue is empty.
+ */
+static uint64_t emu_queue_next_release(struct EMU_QUEUE *q)
+{
+  if (q->chunks_start == q->chunks_end)
+    return 0;
+  return q->chunks[q->chunks_start].release_time;
+}
+
+/*
+ * Move data that arrived at the end of each link: outgoing data to
+ * the wrapped transport, and incoming data from it to the queue.
+ */
+static int emu_pump(struct EMU_TRANSPORT *et, uint64_t now)
+{
+  uint8_t buf[EMU_READ_SIZE];
+  const uint8_t *data;
+  size_t len;
+
+  while ((len = emu_queue_peek(&et->out, now, &data)) > 0) {
+    ssize_t w = ssh_transport_write(et->inner, data, len);
+    if (w < 0)
+      return -1;
+    emu_queue_consume(&et->out, w);
+    if (w < len)
+      break;
+  }
+
+  while (! et->in_closed && emu_queue_len(&et->in) < EMU_MAX_QUEUED) {
+    ssize_t r = ssh_transport_read_ahead(et->inner, buf, 1, sizeof(buf));
+    if (r < 0) {
+      et->in_closed = 1;
+      et->in_eof = (errno == 0);
+      et->in_close_time = emu_get_release_time(et, &et->in, now, 0);
+      break;
+    }
+    if (r == 0)
+      break;
+    if (emu_queue_add(et, &et->in, buf, r, now) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+static int emu_is_readable(struct EMU_TRANSPORT *et, uint64_t now)
+{
+  const uint8_t *data;
+
+  if (emu_queue_peek(&et->in, now, &data) > 0)
+    return 1;
+  return et->in_closed && emu_queue_len(&et->in) == 0 && now >= et->in_close_time;
+}
+
+static void emu_lower_timeout(int *timeout, uint64_t time, uint64_t now)
+{
+  int ms;
+
+  if (time == 0)
+    return;
+  ms = (time <= now) ? 0 : (time - now + 999999) / 1000000;
+  if (*timeout < 0 || ms < *timeout)
+    *timeout = ms;
+}
+
+/*
+ * Prepare to poll the wrapped transport, waking up when the next
+ * chunk arrives.
+ */
+static int emu_prepare_inner(struct EMU_TRANSPORT *et, struct pollfd *poll_fd, int *timeout, uint64_t now)
+{
+  const uint8_t *data;
+
+  emu_lower_timeout(timeout, emu_queue_next_release(&et->out), now);
+  emu_lower_timeout(timeout, emu_queue_next_release(&et->in), now);
+  if (et->in_closed)
+    emu_lower_timeout(timeout, et->in_close_time, now);
+  return ssh_transport_poll_prepare(et->inner, poll_fd, emu_queue_peek(&et->out, now, &data) > 0, timeout);
+}
+
+/*
+ * Wait for something to happen on the wrapped transport or on the
+ * emulated links.
+ */
+static int emu_wait(struct EMU_TRANSPORT *et)
+{
+  struct pollfd poll_fd;
+  int timeout = -1;
+
+  if (emu_prepare_inner(et, &poll_fd, &timeout, ssh_rate_limit_now()) < 0)
+    return -1;
+  if (poll(&poll_fd, 1, timeout) < 0 && errno != EINTR) {
+    ssh_set_error("poll error");
+    return -1;
+  }
+  if (ssh_transport_poll_result(et->inner, &poll_fd) < 0)
+    return -1;
+  return emu_pump(et, ssh_rate_limit_now());
+}
+
+static void emu_free(struct SSH_TRANSPORT *transport)
+{
+  struct EMU_TRANSPORT *et = (struct EMU_TRANSPORT *) transport;
+
+  // deliver the data still in the link
+  while (emu_queue_len(&et->out) > 0) {
+    if (emu_pump(et, ssh_rate_limit_now()) < 0
+        || (emu_queue_len(&et->out) > 0 && emu_wait(et) < 0))
+      break;
+  }
+  ssh_transport_free(et->inner);
+  emu_queue_free(&et->in);
+  emu_queue_free(&et->out);
+  ssh_free(et);
+}
+
+static int emu_set_blocking(struct SSH_TRANSPORT *transport, int block)
+{
+  struct EMU_TRANSPORT *et = (struct EMU_TRANSPORT *) transport;
+
+  et->blocking = block;
+  return 0;
+}
+
+static ssize_t emu_read_ahead(struct SSH_TRANSPORT *transport, void *data, size_t len, size_t max_len)
+{
+  struct EMU_TRANSPORT *et = (struct EMU_TRANSPORT *) transport;
+  uint8_t *p = data;
+  size_t done = 0;
+
+  if (max_len > SSIZE_MAX) {
+    ssh_set_error("read too large");
+    errno = 0;
+    return -1;
+  }
+
+  while (1) {
+    uint64_t now = ssh_rate_limit_now();
+    const uint8_t *chunk_data;
+    size_t chunk_len;
+
+    if (emu_pump(et, now) < 0)
+      return -1;
+    while (done < max_len && (chunk_len = emu_queue_peek(&et->in, now, &chunk_data)) > 0) {
+      if (chunk_len > max_len - done)
+        chunk_len = max_len - done;
+      memcpy(p + done, chunk_data, chunk_len);
+      emu_queue_consume(&et->in, chunk_len);
+      done += chunk_len;
+    }
+    if (done >= len)
+      return done;
+
+    if (et->in_closed && emu_queue_len(&et->in) == 0 && now >= et->in_close_time) {
+      if (et->in_eof) {
+        ssh_set_error("connection closed");
+        errno = 0;
+      } else {
+        ssh_set_error("read error");
+      }
+      return -1;
+    }
+    if (! et->blocking) {
+      errno = EWOULDBLOCK;
+      return done;
+    }
+    if (emu_wait(et) < 0)
+      return -1;
+  }
+}
+
+static ssize_t emu_write(struct SSH_TRANSPORT *transport, const void *data, size_t len)
+{
+  struct EMU_TRANSPORT *et = (struct EMU_TRANSPORT *) transport;
+  const uint8_t *p = data;
+  size_t done = 0;
+
+  if (len > SSIZE_MAX) {
+    ssh_set_error("write too large");
+    errno = 0;
+    return -1;
+  }
+
+  while (1) {
+    uint64_t now = ssh_rate_limit_now();
+    size_t space = EMU_MAX_QUEUED - emu_queue_len(&et->out);
+
+    if (space > len - done)
+      space = len - done;
+    if (space > 0 && emu_queue_add(et, &et->out, p + done, space, now) < 0)
+      return -1;
+    done += space;
+    if (emu_pump(et, now) < 0)
+      return -1;
+    if (done == len || ! et->blocking)
+      break;
+    if (emu_wait(et) < 0)
+      return -1;
+  }
+
+  if (done < len)
+    errno = EWOULDBLOCK;
+  return done;
+}
+
+static int emu_poll_prepare(struct SSH_TRANSPORT *transport, struct pollfd *poll_fd, int want_write, int *timeout)
+{
+  struct EMU_TRANSPORT *et = (struct EMU_TRANSPORT *) transport;
+  uint64_t now = ssh_rate_limit_now();
+
+  if (emu_pump(et, now) < 0)
+    return -1;
+  if (emu_is_readable(et, now) || (want_write && emu_queue_len(&et->out) < EMU_MAX_QUEUED))
+    *timeout = 0;
+  return emu_prepare_inner(et, poll_fd, timeout, now);
+}
+
+static int emu_poll_result(struct SSH_TRANSPORT *transport, const struct pollfd *poll_fd)
+{
+  struct EMU_TRANSPORT *et = (struct EMU_TRANSPORT *) transport;
+  uint64_t now;
+  int flags = 0;
+
+  if (ssh_transport_poll_result(et->inner, poll_fd) < 0)
+    return -1;
+  now = ssh_rate_limit_now();
+  if (emu_pump(et, now) < 0)
+    return -1;
+  if (emu_is_readable(et, now))
+    flags |= SSH_TRANSPORT_CAN_READ;
+  if (emu_queue_len(&et->out) < EMU_MAX_QUEUED)
+    flags |= SSH_TRANSPORT_CAN_WRITE;
+  return flags;
+}
+
+static const struct SSH_TRANSPORT_OPS emu_ops = {
+  "emulated network",
+  emu_free,
+  emu_set_blocking,
+  emu_read_ahead,
+  emu_write,
+  emu_poll_prepare,
+  emu_poll_result,
+};
+
+/*
+ * Wrap a transport to emulate the given network conditions.  The new
+ * transport owns 'inner', which is freed if this fails.
+ */
+struct SSH_TRANSPORT *ssh_transport_emu_new(struct SSH_TRANSPORT *inner, const struct SSH_TRANSPORT_EMU_CONFIG *cfg)
+{
+  struct EMU_TRANSPORT *et;
+
+  if (ssh_transport_set_blocking(inner, 0) < 0
+      || (et = ssh_alloc(sizeof(struct EMU_TRANSPORT))) == NULL) {
+    ssh_transport_free(inner);
+    return NULL;
+  }
+  et->transport.ops = &emu_ops;
+  et->transport.sock = inner->sock;
+  et->inner = inner;
+  et->cfg = *cfg;
+  et->rand_state = (cfg->seed != 0) ? cfg->seed : 1;
+  et->blocking = 1;
+  emu_queue_init(&et->in);
+  emu_queue_init(&et->out);
+  et->in_closed = 0;
+  return &et->transport;
+}
+
+/*
+ * Parse network emulation settings in the form
+ * "latency=100,jitter=20,rate=1M,chunk=512,seed=42", where latency
+ * and jitter are in ms, and rate in bytes per second (with optional
+ * suffix k, M or G).  Settings not given are 0.
+ */
+int ssh_transport_emu_parse_config(struct SSH_TRANSPORT_EMU_CONFIG *cfg, const char *spec)
+{
+  const char *p = spec;
+
+  memset(cfg, 0, sizeof(struct SSH_TRANSPORT_EMU_CONFIG));
+  while (*p != '\0') {
+    const char *eq = strchr(p, '=');
+    size_t name_len;
+    uint64_t val;
+    char *end;
+
+    if (eq == NULL)
+      goto err;
+    name_len = eq - p;
+    errno = 0;
+    val = strtoull(eq + 1, &end, 10);
+    if (errno != 0 || end == eq + 1)
+      goto err;
+    switch (*end) {
+    case 'k': case 'K': val *= 1000; end++; break;
+    case 'm': case 'M': val *= 1000000; end++; break;
+    case 'g': case 'G': val *= 1000000000; end++; break;
+    }
+    if (*end != ',' && *end != '\0')
+      goto err;
+
+    if (name_len == 7 && memcmp(p, "latency", 7) == 0 && val <= UINT32_MAX)
+      cfg->latency_ms = val;
+    else if (name_len == 6 && memcmp(p, "jitter", 6) == 0 && val <= UINT32_MAX)
+      cfg->jitter_ms = val;
+    else if (name_len == 4 && memcmp(p, "rate", 4) == 0)
+      cfg->rate = val;
+    else if (name_len == 5 && memcmp(p, "chunk", 5) == 0 && val <= UINT32_MAX)
+      cfg->max_chunk = val;
+    else if (name_len == 4 && memcmp(p, "seed", 4) == 0 && val <= UINT32_MAX)
+      cfg->seed = val;
+    else
+      goto err;
+    p = (*end == ',') ? end + 1 : end;
+  }
+  return 0;
+
+ err:
+  ssh_set_error("invalid network emulation setting at '%s'", p);
+  return -1;
+}
@@ -0,0 +1,102 @@
+/* transport_i.h */
+
+#ifndef TRANSPORT_I_H_FILE
+#define TRANSPORT_I_H_FILE
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <poll.h>
+
+#include "common/transport.h"
+
+/* flags returned by ssh_transport_poll_result() */
+#define SSH_TRANSPORT_CAN_READ  (1<<0)
+#define SSH_TRANSPORT_CAN_WRITE (1<<1)
+
+struct SSH_TRANSPORT;
+
+typedef void (*ssh_transport_fn_free)(struct SSH_TRANSPORT *transport);
+typedef int (*ssh_transport_fn_set_blocking)(struct SSH_TRANSPORT *transport, int block);
+typedef ssize_t (*ssh_transport_fn_read_ahead)(struct SSH_TRANSPORT *transport, void *data, size_t len, size_t max_len);
+typedef ssize_t (*ssh_transport_fn_write)(struct SSH_TRANSPORT *transport, const void *data, size_t len);
+typedef int (*ssh_transport_fn_poll_prepare)(struct SSH_TRANSPORT *transport, struct pollfd *poll_fd, int want_write, int *timeout);
+typedef int (*ssh_transport_fn_poll_result)(struct SSH_TRANSPORT *transport, const struct pollfd *poll_fd);
+
+struct SSH_TRANSPORT_OPS {
+  const char *name;
+  ssh_transport_fn_free free;
+  ssh_transport_fn_set_blocking set_blocking;
+  ssh_transport_fn_read_ahead read_ahead;
+  ssh_transport_fn_write write;
+  ssh_transport_fn_poll_prepare poll_prepare;
+  ssh_transport_fn_poll_result poll_result;
+};
+
+struct SSH_TRANSPORT {
+  const struct SSH_TRANSPORT_OPS *ops;
+  int sock;
+};
+
+struct SSH_TRANSPORT *ssh_transport_new(enum SSH_TRANSPORT_TYPE type, int sock);
+void ssh_transport_free(struct SSH_TRANSPORT *transport);
+
+struct SSH_TRANSPORT *ssh_transport_uring_new(int sock);
+struct SSH_TRANSPORT *ssh_transport_emu_new(struct SSH_TRANSPORT *inner, const struct SSH_TRANSPORT_EMU_CONFIG *cfg);
+
+static inline const char *ssh_transport_get_name(struct SSH_TRANSPORT *transport)
+{
+  return transport->ops->name;
+}
+
+static inline int ssh_transport_set_blocking(struct SSH_TRANSPORT *transport, int block)
+{
+  return transport->ops->set_blocking(transport, block);
+}
+
+/*
+ * Read at least 'len' bytes (less if the transport is non-blocking
+ * and there's no more data), and take up to 'max_len' if that much is
+ * already available.  Fails with "connection closed" at the end of
+ * the stream.
+ */
+static inline ssize_t ssh_transport_read_ahead(struct SSH_TRANSPORT *transport, void *data, size_t len, size_t max_len)
+{
+  return transport->ops->read_ahead(transport, data, len, max_len);
+}
+
+static inline ssize_t ssh_transport_read(struct SSH_TRANSPORT *transport, void *data, size_t len)
+{
+  return transport->ops->read_ahead(transport, data, len, len);
+}
+
+/*
+ * Write data, returning how much was taken (less than 'len' if the
+ * transport is non-blocking and can't take more now).
+ */
+static inline ssize_t ssh_transport_write(struct SSH_TRANSPORT *transport, const void *data, size_t len)
+{
+  return transport->ops->write(transport, data, len);
+}
+
+/*
+ * Fill 'poll_fd' to wait for the transport to be readable (and
+ * writable, if 'want_write' is set).  The poll() timeout in ms (-1
+ * for none) in '*timeout' is lowered if the transport needs to be
+ * called back sooner, or set to 0 if it already has events to
+ * process.
+ */
+static inline int ssh_transport_poll_prepare(struct SSH_TRANSPORT *transport, struct pollfd *poll_fd, int want_write, int *timeout)
+{
+  return transport->ops->poll_prepare(transport, poll_fd, want_write, timeout);
+}
+
+/*
+ * Process the poll() result for the transport's fd, returning
+ * SSH_TRANSPORT_CAN_* flags.
+ */
+static inline int ssh_transport_poll_result(struct SSH_TRANSPORT *transport, const struct pollfd *poll_fd)
+{
+  return transport->ops->poll_result(transport, poll_fd);
+}
+
+#endif /* TRANSPORT_I_H_FILE */
@@ -0,0 +1,615 @@
+/* transport_uring.c
+ *
+ * io_uring transport.
+ *
+ * The socket is registered with the ring as fixed file 0.  Receiving
+ * uses a single multishot recv that picks buffers from a ring of
+ * provided buffers, so data arrives without a syscall per read; the
+ * filled buffers are queued in order and returned to the ring once
+ * they're consumed.
+ *
+ * Written data is copied to a circular send buffer and sent with one
+ * chain of sends at a time (two linked sends when the data wraps
+ * around the end of the buffer), so the data is never reordered.
+ *
+ * The ring fd is readable whenever there are completions, so the
+ * poll() loop of the caller waits on it instead of the socket.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "common/transport_i.h"
+
+#include "common/error.h"
+#include "common/debug.h"
+#include "common/alloc.h"
+
+#define URING_ENTRIES       64
+#define URING_NUM_BUFS      32             // must be a power of 2
+#define URING_BUF_SIZE      (16*1024)
+#define URING_BUF_GROUP     0
+#define URING_SEND_BUF_SIZE (64*1024)      // must be a power of 2
+
+// user_data of each kind of request
+#define URING_OP_RECV       1
+#define URING_OP_SEND       2
+#define URING_OP_CANCEL     3
+
+struct URING_RECV_CHUNK {
+  uint16_t buf_id;
+  uint32_t len;
+  uint32_t pos;
+};
+
+struct URING_TRANSPORT {
+  struct SSH_TRANSPORT transport;
+  int ring_fd;
+  int blocking;
+
+  // submission and completion rings
+  void *sq_map;
+  size_t sq_map_len;
+  void *cq_map;
+  size_t cq_map_len;
+  struct io_uring_sqe *sqes;
+  size_t sqes_len;
+  uint32_t *sq_head;
+  uint32_t *sq_tail;
+  uint32_t *sq_array;
+  uint32_t sq_mask;
+  uint32_t sq_entries;
+  uint32_t sq_queued;                      // entries added but not submitted yet
+  uint32_t *cq_head;
+  uint32_t *cq_tail;
+  uint32_t cq_mask;
+  struct io_uring_cqe *cqes;
+
+  // receive: provided buffers and buffers filled by the kernel
+  struct io_uring_buf_ring *buf_ring;
+  size_t buf_ring_len;
+  uint8_t *recv_bufs;
+  uint16_t buf_ring_tail;
+  struct URING_RECV_CHUNK recv_queue[URING_NUM_BUFS];
+  uint32_t recv_queue_start;
+  uint32_t recv_queue_len;
+  int recv_armed;
+  int recv_eof;
+  int recv_error;                          // negative errno
+
+  // send: circular buffer, with data from 'send_start' being sent
+  uint8_t *send_buf;
+  size_t send_start;
+  size_t send_len;
+  int send_ops;                            // sends of the current chain still in flight
+  size_t send_done;                        // bytes sent by the current chain
+  int send_error;                          // negative errno
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params)
+{
+  return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+  return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+  return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+ * Submit queued entries and, if 'wait' is set, wait for at least one
+ * completion.
+ */
+static int uring_enter(struct URING_TRANSPORT *ut, int wait)
+{
+  while (ut->sq_queued > 0 || wait) {
+    int ret = sys_io_uring_enter(ut->ring_fd, ut->sq_queued, (wait) ? 1 : 0, (wait) ? IORING_ENTER_GETEVENTS : 0);
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      ssh_set_error("io_uring_enter: %s", strerror(errno));
+      return -1;
+    }
+    ut->sq_queued -= (ret < ut->sq_queued) ? ret : ut->sq_queued;
+    wait = 0;
+  }
+  return 0;
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct URING_TRANSPORT *ut)
+{
+  uint32_t tail = *ut->sq_tail;
+  struct io_uring_sqe *sqe;
+
+  if (tail - __atomic_load_n(ut->sq_head, __ATOMIC_ACQUIRE) >= ut->sq_entries) {
+    if (uring_enter(ut, 0) < 0)
+      return NULL;
+    if (tail - __atomic_load_n(ut->sq_head, __ATOMIC_ACQUIRE) >= ut->sq_entries) {
+      ssh_set_error("io_uring submission queue full");
+      return NULL;
+    }
+  }
+  sqe = &ut->sqes[tail & ut->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+static void uring_queue_sqe(struct URING_TRANSPORT *ut, struct io_uring_sqe *sqe)
+{
+  uint32_t tail = *ut->sq_tail;
+
+  ut->sq_array[tail & ut->sq_mask] = sqe - ut->sqes;
+  __atomic_store_n(ut->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ut->sq_queued++;
+}
+
+static void uring_recycle_buf(struct URING_TRANSPORT *ut, uint16_t buf_id)
+{
+  struct io_uring_buf *buf = &ut->buf_ring->bufs[ut->buf_ring_tail & (URING_NUM_BUFS-1)];
+
+  buf->addr = (uint64_t) (uintptr_t) (ut->recv_bufs + (size_t) buf_id * URING_BUF_SIZE);
+  buf->len = URING_BUF_SIZE;
+  buf->bid = buf_id;
+  ut->buf_ring_tail++;
+  __atomic_store_n(&ut->buf_ring->tail, ut->buf_ring_tail, __ATOMIC_RELEASE);
+}
+
+static int uring_arm_recv(struct URING_TRANSPORT *ut)
+{
+  struct io_uring_sqe *sqe;
+
+  if (ut->recv_armed || ut->recv_eof || ut->recv_error != 0 || ut->recv_queue_len == URING_NUM_BUFS)
+    return 0;
+  if ((sqe = uring_get_sqe(ut)) == NULL)
+    return -1;
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = 0;
+  sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->buf_group = URING_BUF_GROUP;
+  sqe->user_data = URING_OP_RECV;
+  uring_queue_sqe(ut, sqe);
+  ut->recv_armed = 1;
+  return 0;
+}
+
+/*
+ * Start sending the data in the send buffer, unless a send is
+ * already in flight.
+ */
+static int uring_start_send(struct URING_TRANSPORT *ut)
+{
+  size_t pos, len;
+  int i;
+
+  if (ut->send_ops > 0 || ut->send_len == 0 || ut->send_error != 0)
+    return 0;
+
+  pos = ut->send_start;
+  len = ut->send_len;
+  ut->send_done = 0;
+  for (i = 0; i < 2 && len > 0; i++) {
+    size_t part_len = (pos + len > URING_SEND_BUF_SIZE) ? URING_SEND_BUF_SIZE - pos : len;
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = uring_get_sqe(ut)) == NULL)
+      return -1;
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = 0;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (uint64_t) (uintptr_t) (ut->send_buf + pos);
+    sqe->len = part_len;
+    sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+    sqe->user_data = URING_OP_SEND;
+
+    pos = (pos + part_len) & (URING_SEND_BUF_SIZE-1);
+    len -= part_len;
+    if (len > 0)
+      sqe->flags |= IOSQE_IO_LINK;   // the rest is sent only if this part is sent in full
+    uring_queue_sqe(ut, sqe);
+    ut->send_ops++;
+  }
+  return uring_enter(ut, 0);
+}
+
+static void uring_handle_recv(struct URING_TRANSPORT *ut, const struct io_uring_cqe *cqe)
+{
+  if ((cqe->flags & IORING_CQE_F_MORE) == 0)
+    ut->recv_armed = 0;
+
+  if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER) != 0) {
+    struct URING_RECV_CHUNK *chunk = &ut->recv_queue[(ut->recv_queue_start + ut->recv_queue_len) & (URING_NUM_BUFS-1)];
+    chunk->buf_id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    chunk->len = cqe->res;
+    chunk->pos = 0;
+    ut->recv_queue_len++;
+  } else if (cqe->res == 0) {
+    ut->recv_eof = 1;
+  } else if (cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+    // -ENOBUFS means the recv stopped for lack of free buffers, it's
+    // armed again when they're returned
+    ut->recv_error = cqe->res;
+  }
+}
+
+static void uring_handle_send(struct URING_TRANSPORT *ut, const struct io_uring_cqe *cqe)
+{
+  if (cqe->res >= 0)
+    ut->send_done += cqe->res;
+  else if (cqe->res != -ECANCELED)
+    ut->send_error = cqe->res;
+
+  if (--ut->send_ops > 0)
+    return;
+
+  // a short send cancels the rest of the chain, which is sent again
+  ut->send_start = (ut->send_start + ut->send_done) & (URING_SEND_BUF_SIZE-1);
+  ut->send_len -= ut->send_done;
+}
+
+/*
+ * Process all available completions.
+ */
+static int uring_reap(struct URING_TRANSPORT *ut)
+{
+  uint32_t head = *ut->cq_head;
+  uint32_t tail = __atomic_load_n(ut->cq_tail, __ATOMIC_ACQUIRE);
+
+  while (head != tail) {
+    const struct io_uring_cqe *cqe = &ut->cqes[head & ut->cq_mask];
+
+    switch (cqe->user_data) {
+    case URING_OP_RECV: uring_handle_recv(ut, cqe); break;
+    case URING_OP_SEND: uring_handle_send(ut, cqe); break;
+    }
+    head++;
+    if (head == tail)
+      tail = __atomic_load_n(ut->cq_tail, __ATOMIC_ACQUIRE);
+  }
+  __atomic_store_n(ut->cq_head, head, __ATOMIC_RELEASE);
+
+  if (uring_start_send(ut) < 0
+      || uring_arm_recv(ut) < 0
+      || uring_enter(ut, 0) < 0)
+    return -1;
+  return 0;
+}
+
+static int uring_has_completions(struct URING_TRANSPORT *ut)
+{
+  return *ut->cq_head != __atomic_load_n(ut->cq_tail, __ATOMIC_ACQUIRE);
+}
+
+static int uring_is_readable(struct URING_TRANSPORT *ut)
+{
+  return ut->recv_queue_len > 0 || ut->recv_eof || ut->recv_error != 0;
+}
+
+static void uring_free(struct SSH_TRANSPORT *transport)
+{
+  struct URING_TRANSPORT *ut = (struct URING_TRANSPORT *) transport;
+
+  if (ut->ring_fd >= 0) {
+    // send whatever is left, and make sure the kernel is done with
+    // the receive buffers before releasing them
+    while (ut->send_ops > 0) {
+      if (uring_enter(ut, 1) < 0 || uring_reap(ut) < 0)
+        break;
+      if (ut->send_error != 0)
+        break;
+    }
+    if (ut->recv_armed) {
+      struct io_uring_sqe *sqe = uring_get_sqe(ut);
+      if (sqe != NULL) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = URING_OP_RECV;
+        sqe->user_data = URING_OP_CANCEL;
+        uring_queue_sqe(ut, sqe);
+        ut->recv_error = -ECANCELED;   // don't arm it again
+        while (ut->recv_armed && uring_enter(ut, 1) == 0 && uring_reap(ut) == 0)
+          ;
+      }
+    }
+    close(ut->ring_fd);
+  }
+
+  if (ut->sq_map != NULL && ut->sq_map != MAP_FAILED)
+    munmap(ut->sq_map, ut->sq_map_len);
+  if (ut->cq_map != NULL && ut->cq_map != MAP_FAILED && ut->cq_map != ut->sq_map)
+    munmap(ut->cq_map, ut->cq_map_len);
+  if (ut->sqes != NULL && ut->sqes != MAP_FAILED)
+    munmap(ut->sqes, ut->sqes_len);
+  if (ut->buf_ring != NULL && ut->buf_ring != MAP_FAILED)
+    munmap(ut->buf_ring, ut->buf_ring_len);
+  ssh_free(ut->recv_bufs);
+  ssh_free(ut->send_buf);
+  if (ut->transport.sock >= 0)
+    close(ut->transport.sock);
+  ssh_free(ut);
+}
+
+static int uring_set_blocking(struct SSH_TRANSPORT *transport, int block)
+{
+  struct URING_TRANSPORT *ut = (struct URING_TRANSPORT *) transport;
+
+  // the socket itself is left alone, io_uring never blocks on it
+  ut->blocking = block;
+  return 0;
+}
+
+static ssize_t uring_read_ahead(struct SSH_TRANSPORT *transport, void *data, size_t len, size_t max_len)
+{
+  struct URING_TRANSPORT *ut = (struct URING_TRANSPORT *) transport;
+  uint8_t *p = data;
+  size_t done = 0;
+
+  if (max_len > SSIZE_MAX) {
+    ssh_set_error("read too large");
+    errno = 0;
+    return -1;
+  }
+
+  while (1) {
+    // take what's already received
+    while (done < max_len && ut->recv_queue_len > 0) {
+      struct URING_RECV_CHUNK *chunk = &ut->recv_queue[ut->recv_queue_start];
+      size_t copy_len = chunk->len - chunk->pos;
+
+      if (copy_len > max_len - done)
+        copy_len = max_len - done;
+      memcpy(p + done, ut->recv_bufs + (size_t) chunk->buf_id * URING_BUF_SIZE + chunk->pos, copy_len);
+      chunk->pos += copy_len;
+      done += copy_len;
+      if (chunk->pos == chunk->len) {
+        uring_recycle_buf(ut, chunk->buf_id);
+        ut->recv_queue_start = (ut->recv_queue_start + 1) & (URING_NUM_BUFS-1);
+        ut->recv_queue_len--;
+      }
+    }
+    if (done >= len)
+      break;
+
+    if (ut->recv_error != 0) {
+      ssh_set_error("read error");
+      errno = -ut->recv_error;
+      return -1;
+    }
+    if (ut->recv_eof) {
+      ssh_set_error("connection closed");
+      errno = 0;
+      return -1;
+    }
+
+    // get more completions, waiting for them if blocking
+    if (uring_arm_recv(ut) < 0)
+      return -1;
+    if (! uring_has_completions(ut)) {
+      if (! ut->blocking) {
+        if (uring_enter(ut, 0) < 0)
+          return -1;
+        errno = EWOULDBLOCK;
+        return done;
+      }
+      if (uring_enter(ut, 1) < 0)
+        return -1;
+    }
+    if (uring_reap(ut) < 0)
+      return -1;
+  }
+
+  if (uring_arm_recv(ut) < 0 || uring_enter(ut, 0) < 0)
+    return -1;
+  return done;
+}
+
+static ssize_t uring_write(struct SSH_TRANSPORT *transport, const void *data, size_t len)
+{
+  struct URING_TRANSPORT *ut = (struct URING_TRANSPORT *) transport;
+  const uint8_t *p = data;
+  size_t done = 0;
+
+  if (len > SSIZE_MAX) {
+    ssh_set_error("write too large");
+    errno = 0;
+    return -1;
+  }
+
+  while (1) {
+    if (ut->send_error != 0) {
+      ssh_set_error("write error");
+      errno = -ut->send_error;
+      return -1;
+    }
+
+    // copy as much as fits in the send buffer, wrapping around its end
+    while (done < len && ut->send_len < URING_SEND_BUF_SIZE) {
+      size_t pos = (ut->send_start + ut->send_len) & (URING_SEND_BUF_SIZE-1);
+      size_t copy_len = len - done;
+
+      if (copy_len > URING_SEND_BUF_SIZE - ut->send_len)
+        copy_len = URING_SEND_BUF_SIZE - ut->send_len;
+      if (copy_len > URING_SEND_BUF_SIZE - pos)
+        copy_len = URING_SEND_BUF_SIZE - pos;
+      memcpy(ut->send_buf + pos, p + done, copy_len);
+      ut->send_len += copy_len;
+      done += copy_len;
+    }
+    if (uring_start_send(ut) < 0)
+      return -1;
+    if (done == len || ! ut->blocking)
+      break;
+
+    // blocking: wait for the send buffer to drain
+    if (uring_enter(ut, 1) < 0 || uring_reap(ut) < 0)
+      return -1;
+  }
+
+  if (done < len)
+    errno = EWOULDBLOCK;
+  return done;
+}
+
+static int uring_poll_prepare(struct SSH_TRANSPORT *transport, struct pollfd *poll_fd, int want_write, int *timeout)
+{
+  struct URING_TRANSPORT *ut = (struct URING_TRANSPORT *) transport;
+
+  if (uring_arm_recv(ut) < 0 || uring_enter(ut, 0) < 0)
+    return -1;
+
+  poll_fd->fd = ut->ring_fd;
+  poll_fd->events = POLLIN;
+  if (uring_has_completions(ut)
+      || uring_is_readable(ut)
+      || (want_write && ut->send_len < URING_SEND_BUF_SIZE))
+    *timeout = 0;
+  return 0;
+}
+
+static int uring_poll_result(struct SSH_TRANSPORT *transport, const struct pollfd *poll_fd)
+{
+  struct URING_TRANSPORT *ut = (struct URING_TRANSPORT *) transport;
+  int flags = 0;
+
+  if (uring_reap(ut) < 0)
+    return -1;
+  if (uring_is_readable(ut))
+    flags |= SSH_TRANSPORT_CAN_READ;
+  if (ut->send_len < URING_SEND_BUF_SIZE || ut->send_error != 0)
+    flags |= SSH_TRANSPORT_CAN_WRITE;
+  return flags;
+}
+
+static const struct SSH_TRANSPORT_OPS uring_ops = {
+  "io_uring",
+  uring_free,
+  uring_set_blocking,
+  uring_read_ahead,
+  uring_write,
+  uring_poll_prepare,
+  uring_poll_result,
+};
+
+static int uring_setup(struct URING_TRANSPORT *ut)
+{
+  struct io_uring_params params;
+  struct io_uring_buf_reg buf_reg;
+  int i;
+
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_SINGLE_ISSUER;
+  if ((ut->ring_fd = sys_io_uring_setup(URING_ENTRIES, &params)) < 0 && errno == EINVAL) {
+    // older kernel
+    memset(&params, 0, sizeof(params));
+    ut->ring_fd = sys_io_uring_setup(URING_ENTRIES, &params);
+  }
+  if (ut->ring_fd < 0) {
+    ssh_set_error("io_uring_setup: %s", strerror(errno));
+    return -1;
+  }
+
+  // map the rings
+  ut->sq_map_len = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+  ut->cq_map_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0) {
+    if (ut->cq_map_len > ut->sq_map_len)
+      ut->sq_map_len = ut->cq_map_len;
+    ut->cq_map_len = ut->sq_map_len;
+  }
+  ut->sq_map = mmap(NULL, ut->sq_map_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ut->ring_fd, IORING_OFF_SQ_RING);
+  if (ut->sq_map == MAP_FAILED)
+    goto err;
+  if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0)
+    ut->cq_map = ut->sq_map;
+  else if ((ut->cq_map = mmap(NULL, ut->cq_map_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ut->ring_fd, IORING_OFF_CQ_RING)) == MAP_FAILED)
+    goto err;
+  ut->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+  ut->sqes = mmap(NULL, ut->sqes_len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ut->ring_fd, IORING_OFF_SQES);
+  if (ut->sqes == MAP_FAILED)
+    goto err;
+
+  ut->sq_head = (uint32_t *) ((uint8_t *) ut->sq_map + params.sq_off.head);
+  ut->sq_tail = (uint32_t *) ((uint8_t *) ut->sq_map + params.sq_off.tail);
+  ut->sq_array = (uint32_t *) ((uint8_t *) ut->sq_map + params.sq_off.array);
+  ut->sq_mask = *(uint32_t *) ((uint8_t *) ut->sq_map + params.sq_off.ring_mask);
+  ut->sq_entries = params.sq_entries;
+  ut->cq_head = (uint32_t *) ((uint8_t *) ut->cq_map + params.cq_off.head);
+  ut->cq_tail = (uint32_t *) ((uint8_t *) ut->cq_map + params.cq_off.tail);
+  ut->cq_mask = *(uint32_t *) ((uint8_t *) ut->cq_map + params.cq_off.ring_mask);
+  ut->cqes = (struct io_uring_cqe *) ((uint8_t *) ut->cq_map + params.cq_off.cqes);
+
+  // register the socket
+  if (sys_io_uring_register(ut->ring_fd, IORING_REGISTER_FILES, &ut->transport.sock, 1) < 0) {
+    ssh_set_error("can't register socket with io_uring: %s", strerror(errno));
+    return -1;
+  }
+
+  // register the receive buffers
+  ut->buf_ring_len = URING_NUM_BUFS * sizeof(struct io_uring_buf);
+  ut->buf_ring = mmap(NULL, ut->buf_ring_len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (ut->buf_ring == MAP_FAILED)
+    goto err;
+  memset(&buf_reg, 0, sizeof(buf_reg));
+  buf_reg.ring_addr = (uint64_t) (uintptr_t) ut->buf_ring;
+  buf_reg.ring_entries = URING_NUM_BUFS;
+  buf_reg.bgid = URING_BUF_GROUP;
+  if (sys_io_uring_register(ut->ring_fd, IORING_REGISTER_PBUF_RING, &buf_reg, 1) < 0) {
+    ssh_set_error("can't register io_uring buffer ring: %s", strerror(errno));
+    return -1;
+  }
+  if ((ut->recv_bufs = ssh_alloc((size_t) URING_NUM_BUFS * URING_BUF_SIZE)) == NULL
+      || (ut->send_buf = ssh_alloc(URING_SEND_BUF_SIZE)) == NULL)
+    return -1;
+  for (i = 0; i < URING_NUM_BUFS; i++)
+    uring_recycle_buf(ut, i);
+
+  ut->blocking = 1;
+  if (uring_arm_recv(ut) < 0 || uring_enter(ut, 0) < 0)
+    return -1;
+  return 0;
+
+ err:
+  ssh_set_error("can't map io_uring memory: %s", strerror(errno));
+  return -1;
+}
+
+/*
+ * Create an io_uring transport for the socket, returning NULL if
+ * io_uring is not available.  The socket is closed only if this
+ * succeeds.
+ */
+struct SSH_TRANSPORT *ssh_transport_uring_new(int sock)
+{
+  struct URING_TRANSPORT *ut;
+
+  if ((ut = ssh_alloc(sizeof(struct URING_TRANSPORT))) == NULL)
+    return NULL;
+  memset(ut, 0, sizeof(struct URING_TRANSPORT));
+  ut->transport.ops = &uring_ops;
+  ut->transport.sock = sock;
+  ut->ring_fd = -1;
+
+  if (uring_setup(ut) < 0) {
+    ut->transport.sock = -1;
+    if (ut->ring_fd >= 0) {
+      close(ut->ring_fd);
+      ut->ring_fd = -1;
+    }
+    uring_free(&ut->transport);
+    return NULL;
+  }
+  return &ut->transport;
+}
@@ -1,7 +1,12 @@
-/* aes.c */
+/* aes.c
+ *
+ * AES through OpenSSL, or through the in-tree AES-NI implementation
+ * (aes_ni.c) for CTR mode on CPUs that support it.
+ */
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 
 #include <openssl/evp.h>
 
@@ -9,15 +14,25 @@
 
 #include "common/error.h"
 #include "common/debug.h"
+#include "common/alloc.h"
 #include "crypto/algorithms.h"
+#include "crypto/evp.h"
+#include "crypto/cpu.h"
+#include "crypto/aes_ni.h"
 
-#define TO_EVP_CTX(ctx) ((EVP_CIPHER_CTX *) (ctx))
+struct CRYPTO_CIPHER_CTX {
+  EVP_CIPHER_CTX *evp;             // NULL until needed
+  int use_aes_ni;
+  struct CRYPTO_AES_NI_CTR aes_ni;
+};
 
-static const EVP_CIPHER *get_evp_cipher(enum SSH_CIPHER_TYPE type)
+static EVP_CIPHER *get_evp_cipher(enum SSH_CIPHER_TYPE type)
 {
   switch (type) {
-  case SSH_CIPHER_AES128_CTR: return EVP_aes_128_ctr();
-  case SSH_CIPHER_AES128_CBC: return EVP_aes_128_cbc();
+  case SSH_CIPHER_AES128_CTR:
+  case SSH_CIPHER_AES256_CTR:
+  case SSH_CIPHER_AES128_CBC:
+    return crypto_evp_get_cipher(type);
 
   default:
     ssh_set_error("invalid AES cipher: %d", type);
@@ -27,55 +42,78 @@ static const EVP_CIPHER *get_evp_cipher(enum SSH_CIPHER_TYPE type)
 
 struct CRYPTO_CIPHER_CTX *crypto_aes_new(enum SSH_CIPHER_TYPE type, enum SSH_CIPHER_DIRECTION dir, const struct SSH_STRING *iv, const struct SSH_STRING *key)
 {
-  const EVP_CIPHER *cipher;
-  EVP_CIPHER_CTX *ctx;
-  
-  cipher = get_evp_cipher(type);
-  if (cipher == NULL)
+  struct CRYPTO_CIPHER_CTX *ctx;
+
+  if ((ctx = ssh_alloc(sizeof(struct CRYPTO_CIPHER_CTX))) == NULL)
     return NULL;
-    
-  ctx = EVP_CIPHER_CTX_new();
-  if (ctx == NULL) {
-    ssh_set_error("out of memory");
+
+  if (crypto_aes_rekey(ctx, type, dir, iv, key) < 0) {
+    crypto_aes_free(ctx);
     return NULL;
   }
+  return ctx;
+}
 
-  EVP_CIPHER_CTX_init(ctx);
-  if (EVP_CipherInit(ctx, cipher, NULL, NULL, dir == SSH_CIPHER_ENCRYPT) == 0) {
-    EVP_CIPHER_CTX_free(ctx);
-    ssh_set_error("error initializing AES cipher");
-    return NULL;
+/*
+ * Set a new key and IV.  If the cipher doesn't change, the provider
+ * context is kept and only the key schedule is recomputed.
+ */
+int crypto_aes_rekey(struct CRYPTO_CIPHER_CTX *ctx, enum SSH_CIPHER_TYPE type, enum SSH_CIPHER_DIRECTION dir, const struct SSH_STRING *iv, const struct SSH_STRING *key)
+{
+  EVP_CIPHER *cipher;
+  int key_len;
+
+  cipher = get_evp_cipher(type);
+  if (cipher == NULL)
+    return -1;
+
+  key_len = EVP_CIPHER_get_key_length(cipher);
+  if (key->len < key_len || iv->len < EVP_CIPHER_get_iv_length(cipher)) {
+    ssh_set_error("invalid key or IV size (%d,%d) vs (%d,%d)", (int) key->len, (int) iv->len, key_len, EVP_CIPHER_get_iv_length(cipher));
+    return -1;
   }
-  if (key->len < EVP_CIPHER_CTX_key_length(ctx)
-      || iv->len < EVP_CIPHER_CTX_iv_length(ctx)) {
-    ssh_set_error("invalid key or IV size (%d,%d) vs (%d,%d)", (int) key->len, (int) iv->len, (int)EVP_CIPHER_CTX_key_length(ctx), (int)EVP_CIPHER_CTX_iv_length(ctx));
-    EVP_CIPHER_CTX_free(ctx);
-    return NULL;
+
+  // CTR mode doesn't care about the direction
+  if ((type == SSH_CIPHER_AES128_CTR || type == SSH_CIPHER_AES256_CTR) && crypto_cpu_has(CRYPTO_CPU_AESNI)) {
+    if (crypto_aes_ni_ctr_init(&ctx->aes_ni, key->str, 8*key_len, iv->str) < 0)
+      return -1;
+    ctx->use_aes_ni = 1;
+    return 0;
+  }
+  ctx->use_aes_ni = 0;
+
+  if (ctx->evp == NULL && (ctx->evp = EVP_CIPHER_CTX_new()) == NULL) {
+    ssh_set_error("out of memory");
+    return -1;
   }
-  if (EVP_CipherInit(ctx, NULL, key->str, iv->str, -1) == 0) {
-    EVP_CIPHER_CTX_free(ctx);
+  if (EVP_CIPHER_CTX_get0_cipher(ctx->evp) == cipher)
+    cipher = NULL;
+  if (EVP_CipherInit_ex2(ctx->evp, cipher, key->str, iv->str, dir == SSH_CIPHER_ENCRYPT, NULL) == 0
+      || EVP_CIPHER_CTX_set_padding(ctx->evp, 0) == 0) {
     ssh_set_error("error initializing AES cipher");
-    return NULL;
+    return -1;
   }
-  
-  return (struct CRYPTO_CIPHER_CTX *) ctx;
+  return 0;
 }
 
-void crypto_aes_free(struct CRYPTO_CIPHER_CTX *cipher_ctx)
+void crypto_aes_free(struct CRYPTO_CIPHER_CTX *ctx)
 {
-  EVP_CIPHER_CTX *ctx = TO_EVP_CTX(cipher_ctx);
-  
-  EVP_CIPHER_CTX_free(ctx);
+  EVP_CIPHER_CTX_free(ctx->evp);
+  crypto_aes_ni_ctr_clear(&ctx->aes_ni);
+  ssh_free(ctx);
 }
 
-int crypto_aes_crypt(struct CRYPTO_CIPHER_CTX *cipher_ctx, uint8_t *out, uint8_t *data, uint32_t len)
+int crypto_aes_crypt(struct CRYPTO_CIPHER_CTX *ctx, uint8_t *out, uint8_t *data, uint32_t len)
 {
-  EVP_CIPHER_CTX *ctx = TO_EVP_CTX(cipher_ctx);
-
   //ssh_log("CIPHER: processing %u bytes\n", len);
   //dump_mem("CIPHER [BEFORE PROCESSING]", data, len);
 
-  if (EVP_Cipher(ctx, out, data, len) == 0) {
+  if (ctx->use_aes_ni) {
+    crypto_aes_ni_ctr_crypt(&ctx->aes_ni, out, data, len);
+    return 0;
+  }
+
+  if (EVP_Cipher(ctx->evp, out, data, len) <= 0) {
     ssh_set_error("cipher error");
     return -1;
   }
@@ -84,3 +122,86 @@ int crypto_aes_crypt(struct CRYPTO_CIPHER_CTX *cipher_ctx, uint8_t *out, uint8_t
   
   return 0;
 }
+
+static int check_ctr_mode(struct CRYPTO_CIPHER_CTX *ctx, size_t len)
+{
+  if (! ctx->use_aes_ni && EVP_CIPHER_CTX_get_mode(ctx->evp) != EVP_CIPH_CTR_MODE) {
+    ssh_set_error("cipher is not in CTR mode");
+    return -1;
+  }
+  if (len % 16 != 0) {
+    ssh_set_error("invalid keystream length: %u", (unsigned) len);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * CTR mode only: write the next 'len' bytes of keystream to 'out',
+ * advancing the counter as if 'len' bytes had been processed.  'len'
+ * must be a multiple of the block size.
+ */
+int crypto_aes_ctr_keystream(struct CRYPTO_CIPHER_CTX *ctx, uint8_t *out, size_t len)
+{
+  if (check_ctr_mode(ctx, len) < 0)
+    return -1;
+
+  if (ctx->use_aes_ni) {
+    crypto_aes_ni_ctr_keystream(&ctx->aes_ni, out, len / 16);
+    return 0;
+  }
+
+  memset(out, 0, len);
+  if (len > 0 && EVP_Cipher(ctx->evp, out, out, len) <= 0) {
+    ssh_set_error("cipher error");
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * CTR mode only: move the counter back 'len' bytes (a multiple of the
+ * block size), to give back keystream returned by
+ * crypto_aes_ctr_keystream() that wasn't used.
+ */
+int crypto_aes_ctr_rewind(struct CRYPTO_CIPHER_CTX *ctx, size_t len)
+{
+  uint8_t ctr[16];
+  uint64_t borrow;
+  int i;
+
+  if (check_ctr_mode(ctx, len) < 0)
+    return -1;
+
+  if (ctx->use_aes_ni) {
+    crypto_aes_ni_ctr_rewind(&ctx->aes_ni, len / 16);
+    return 0;
+  }
+
+  // subtract from the big-endian counter and restart the cipher there
+  if (EVP_CIPHER_CTX_get_updated_iv(ctx->evp, ctr, sizeof(ctr)) == 0) {
+    ssh_set_error("error reading AES counter");
+    return -1;
+  }
+  borrow = len / 16;
+  for (i = 15; i >= 0 && borrow != 0; i--) {
+    uint8_t sub = borrow & 0xff;
+
+    borrow = (borrow >> 8) + (ctr[i] < sub);
+    ctr[i] -= sub;
+  }
+  if (EVP_CipherInit_ex2(ctx->evp, NULL, NULL, ctr, -1, NULL) == 0) {
+    ssh_set_error("error setting AES counter");
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Return the AES-NI CTR state if the context uses it, or NULL.  Used
+ * by the stitched AES-CTR/HMAC code (aes_hmac.c).
+ */
+struct CRYPTO_AES_NI_CTR *crypto_aes_get_aes_ni(struct CRYPTO_CIPHER_CTX *ctx)
+{
+  return (ctx->use_aes_ni) ? &ctx->aes_ni : NULL;
+}
@@ -9,8 +9,14 @@
 #include "common/buffer.h"
 #include "crypto/algorithms.h"
 
+struct CRYPTO_AES_NI_CTR;
+
 struct CRYPTO_CIPHER_CTX *crypto_aes_new(enum SSH_CIPHER_TYPE type, enum SSH_CIPHER_DIRECTION dir, const struct SSH_STRING *iv, const struct SSH_STRING *key);
+int crypto_aes_rekey(struct CRYPTO_CIPHER_CTX *ctx, enum SSH_CIPHER_TYPE type, enum SSH_CIPHER_DIRECTION dir, const struct SSH_STRING *iv, const struct SSH_STRING *key);
 void crypto_aes_free(struct CRYPTO_CIPHER_CTX *ctx);
 int crypto_aes_crypt(struct CRYPTO_CIPHER_CTX *ctx, uint8_t *out, uint8_t *data, uint32_t len);
+int crypto_aes_ctr_keystream(struct CRYPTO_CIPHER_CTX *ctx, uint8_t *out, size_t len);
+int crypto_aes_ctr_rewind(struct CRYPTO_CIPHER_CTX *ctx, size_t len);
+struct CRYPTO_AES_NI_CTR *crypto_aes_get_aes_ni(struct CRYPTO_CIPHER_CTX *ctx);
 
 #endif /* CRYPTO_AES_H_FILE */
@@ -0,0 +1,260 @@
+/* aes_hmac.c
+ *
+ * AES-CTR combined with HMAC-SHA256 in a single pass over the data.
+ *
+ * When both the cipher and the HMAC use the in-tree x86
+ * implementations, the stitched kernel encrypts 4 AES blocks per
+ * SHA-256 block, interleaving the AES rounds with the SHA rounds so
+ * both run at the same time on different execution units, and each
+ * byte is loaded only once.  Otherwise the two are done one after
+ * the other.
+ *
+ * The MAC covers 'prefix' (the packet sequence number in SSH) and
+ * the plaintext: 'in' when encrypting, and 'head' (plaintext the
+ * caller already decrypted) followed by 'out' when decrypting.
+ * 'out' must not overlap 'in'.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "crypto/aes_hmac.h"
+
+#include "crypto/aes.h"
+#include "crypto/hmac.h"
+#include "crypto/cpu.h"
+#include "crypto/aes_ni.h"
+#include "crypto/sha256_ni.h"
+#include "crypto/sha256_ni_i.h"
+
+#define CHUNK_SIZE CRYPTO_SHA256_BLOCK_SIZE   // data processed per iteration (4 AES blocks)
+
+#if CRYPTO_CPU_X86
+
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#define UNROLL _Pragma("GCC unroll 16")
+
+#define BSWAP128_MASK  0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15
+
+/*
+ * Encrypt (or decrypt) 'num_chunks' chunks from 'in' to 'out' and
+ * hash the same number of blocks from 'hash_data'.  Round g+1 of AES
+ * is issued after the 4 SHA-256 rounds of group g.  Like the
+ * functions in aes_ni.c, this doesn't propagate the carry out of the
+ * low 64 bits of the counter.
+ */
+__attribute__((target("aes,sha,sse4.1")))
+static ALWAYS_INLINE void stitched_chunks(const struct CRYPTO_AES_NI_CTR *aes, uint32_t *state,
+                                          uint8_t *out, const uint8_t *in, const uint8_t *hash_data,
+                                          size_t num_chunks, const int nr)
+{
+  const __m128i aes_bswap = _mm_set_epi8(BSWAP128_MASK);
+  const __m128i sha_bswap = SHA256_NI_BSWAP_MASK;
+  const __m128i one = _mm_set_epi64x(0, 1);
+  __m128i ctr = _mm_set_epi64x(aes->ctr_hi, aes->ctr_lo);
+  __m128i rk[15];
+  __m128i b[4], w[4];
+  __m128i abef, cdgh, abef_save, cdgh_save, msg;
+  int r, i, g;
+
+  UNROLL
+  for (r = 0; r <= nr; r++)
+    rk[r] = _mm_load_si128((const __m128i *) (aes->round_keys + 16*r));
+  sha256_ni_load_state(state, &abef, &cdgh);
+
+  while (num_chunks-- > 0) {
+    UNROLL
+    for (i = 0; i < 4; i++) {
+      b[i] = _mm_xor_si128(_mm_shuffle_epi8(ctr, aes_bswap), rk[0]);
+      ctr = _mm_add_epi64(ctr, one);
+      w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (hash_data + 16*i)), sha_bswap);
+    }
+    abef_save = abef;
+    cdgh_save = cdgh;
+
+    UNROLL
+    for (g = 0; g < 16; g++) {
+      if (g >= 4)
+        SHA256_SCHEDULE(w[g%4], w[(g+1)%4], w[(g+2)%4], w[(g+3)%4]);
+      SHA256_ROUNDS4(g, w[g%4]);
+      if (g+1 < nr) {
+        UNROLL
+        for (i = 0; i < 4; i++)
+          b[i] = _mm_aesenc_si128(b[i], rk[g+1]);
+      } else if (g+1 == nr) {
+        UNROLL
+        for (i = 0; i < 4; i++)
+          b[i] = _mm_aesenclast_si128(b[i], rk[nr]);
+      }
+    }
+
+    abef = _mm_add_epi32(abef, abef_save);
+    cdgh = _mm_add_epi32(cdgh, cdgh_save);
+    UNROLL
+    for (i = 0; i < 4; i++)
+      _mm_storeu_si128((__m128i *) (out + 16*i),
+                       _mm_xor_si128(b[i], _mm_loadu_si128((const __m128i *) (in + 16*i))));
+    in += CHUNK_SIZE;
+    out += CHUNK_SIZE;
+    hash_data += CHUNK_SIZE;
+  }
+
+  sha256_ni_store_state(state, abef, cdgh);
+}
+
+__attribute__((target("aes,sha,sse4.1")))
+static void stitched_chunks_128(const struct CRYPTO_AES_NI_CTR *aes, uint32_t *state, uint8_t *out, const uint8_t *in, const uint8_t *hash_data, size_t num_chunks)
+{
+  stitched_chunks(aes, state, out, in, hash_data, num_chunks, 10);
+}
+
+__attribute__((target("aes,sha,sse4.1")))
+static void stitched_chunks_256(const struct CRYPTO_AES_NI_CTR *aes, uint32_t *state, uint8_t *out, const uint8_t *in, const uint8_t *hash_data, size_t num_chunks)
+{
+  stitched_chunks(aes, state, out, in, hash_data, num_chunks, 14);
+}
+
+/*
+ * Run the stitched kernel and advance the AES counter and the hash
+ * length.  The hash must be at a block boundary.
+ */
+static void stitched_run(struct CRYPTO_AES_NI_CTR *aes, struct CRYPTO_SHA256_NI_CTX *hash,
+                         uint8_t *out, const uint8_t *in, const uint8_t *hash_data, size_t num_chunks)
+{
+  if (aes->rounds == 10)
+    stitched_chunks_128(aes, hash->state, out, in, hash_data, num_chunks);
+  else
+    stitched_chunks_256(aes, hash->state, out, in, hash_data, num_chunks);
+
+  aes->ctr_lo += 4*num_chunks;
+  if (aes->ctr_lo == 0)
+    aes->ctr_hi++;
+  hash->len += CHUNK_SIZE*num_chunks;
+}
+
+#else /* CRYPTO_CPU_X86 */
+
+static void stitched_run(struct CRYPTO_AES_NI_CTR *aes, struct CRYPTO_SHA256_NI_CTX *hash,
+                         uint8_t *out, const uint8_t *in, const uint8_t *hash_data, size_t num_chunks)
+{
+  abort();
+}
+
+#endif /* CRYPTO_CPU_X86 */
+
+/*
+ * Return the number of chunks the stitched kernel can process, or 0
+ * if it can't be used: the AES state must be at a block boundary and
+ * the low half of the counter must not wrap (which is so rare that
+ * it's not worth splitting the data).
+ */
+static size_t stitched_num_chunks(struct CRYPTO_AES_NI_CTR *aes, size_t len)
+{
+  uint64_t until_wrap = -aes->ctr_lo;   // 0 means 2^64
+  size_t num_chunks = len / CHUNK_SIZE;
+
+  if (aes->keystream_pos != sizeof(aes->keystream))
+    return 0;
+  if (until_wrap != 0 && until_wrap < 4*(uint64_t)num_chunks)
+    return 0;
+  return num_chunks;
+}
+
+// bytes to hash before the hash is at a block boundary
+static size_t hash_align_len(struct CRYPTO_SHA256_NI_CTX *hash)
+{
+  return (CRYPTO_SHA256_BLOCK_SIZE - hash->buf_len) % CRYPTO_SHA256_BLOCK_SIZE;
+}
+
+int crypto_aes_hmac_encrypt(struct CRYPTO_CIPHER_CTX *cipher, struct CRYPTO_HMAC_CTX *hmac,
+                            const uint8_t *prefix, size_t prefix_len,
+                            uint8_t *out, const uint8_t *in, size_t len,
+                            uint8_t *mac, uint32_t mac_size)
+{
+  struct CRYPTO_AES_NI_CTR *aes;
+  struct CRYPTO_SHA256_NI_CTX *hash;
+  size_t skip, num_chunks, done;
+
+  if (crypto_hmac_init(hmac) < 0)
+    return -1;
+
+  aes = crypto_aes_get_aes_ni(cipher);
+  hash = crypto_hmac_get_sha256_ni(hmac);
+  if (aes == NULL || hash == NULL) {
+    if (crypto_hmac_update(hmac, prefix, prefix_len) < 0
+        || crypto_hmac_update(hmac, in, len) < 0
+        || (len > 0 && crypto_aes_crypt(cipher, out, (uint8_t *) in, len) < 0))
+      return -1;
+    return crypto_hmac_final(hmac, mac, mac_size);
+  }
+
+  // hash up to a block boundary; the kernel then hashes 'skip' bytes
+  // ahead of the data it encrypts
+  crypto_sha256_ni_update(hash, prefix, prefix_len);
+  skip = hash_align_len(hash);
+  if (skip > len)
+    skip = len;
+  crypto_sha256_ni_update(hash, in, skip);
+
+  num_chunks = stitched_num_chunks(aes, len - skip);
+  if (num_chunks > 0)
+    stitched_run(aes, hash, out, in, in + skip, num_chunks);
+  done = CHUNK_SIZE*num_chunks;
+
+  crypto_aes_ni_ctr_crypt(aes, out + done, in + done, len - done);
+  crypto_sha256_ni_update(hash, in + skip + done, len - skip - done);
+  return crypto_hmac_final(hmac, mac, mac_size);
+}
+
+int crypto_aes_hmac_decrypt(struct CRYPTO_CIPHER_CTX *cipher, struct CRYPTO_HMAC_CTX *hmac,
+                            const uint8_t *prefix, size_t prefix_len,
+                            const uint8_t *head, size_t head_len,
+                            uint8_t *out, const uint8_t *in, size_t len,
+                            uint8_t *mac, uint32_t mac_size)
+{
+  struct CRYPTO_AES_NI_CTR *aes;
+  struct CRYPTO_SHA256_NI_CTX *hash;
+  size_t skip, lead, num_chunks, done;
+
+  if (crypto_hmac_init(hmac) < 0)
+    return -1;
+
+  aes = crypto_aes_get_aes_ni(cipher);
+  hash = crypto_hmac_get_sha256_ni(hmac);
+  if (aes == NULL || hash == NULL) {
+    if ((len > 0 && crypto_aes_crypt(cipher, out, (uint8_t *) in, len) < 0)
+        || crypto_hmac_update(hmac, prefix, prefix_len) < 0
+        || crypto_hmac_update(hmac, head, head_len) < 0
+        || crypto_hmac_update(hmac, out, len) < 0)
+      return -1;
+    return crypto_hmac_final(hmac, mac, mac_size);
+  }
+
+  crypto_sha256_ni_update(hash, prefix, prefix_len);
+  crypto_sha256_ni_update(hash, head, head_len);
+
+  // the hash needs plaintext, so it runs behind the cipher: decrypt
+  // 'lead' bytes (a whole number of AES blocks) first so the kernel
+  // hashes data decrypted two iterations earlier.  With only one
+  // iteration between them, the unaligned hash loads would stall
+  // waiting for the stores of the previous chunk.
+  skip = hash_align_len(hash);
+  lead = (skip + 2*CHUNK_SIZE + 15) & ~(size_t) 15;
+  if (len <= lead) {
+    crypto_aes_ni_ctr_crypt(aes, out, in, len);
+    crypto_sha256_ni_update(hash, out, len);
+    return crypto_hmac_final(hmac, mac, mac_size);
+  }
+
+  crypto_aes_ni_ctr_crypt(aes, out, in, lead);
+  crypto_sha256_ni_update(hash, out, skip);
+  num_chunks = stitched_num_chunks(aes, len - lead);
+  if (num_chunks > 0)
+    stitched_run(aes, hash, out + lead, in + lead, out + skip, num_chunks);
+  done = CHUNK_SIZE*num_chunks;
+
+  crypto_aes_ni_ctr_crypt(aes, out + lead + done, in + lead + done, len - lead - done);
+  crypto_sha256_ni_update(hash, out + skip + done, len - skip - done);
+  return crypto_hmac_final(hmac, mac, mac_size);
+}
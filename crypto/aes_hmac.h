@@ -0,0 +1,23 @@
+/* aes_hmac.h */
+
+#ifndef CRYPTO_AES_HMAC_H_FILE
+#define CRYPTO_AES_HMAC_H_FILE
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "crypto/algorithms.h"
+
+struct CRYPTO_HMAC_CTX;
+
+int crypto_aes_hmac_encrypt(struct CRYPTO_CIPHER_CTX *cipher, struct CRYPTO_HMAC_CTX *hmac,
+                            const uint8_t *prefix, size_t prefix_len,
+                            uint8_t *out, const uint8_t *in, size_t len,
+                            uint8_t *mac, uint32_t mac_size);
+int crypto_aes_hmac_decrypt(struct CRYPTO_CIPHER_CTX *cipher, struct CRYPTO_HMAC_CTX *hmac,
+                            const uint8_t *prefix, size_t prefix_len,
+                            const uint8_t *head, size_t head_len,
+                            uint8_t *out, const uint8_t *in, size_t len,
+                            uint8_t *mac, uint32_t mac_size);
+
+#endif /* CRYPTO_AES_HMAC_H_FILE */
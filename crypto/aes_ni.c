@@ -0,0 +1,421 @@
+/* aes_ni.c
+ *
+ * AES-CTR with the x86 AES instructions.  There are three versions
+ * of the block function, selected by crypto_aes_ni_ctr_init()
+ * according to the CPU:
+ *
+ * - AES-NI: 8 blocks in flight to hide the latency of AESENC.
+ * - VAES/AVX2: 16 blocks in 8 YMM registers.
+ * - VAES/AVX-512: 16 blocks in 4 ZMM registers.
+ *
+ * Each function is compiled for its instruction set with the target
+ * attribute, so the rest of the program doesn't need special flags.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "crypto/aes_ni.h"
+
+#include "common/error.h"
+#include "crypto/cpu.h"
+
+#if CRYPTO_CPU_X86
+
+#include <immintrin.h>
+
+#define TARGET(t) __attribute__((target(t)))
+
+/* ------- key expansion ------------------------- */
+
+TARGET("aes,sse2")
+static inline __m128i aes128_expand_step(__m128i key, __m128i assist)
+{
+  assist = _mm_shuffle_epi32(assist, 0xff);
+  key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+  key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+  key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+  return _mm_xor_si128(key, assist);
+}
+
+#define AES128_ROUND_KEY(rk, i, rcon)                                   \
+  rk[i] = aes128_expand_step(rk[i-1], _mm_aeskeygenassist_si128(rk[i-1], rcon))
+
+TARGET("aes,sse2")
+static void aes128_expand_key(uint8_t *round_keys, const uint8_t *key)
+{
+  __m128i rk[11];
+
+  rk[0] = _mm_loadu_si128((const __m128i *) key);
+  AES128_ROUND_KEY(rk, 1, 0x01);
+  AES128_ROUND_KEY(rk, 2, 0x02);
+  AES128_ROUND_KEY(rk, 3, 0x04);
+  AES128_ROUND_KEY(rk, 4, 0x08);
+  AES128_ROUND_KEY(rk, 5, 0x10);
+  AES128_ROUND_KEY(rk, 6, 0x20);
+  AES128_ROUND_KEY(rk, 7, 0x40);
+  AES128_ROUND_KEY(rk, 8, 0x80);
+  AES128_ROUND_KEY(rk, 9, 0x1b);
+  AES128_ROUND_KEY(rk, 10, 0x36);
+  memcpy(round_keys, rk, sizeof(rk));
+}
+
+// for AES-256, the odd round keys use SubWord without RotWord or rcon
+#define AES256_ROUND_KEYS(rk, i, rcon)                                  \
+  do {                                                                  \
+    rk[i] = aes128_expand_step(rk[i-2], _mm_aeskeygenassist_si128(rk[i-1], rcon)); \
+    if (i+1 < 15)                                                       \
+      rk[i+1] = aes128_expand_step(rk[i-1],                             \
+                                   _mm_shuffle_epi32(_mm_aeskeygenassist_si128(rk[i], 0), 0xaa)); \
+  } while (0)
+
+TARGET("aes,sse2")
+static void aes256_expand_key(uint8_t *round_keys, const uint8_t *key)
+{
+  __m128i rk[15];
+
+  rk[0] = _mm_loadu_si128((const __m128i *) key);
+  rk[1] = _mm_loadu_si128((const __m128i *) (key + 16));
+  AES256_ROUND_KEYS(rk, 2, 0x01);
+  AES256_ROUND_KEYS(rk, 4, 0x02);
+  AES256_ROUND_KEYS(rk, 6, 0x04);
+  AES256_ROUND_KEYS(rk, 8, 0x08);
+  AES256_ROUND_KEYS(rk, 10, 0x10);
+  AES256_ROUND_KEYS(rk, 12, 0x20);
+  AES256_ROUND_KEYS(rk, 14, 0x40);
+  memcpy(round_keys, rk, sizeof(rk));
+}
+
+/* ------- block functions ------------------------- */
+
+/*
+ * The block functions don't propagate the carry out of the low 64
+ * bits of the counter (the caller splits the data where it wraps),
+ * so the counter blocks can be generated with vector additions.
+ * They're templates on the number of rounds, instantiated for
+ * AES-128 and AES-256 below.
+ */
+
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+// the loops over rounds and registers must be fully unrolled to keep
+// the blocks in registers
+#define UNROLL _Pragma("GCC unroll 16")
+
+#define BSWAP128_MASK  0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15
+
+#define AESNI_WIDTH 8
+
+TARGET("aes,ssse3")
+static ALWAYS_INLINE void ctr_aesni(const struct CRYPTO_AES_NI_CTR *ctx, uint64_t ctr_lo, uint8_t *out, const uint8_t *in, size_t num_blocks, const int nr)
+{
+  const __m128i bswap = _mm_set_epi8(BSWAP128_MASK);
+  const __m128i one = _mm_set_epi64x(0, 1);
+  __m128i ctr = _mm_set_epi64x(ctx->ctr_hi, ctr_lo);
+  __m128i rk[15];
+  __m128i b[AESNI_WIDTH];
+  int r, i;
+
+  UNROLL
+  for (r = 0; r <= nr; r++)
+    rk[r] = _mm_load_si128((const __m128i *) (ctx->round_keys + 16*r));
+
+  while (num_blocks >= AESNI_WIDTH) {
+    UNROLL
+    for (i = 0; i < AESNI_WIDTH; i++) {
+      b[i] = _mm_xor_si128(_mm_shuffle_epi8(ctr, bswap), rk[0]);
+      ctr = _mm_add_epi64(ctr, one);
+    }
+    UNROLL
+    for (r = 1; r < nr; r++)
+      UNROLL
+      for (i = 0; i < AESNI_WIDTH; i++)
+        b[i] = _mm_aesenc_si128(b[i], rk[r]);
+    UNROLL
+    for (i = 0; i < AESNI_WIDTH; i++) {
+      b[i] = _mm_aesenclast_si128(b[i], rk[nr]);
+      b[i] = _mm_xor_si128(b[i], _mm_loadu_si128((const __m128i *) (in + 16*i)));
+      _mm_storeu_si128((__m128i *) (out + 16*i), b[i]);
+    }
+    in += 16*AESNI_WIDTH;
+    out += 16*AESNI_WIDTH;
+    num_blocks -= AESNI_WIDTH;
+  }
+
+  while (num_blocks > 0) {
+    b[0] = _mm_xor_si128(_mm_shuffle_epi8(ctr, bswap), rk[0]);
+    ctr = _mm_add_epi64(ctr, one);
+    UNROLL
+    for (r = 1; r < nr; r++)
+      b[0] = _mm_aesenc_si128(b[0], rk[r]);
+    b[0] = _mm_aesenclast_si128(b[0], rk[nr]);
+    b[0] = _mm_xor_si128(b[0], _mm_loadu_si128((const __m128i *) in));
+    _mm_storeu_si128((__m128i *) out, b[0]);
+    in += 16;
+    out += 16;
+    num_blocks--;
+  }
+}
+
+#define VAES256_REGS 8   // 2 blocks per register
+
+TARGET("aes,vaes,avx2")
+static ALWAYS_INLINE void ctr_vaes_avx2(const struct CRYPTO_AES_NI_CTR *ctx, uint64_t ctr_lo, uint8_t *out, const uint8_t *in, size_t num_blocks, const int nr)
+{
+  const __m256i bswap = _mm256_set_epi8(BSWAP128_MASK, BSWAP128_MASK);
+  const __m256i two = _mm256_set_epi64x(0, 2, 0, 2);
+  __m256i ctr = _mm256_add_epi64(_mm256_broadcastsi128_si256(_mm_set_epi64x(ctx->ctr_hi, ctr_lo)),
+                                 _mm256_set_epi64x(0, 1, 0, 0));
+  __m256i rk[15];
+  __m256i b[VAES256_REGS];
+  int r, i;
+
+  UNROLL
+  for (r = 0; r <= nr; r++)
+    rk[r] = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *) (ctx->round_keys + 16*r)));
+
+  while (num_blocks >= 2*VAES256_REGS) {
+    UNROLL
+    for (i = 0; i < VAES256_REGS; i++) {
+      b[i] = _mm256_xor_si256(_mm256_shuffle_epi8(ctr, bswap), rk[0]);
+      ctr = _mm256_add_epi64(ctr, two);
+    }
+    UNROLL
+    for (r = 1; r < nr; r++)
+      UNROLL
+      for (i = 0; i < VAES256_REGS; i++)
+        b[i] = _mm256_aesenc_epi128(b[i], rk[r]);
+    UNROLL
+    for (i = 0; i < VAES256_REGS; i++) {
+      b[i] = _mm256_aesenclast_epi128(b[i], rk[nr]);
+      b[i] = _mm256_xor_si256(b[i], _mm256_loadu_si256((const __m256i *) (in + 32*i)));
+      _mm256_storeu_si256((__m256i *) (out + 32*i), b[i]);
+    }
+    in += 32*VAES256_REGS;
+    out += 32*VAES256_REGS;
+    num_blocks -= 2*VAES256_REGS;
+    ctr_lo += 2*VAES256_REGS;
+  }
+
+  while (num_blocks >= 2) {
+    b[0] = _mm256_xor_si256(_mm256_shuffle_epi8(ctr, bswap), rk[0]);
+    ctr = _mm256_add_epi64(ctr, two);
+    UNROLL
+    for (r = 1; r < nr; r++)
+      b[0] = _mm256_aesenc_epi128(b[0], rk[r]);
+    b[0] = _mm256_aesenclast_epi128(b[0], rk[nr]);
+    b[0] = _mm256_xor_si256(b[0], _mm256_loadu_si256((const __m256i *) in));
+    _mm256_storeu_si256((__m256i *) out, b[0]);
+    in += 32;
+    out += 32;
+    num_blocks -= 2;
+    ctr_lo += 2;
+  }
+
+  if (num_blocks > 0)
+    ctr_aesni(ctx, ctr_lo, out, in, num_blocks, nr);
+}
+
+#define VAES512_REGS 4   // 4 blocks per register
+
+TARGET("aes,vaes,avx512f,avx512bw")
+static ALWAYS_INLINE void ctr_vaes_avx512(const struct CRYPTO_AES_NI_CTR *ctx, uint64_t ctr_lo, uint8_t *out, const uint8_t *in, size_t num_blocks, const int nr)
+{
+  const __m512i bswap = _mm512_broadcast_i32x4(_mm_set_epi8(BSWAP128_MASK));
+  const __m512i four = _mm512_set_epi64(0, 4, 0, 4, 0, 4, 0, 4);
+  __m512i ctr = _mm512_add_epi64(_mm512_broadcast_i32x4(_mm_set_epi64x(ctx->ctr_hi, ctr_lo)),
+                                 _mm512_set_epi64(0, 3, 0, 2, 0, 1, 0, 0));
+  __m512i rk[15];
+  __m512i b[VAES512_REGS];
+  int r, i;
+
+  UNROLL
+  for (r = 0; r <= nr; r++)
+    rk[r] = _mm512_broadcast_i32x4(_mm_load_si128((const __m128i *) (ctx->round_keys + 16*r)));
+
+  while (num_blocks >= 4*VAES512_REGS) {
+    UNROLL
+    for (i = 0; i < VAES512_REGS; i++) {
+      b[i] = _mm512_xor_si512(_mm512_shuffle_epi8(ctr, bswap), rk[0]);
+      ctr = _mm512_add_epi64(ctr, four);
+    }
+    UNROLL
+    for (r = 1; r < nr; r++)
+      UNROLL
+      for (i = 0; i < VAES512_REGS; i++)
+        b[i] = _mm512_aesenc_epi128(b[i], rk[r]);
+    UNROLL
+    for (i = 0; i < VAES512_REGS; i++) {
+      b[i] = _mm512_aesenclast_epi128(b[i], rk[nr]);
+      b[i] = _mm512_xor_si512(b[i], _mm512_loadu_si512(in + 64*i));
+      _mm512_storeu_si512(out + 64*i, b[i]);
+    }
+    in += 64*VAES512_REGS;
+    out += 64*VAES512_REGS;
+    num_blocks -= 4*VAES512_REGS;
+    ctr_lo += 4*VAES512_REGS;
+  }
+
+  while (num_blocks >= 4) {
+    b[0] = _mm512_xor_si512(_mm512_shuffle_epi8(ctr, bswap), rk[0]);
+    ctr = _mm512_add_epi64(ctr, four);
+    UNROLL
+    for (r = 1; r < nr; r++)
+      b[0] = _mm512_aesenc_epi128(b[0], rk[r]);
+    b[0] = _mm512_aesenclast_epi128(b[0], rk[nr]);
+    b[0] = _mm512_xor_si512(b[0], _mm512_loadu_si512(in));
+    _mm512_storeu_si512(out, b[0]);
+    in += 64;
+    out += 64;
+    num_blocks -= 4;
+    ctr_lo += 4;
+  }
+
+  if (num_blocks > 0)
+    ctr_aesni(ctx, ctr_lo, out, in, num_blocks, nr);
+}
+
+#define DEFINE_CTR_BLOCKS(name, target, impl, nr)                         TARGET(target)                                                          static void name(const struct CRYPTO_AES_NI_CTR *ctx, uint64_t ctr_lo, uint8_t *out, const uint8_t *in, size_t num_blocks)   {                                                                         impl(ctx, ctr_lo, out, in, num_blocks, nr);                           }
+
+DEFINE_CTR_BLOCKS(ctr_blocks_aesni_128,       "aes,ssse3",                 ctr_aesni,       10)
+DEFINE_CTR_BLOCKS(ctr_blocks_aesni_256,       "aes,ssse3",                 ctr_aesni,       14)
+DEFINE_CTR_BLOCKS(ctr_blocks_vaes_avx2_128,   "aes,vaes,avx2",             ctr_vaes_avx2,   10)
+DEFINE_CTR_BLOCKS(ctr_blocks_vaes_avx2_256,   "aes,vaes,avx2",             ctr_vaes_avx2,   14)
+DEFINE_CTR_BLOCKS(ctr_blocks_vaes_avx512_128, "aes,vaes,avx512f,avx512bw", ctr_vaes_avx512, 10)
+DEFINE_CTR_BLOCKS(ctr_blocks_vaes_avx512_256, "aes,vaes,avx512f,avx512bw", ctr_vaes_avx512, 14)
+
+/*
+ * Run the block function, splitting the data where the low 64 bits
+ * of the counter wrap around.
+ */
+static void ctr_blocks(struct CRYPTO_AES_NI_CTR *ctx, uint8_t *out, const uint8_t *in, size_t num_blocks)
+{
+  while (num_blocks > 0) {
+    uint64_t until_wrap = -ctx->ctr_lo;   // 0 means 2^64
+    size_t n = (until_wrap != 0 && until_wrap < num_blocks) ? until_wrap : num_blocks;
+
+    ctx->blocks(ctx, ctx->ctr_lo, out, in, n);
+    ctx->ctr_lo += n;
+    if (ctx->ctr_lo == 0)
+      ctx->ctr_hi++;
+    out += 16*n;
+    in += 16*n;
+    num_blocks -= n;
+  }
+}
+
+/* ------- interface ------------------------- */
+
+int crypto_aes_ni_ctr_init(struct CRYPTO_AES_NI_CTR *ctx, const uint8_t *key, int key_bits, const uint8_t *iv)
+{
+  if (! crypto_cpu_has(CRYPTO_CPU_AESNI)) {
+    ssh_set_error("AES-NI not available");
+    return -1;
+  }
+
+  switch (key_bits) {
+  case 128: aes128_expand_key(ctx->round_keys, key); ctx->rounds = 10; break;
+  case 256: aes256_expand_key(ctx->round_keys, key); ctx->rounds = 14; break;
+  default:
+    ssh_set_error("invalid AES key size: %d", key_bits);
+    return -1;
+  }
+
+  memcpy(&ctx->ctr_hi, iv, 8);
+  memcpy(&ctx->ctr_lo, iv + 8, 8);
+  ctx->ctr_hi = __builtin_bswap64(ctx->ctr_hi);
+  ctx->ctr_lo = __builtin_bswap64(ctx->ctr_lo);
+  ctx->keystream_pos = sizeof(ctx->keystream);
+
+  if (crypto_cpu_has(CRYPTO_CPU_VAES_AVX512))
+    ctx->blocks = (key_bits == 128) ? ctr_blocks_vaes_avx512_128 : ctr_blocks_vaes_avx512_256;
+  else if (crypto_cpu_has(CRYPTO_CPU_VAES_AVX2))
+    ctx->blocks = (key_bits == 128) ? ctr_blocks_vaes_avx2_128 : ctr_blocks_vaes_avx2_256;
+  else
+    ctx->blocks = (key_bits == 128) ? ctr_blocks_aesni_128 : ctr_blocks_aesni_256;
+  return 0;
+}
+
+void crypto_aes_ni_ctr_crypt(struct CRYPTO_AES_NI_CTR *ctx, uint8_t *out, const uint8_t *in, size_t len)
+{
+  size_t i;
+
+  // use up keystream left over from the previous call
+  while (ctx->keystream_pos < sizeof(ctx->keystream) && len > 0) {
+    *out++ = *in++ ^ ctx->keystream[ctx->keystream_pos++];
+    len--;
+  }
+
+  if (len >= 16) {
+    ctr_blocks(ctx, out, in, len / 16);
+    out += len & ~(size_t) 15;
+    in += len & ~(size_t) 15;
+    len &= 15;
+  }
+
+  // partial block: keep the rest of the keystream for the next call
+  if (len > 0) {
+    memset(ctx->keystream, 0, sizeof(ctx->keystream));
+    ctr_blocks(ctx, ctx->keystream, ctx->keystream, 1);
+    for (i = 0; i < len; i++)
+      out[i] = in[i] ^ ctx->keystream[i];
+    ctx->keystream_pos = len;
+  }
+}
+
+/*
+ * Write the keystream for the next 'num_blocks' blocks to 'out'.  The
+ * counter must be at a block boundary (no leftover keystream).
+ */
+void crypto_aes_ni_ctr_keystream(struct CRYPTO_AES_NI_CTR *ctx, uint8_t *out, size_t num_blocks)
+{
+  static const uint8_t zero[64*16] __attribute__((aligned(16)));
+
+  while (num_blocks > 0) {
+    size_t n = (num_blocks < sizeof(zero)/16) ? num_blocks : sizeof(zero)/16;
+
+    ctr_blocks(ctx, out, zero, n);
+    out += 16*n;
+    num_blocks -= n;
+  }
+}
+
+#else /* CRYPTO_CPU_X86 */
+
+int crypto_aes_ni_ctr_init(struct CRYPTO_AES_NI_CTR *ctx, const uint8_t *key, int key_bits, const uint8_t *iv)
+{
+  ssh_set_error("AES-NI not available");
+  return -1;
+}
+
+void crypto_aes_ni_ctr_crypt(struct CRYPTO_AES_NI_CTR *ctx, uint8_t *out, const uint8_t *in, size_t len)
+{
+}
+
+void crypto_aes_ni_ctr_keystream(struct CRYPTO_AES_NI_CTR *ctx, uint8_t *out, size_t num_blocks)
+{
+}
+
+#endif /* CRYPTO_CPU_X86 */
+
+/*
+ * Move the counter back 'num_blocks' blocks, so that keystream that
+ * was generated but not used is generated again.  The counter must
+ * be at a block boundary.
+ */
+void crypto_aes_ni_ctr_rewind(struct CRYPTO_AES_NI_CTR *ctx, size_t num_blocks)
+{
+  if (ctx->ctr_lo < num_blocks)
+    ctx->ctr_hi--;
+  ctx->ctr_lo -= num_blocks;
+}
+
+void crypto_aes_ni_ctr_clear(struct CRYPTO_AES_NI_CTR *ctx)
+{
+  volatile uint8_t *p = (volatile uint8_t *) ctx;
+  size_t i;
+
+  for (i = 0; i < sizeof(*ctx); i++)
+    p[i] = 0;
+}
@@ -0,0 +1,30 @@
+/* aes_ni.h */
+
+#ifndef CRYPTO_AES_NI_H_FILE
+#define CRYPTO_AES_NI_H_FILE
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct CRYPTO_AES_NI_CTR;
+
+typedef void (*crypto_aes_ni_fn_blocks)(const struct CRYPTO_AES_NI_CTR *ctx, uint64_t ctr_lo, uint8_t *out, const uint8_t *in, size_t num_blocks);
+
+/* AES-CTR state with a 128-bit big-endian counter, as used by SSH */
+struct CRYPTO_AES_NI_CTR {
+  uint8_t round_keys[15*16] __attribute__((aligned(16)));
+  int rounds;
+  uint64_t ctr_hi;                 // counter, in host byte order
+  uint64_t ctr_lo;
+  uint8_t keystream[16];           // keystream left over from a partial block
+  uint32_t keystream_pos;
+  crypto_aes_ni_fn_blocks blocks;
+};
+
+int crypto_aes_ni_ctr_init(struct CRYPTO_AES_NI_CTR *ctx, const uint8_t *key, int key_bits, const uint8_t *iv);
+void crypto_aes_ni_ctr_crypt(struct CRYPTO_AES_NI_CTR *ctx, uint8_t *out, const uint8_t *in, size_t len);
+void crypto_aes_ni_ctr_keystream(struct CRYPTO_AES_NI_CTR *ctx, uint8_t *out, size_t num_blocks);
+void crypto_aes_ni_ctr_rewind(struct CRYPTO_AES_NI_CTR *ctx, size_t num_blocks);
+void crypto_aes_ni_ctr_clear(struct CRYPTO_AES_NI_CTR *ctx);
+
+#endif /* CRYPTO_AES_NI_H_FILE */
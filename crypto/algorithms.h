@@ -20,6 +20,7 @@ enum SSH_HASH_TYPE {
 enum SSH_CIPHER_TYPE {
   SSH_CIPHER_NONE,
   SSH_CIPHER_AES128_CTR,
+  SSH_CIPHER_AES256_CTR,
   SSH_CIPHER_AES128_CBC,
 
   SSH_CIPHER_INVALID
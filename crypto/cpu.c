@@ -0,0 +1,83 @@
+/* cpu.c
+ *
+ * Runtime CPU feature detection.  Besides the CPUID bits, the wider
+ * register sets need OS support (checked with XGETBV), otherwise
+ * using them traps.
+ *
+ * Setting the environment variable EESSH_CRYPTO_NO_ASM disables all
+ * in-tree implementations, so everything goes through OpenSSL.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "crypto/cpu.h"
+
+#if CRYPTO_CPU_X86
+#include <cpuid.h>
+#endif
+
+static unsigned int cpu_features;
+
+#if CRYPTO_CPU_X86
+static uint64_t cpu_xgetbv(void)
+{
+  uint32_t eax, edx;
+
+  __asm__ volatile ("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+  return ((uint64_t) edx << 32) | eax;
+}
+
+static unsigned int cpu_detect(void)
+{
+  unsigned int eax, ebx, edx;
+  unsigned int ecx1, ebx7 = 0, ecx7 = 0;
+  unsigned int features = 0;
+  uint64_t xcr0 = 0;
+
+  if (! __get_cpuid(1, &eax, &ebx, &ecx1, &edx))
+    return 0;
+  if (__get_cpuid_max(0, NULL) >= 7)
+    __cpuid_count(7, 0, eax, ebx7, ecx7, edx);
+  if (ecx1 & bit_OSXSAVE)
+    xcr0 = cpu_xgetbv();
+
+  if ((ecx1 & bit_AES) && (ecx1 & bit_SSSE3))
+    features |= CRYPTO_CPU_AESNI;
+  if ((ebx7 & bit_SHA) && (ecx1 & bit_SSE4_1))
+    features |= CRYPTO_CPU_SHANI;
+
+  // the wide registers need OS support: XCR0 bits 1-2 for YMM, and
+  // bits 5-7 as well for ZMM
+  if ((ebx7 & bit_AVX2) && (xcr0 & 0x06) == 0x06)
+    features |= CRYPTO_CPU_AVX2;
+  if ((ebx7 & bit_AVX512F) && (ebx7 & bit_AVX512BW) && (xcr0 & 0xe6) == 0xe6)
+    features |= CRYPTO_CPU_AVX512;
+
+  if ((features & CRYPTO_CPU_AESNI) && (ecx7 & bit_VAES)) {
+    if (features & CRYPTO_CPU_AVX2)
+      features |= CRYPTO_CPU_VAES_AVX2;
+    if (features & CRYPTO_CPU_AVX512)
+      features |= CRYPTO_CPU_VAES_AVX512;
+  }
+  return features;
+}
+#else
+static unsigned int cpu_detect(void)
+{
+  return 0;
+}
+#endif
+
+void crypto_cpu_init(void)
+{
+  if (getenv("EESSH_CRYPTO_NO_ASM") != NULL)
+    cpu_features = 0;
+  else
+    cpu_features = cpu_detect();
+}
+
+int crypto_cpu_has(unsigned int features)
+{
+  return (cpu_features & features) == features;
+}
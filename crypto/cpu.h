@@ -0,0 +1,23 @@
+/* cpu.h */
+
+#ifndef CRYPTO_CPU_H_FILE
+#define CRYPTO_CPU_H_FILE
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CRYPTO_CPU_X86 1
+#else
+#define CRYPTO_CPU_X86 0
+#endif
+
+/* CPU features used by the in-tree crypto implementations */
+#define CRYPTO_CPU_AESNI       (1<<0)
+#define CRYPTO_CPU_VAES_AVX2   (1<<1)   // VAES on 256-bit registers
+#define CRYPTO_CPU_VAES_AVX512 (1<<2)   // VAES on 512-bit registers
+#define CRYPTO_CPU_SHANI       (1<<3)
+#define CRYPTO_CPU_AVX2        (1<<4)
+#define CRYPTO_CPU_AVX512      (1<<5)   // AVX-512 F+BW
+
+void crypto_cpu_init(void);
+int crypto_cpu_has(unsigned int features);
+
+#endif /* CRYPTO_CPU_H_FILE */
@@ -4,64 +4,209 @@
 #include <stdint.h>
 #include <string.h>
 
-#include <openssl/dh.h>
+#include <openssl/evp.h>
+#include <openssl/core_names.h>
+#include <openssl/param_build.h>
+#include <openssl/crypto.h>
 
 #include "crypto/dh.h"
 
 #include "common/error.h"
 #include "common/alloc.h"
 #include "crypto/bignum.h"
+#include "crypto/dh_comb.h"
+#include "crypto/random.h"
+
+struct CRYPTO_DH {
+  BIGNUM *p;
+  BIGNUM *g;
+  EVP_PKEY *key;
+};
+
+/*
+ * Make a DH key from the group parameters and (optionally) a public
+ * and private key.  Without keys, the result holds only the
+ * parameters.
+ */
+static EVP_PKEY *dh_pkey_from_data(struct CRYPTO_DH *dh, const BIGNUM *pub_key, const BIGNUM *priv_key)
+{
+  OSSL_PARAM_BLD *bld;
+  OSSL_PARAM *params = NULL;
+  EVP_PKEY_CTX *ctx = NULL;
+  EVP_PKEY *pkey = NULL;
+  int selection;
+
+  if (priv_key != NULL)
+    selection = EVP_PKEY_KEYPAIR;
+  else if (pub_key != NULL)
+    selection = EVP_PKEY_PUBLIC_KEY;
+  else
+    selection = EVP_PKEY_KEY_PARAMETERS;
+
+  if ((bld = OSSL_PARAM_BLD_new()) == NULL
+      || OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_FFC_P, dh->p) == 0
+      || OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_FFC_G, dh->g) == 0
+      || (pub_key != NULL && OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_PUB_KEY, pub_key) == 0)
+      || (priv_key != NULL && OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_PRIV_KEY, priv_key) == 0)
+      || (params = OSSL_PARAM_BLD_to_param(bld)) == NULL
+      || (ctx = EVP_PKEY_CTX_new_from_name(NULL, "DH", NULL)) == NULL
+      || EVP_PKEY_fromdata_init(ctx) <= 0
+      || EVP_PKEY_fromdata(ctx, &pkey, selection, params) <= 0) {
+    ssh_set_error("can't build DH key");
+    pkey = NULL;
+  }
+
+  EVP_PKEY_CTX_free(ctx);
+  OSSL_PARAM_free(params);
+  OSSL_PARAM_BLD_free(bld);
+  return pkey;
+}
+
+/*
+ * Generate the key pair with the fixed-base exponentiation code,
+ * which is several times faster than EVP_PKEY_generate() once the
+ * group's table is computed.
+ */
+static int dh_generate_key_comb(struct CRYPTO_DH *dh, const struct CRYPTO_DH_COMB *comb)
+{
+  uint8_t exp[CRYPTO_DH_COMB_MAX_BITS/8];
+  size_t exp_len = crypto_dh_comb_get_exp_bits(comb) / 8;
+  BIGNUM *priv_key, *pub_key;
+  int i, ret = -1;
+
+  priv_key = BN_secure_new();
+  pub_key = BN_new();
+  if (priv_key == NULL || pub_key == NULL) {
+    ssh_set_error("out of memory");
+    goto out;
+  }
 
-#define GET_DH(p) ((DH *) (p))
+  // random non-zero exponent
+  do {
+    if (crypto_random_gen(exp, exp_len) < 0)
+      goto out;
+    for (i = 0; i < exp_len && exp[i] == 0; i++)
+      ;
+  } while (i == exp_len);
+
+  if (crypto_dh_comb_exp(comb, pub_key, exp, exp_len) < 0)
+    goto out;
+  if (BN_bin2bn(exp, exp_len, priv_key) == NULL) {
+    ssh_set_error("out of memory");
+    goto out;
+  }
+  if ((dh->key = dh_pkey_from_data(dh, pub_key, priv_key)) == NULL)
+    goto out;
+  ret = 0;
+
+ out:
+  OPENSSL_cleanse(exp, sizeof(exp));
+  BN_clear_free(priv_key);
+  BN_free(pub_key);
+  return ret;
+}
 
 struct CRYPTO_DH *crypto_dh_new(const char *hex_gen, const char *hex_modulus)
 {
-  DH *dh = DH_new();
+  const struct CRYPTO_DH_COMB *comb;
+  struct CRYPTO_DH *dh;
+  EVP_PKEY *dh_params;
+  EVP_PKEY_CTX *ctx;
+
+  if ((dh = ssh_alloc(sizeof(struct CRYPTO_DH))) == NULL)
+    return NULL;
 
   if (BN_hex2bn(&dh->p, hex_modulus) == 0) {
-    DH_free(dh);
+    crypto_dh_free(dh);
     ssh_set_error("can't set DH modulus");
     return NULL;
   }
 
   if (BN_hex2bn(&dh->g, hex_gen) == 0) {
-    DH_free(dh);
+    crypto_dh_free(dh);
     ssh_set_error("can't set DH generator");
     return NULL;
   }
 
-  if (DH_generate_key(dh) == 0) {
-    DH_free(dh);
+  // use the precomputed table for the group if possible
+  if ((comb = crypto_dh_comb_get(hex_gen, hex_modulus)) != NULL) {
+    if (dh_generate_key_comb(dh, comb) < 0) {
+      crypto_dh_free(dh);
+      return NULL;
+    }
+    return dh;
+  }
+
+  if ((dh_params = dh_pkey_from_data(dh, NULL, NULL)) == NULL) {
+    crypto_dh_free(dh);
+    return NULL;
+  }
+  ctx = EVP_PKEY_CTX_new_from_pkey(NULL, dh_params, NULL);
+  if (ctx == NULL
+      || EVP_PKEY_keygen_init(ctx) <= 0
+      || EVP_PKEY_generate(ctx, &dh->key) <= 0) {
+    EVP_PKEY_CTX_free(ctx);
+    EVP_PKEY_free(dh_params);
+    crypto_dh_free(dh);
     ssh_set_error("can't generate DH key");
     return NULL;
   }
+  EVP_PKEY_CTX_free(ctx);
+  EVP_PKEY_free(dh_params);
   
-  return (struct CRYPTO_DH *) dh;
+  return dh;
 }
 
-int crypto_dh_compute_key(struct CRYPTO_DH *crypto_dh, struct SSH_STRING *ret_key, const struct SSH_STRING *server_pubkey)
+int crypto_dh_compute_key(struct CRYPTO_DH *dh, struct SSH_STRING *ret_key, const struct SSH_STRING *server_pubkey)
 {
-  DH *dh = GET_DH(crypto_dh);
   BIGNUM *bn_server_pubkey;
-  int len;
+  EVP_PKEY *peer;
+  EVP_PKEY_CTX *ctx;
+  size_t len, key_size;
   uint8_t *key;
 
-  bn_server_pubkey = BN_new();
-  if (crypto_string_to_bignum(bn_server_pubkey, server_pubkey) < 0)
+  if ((bn_server_pubkey = BN_new()) == NULL) {
+    ssh_set_error("out of memory");
+    return -1;
+  }
+  if (crypto_string_to_bignum(bn_server_pubkey, server_pubkey) < 0) {
+    BN_free(bn_server_pubkey);
     return -1;
-    
-  len = DH_size(dh);
-  key = ssh_alloc(len+1);
+  }
+  peer = dh_pkey_from_data(dh, bn_server_pubkey, NULL);
+  BN_free(bn_server_pubkey);
+  if (peer == NULL)
+    return -1;
+
+  // EVP_PKEY_derive_set_peer() also validates the server public key
+  ctx = EVP_PKEY_CTX_new_from_pkey(NULL, dh->key, NULL);
+  if (ctx == NULL
+      || EVP_PKEY_derive_init(ctx) <= 0
+      || EVP_PKEY_derive_set_peer(ctx, peer) <= 0
+      || EVP_PKEY_derive(ctx, NULL, &len) <= 0) {
+    EVP_PKEY_CTX_free(ctx);
+    EVP_PKEY_free(peer);
+    ssh_set_error("error computing key");
+    return -1;
+  }
+  
+  key_size = len+1;
+  key = ssh_alloc(key_size);
   if (key == NULL) {
-    BN_clear_free(bn_server_pubkey);
+    EVP_PKEY_CTX_free(ctx);
+    EVP_PKEY_free(peer);
     return -1;
   }
-  if ((len = DH_compute_key(key+1, bn_server_pubkey, dh)) < 0) {
+  if (EVP_PKEY_derive(ctx, key+1, &len) <= 0) {
+    OPENSSL_cleanse(key, key_size);
     ssh_free(key);
-    BN_clear_free(bn_server_pubkey);
+    EVP_PKEY_CTX_free(ctx);
+    EVP_PKEY_free(peer);
     ssh_set_error("error computing key");
     return -1;
   }
+  EVP_PKEY_CTX_free(ctx);
+  EVP_PKEY_free(peer);
   
   // prefix key with a 0 if necessary
   if ((key[1] & 0x80) != 0) {
@@ -71,23 +216,31 @@ int crypto_dh_compute_key(struct CRYPTO_DH *crypto_dh, struct SSH_STRING *ret_ke
     memmove(key, key+1, len);
   }
 
-  BN_clear_free(bn_server_pubkey);
   ret_key->str = key;
   ret_key->len = len;
   return 0;
 }
 
-int crypto_dh_get_pubkey(struct CRYPTO_DH *crypto_dh, struct SSH_STRING *out)
+int crypto_dh_get_pubkey(struct CRYPTO_DH *dh, struct SSH_STRING *out)
 {
-  DH *dh = GET_DH(crypto_dh);
+  BIGNUM *pub_key = NULL;
+  int ret;
 
-  return crypto_bignum_to_string(dh->pub_key, out);
+  if (EVP_PKEY_get_bn_param(dh->key, OSSL_PKEY_PARAM_PUB_KEY, &pub_key) == 0) {
+    ssh_set_error("can't get DH public key");
+    return -1;
+  }
+  ret = crypto_bignum_to_string(pub_key, out);
+  BN_free(pub_key);
+  return ret;
 }
 
-void crypto_dh_free(struct CRYPTO_DH *crypto_dh)
+void crypto_dh_free(struct CRYPTO_DH *dh)
 {
-  DH *dh = GET_DH(crypto_dh);
-  if (dh != NULL)
-    DH_free(dh);
+  if (dh == NULL)
+    return;
+  EVP_PKEY_free(dh->key);
+  BN_free(dh->p);
+  BN_free(dh->g);
+  ssh_free(dh);
 }
-
@@ -0,0 +1,309 @@
+/* dh_comb.c
+ *
+ * Fixed-base modular exponentiation for the Diffie-Hellman groups:
+ * g^x mod p with the Lim-Lee comb method.
+ *
+ * The exponent is split into COMB_TEETH*COMB_TABLES pieces of 'cols'
+ * bits, piece q starting at bit q*cols.  For each table s and each
+ * value j of COMB_TEETH bits, the tables hold
+ *
+ *   T_s[j] = product of g^(2^((k*COMB_TABLES+s)*cols)) for each bit k set in j
+ *
+ * so g^x is computed with one squaring per column and one
+ * multiplication per table per column, instead of one squaring per
+ * exponent bit.  The tables depend only on the group, so they're
+ * computed once per process and shared.
+ *
+ * Table entries are kept in Montgomery form as fixed-size byte
+ * arrays, and are read with a full scan of the table so the memory
+ * access pattern doesn't depend on the exponent.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <openssl/bn.h>
+#include <openssl/crypto.h>
+
+#include "crypto/dh_comb.h"
+
+#include "common/error.h"
+#include "common/alloc.h"
+
+#define MAX_GROUPS 4
+
+#define COMB_TEETH  6
+#define COMB_TABLES 2
+#define COMB_SIZE   (1<<COMB_TEETH)   // entries per table
+
+struct CRYPTO_DH_COMB {
+  char *hex_gen;
+  char *hex_modulus;
+  BN_MONT_CTX *mont;
+  BIGNUM *one;                     // 1 in Montgomery form
+  int entry_len;                   // bytes per table entry, a multiple of 8
+  int exp_bits;                    // size of the private exponents
+  int cols;                        // exp_bits/(COMB_TEETH*COMB_TABLES), rounded up
+  uint8_t *table;                  // COMB_TABLES tables of COMB_SIZE entries, little-endian
+};
+
+static pthread_mutex_t comb_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct CRYPTO_DH_COMB *combs[MAX_GROUPS];
+
+static uint8_t *table_entry(const struct CRYPTO_DH_COMB *comb, int table, uint32_t index)
+{
+  return comb->table + ((size_t) table*COMB_SIZE + index) * comb->entry_len;
+}
+
+/*
+ * Copy entry 'index' of a table to 'out', reading every entry.
+ */
+static void table_select(const struct CRYPTO_DH_COMB *comb, uint8_t *out, int table, uint32_t index)
+{
+  uint64_t acc[CRYPTO_DH_COMB_MAX_BITS/64];
+  int num_words = comb->entry_len / 8;
+  uint32_t i;
+  int j;
+
+  memset(acc, 0, sizeof(uint64_t)*num_words);
+  for (i = 0; i < COMB_SIZE; i++) {
+    const uint8_t *entry = table_entry(comb, table, i);
+    uint64_t mask = 0 - (((uint64_t) (i ^ index) - 1) >> 63);
+
+    for (j = 0; j < num_words; j++) {
+      uint64_t w;
+
+      memcpy(&w, entry + 8*j, 8);
+      acc[j] |= w & mask;
+    }
+  }
+  memcpy(out, acc, comb->entry_len);
+}
+
+/*
+ * Private exponent size for the group: twice the security strength
+ * of the modulus (NIST SP 800-56A), as OpenSSL does for the named
+ * groups.
+ */
+static int get_exp_bits(int modulus_bits)
+{
+  if (modulus_bits >= 7680) return 2*192;
+  if (modulus_bits >= 3072) return 2*128;
+  if (modulus_bits >= 2048) return 2*112;
+  return 2*80;
+}
+
+static void comb_free(struct CRYPTO_DH_COMB *comb)
+{
+  if (comb == NULL)
+    return;
+  ssh_free(comb->hex_gen);
+  ssh_free(comb->hex_modulus);
+  BN_MONT_CTX_free(comb->mont);
+  BN_free(comb->one);
+  ssh_free(comb->table);
+  ssh_free(comb);
+}
+
+static char *dup_string(const char *str)
+{
+  size_t len = strlen(str) + 1;
+  char *ret;
+
+  if ((ret = ssh_alloc(len)) == NULL)
+    return NULL;
+  memcpy(ret, str, len);
+  return ret;
+}
+
+/*
+ * Compute the Montgomery constants and the comb tables for a group.
+ */
+static int comb_init(struct CRYPTO_DH_COMB *comb, const BIGNUM *g, const BIGNUM *p)
+{
+  BN_CTX *bn_ctx;
+  BIGNUM *base, *entry;
+  int q, i, j, ret = -1;
+
+  comb->entry_len = 8 * ((BN_num_bytes(p) + 7) / 8);
+  comb->exp_bits = get_exp_bits(BN_num_bits(p));
+  comb->cols = (comb->exp_bits + COMB_TEETH*COMB_TABLES - 1) / (COMB_TEETH*COMB_TABLES);
+  if ((comb->table = ssh_alloc((size_t) comb->entry_len*COMB_SIZE*COMB_TABLES)) == NULL)
+    return -1;
+
+  bn_ctx = BN_CTX_new();
+  base = BN_new();
+  entry = BN_new();
+  comb->one = BN_new();
+  comb->mont = BN_MONT_CTX_new();
+  if (bn_ctx == NULL || base == NULL || entry == NULL || comb->one == NULL || comb->mont == NULL
+      || BN_MONT_CTX_set(comb->mont, p, bn_ctx) == 0
+      || BN_to_montgomery(comb->one, BN_value_one(), comb->mont, bn_ctx) == 0
+      || BN_to_montgomery(base, g, comb->mont, bn_ctx) == 0)
+    goto out;
+
+  // T_s[2^k] = g^(2^(q*cols)) with q = k*COMB_TABLES+s, T_s[0] = 1,
+  // and the other entries are products of these
+  for (q = 0; q < COMB_TEETH*COMB_TABLES; q++) {
+    int k = q / COMB_TABLES, s = q % COMB_TABLES;
+
+    if (k == 0 && BN_bn2lebinpad(comb->one, table_entry(comb, s, 0), comb->entry_len) < 0)
+      goto out;
+    if (BN_bn2lebinpad(base, table_entry(comb, s, 1<<k), comb->entry_len) < 0)
+      goto out;
+    for (j = 1; j < (1<<k); j++) {
+      if (BN_lebin2bn(table_entry(comb, s, j), comb->entry_len, entry) == NULL
+          || BN_mod_mul_montgomery(entry, entry, base, comb->mont, bn_ctx) == 0
+          || BN_bn2lebinpad(entry, table_entry(comb, s, (1<<k) + j), comb->entry_len) < 0)
+        goto out;
+    }
+    if (q+1 < COMB_TEETH*COMB_TABLES) {
+      for (i = 0; i < comb->cols; i++)
+        if (BN_mod_mul_montgomery(base, base, base, comb->mont, bn_ctx) == 0)
+          goto out;
+    }
+  }
+  ret = 0;
+
+ out:
+  if (ret < 0)
+    ssh_set_error("error computing DH group tables");
+  BN_free(entry);
+  BN_free(base);
+  BN_CTX_free(bn_ctx);
+  return ret;
+}
+
+/*
+ * Return the tables for the group, computing them the first time.
+ */
+const struct CRYPTO_DH_COMB *crypto_dh_comb_get(const char *hex_gen, const char *hex_modulus)
+{
+  struct CRYPTO_DH_COMB *comb = NULL;
+  BIGNUM *g = NULL, *p = NULL;
+  int i;
+
+  pthread_mutex_lock(&comb_lock);
+  for (i = 0; i < MAX_GROUPS && combs[i] != NULL; i++) {
+    if (strcmp(combs[i]->hex_gen, hex_gen) == 0 && strcmp(combs[i]->hex_modulus, hex_modulus) == 0) {
+      pthread_mutex_unlock(&comb_lock);
+      return combs[i];
+    }
+  }
+  if (i == MAX_GROUPS) {
+    pthread_mutex_unlock(&comb_lock);
+    ssh_set_error("too many DH groups");
+    return NULL;
+  }
+
+  if (BN_hex2bn(&g, hex_gen) == 0 || BN_hex2bn(&p, hex_modulus) == 0) {
+    ssh_set_error("invalid DH group");
+    goto err;
+  }
+  if (! BN_is_odd(p) || BN_num_bits(p) > CRYPTO_DH_COMB_MAX_BITS) {
+    ssh_set_error("unsupported DH modulus");
+    goto err;
+  }
+  if ((comb = ssh_alloc(sizeof(struct CRYPTO_DH_COMB))) == NULL)
+    goto err;
+  if ((comb->hex_gen = dup_string(hex_gen)) == NULL
+      || (comb->hex_modulus = dup_string(hex_modulus)) == NULL
+      || comb_init(comb, g, p) < 0)
+    goto err;
+
+  combs[i] = comb;
+  pthread_mutex_unlock(&comb_lock);
+  BN_free(g);
+  BN_free(p);
+  return comb;
+
+ err:
+  pthread_mutex_unlock(&comb_lock);
+  comb_free(comb);
+  BN_free(g);
+  BN_free(p);
+  return NULL;
+}
+
+/*
+ * Free the tables of all groups.  No comb returned by
+ * crypto_dh_comb_get() may be used after this.
+ */
+void crypto_dh_comb_deinit(void)
+{
+  int i;
+
+  pthread_mutex_lock(&comb_lock);
+  for (i = 0; i < MAX_GROUPS; i++) {
+    comb_free(combs[i]);
+    combs[i] = NULL;
+  }
+  pthread_mutex_unlock(&comb_lock);
+}
+
+int crypto_dh_comb_get_exp_bits(const struct CRYPTO_DH_COMB *comb)
+{
+  return comb->exp_bits;
+}
+
+/*
+ * Compute g^x mod p, where 'exp' is x in big-endian order with at
+ * most crypto_dh_comb_get_exp_bits() bits, and store the result in
+ * 'out'.
+ */
+int crypto_dh_comb_exp(const struct CRYPTO_DH_COMB *comb, BIGNUM *out, const uint8_t *exp, size_t exp_len)
+{
+  uint8_t x[CRYPTO_DH_COMB_MAX_BITS/8];
+  uint8_t entry_data[CRYPTO_DH_COMB_MAX_BITS/8];
+  BN_CTX *bn_ctx;
+  BIGNUM *acc, *entry;
+  int i, s, k, ret = -1;
+
+  if (8*exp_len > (size_t) comb->cols*COMB_TEETH*COMB_TABLES) {
+    ssh_set_error("DH exponent too large");
+    return -1;
+  }
+  // little-endian copy of the exponent, padded with zeros
+  memset(x, 0, sizeof(x));
+  for (i = 0; i < exp_len; i++)
+    x[i] = exp[exp_len-1-i];
+
+  bn_ctx = BN_CTX_secure_new();
+  acc = BN_secure_new();
+  entry = BN_secure_new();
+  if (bn_ctx == NULL || acc == NULL || entry == NULL
+      || BN_copy(acc, comb->one) == NULL)
+    goto out;
+
+  for (i = comb->cols - 1; i >= 0; i--) {
+    if (BN_mod_mul_montgomery(acc, acc, acc, comb->mont, bn_ctx) == 0)
+      goto out;
+    for (s = 0; s < COMB_TABLES; s++) {
+      uint32_t index = 0;
+
+      for (k = 0; k < COMB_TEETH; k++) {
+        int bit = (k*COMB_TABLES + s)*comb->cols + i;
+        index |= (uint32_t) ((x[bit/8] >> (bit%8)) & 1) << k;
+      }
+      table_select(comb, entry_data, s, index);
+      if (BN_lebin2bn(entry_data, comb->entry_len, entry) == NULL
+          || BN_mod_mul_montgomery(acc, acc, entry, comb->mont, bn_ctx) == 0)
+        goto out;
+    }
+  }
+  if (BN_from_montgomery(out, acc, comb->mont, bn_ctx) == 0)
+    goto out;
+  ret = 0;
+
+ out:
+  if (ret < 0)
+    ssh_set_error("error computing DH public key");
+  OPENSSL_cleanse(x, sizeof(x));
+  OPENSSL_cleanse(entry_data, sizeof(entry_data));
+  BN_clear_free(entry);
+  BN_clear_free(acc);
+  BN_CTX_free(bn_ctx);
+  return ret;
+}
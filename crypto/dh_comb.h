@@ -0,0 +1,20 @@
+/* dh_comb.h */
+
+#ifndef CRYPTO_DH_COMB_H_FILE
+#define CRYPTO_DH_COMB_H_FILE
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <openssl/bn.h>
+
+#define CRYPTO_DH_COMB_MAX_BITS 8192
+
+struct CRYPTO_DH_COMB;
+
+const struct CRYPTO_DH_COMB *crypto_dh_comb_get(const char *hex_gen, const char *hex_modulus);
+void crypto_dh_comb_deinit(void);
+int crypto_dh_comb_get_exp_bits(const struct CRYPTO_DH_COMB *comb);
+int crypto_dh_comb_exp(const struct CRYPTO_DH_COMB *comb, BIGNUM *out, const uint8_t *exp, size_t exp_len);
+
+#endif /* CRYPTO_DH_COMB_H_FILE */
@@ -0,0 +1,117 @@
+/* evp.c
+ *
+ * Algorithm implementations fetched from the OpenSSL providers.
+ *
+ * Implicit fetches (EVP_sha256(), EVP_DigestInit_ex() with a NULL
+ * engine etc.) look the algorithm up in the provider store every
+ * time a context is initialized.  We fetch everything we use once in
+ * crypto_init() and hand out the same objects until crypto_deinit().
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include <openssl/evp.h>
+
+#include "crypto/evp.h"
+
+#include "common/error.h"
+
+static const struct EVP_MD_ALGO {
+  enum SSH_HASH_TYPE type;
+  const char *name;
+} md_algos[] = {
+  { SSH_HASH_SHA1,     "SHA1" },
+  { SSH_HASH_SHA2_256, "SHA2-256" },
+  { SSH_HASH_SHA2_512, "SHA2-512" },
+};
+
+static const struct EVP_CIPHER_ALGO {
+  enum SSH_CIPHER_TYPE type;
+  const char *name;
+} cipher_algos[] = {
+  { SSH_CIPHER_AES128_CTR, "AES-128-CTR" },
+  { SSH_CIPHER_AES256_CTR, "AES-256-CTR" },
+  { SSH_CIPHER_AES128_CBC, "AES-128-CBC" },
+};
+
+#define NUM_MD_ALGOS      (sizeof(md_algos)/sizeof(md_algos[0]))
+#define NUM_CIPHER_ALGOS  (sizeof(cipher_algos)/sizeof(cipher_algos[0]))
+
+static EVP_MD *mds[NUM_MD_ALGOS];
+static EVP_CIPHER *ciphers[NUM_CIPHER_ALGOS];
+static EVP_MAC *hmac;
+
+int crypto_evp_init(void)
+{
+  int i;
+
+  for (i = 0; i < NUM_MD_ALGOS; i++) {
+    if ((mds[i] = EVP_MD_fetch(NULL, md_algos[i].name, NULL)) == NULL) {
+      ssh_set_error("can't fetch hash algorithm %s", md_algos[i].name);
+      crypto_evp_deinit();
+      return -1;
+    }
+  }
+
+  for (i = 0; i < NUM_CIPHER_ALGOS; i++) {
+    if ((ciphers[i] = EVP_CIPHER_fetch(NULL, cipher_algos[i].name, NULL)) == NULL) {
+      ssh_set_error("can't fetch cipher %s", cipher_algos[i].name);
+      crypto_evp_deinit();
+      return -1;
+    }
+  }
+
+  if ((hmac = EVP_MAC_fetch(NULL, "HMAC", NULL)) == NULL) {
+    ssh_set_error("can't fetch HMAC");
+    crypto_evp_deinit();
+    return -1;
+  }
+
+  return 0;
+}
+
+void crypto_evp_deinit(void)
+{
+  int i;
+
+  for (i = 0; i < NUM_MD_ALGOS; i++) {
+    EVP_MD_free(mds[i]);
+    mds[i] = NULL;
+  }
+  for (i = 0; i < NUM_CIPHER_ALGOS; i++) {
+    EVP_CIPHER_free(ciphers[i]);
+    ciphers[i] = NULL;
+  }
+  EVP_MAC_free(hmac);
+  hmac = NULL;
+}
+
+EVP_MD *crypto_evp_get_md(enum SSH_HASH_TYPE type)
+{
+  int i;
+
+  for (i = 0; i < NUM_MD_ALGOS; i++)
+    if (md_algos[i].type == type && mds[i] != NULL)
+      return mds[i];
+  ssh_set_error("hash algorithm not available: %d", type);
+  return NULL;
+}
+
+EVP_CIPHER *crypto_evp_get_cipher(enum SSH_CIPHER_TYPE type)
+{
+  int i;
+
+  for (i = 0; i < NUM_CIPHER_ALGOS; i++)
+    if (cipher_algos[i].type == type && ciphers[i] != NULL)
+      return ciphers[i];
+  ssh_set_error("cipher not available: %d", type);
+  return NULL;
+}
+
+EVP_MAC *crypto_evp_get_hmac(void)
+{
+  if (hmac == NULL)
+    ssh_set_error("HMAC not available");
+  return hmac;
+}
@@ -0,0 +1,17 @@
+/* evp.h */
+
+#ifndef CRYPTO_EVP_H_FILE
+#define CRYPTO_EVP_H_FILE
+
+#include <openssl/evp.h>
+
+#include "crypto/algorithms.h"
+
+int crypto_evp_init(void);
+void crypto_evp_deinit(void);
+
+EVP_MD *crypto_evp_get_md(enum SSH_HASH_TYPE type);
+EVP_CIPHER *crypto_evp_get_cipher(enum SSH_CIPHER_TYPE type);
+EVP_MAC *crypto_evp_get_hmac(void);
+
+#endif /* CRYPTO_EVP_H_FILE */
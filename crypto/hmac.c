@@ -0,0 +1,296 @@
+/* hmac.c
+ *
+ * HMAC through EVP_MAC.  The key is set once; each message restarts
+ * the context with crypto_hmac_init(), which reuses the key schedule
+ * (the hashed inner and outer pads) instead of recomputing it.
+ *
+ * HMAC-SHA256 has an in-tree implementation on CPUs with the SHA
+ * extensions, which avoids the EVP overhead on small packets.  It
+ * keeps the hash state after the inner and outer pads and starts
+ * each message from a copy.
+ *
+ * crypto_hmac_batch() computes the MACs of several messages at once
+ * with the multi-buffer SHA-2 code (sha_mb.c), which keeps its own
+ * copy of the hashed pads.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <openssl/evp.h>
+#include <openssl/crypto.h>
+#include <openssl/core_names.h>
+#include <openssl/params.h>
+
+#include "crypto/hmac.h"
+
+#include "common/error.h"
+#include "common/alloc.h"
+#include "crypto/evp.h"
+#include "crypto/cpu.h"
+#include "crypto/sha256_ni.h"
+#include "crypto/sha_mb.h"
+
+struct CRYPTO_HMAC_CTX {
+  EVP_MAC_CTX *evp;                // NULL until needed
+  int use_sha256_ni;
+  struct CRYPTO_SHA256_NI_CTX ipad;
+  struct CRYPTO_SHA256_NI_CTX opad;
+  struct CRYPTO_SHA256_NI_CTX hash;
+
+  enum SSH_HASH_TYPE type;
+  int mb_lanes;                    // 0 if there's no multi-buffer implementation
+  union CRYPTO_SHA_MB_STATE mb_ipad;
+  union CRYPTO_SHA_MB_STATE mb_opad;
+};
+
+struct CRYPTO_HMAC_CTX *crypto_hmac_new(enum SSH_HASH_TYPE type, const struct SSH_STRING *key)
+{
+  struct CRYPTO_HMAC_CTX *ctx;
+
+  if ((ctx = ssh_alloc(sizeof(struct CRYPTO_HMAC_CTX))) == NULL)
+    return NULL;
+
+  if (crypto_hmac_set_key(ctx, type, key) < 0) {
+    crypto_hmac_free(ctx);
+    return NULL;
+  }
+  return ctx;
+}
+
+static void hmac_sha256_ni_set_key(struct CRYPTO_HMAC_CTX *ctx, const struct SSH_STRING *key)
+{
+  uint8_t block[CRYPTO_SHA256_BLOCK_SIZE];
+  int i;
+
+  // fit key in a block, hashing or filling 0s as necessary
+  memset(block, 0, sizeof(block));
+  if (key->len > CRYPTO_SHA256_BLOCK_SIZE) {
+    crypto_sha256_ni_init(&ctx->hash);
+    crypto_sha256_ni_update(&ctx->hash, key->str, key->len);
+    crypto_sha256_ni_final(&ctx->hash, block);
+  } else if (key->len > 0) {
+    memcpy(block, key->str, key->len);
+  }
+
+  for (i = 0; i < CRYPTO_SHA256_BLOCK_SIZE; i++)
+    block[i] ^= 0x36;
+  crypto_sha256_ni_init(&ctx->ipad);
+  crypto_sha256_ni_update(&ctx->ipad, block, CRYPTO_SHA256_BLOCK_SIZE);
+
+  for (i = 0; i < CRYPTO_SHA256_BLOCK_SIZE; i++)
+    block[i] ^= 0x36 ^ 0x5c;  // 0x36 to undo ipad
+  crypto_sha256_ni_init(&ctx->opad);
+  crypto_sha256_ni_update(&ctx->opad, block, CRYPTO_SHA256_BLOCK_SIZE);
+
+  OPENSSL_cleanse(block, sizeof(block));
+  OPENSSL_cleanse(&ctx->hash, sizeof(ctx->hash));
+}
+
+static int hmac_mb_set_key(struct CRYPTO_HMAC_CTX *ctx, enum SSH_HASH_TYPE type, const struct SSH_STRING *key)
+{
+  uint8_t block[CRYPTO_SHA_MB_BLOCK_MAX];
+  size_t block_size = (type == SSH_HASH_SHA2_512) ? 128 : 64;
+  int i;
+
+  // fit key in a block, hashing or filling 0s as necessary
+  memset(block, 0, sizeof(block));
+  if (key->len > block_size) {
+    struct CRYPTO_SHA_MB_MSG msg = { NULL, 0, key->str, key->len, block };
+    if (crypto_sha_mb_hash(type, NULL, 0, &msg, 1) < 0)
+      return -1;
+  } else if (key->len > 0) {
+    memcpy(block, key->str, key->len);
+  }
+
+  for (i = 0; i < block_size; i++)
+    block[i] ^= 0x36;
+  if (crypto_sha_mb_hash_block(type, NULL, block, &ctx->mb_ipad) < 0)
+    return -1;
+  for (i = 0; i < block_size; i++)
+    block[i] ^= 0x36 ^ 0x5c;  // 0x36 to undo ipad
+  if (crypto_sha_mb_hash_block(type, NULL, block, &ctx->mb_opad) < 0)
+    return -1;
+
+  OPENSSL_cleanse(block, sizeof(block));
+  return 0;
+}
+
+int crypto_hmac_set_key(struct CRYPTO_HMAC_CTX *ctx, enum SSH_HASH_TYPE type, const struct SSH_STRING *key)
+{
+  OSSL_PARAM params[2];
+  EVP_MAC *hmac;
+  EVP_MD *md;
+
+  ctx->type = type;
+  ctx->mb_lanes = crypto_sha_mb_get_lanes(type);
+  if (ctx->mb_lanes > 0 && hmac_mb_set_key(ctx, type, key) < 0)
+    return -1;
+
+  if (type == SSH_HASH_SHA2_256 && crypto_cpu_has(CRYPTO_CPU_SHANI)) {
+    hmac_sha256_ni_set_key(ctx, key);
+    ctx->use_sha256_ni = 1;
+    return 0;
+  }
+  ctx->use_sha256_ni = 0;
+
+  if ((md = crypto_evp_get_md(type)) == NULL)
+    return -1;
+  if (ctx->evp == NULL) {
+    if ((hmac = crypto_evp_get_hmac()) == NULL)
+      return -1;
+    if ((ctx->evp = EVP_MAC_CTX_new(hmac)) == NULL) {
+      ssh_set_error("out of memory");
+      return -1;
+    }
+  }
+
+  params[0] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, (char *) EVP_MD_get0_name(md), 0);
+  params[1] = OSSL_PARAM_construct_end();
+  if (EVP_MAC_init(ctx->evp, key->str, key->len, params) == 0) {
+    ssh_set_error("error setting HMAC key");
+    return -1;
+  }
+  return 0;
+}
+
+void crypto_hmac_free(struct CRYPTO_HMAC_CTX *ctx)
+{
+  EVP_MAC_CTX_free(ctx->evp);
+  OPENSSL_cleanse(ctx, sizeof(*ctx));
+  ssh_free(ctx);
+}
+
+int crypto_hmac_init(struct CRYPTO_HMAC_CTX *ctx)
+{
+  if (ctx->use_sha256_ni) {
+    ctx->hash = ctx->ipad;
+    return 0;
+  }
+
+  if (EVP_MAC_init(ctx->evp, NULL, 0, NULL) == 0) {
+    ssh_set_error("error initializing HMAC");
+    return -1;
+  }
+  return 0;
+}
+
+int crypto_hmac_update(struct CRYPTO_HMAC_CTX *ctx, const void *data, uint32_t len)
+{
+  if (ctx->use_sha256_ni) {
+    crypto_sha256_ni_update(&ctx->hash, data, len);
+    return 0;
+  }
+
+  if (EVP_MAC_update(ctx->evp, data, len) == 0) {
+    ssh_set_error("error updating HMAC");
+    return -1;
+  }
+  return 0;
+}
+
+int crypto_hmac_final(struct CRYPTO_HMAC_CTX *ctx, void *out, uint32_t out_size)
+{
+  size_t out_len;
+
+  if (ctx->use_sha256_ni) {
+    uint8_t inner[CRYPTO_SHA256_DIGEST_LEN];
+
+    if (out_size < CRYPTO_SHA256_DIGEST_LEN) {
+      ssh_set_error("HMAC output buffer too small");
+      return -1;
+    }
+    crypto_sha256_ni_final(&ctx->hash, inner);
+    ctx->hash = ctx->opad;
+    crypto_sha256_ni_update(&ctx->hash, inner, sizeof(inner));
+    crypto_sha256_ni_final(&ctx->hash, out);
+    return 0;
+  }
+
+  if (EVP_MAC_final(ctx->evp, out, &out_len, out_size) == 0) {
+    ssh_set_error("error finalizing HMAC");
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Return the running inner hash if the context uses the SHA-NI
+ * implementation, or NULL.  Between crypto_hmac_init() and
+ * crypto_hmac_final() the caller may feed it directly.
+ */
+struct CRYPTO_SHA256_NI_CTX *crypto_hmac_get_sha256_ni(struct CRYPTO_HMAC_CTX *ctx)
+{
+  return (ctx->use_sha256_ni) ? &ctx->hash : NULL;
+}
+
+/*
+ * Return the number of messages crypto_hmac_batch() processes in
+ * parallel, or 1 if it just processes them one after the other.
+ */
+int crypto_hmac_get_batch_size(struct CRYPTO_HMAC_CTX *ctx)
+{
+  return (ctx->mb_lanes > 0) ? ctx->mb_lanes : 1;
+}
+
+/*
+ * Compute the MAC of each message.  The prefix of each message must
+ * not be longer than a hash block.
+ */
+int crypto_hmac_batch(struct CRYPTO_HMAC_CTX *ctx, struct CRYPTO_HMAC_MSG *msgs, int num_msgs, uint32_t mac_size)
+{
+  struct CRYPTO_SHA_MB_MSG mb_msgs[CRYPTO_SHA_MB_MAX_LANES];
+  uint8_t inner[CRYPTO_SHA_MB_MAX_LANES][CRYPTO_SHA_MB_DIGEST_MAX];
+  size_t block_size, digest_len;
+  int first, n, i;
+
+  if (ctx->mb_lanes == 0 || num_msgs < 2) {
+    for (i = 0; i < num_msgs; i++) {
+      if (crypto_hmac_init(ctx) < 0
+          || crypto_hmac_update(ctx, msgs[i].prefix, msgs[i].prefix_len) < 0
+          || crypto_hmac_update(ctx, msgs[i].data, msgs[i].len) < 0
+          || crypto_hmac_final(ctx, msgs[i].mac, mac_size) < 0)
+        return -1;
+    }
+    return 0;
+  }
+
+  block_size = (ctx->type == SSH_HASH_SHA2_512) ? 128 : 64;
+  digest_len = (ctx->type == SSH_HASH_SHA2_512) ? 64 : 32;
+  if (mac_size < digest_len) {
+    ssh_set_error("HMAC output buffer too small");
+    return -1;
+  }
+
+  for (first = 0; first < num_msgs; first += n) {
+    n = num_msgs - first;
+    if (n > CRYPTO_SHA_MB_MAX_LANES)
+      n = CRYPTO_SHA_MB_MAX_LANES;
+
+    // inner hash, from the ipad state
+    for (i = 0; i < n; i++) {
+      mb_msgs[i].prefix = msgs[first+i].prefix;
+      mb_msgs[i].prefix_len = msgs[first+i].prefix_len;
+      mb_msgs[i].data = msgs[first+i].data;
+      mb_msgs[i].len = msgs[first+i].len;
+      mb_msgs[i].digest = inner[i];
+    }
+    if (crypto_sha_mb_hash(ctx->type, &ctx->mb_ipad, block_size, mb_msgs, n) < 0)
+      return -1;
+
+    // outer hash, from the opad state
+    for (i = 0; i < n; i++) {
+      mb_msgs[i].prefix = NULL;
+      mb_msgs[i].prefix_len = 0;
+      mb_msgs[i].data = inner[i];
+      mb_msgs[i].len = digest_len;
+      mb_msgs[i].digest = msgs[first+i].mac;
+    }
+    if (crypto_sha_mb_hash(ctx->type, &ctx->mb_opad, block_size, mb_msgs, n) < 0)
+      return -1;
+  }
+
+  OPENSSL_cleanse(inner, sizeof(inner));
+  return 0;
+}
@@ -0,0 +1,33 @@
+/* hmac.h */
+
+#ifndef CRYPTO_HMAC_H_FILE
+#define CRYPTO_HMAC_H_FILE
+
+#include <stdint.h>
+
+#include "common/buffer.h"
+#include "crypto/algorithms.h"
+
+struct CRYPTO_HMAC_CTX;
+struct CRYPTO_SHA256_NI_CTX;
+
+/* message for crypto_hmac_batch() */
+struct CRYPTO_HMAC_MSG {
+  const uint8_t *prefix;           // MACed before 'data' (e.g. the sequence number)
+  size_t prefix_len;
+  const uint8_t *data;
+  size_t len;
+  uint8_t *mac;                    // output
+};
+
+struct CRYPTO_HMAC_CTX *crypto_hmac_new(enum SSH_HASH_TYPE type, const struct SSH_STRING *key);
+int crypto_hmac_set_key(struct CRYPTO_HMAC_CTX *ctx, enum SSH_HASH_TYPE type, const struct SSH_STRING *key);
+void crypto_hmac_free(struct CRYPTO_HMAC_CTX *ctx);
+int crypto_hmac_init(struct CRYPTO_HMAC_CTX *ctx);
+int crypto_hmac_update(struct CRYPTO_HMAC_CTX *ctx, const void *data, uint32_t len);
+int crypto_hmac_final(struct CRYPTO_HMAC_CTX *ctx, void *out, uint32_t out_size);
+struct CRYPTO_SHA256_NI_CTX *crypto_hmac_get_sha256_ni(struct CRYPTO_HMAC_CTX *ctx);
+int crypto_hmac_get_batch_size(struct CRYPTO_HMAC_CTX *ctx);
+int crypto_hmac_batch(struct CRYPTO_HMAC_CTX *ctx, struct CRYPTO_HMAC_MSG *msgs, int num_msgs, uint32_t mac_size);
+
+#endif /* CRYPTO_HMAC_H_FILE */
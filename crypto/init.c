@@ -3,28 +3,36 @@
 #include <stdlib.h>
 #include <stdint.h>
 
-#include <openssl/conf.h>
-#include <openssl/evp.h>
-#include <openssl/err.h>
+#include <openssl/crypto.h>
 
 #include "crypto/init.h"
+#include "crypto/cpu.h"
+#include "crypto/evp.h"
+#include "crypto/dh_comb.h"
 #include "crypto/random.h"
 
+#include "common/error.h"
+
 int crypto_init(void)
 {
-  ERR_load_crypto_strings();
-  OpenSSL_add_all_algorithms();
-  //OPENSSL_config(NULL);
+  if (OPENSSL_init_crypto(OPENSSL_INIT_LOAD_CRYPTO_STRINGS, NULL) == 0) {
+    ssh_set_error("error initializing OpenSSL");
+    return -1;
+  }
 
-  if (crypto_random_init() < 0)
+  crypto_cpu_init();
+  if (crypto_evp_init() < 0)
+    return -1;
+  if (crypto_random_init() < 0) {
+    crypto_evp_deinit();
     return -1;
+  }
   return 0;
 }
 
 void crypto_deinit(void)
 {
+  crypto_dh_comb_deinit();
   crypto_random_deinit();
-  EVP_cleanup();
-  CRYPTO_cleanup_all_ex_data();
-  ERR_free_strings();
+  crypto_evp_deinit();
 }
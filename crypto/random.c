@@ -1,6 +1,18 @@
-/* random.c */
+/* random.c
+ *
+ * Random numbers come from a ChaCha20 DRBG with fast key erasure: each
+ * refill generates a batch of keystream, the first 32 bytes of which
+ * replace the key, and the rest is handed out (and wiped) as needed.
+ * The state is per-thread, and it's reseeded from the system source
+ * below after RANDOM_RESEED_INTERVAL bytes and in the child after a
+ * fork().
+ */
 
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <openssl/crypto.h>
 
 #include "crypto/random.h"
 #include "common/error.h"
@@ -9,9 +21,9 @@
 
 #if defined(USE_ARC4)
 
-int crypto_random_init(void) { return 0; }
-void crypto_random_deinit(void) {}
-int crypto_random_gen(uint8_t *data, size_t len)
+static int random_source_init(void) { return 0; }
+static void random_source_deinit(void) {}
+static int random_source_gen(uint8_t *data, size_t len)
 {
   arc4random_buf(data, len);
   return 0;
@@ -24,10 +36,10 @@ int crypto_random_gen(uint8_t *data, size_t len)
 #include <linux/random.h>
 #include <errno.h>
 
-int crypto_random_init(void) { return 0; }
-void crypto_random_deinit(void) {}
+static int random_source_init(void) { return 0; }
+static void random_source_deinit(void) {}
 
-int crypto_random_gen(uint8_t *data, size_t len)
+static int random_source_gen(uint8_t *data, size_t len)
 {
   size_t s = 0;
 
@@ -55,7 +67,7 @@ int crypto_random_gen(uint8_t *data, size_t len)
 
 static int dev_urandom_fd = -1;
 
-int crypto_random_init(void)
+static int random_source_init(void)
 {
   dev_urandom_fd = open("/dev/urandom", O_RDONLY);
   if (dev_urandom_fd < 0) {
@@ -65,7 +77,7 @@ int crypto_random_init(void)
   return 0;
 }
 
-void crypto_random_deinit(void)
+static void random_source_deinit(void)
 {
   if (dev_urandom_fd >= 0) {
     close(dev_urandom_fd);
@@ -73,7 +85,7 @@ void crypto_random_deinit(void)
   }
 }
 
-int crypto_random_gen(uint8_t *data, size_t len)
+static int random_source_gen(uint8_t *data, size_t len)
 {
   size_t s = 0;
 
@@ -97,3 +109,188 @@ int crypto_random_gen(uint8_t *data, size_t len)
 
 #endif
 
+/* ------- DRBG ------------------------------------------------------- */
+
+#define CHACHA_KEY_LEN         32
+#define CHACHA_BLOCK_LEN       64
+#define RANDOM_BUF_BLOCKS      16
+#define RANDOM_BUF_LEN         (RANDOM_BUF_BLOCKS * CHACHA_BLOCK_LEN - CHACHA_KEY_LEN)
+#define RANDOM_RESEED_INTERVAL (1024*1024)
+
+struct RANDOM_STATE {
+  int seeded;
+  unsigned int fork_generation;
+  size_t bytes_since_reseed;
+  size_t buf_pos;               // bytes before this position are used up
+  uint8_t key[CHACHA_KEY_LEN];
+  uint8_t buf[RANDOM_BUF_LEN];
+};
+
+static __thread struct RANDOM_STATE random_state;
+static unsigned int fork_generation;
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define QUARTER_ROUND(a, b, c, d)                      \
+  do {                                                  \
+    a += b; d ^= a; d = ROTL32(d, 16);                  \
+    c += d; b ^= c; b = ROTL32(b, 12);                  \
+    a += b; d ^= a; d = ROTL32(d, 8);                   \
+    c += d; b ^= c; b = ROTL32(b, 7);                   \
+  } while (0)
+
+static uint32_t load_le32(const uint8_t *p)
+{
+  return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static void store_le32(uint8_t *p, uint32_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+/* write ChaCha20 keystream block 'counter' (with an all-zero nonce) */
+static void chacha20_block(uint8_t *out, const uint8_t *key, uint32_t counter)
+{
+  uint32_t in[16], x[16];
+  int i;
+
+  in[0] = 0x61707865;
+  in[1] = 0x3320646e;
+  in[2] = 0x79622d32;
+  in[3] = 0x6b206574;
+  for (i = 0; i < 8; i++)
+    in[4+i] = load_le32(key + 4*i);
+  in[12] = counter;
+  in[13] = in[14] = in[15] = 0;
+
+  memcpy(x, in, sizeof(x));
+  for (i = 0; i < 10; i++) {
+    QUARTER_ROUND(x[0], x[4], x[ 8], x[12]);
+    QUARTER_ROUND(x[1], x[5], x[ 9], x[13]);
+    QUARTER_ROUND(x[2], x[6], x[10], x[14]);
+    QUARTER_ROUND(x[3], x[7], x[11], x[15]);
+    QUARTER_ROUND(x[0], x[5], x[10], x[15]);
+    QUARTER_ROUND(x[1], x[6], x[11], x[12]);
+    QUARTER_ROUND(x[2], x[7], x[ 8], x[13]);
+    QUARTER_ROUND(x[3], x[4], x[ 9], x[14]);
+  }
+  for (i = 0; i < 16; i++)
+    store_le32(out + 4*i, x[i] + in[i]);
+
+  OPENSSL_cleanse(x, sizeof(x));
+  OPENSSL_cleanse(in, sizeof(in));
+}
+
+/*
+ * Generate a new key and a fresh output buffer from the current key.
+ * The whole batch comes from the old key, which is then erased, so
+ * the new key can't be used to recompute any of the output.
+ */
+static void random_refill(struct RANDOM_STATE *st)
+{
+  uint8_t old_key[CHACHA_KEY_LEN];
+  uint8_t block[CHACHA_BLOCK_LEN];
+  size_t pos = 0;
+  uint32_t i;
+
+  memcpy(old_key, st->key, CHACHA_KEY_LEN);
+  for (i = 0; i < RANDOM_BUF_BLOCKS; i++) {
+    chacha20_block(block, old_key, i);
+    if (i == 0) {
+      memcpy(st->key, block, CHACHA_KEY_LEN);
+      memcpy(st->buf, block + CHACHA_KEY_LEN, CHACHA_BLOCK_LEN - CHACHA_KEY_LEN);
+      pos = CHACHA_BLOCK_LEN - CHACHA_KEY_LEN;
+    } else {
+      memcpy(st->buf + pos, block, CHACHA_BLOCK_LEN);
+      pos += CHACHA_BLOCK_LEN;
+    }
+  }
+  OPENSSL_cleanse(old_key, sizeof(old_key));
+  OPENSSL_cleanse(block, sizeof(block));
+  st->buf_pos = 0;
+}
+
+static int random_reseed(struct RANDOM_STATE *st)
+{
+  uint8_t seed[CHACHA_KEY_LEN];
+  int i;
+
+  if (random_source_gen(seed, sizeof(seed)) < 0)
+    return -1;
+  // mix with the old key, if any, so a bad seed doesn't make things worse
+  for (i = 0; i < CHACHA_KEY_LEN; i++)
+    st->key[i] ^= seed[i];
+  OPENSSL_cleanse(seed, sizeof(seed));
+
+  st->seeded = 1;
+  st->fork_generation = __atomic_load_n(&fork_generation, __ATOMIC_ACQUIRE);
+  st->bytes_since_reseed = 0;
+  random_refill(st);
+  return 0;
+}
+
+static void random_wipe(struct RANDOM_STATE *st)
+{
+  OPENSSL_cleanse(st, sizeof(*st));
+}
+
+static void random_atfork_child(void)
+{
+  // the thread that called fork() is the only one in the child
+  __atomic_fetch_add(&fork_generation, 1, __ATOMIC_ACQ_REL);
+  random_wipe(&random_state);
+}
+
+static void random_register_atfork(void)
+{
+  pthread_atfork(NULL, NULL, random_atfork_child);
+}
+
+int crypto_random_init(void)
+{
+  static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+  
+  if (random_source_init() < 0)
+    return -1;
+  pthread_once(&atfork_once, random_register_atfork);
+  return 0;
+}
+
+void crypto_random_deinit(void)
+{
+  random_wipe(&random_state);
+  random_source_deinit();
+}
+
+int crypto_random_gen(uint8_t *data, size_t len)
+{
+  struct RANDOM_STATE *st = &random_state;
+
+  if (! st->seeded
+      || st->bytes_since_reseed >= RANDOM_RESEED_INTERVAL
+      || st->fork_generation != __atomic_load_n(&fork_generation, __ATOMIC_ACQUIRE)) {
+    if (random_reseed(st) < 0)
+      return -1;
+  }
+
+  while (len > 0) {
+    size_t n;
+
+    if (st->buf_pos == RANDOM_BUF_LEN)
+      random_refill(st);
+    n = RANDOM_BUF_LEN - st->buf_pos;
+    if (n > len)
+      n = len;
+    memcpy(data, st->buf + st->buf_pos, n);
+    memset(st->buf + st->buf_pos, 0, n);
+    st->buf_pos += n;
+    st->bytes_since_reseed += n;
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
@@ -4,47 +4,116 @@
 #include <stdint.h>
 #include <string.h>
 
+#include <openssl/evp.h>
 #include <openssl/rsa.h>
+#include <openssl/crypto.h>
+#include <openssl/core_names.h>
+#include <openssl/param_build.h>
 
 #include "crypto/rsa.h"
 
 #include "common/error.h"
 #include "common/debug.h"
+#include "common/alloc.h"
 #include "common/buffer.h"
 #include "crypto/algorithms.h"
 #include "crypto/oid.h"
 #include "crypto/bignum.h"
 
-int crypto_rsa_verify(enum SSH_HASH_TYPE hash_type, struct SSH_STRING *e, struct SSH_STRING *n, struct SSH_STRING *signature, struct SSH_STRING *hash)
+// large enough for 4096-bit keys
+#define RSA_INLINE_BUF_SIZE 512
+
+static EVP_PKEY *rsa_pkey_from_data(struct SSH_STRING *e, struct SSH_STRING *n)
+{
+  BIGNUM *bn_e, *bn_n;
+  OSSL_PARAM_BLD *bld = NULL;
+  OSSL_PARAM *params = NULL;
+  EVP_PKEY_CTX *ctx = NULL;
+  EVP_PKEY *pkey = NULL;
+
+  bn_e = BN_new();
+  bn_n = BN_new();
+  if (bn_e == NULL || bn_n == NULL) {
+    BN_free(bn_e);
+    BN_free(bn_n);
+    ssh_set_error("out of memory");
+    return NULL;
+  }
+  if (crypto_string_to_bignum(bn_e, e) < 0
+      || crypto_string_to_bignum(bn_n, n) < 0) {
+    BN_free(bn_e);
+    BN_free(bn_n);
+    return NULL;
+  }
+
+  if ((bld = OSSL_PARAM_BLD_new()) == NULL
+      || OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_RSA_N, bn_n) == 0
+      || OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_RSA_E, bn_e) == 0
+      || (params = OSSL_PARAM_BLD_to_param(bld)) == NULL
+      || (ctx = EVP_PKEY_CTX_new_from_name(NULL, "RSA", NULL)) == NULL
+      || EVP_PKEY_fromdata_init(ctx) <= 0
+      || EVP_PKEY_fromdata(ctx, &pkey, EVP_PKEY_PUBLIC_KEY, params) <= 0) {
+    ssh_set_error("can't build RSA key");
+    pkey = NULL;
+  }
+
+  EVP_PKEY_CTX_free(ctx);
+  OSSL_PARAM_free(params);
+  OSSL_PARAM_BLD_free(bld);
+  BN_free(bn_e);
+  BN_free(bn_n);
+  return pkey;
+}
+
+struct CRYPTO_RSA_PUBKEY {
+  EVP_PKEY *pkey;
+  size_t rsa_size;
+};
+
+/*
+ * Build a public key from (e, n).  The key can be used for any number
+ * of verifications; OpenSSL keeps the Montgomery context for n in it
+ * after the first one.
+ */
+struct CRYPTO_RSA_PUBKEY *crypto_rsa_pubkey_new(struct SSH_STRING *e, struct SSH_STRING *n)
+{
+  struct CRYPTO_RSA_PUBKEY *key;
+
+  if ((key = ssh_alloc(sizeof(struct CRYPTO_RSA_PUBKEY))) == NULL)
+    return NULL;
+  if ((key->pkey = rsa_pkey_from_data(e, n)) == NULL) {
+    ssh_free(key);
+    return NULL;
+  }
+  key->rsa_size = EVP_PKEY_get_size(key->pkey);
+  return key;
+}
+
+void crypto_rsa_pubkey_free(struct CRYPTO_RSA_PUBKEY *key)
+{
+  if (key == NULL)
+    return;
+  EVP_PKEY_free(key->pkey);
+  ssh_free(key);
+}
+
+int crypto_rsa_verify_key(enum SSH_HASH_TYPE hash_type, const struct CRYPTO_RSA_PUBKEY *key, struct SSH_STRING *signature, struct SSH_STRING *hash)
 {
   struct SSH_STRING oid;
   struct SSH_STRING use_sig;
-  struct SSH_BUFFER sig_buf;
-  struct SSH_BUFFER decrypted_buf;
+  SSH_BUF_DECLARE_INLINE(sig_buf, RSA_INLINE_BUF_SIZE);
+  SSH_BUF_DECLARE_INLINE(decrypted_buf, RSA_INLINE_BUF_SIZE);
   uint8_t *decrypted;
-  RSA *rsa;
+  EVP_PKEY_CTX *ctx;
   size_t rsa_size;
-  int decrypted_len;
+  size_t decrypted_len;
   int oid_ok, hash_ok;
   int must_free_sig;
   
   if (crypto_oid_get_for_hash(hash_type, &oid) < 0)
     return -1;
 
-  if ((rsa = RSA_new()) == NULL
-      || (rsa->e = BN_new()) == NULL
-      || (rsa->n = BN_new()) == NULL) {
-    if (rsa != NULL)
-      RSA_free(rsa);
-    ssh_set_error("out of memory");
-    return -1;
-  }
-  if (crypto_string_to_bignum(rsa->e, e) < 0)
-    return -1;
-  if (crypto_string_to_bignum(rsa->n, n) < 0)
-    return -1;
-
-  rsa_size = RSA_size(rsa);
+  rsa_size = key->rsa_size;
   if (rsa_size < signature->len) {
     ssh_set_error("signature too large");
     return -1;
@@ -52,7 +121,6 @@ int crypto_rsa_verify(enum SSH_HASH_TYPE hash_type, struct SSH_STRING *e, struct
     uint8_t *p;
 
     // fill signature with 0s at the start
-    sig_buf = ssh_buf_new();
     p = ssh_buf_get_write_pointer(&sig_buf, rsa_size - signature->len);
     memset(p, 0, rsa_size - signature->len);
     p = ssh_buf_get_write_pointer(&sig_buf, signature->len);
@@ -65,26 +133,28 @@ int crypto_rsa_verify(enum SSH_HASH_TYPE hash_type, struct SSH_STRING *e, struct
     must_free_sig = 0;
   }
 
-  // decrypt signature
-  decrypted_buf = ssh_buf_new();
+  // decrypt signature (no digest set, so we get the raw DigestInfo)
   decrypted = ssh_buf_get_write_pointer(&decrypted_buf, rsa_size);
-  decrypted_len = RSA_public_decrypt(use_sig.len, use_sig.str, decrypted, rsa, RSA_PKCS1_PADDING);
-
-  if (decrypted_len < 0 || hash->len + oid.len != (size_t) decrypted_len) {
-    RSA_free(rsa);
+  decrypted_len = rsa_size;
+  ctx = EVP_PKEY_CTX_new_from_pkey(NULL, key->pkey, NULL);
+  if (ctx == NULL
+      || EVP_PKEY_verify_recover_init(ctx) <= 0
+      || EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_PKCS1_PADDING) <= 0
+      || EVP_PKEY_verify_recover(ctx, decrypted, &decrypted_len, use_sig.str, use_sig.len) <= 0
+      || hash->len + oid.len != decrypted_len) {
+    EVP_PKEY_CTX_free(ctx);
     ssh_buf_free(&decrypted_buf);
     if (must_free_sig)
       ssh_buf_free(&sig_buf);
     ssh_set_error("RSA error decypting signature");
     return -1;
   }
-  RSA_free(rsa);
+  EVP_PKEY_CTX_free(ctx);
   if (must_free_sig)
     ssh_buf_free(&sig_buf);
 
-  // TODO: protect against timing attacks
-  oid_ok = (memcmp(decrypted, oid.str, oid.len) == 0);
-  hash_ok = (memcmp(decrypted + oid.len, hash->str, hash->len) == 0);
+  oid_ok = (CRYPTO_memcmp(decrypted, oid.str, oid.len) == 0);
+  hash_ok = (CRYPTO_memcmp(decrypted + oid.len, hash->str, hash->len) == 0);
   ssh_buf_free(&decrypted_buf);
   if (! oid_ok || ! hash_ok) {
     ssh_set_error("invalid signature (%d, %d)", oid_ok, hash_ok);
@@ -93,3 +163,15 @@ int crypto_rsa_verify(enum SSH_HASH_TYPE hash_type, struct SSH_STRING *e, struct
 
   return 0;
 }
+
+int crypto_rsa_verify(enum SSH_HASH_TYPE hash_type, struct SSH_STRING *e, struct SSH_STRING *n, struct SSH_STRING *signature, struct SSH_STRING *hash)
+{
+  struct CRYPTO_RSA_PUBKEY *key;
+  int ret;
+
+  if ((key = crypto_rsa_pubkey_new(e, n)) == NULL)
+    return -1;
+  ret = crypto_rsa_verify_key(hash_type, key, signature, hash);
+  crypto_rsa_pubkey_free(key);
+  return ret;
+}
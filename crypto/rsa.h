@@ -6,6 +6,11 @@
 #include "common/buffer.h"
 #include "crypto/algorithms.h"
 
+struct CRYPTO_RSA_PUBKEY;
+
+struct CRYPTO_RSA_PUBKEY *crypto_rsa_pubkey_new(struct SSH_STRING *e, struct SSH_STRING *n);
+void crypto_rsa_pubkey_free(struct CRYPTO_RSA_PUBKEY *key);
+int crypto_rsa_verify_key(enum SSH_HASH_TYPE hash_type, const struct CRYPTO_RSA_PUBKEY *key, struct SSH_STRING *signature, struct SSH_STRING *data_hash);
 int crypto_rsa_verify(enum SSH_HASH_TYPE hash_type, struct SSH_STRING *e, struct SSH_STRING *n, struct SSH_STRING *signature, struct SSH_STRING *data_hash);
 
 #endif /* CRYPTO_RSA_H_FILE */
@@ -6,14 +6,21 @@
 #include <openssl/evp.h>
 
 #include "crypto/sha1.h"
+#include "crypto/evp.h"
 
 #include "common/error.h"
 
+#define TO_MD_CTX(ctx) ((EVP_MD_CTX *) (ctx))
+
 int crypto_sha1_single(enum SSH_HASH_TYPE type, void *out, uint32_t *out_len, const void *data, uint32_t data_len)
 {
   unsigned int digest_len;
+  EVP_MD *md;
+
+  if ((md = crypto_evp_get_md(SSH_HASH_SHA1)) == NULL)
+    return -1;
 
-  if (! EVP_Digest(data, data_len, out, &digest_len, EVP_sha1(), NULL)) {
+  if (! EVP_Digest(data, data_len, out, &digest_len, md, NULL)) {
     ssh_set_error("error generating sha1 hash");
     return -1;
   }
@@ -24,8 +31,78 @@ int crypto_sha1_single(enum SSH_HASH_TYPE type, void *out, uint32_t *out_len, co
 
 int crypto_sha1_get_block_size(enum SSH_HASH_TYPE type)
 {
-  int ret = EVP_MD_block_size(EVP_sha1());
+  EVP_MD *md;
+
+  if ((md = crypto_evp_get_md(SSH_HASH_SHA1)) == NULL)
+    return -1;
+
+  int ret = EVP_MD_get_block_size(md);
   if (ret < 0)
     ssh_set_error("invalid sha1 hash block size");
   return ret;
 }
+
+struct CRYPTO_HASH_CTX *crypto_sha1_new(enum SSH_HASH_TYPE type)
+{
+  EVP_MD *md;
+  EVP_MD_CTX *ctx;
+
+  if ((md = crypto_evp_get_md(SSH_HASH_SHA1)) == NULL)
+    return NULL;
+
+  if ((ctx = EVP_MD_CTX_new()) == NULL) {
+    ssh_set_error("out of memory");
+    return NULL;
+  }
+  if (EVP_DigestInit_ex2(ctx, md, NULL) == 0) {
+    EVP_MD_CTX_free(ctx);
+    ssh_set_error("error initializing sha1 hash");
+    return NULL;
+  }
+
+  return (struct CRYPTO_HASH_CTX *) ctx;
+}
+
+int crypto_sha1_copy_ctx(struct CRYPTO_HASH_CTX *crypto_to_ctx, const struct CRYPTO_HASH_CTX *crypto_from_ctx)
+{
+  EVP_MD_CTX *to_ctx = TO_MD_CTX(crypto_to_ctx);
+  const EVP_MD_CTX *from_ctx = TO_MD_CTX(crypto_from_ctx);
+
+  if (EVP_MD_CTX_copy_ex(to_ctx, from_ctx) == 0) {
+    ssh_set_error("error copying sha1 hash");
+    return -1;
+  }
+  return 0;
+}
+
+int crypto_sha1_update(struct CRYPTO_HASH_CTX *crypto_ctx, const void *data, uint32_t len)
+{
+  EVP_MD_CTX *ctx = TO_MD_CTX(crypto_ctx);
+
+  if (EVP_DigestUpdate(ctx, data, len) == 0) {
+    ssh_set_error("error updating sha1 hash");
+    return -1;
+  }
+  return 0;
+}
+
+int crypto_sha1_final(struct CRYPTO_HASH_CTX *crypto_ctx, void *out, uint32_t *out_len)
+{
+  EVP_MD_CTX *ctx = TO_MD_CTX(crypto_ctx);
+  unsigned int digest_len;
+
+  if (EVP_DigestFinal_ex(ctx, out, &digest_len) == 0) {
+    ssh_set_error("error finalizing sha1 hash");
+    return -1;
+  }
+  if (out_len != NULL)
+    *out_len = digest_len;
+  return 0;
+}
+
+void crypto_sha1_free(struct CRYPTO_HASH_CTX *crypto_ctx)
+{
+  EVP_MD_CTX *ctx = TO_MD_CTX(crypto_ctx);
+
+  EVP_MD_CTX_free(ctx);
+}
@@ -6,17 +6,19 @@
 #include <openssl/evp.h>
 
 #include "crypto/sha2.h"
+#include "crypto/evp.h"
 
 #include "common/error.h"
-#include "common/alloc.h"
 
 #define TO_MD_CTX(ctx) ((EVP_MD_CTX *) (ctx))
 
 static const EVP_MD *get_hash_evp(enum SSH_HASH_TYPE type)
 {
   switch (type) {
-  case SSH_HASH_SHA2_256: return EVP_sha256();
-  case SSH_HASH_SHA2_512: return EVP_sha512();
+  case SSH_HASH_SHA2_256:
+  case SSH_HASH_SHA2_512:
+    return crypto_evp_get_md(type);
+
   default:
     ssh_set_error("invalid sha2 algorithm: %d", type);
     return NULL;
@@ -47,7 +49,7 @@ int crypto_sha2_get_block_size(enum SSH_HASH_TYPE type)
   if ((evp = get_hash_evp(type)) == NULL)
     return -1;
 
-  int ret = EVP_MD_block_size(evp);
+  int ret = EVP_MD_get_block_size(evp);
   if (ret < 0)
     ssh_set_error("invalid sha2 hash block size");
   return ret;
@@ -61,11 +63,12 @@ struct CRYPTO_HASH_CTX *crypto_sha2_new(enum SSH_HASH_TYPE type)
   if ((evp = get_hash_evp(type)) == NULL)
     return NULL;
 
-  if ((ctx = ssh_alloc(sizeof(EVP_MD_CTX))) == NULL)
+  if ((ctx = EVP_MD_CTX_new()) == NULL) {
+    ssh_set_error("out of memory");
     return NULL;
-  EVP_MD_CTX_init(ctx);
-  if (EVP_DigestInit_ex(ctx, evp, NULL) == 0) {
-    ssh_free(ctx);
+  }
+  if (EVP_DigestInit_ex2(ctx, evp, NULL) == 0) {
+    EVP_MD_CTX_free(ctx);
     ssh_set_error("error initializing sha2 hash");
     return NULL;
   }
@@ -114,6 +117,5 @@ void crypto_sha2_free(struct CRYPTO_HASH_CTX *crypto_ctx)
 {
   EVP_MD_CTX *ctx = TO_MD_CTX(crypto_ctx);
 
-  EVP_MD_CTX_cleanup(ctx);
-  ssh_free(ctx);
+  EVP_MD_CTX_free(ctx);
 }
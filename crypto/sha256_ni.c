@@ -0,0 +1,147 @@
+/* sha256_ni.c
+ *
+ * SHA-256 with the x86 SHA extensions.  Callers must check for
+ * CRYPTO_CPU_SHANI before using these functions.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "crypto/sha256_ni.h"
+#include "crypto/sha256_ni_i.h"
+
+#include "crypto/cpu.h"
+
+#if CRYPTO_CPU_X86
+
+const uint32_t crypto_sha256_ni_k[64] __attribute__((aligned(16))) = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+__attribute__((target("sha,sse4.1")))
+static void sha256_ni_blocks(uint32_t *state, const uint8_t *data, size_t num_blocks)
+{
+  const __m128i bswap_mask = SHA256_NI_BSWAP_MASK;
+  __m128i abef, cdgh, abef_save, cdgh_save, msg;
+  __m128i w0, w1, w2, w3;
+  int i;
+
+  sha256_ni_load_state(state, &abef, &cdgh);
+
+  while (num_blocks-- > 0) {
+    abef_save = abef;
+    cdgh_save = cdgh;
+
+    w0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data +  0)), bswap_mask);
+    w1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 16)), bswap_mask);
+    w2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 32)), bswap_mask);
+    w3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (data + 48)), bswap_mask);
+    SHA256_ROUNDS4(0, w0);
+    SHA256_ROUNDS4(1, w1);
+    SHA256_ROUNDS4(2, w2);
+    SHA256_ROUNDS4(3, w3);
+
+    for (i = 4; i < 16; i += 4) {
+      SHA256_SCHEDULE(w0, w1, w2, w3);
+      SHA256_ROUNDS4(i, w0);
+      SHA256_SCHEDULE(w1, w2, w3, w0);
+      SHA256_ROUNDS4(i+1, w1);
+      SHA256_SCHEDULE(w2, w3, w0, w1);
+      SHA256_ROUNDS4(i+2, w2);
+      SHA256_SCHEDULE(w3, w0, w1, w2);
+      SHA256_ROUNDS4(i+3, w3);
+    }
+
+    abef = _mm_add_epi32(abef, abef_save);
+    cdgh = _mm_add_epi32(cdgh, cdgh_save);
+    data += CRYPTO_SHA256_BLOCK_SIZE;
+  }
+
+  sha256_ni_store_state(state, abef, cdgh);
+}
+
+#else /* CRYPTO_CPU_X86 */
+
+static void sha256_ni_blocks(uint32_t *state, const uint8_t *data, size_t num_blocks)
+{
+  abort();
+}
+
+#endif /* CRYPTO_CPU_X86 */
+
+void crypto_sha256_ni_init(struct CRYPTO_SHA256_NI_CTX *ctx)
+{
+  static const uint32_t init_state[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+  };
+
+  memcpy(ctx->state, init_state, sizeof(init_state));
+  ctx->len = 0;
+  ctx->buf_len = 0;
+}
+
+void crypto_sha256_ni_update(struct CRYPTO_SHA256_NI_CTX *ctx, const void *data, size_t len)
+{
+  const uint8_t *p = data;
+  size_t n;
+
+  ctx->len += len;
+
+  if (ctx->buf_len > 0) {
+    n = CRYPTO_SHA256_BLOCK_SIZE - ctx->buf_len;
+    if (n > len)
+      n = len;
+    memcpy(ctx->buf + ctx->buf_len, p, n);
+    ctx->buf_len += n;
+    p += n;
+    len -= n;
+    if (ctx->buf_len < CRYPTO_SHA256_BLOCK_SIZE)
+      return;
+    sha256_ni_blocks(ctx->state, ctx->buf, 1);
+    ctx->buf_len = 0;
+  }
+
+  if (len >= CRYPTO_SHA256_BLOCK_SIZE) {
+    n = len / CRYPTO_SHA256_BLOCK_SIZE;
+    sha256_ni_blocks(ctx->state, p, n);
+    p += n * CRYPTO_SHA256_BLOCK_SIZE;
+    len -= n * CRYPTO_SHA256_BLOCK_SIZE;
+  }
+
+  if (len > 0) {
+    memcpy(ctx->buf, p, len);
+    ctx->buf_len = len;
+  }
+}
+
+void crypto_sha256_ni_final(struct CRYPTO_SHA256_NI_CTX *ctx, uint8_t *out)
+{
+  uint64_t bit_len = ctx->len * 8;
+  int i;
+
+  ctx->buf[ctx->buf_len++] = 0x80;
+  if (ctx->buf_len > CRYPTO_SHA256_BLOCK_SIZE - 8) {
+    memset(ctx->buf + ctx->buf_len, 0, CRYPTO_SHA256_BLOCK_SIZE - ctx->buf_len);
+    sha256_ni_blocks(ctx->state, ctx->buf, 1);
+    ctx->buf_len = 0;
+  }
+  memset(ctx->buf + ctx->buf_len, 0, CRYPTO_SHA256_BLOCK_SIZE - 8 - ctx->buf_len);
+  for (i = 0; i < 8; i++)
+    ctx->buf[CRYPTO_SHA256_BLOCK_SIZE - 1 - i] = (uint8_t) (bit_len >> (8*i));
+  sha256_ni_blocks(ctx->state, ctx->buf, 1);
+
+  for (i = 0; i < 8; i++) {
+    out[4*i  ] = (uint8_t) (ctx->state[i] >> 24);
+    out[4*i+1] = (uint8_t) (ctx->state[i] >> 16);
+    out[4*i+2] = (uint8_t) (ctx->state[i] >> 8);
+    out[4*i+3] = (uint8_t) ctx->state[i];
+  }
+}
@@ -0,0 +1,23 @@
+/* sha256_ni.h */
+
+#ifndef CRYPTO_SHA256_NI_H_FILE
+#define CRYPTO_SHA256_NI_H_FILE
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define CRYPTO_SHA256_BLOCK_SIZE  64
+#define CRYPTO_SHA256_DIGEST_LEN  32
+
+struct CRYPTO_SHA256_NI_CTX {
+  uint32_t state[8];
+  uint64_t len;                    // total bytes hashed
+  uint8_t buf[CRYPTO_SHA256_BLOCK_SIZE];
+  uint32_t buf_len;
+};
+
+void crypto_sha256_ni_init(struct CRYPTO_SHA256_NI_CTX *ctx);
+void crypto_sha256_ni_update(struct CRYPTO_SHA256_NI_CTX *ctx, const void *data, size_t len);
+void crypto_sha256_ni_final(struct CRYPTO_SHA256_NI_CTX *ctx, uint8_t *out);
+
+#endif /* CRYPTO_SHA256_NI_H_FILE */
@@ -0,0 +1,59 @@
+/* sha256_ni_i.h
+ *
+ * Building blocks of the SHA-NI SHA-256 compression function, shared
+ * with the stitched AES-CTR/HMAC-SHA256 code.
+ */
+
+#ifndef CRYPTO_SHA256_NI_I_H_FILE
+#define CRYPTO_SHA256_NI_I_H_FILE
+
+#include <stdint.h>
+
+#include "crypto/cpu.h"
+
+#if CRYPTO_CPU_X86
+
+#include <immintrin.h>
+
+extern const uint32_t crypto_sha256_ni_k[64];
+
+#define SHA256_NI_BSWAP_MASK  _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL)
+
+/* the SHA instructions keep the state as ABEF/CDGH */
+__attribute__((target("sha,sse4.1")))
+static inline void sha256_ni_load_state(const uint32_t *state, __m128i *abef, __m128i *cdgh)
+{
+  __m128i tmp;
+
+  tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) state), 0xb1);         // CDAB
+  *cdgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) (state + 4)), 0x1b); // EFGH
+  *abef = _mm_alignr_epi8(tmp, *cdgh, 8);
+  *cdgh = _mm_blend_epi16(*cdgh, tmp, 0xf0);
+}
+
+__attribute__((target("sha,sse4.1")))
+static inline void sha256_ni_store_state(uint32_t *state, __m128i abef, __m128i cdgh)
+{
+  __m128i tmp;
+
+  tmp = _mm_shuffle_epi32(abef, 0x1b);    // FEBA
+  cdgh = _mm_shuffle_epi32(cdgh, 0xb1);   // DCHG
+  _mm_storeu_si128((__m128i *) state, _mm_blend_epi16(tmp, cdgh, 0xf0));      // DCBA
+  _mm_storeu_si128((__m128i *) (state + 4), _mm_alignr_epi8(cdgh, tmp, 8));   // HGFE
+}
+
+/* 4 rounds with message vector 'w' (uses 'abef', 'cdgh' and 'msg') */
+#define SHA256_ROUNDS4(i, w)                                            \
+  do {                                                                  \
+    msg = _mm_add_epi32(w, _mm_load_si128((const __m128i *) (crypto_sha256_ni_k + 4*(i)))); \
+    cdgh = _mm_sha256rnds2_epu32(cdgh, abef, msg);                      \
+    abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(msg, 0x0e)); \
+  } while (0)
+
+/* next message vector, replacing w0 (w0..w3 are the last 4, oldest first) */
+#define SHA256_SCHEDULE(w0, w1, w2, w3)                                 \
+  w0 = _mm_sha256msg2_epu32(_mm_add_epi32(_mm_sha256msg1_epu32(w0, w1), _mm_alignr_epi8(w3, w2, 4)), w3)
+
+#endif /* CRYPTO_CPU_X86 */
+
+#endif /* CRYPTO_SHA256_NI_I_H_FILE */
@@ -0,0 +1,434 @@
+/* sha_mb.c
+ *
+ * Multi-buffer SHA-256 and SHA-512: hash several independent
+ * messages at the same time, one per SIMD lane.  A single SHA-2 hash
+ * is a serial chain of rounds; running 8 or 16 of them side by side
+ * uses the full vector width instead.
+ *
+ * Lanes per algorithm:
+ *
+ *            AVX2   AVX-512
+ *   SHA-256     8        16
+ *   SHA-512     4         8
+ *
+ * The compression functions are written with GCC vector extensions
+ * and compiled for each instruction set with the target attribute.
+ * Messages of different lengths can share a batch: each lane stops
+ * contributing when its message ends, but the batch runs until the
+ * longest one is done, so it's best to batch messages of similar
+ * size.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "crypto/sha_mb.h"
+
+#include "common/error.h"
+#include "crypto/cpu.h"
+
+#define MAX_BLOCK_SIZE CRYPTO_SHA_MB_BLOCK_MAX
+
+#if CRYPTO_CPU_X86
+
+#define TARGET(t) __attribute__((target(t)))
+
+// the 16 rounds of each step must be unrolled to keep the message
+// schedule in registers
+#define UNROLL _Pragma("GCC unroll 16")
+
+static const uint32_t sha256_k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static const uint64_t sha512_k[80] = {
+  0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
+  0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL, 0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL,
+  0xd807aa98a3030242ULL, 0x12835b0145706fbeULL, 0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+  0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL, 0xc19bf174cf692694ULL,
+  0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL, 0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+  0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+  0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL, 0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL,
+  0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL, 0x06ca6351e003826fULL, 0x142929670a0e6e70ULL,
+  0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+  0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+  0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL, 0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL,
+  0xd192e819d6ef5218ULL, 0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+  0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL, 0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL,
+  0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL, 0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL,
+  0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+  0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL,
+  0xca273eceea26619cULL, 0xd186b8c721c0c207ULL, 0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL,
+  0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL, 0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+  0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL, 0x431d67c49c100d4cULL,
+  0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL, 0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL,
+};
+
+#define ROTR32(x, n)  (((x) >> (n)) | ((x) << (32 - (n))))
+#define ROTR64(x, n)  (((x) >> (n)) | ((x) << (64 - (n))))
+
+#define CH(e, f, g)   (((e) & (f)) ^ (~(e) & (g)))
+#define MAJ(a, b, c)  (((a) & (b)) ^ ((a) & (c)) ^ ((b) & (c)))
+
+#define SHA256_S0(x)  (ROTR32(x, 2) ^ ROTR32(x, 13) ^ ROTR32(x, 22))
+#define SHA256_S1(x)  (ROTR32(x, 6) ^ ROTR32(x, 11) ^ ROTR32(x, 25))
+#define SHA256_s0(x)  (ROTR32(x, 7) ^ ROTR32(x, 18) ^ ((x) >> 3))
+#define SHA256_s1(x)  (ROTR32(x, 17) ^ ROTR32(x, 19) ^ ((x) >> 10))
+
+#define SHA512_S0(x)  (ROTR64(x, 28) ^ ROTR64(x, 34) ^ ROTR64(x, 39))
+#define SHA512_S1(x)  (ROTR64(x, 14) ^ ROTR64(x, 18) ^ ROTR64(x, 41))
+#define SHA512_s0(x)  (ROTR64(x, 1) ^ ROTR64(x, 8) ^ ((x) >> 7))
+#define SHA512_s1(x)  (ROTR64(x, 19) ^ ROTR64(x, 61) ^ ((x) >> 6))
+
+static inline uint32_t load_be32(const uint8_t *p)
+{
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return __builtin_bswap32(v);
+}
+
+static inline uint64_t load_be64(const uint8_t *p)
+{
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return __builtin_bswap64(v);
+}
+
+/*
+ * Compress one block per lane.  'state' holds each state word for
+ * all lanes (state[word][lane]), so each row loads into one vector.
+ */
+#define DEFINE_MB_COMPRESS(name, target, word_t, num_lanes, num_rounds, k, load_be, S0, S1, s0, s1) \
+  typedef word_t name##_vec __attribute__((vector_size(sizeof(word_t) * (num_lanes)))); \
+                                                                        \
+  TARGET(target)                                                        \
+  static void name(void *state_rows, const uint8_t *const *blocks)      \
+  {                                                                     \
+    word_t (*state)[CRYPTO_SHA_MB_MAX_LANES] = state_rows;              \
+    word_t words[16][num_lanes];                                        \
+    name##_vec w[16], v[8];                                             \
+    name##_vec a, b, c, d, e, f, g, h, t1, t2;                          \
+    int r, i, l;                                                        \
+                                                                        \
+    for (l = 0; l < (num_lanes); l++)                                   \
+      for (i = 0; i < 16; i++)                                          \
+        words[i][l] = load_be(blocks[l] + sizeof(word_t)*i);            \
+    for (i = 0; i < 16; i++)                                            \
+      memcpy(&w[i], words[i], sizeof(name##_vec));                      \
+    for (i = 0; i < 8; i++)                                             \
+      memcpy(&v[i], state[i], sizeof(name##_vec));                      \
+                                                                        \
+    a = v[0]; b = v[1]; c = v[2]; d = v[3];                             \
+    e = v[4]; f = v[5]; g = v[6]; h = v[7];                             \
+    for (r = 0; r < (num_rounds); r += 16) {                            \
+      UNROLL                                                            \
+      for (i = 0; i < 16; i++) {                                        \
+        if (r > 0)                                                      \
+          w[i] += s1(w[(i+14)%16]) + w[(i+9)%16] + s0(w[(i+1)%16]);     \
+        t1 = h + S1(e) + CH(e, f, g) + k[r+i] + w[i];                   \
+        t2 = S0(a) + MAJ(a, b, c);                                      \
+        h = g; g = f; f = e; e = d + t1;                                \
+        d = c; c = b; b = a; a = t1 + t2;                               \
+      }                                                                 \
+    }                                                                   \
+    v[0] += a; v[1] += b; v[2] += c; v[3] += d;                         \
+    v[4] += e; v[5] += f; v[6] += g; v[7] += h;                         \
+                                                                        \
+    for (i = 0; i < 8; i++)                                             \
+      memcpy(state[i], &v[i], sizeof(name##_vec));                      \
+  }
+
+DEFINE_MB_COMPRESS(sha256_mb_avx2,   "avx2",    uint32_t,  8, 64, sha256_k, load_be32, SHA256_S0, SHA256_S1, SHA256_s0, SHA256_s1)
+DEFINE_MB_COMPRESS(sha256_mb_avx512, "avx512f", uint32_t, 16, 64, sha256_k, load_be32, SHA256_S0, SHA256_S1, SHA256_s0, SHA256_s1)
+DEFINE_MB_COMPRESS(sha512_mb_avx2,   "avx2",    uint64_t,  4, 80, sha512_k, load_be64, SHA512_S0, SHA512_S1, SHA512_s0, SHA512_s1)
+DEFINE_MB_COMPRESS(sha512_mb_avx512, "avx512f", uint64_t,  8, 80, sha512_k, load_be64, SHA512_S0, SHA512_S1, SHA512_s0, SHA512_s1)
+
+#endif /* CRYPTO_CPU_X86 */
+
+typedef void (*mb_fn_compress)(void *state_rows, const uint8_t *const *blocks);
+
+struct MB_ALGO {
+  int block_size;
+  int word_size;
+  int digest_len;
+  int num_lanes;
+  mb_fn_compress compress;
+};
+
+static const uint32_t sha256_iv[8] = {
+  0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static const uint64_t sha512_iv[8] = {
+  0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL, 0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+  0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL, 0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL,
+};
+
+static int get_algo(enum SSH_HASH_TYPE type, struct MB_ALGO *algo)
+{
+#if CRYPTO_CPU_X86
+  int avx512 = crypto_cpu_has(CRYPTO_CPU_AVX512);
+
+  if (! avx512 && ! crypto_cpu_has(CRYPTO_CPU_AVX2))
+    return -1;
+
+  switch (type) {
+  case SSH_HASH_SHA2_256:
+    algo->block_size = 64;
+    algo->word_size = 4;
+    algo->digest_len = 32;
+    algo->num_lanes = (avx512) ? 16 : 8;
+    algo->compress = (avx512) ? sha256_mb_avx512 : sha256_mb_avx2;
+    return 0;
+
+  case SSH_HASH_SHA2_512:
+    algo->block_size = 128;
+    algo->word_size = 8;
+    algo->digest_len = 64;
+    algo->num_lanes = (avx512) ? 8 : 4;
+    algo->compress = (avx512) ? sha512_mb_avx512 : sha512_mb_avx2;
+    return 0;
+
+  default:
+    return -1;
+  }
+#else
+  return -1;
+#endif
+}
+
+/*
+ * Return the number of lanes for the hash type, or 0 if there's no
+ * multi-buffer implementation for it on this CPU.
+ */
+int crypto_sha_mb_get_lanes(enum SSH_HASH_TYPE type)
+{
+  struct MB_ALGO algo;
+
+  if (get_algo(type, &algo) < 0)
+    return 0;
+  return algo.num_lanes;
+}
+
+/* ------- lanes ------------------------- */
+
+struct MB_STATE_ROWS {
+  union {
+    uint32_t w32[8][CRYPTO_SHA_MB_MAX_LANES];
+    uint64_t w64[8][CRYPTO_SHA_MB_MAX_LANES];
+  } u;
+};
+
+struct MB_LANE {
+  const struct CRYPTO_SHA_MB_MSG *msg;
+  size_t num_blocks;               // including padding
+  size_t num_full;                 // blocks read directly from the message
+  uint8_t first[MAX_BLOCK_SIZE];   // first block, if the message has a prefix
+  uint8_t tail[2*MAX_BLOCK_SIZE];  // last partial block and padding
+};
+
+// copy message bytes [pos, pos+len), where the message is prefix||data
+static void msg_copy(const struct CRYPTO_SHA_MB_MSG *msg, uint8_t *out, size_t pos, size_t len)
+{
+  if (pos < msg->prefix_len) {
+    size_t n = msg->prefix_len - pos;
+    if (n > len)
+      n = len;
+    memcpy(out, msg->prefix + pos, n);
+    out += n;
+    pos += n;
+    len -= n;
+  }
+  if (len > 0)
+    memcpy(out, msg->data + pos - msg->prefix_len, len);
+}
+
+static void lane_setup(const struct MB_ALGO *algo, struct MB_LANE *lane, const struct CRYPTO_SHA_MB_MSG *msg, uint64_t init_len)
+{
+  size_t bs = algo->block_size;
+  size_t total = msg->prefix_len + msg->len;
+  size_t tail_len = total % bs;
+  size_t len_size = 2*algo->word_size;   // size of the length field
+  size_t tail_blocks = (tail_len + 1 + len_size <= bs) ? 1 : 2;
+  uint64_t bit_len = 8 * (init_len + total);
+  int i;
+
+  lane->msg = msg;
+  lane->num_full = total / bs;
+  lane->num_blocks = lane->num_full + tail_blocks;
+
+  if (lane->num_full > 0 && msg->prefix_len > 0)
+    msg_copy(msg, lane->first, 0, bs);
+
+  memset(lane->tail, 0, tail_blocks * bs);
+  msg_copy(msg, lane->tail, lane->num_full * bs, tail_len);
+  lane->tail[tail_len] = 0x80;
+  for (i = 0; i < 8; i++)
+    lane->tail[tail_blocks*bs - 1 - i] = (uint8_t) (bit_len >> (8*i));
+}
+
+static const uint8_t *lane_get_block(const struct MB_ALGO *algo, const struct MB_LANE *lane, size_t k)
+{
+  if (k >= lane->num_full)
+    return lane->tail + (k - lane->num_full) * algo->block_size;
+  if (k == 0 && lane->msg->prefix_len > 0)
+    return lane->first;
+  return lane->msg->data + k * algo->block_size - lane->msg->prefix_len;
+}
+
+static void rows_set_lane(const struct MB_ALGO *algo, struct MB_STATE_ROWS *rows, int l, const union CRYPTO_SHA_MB_STATE *state)
+{
+  int i;
+
+  for (i = 0; i < 8; i++) {
+    if (algo->word_size == 4)
+      rows->u.w32[i][l] = state->sha256[i];
+    else
+      rows->u.w64[i][l] = state->sha512[i];
+  }
+}
+
+static void rows_get_lane(const struct MB_ALGO *algo, const struct MB_STATE_ROWS *rows, int l, union CRYPTO_SHA_MB_STATE *state)
+{
+  int i;
+
+  for (i = 0; i < 8; i++) {
+    if (algo->word_size == 4)
+      state->sha256[i] = rows->u.w32[i][l];
+    else
+      state->sha512[i] = rows->u.w64[i][l];
+  }
+}
+
+static void state_to_digest(const struct MB_ALGO *algo, const union CRYPTO_SHA_MB_STATE *state, uint8_t *out)
+{
+  int i, j;
+
+  for (i = 0; i < 8; i++)
+    for (j = 0; j < algo->word_size; j++) {
+      if (algo->word_size == 4)
+        *out++ = (uint8_t) (state->sha256[i] >> (8*(3-j)));
+      else
+        *out++ = (uint8_t) (state->sha512[i] >> (8*(7-j)));
+    }
+}
+
+static void state_set_iv(const struct MB_ALGO *algo, union CRYPTO_SHA_MB_STATE *state)
+{
+  if (algo->word_size == 4)
+    memcpy(state->sha256, sha256_iv, sizeof(sha256_iv));
+  else
+    memcpy(state->sha512, sha512_iv, sizeof(sha512_iv));
+}
+
+/* ------- interface ------------------------- */
+
+/*
+ * Hash one block (in a single lane), starting from 'init' or from the
+ * IV if 'init' is NULL.  Used to precompute states shared by many
+ * messages, like the HMAC pads.
+ */
+int crypto_sha_mb_hash_block(enum SSH_HASH_TYPE type, const union CRYPTO_SHA_MB_STATE *init, const uint8_t *block,
+                             union CRYPTO_SHA_MB_STATE *out)
+{
+  static const uint8_t zero_block[MAX_BLOCK_SIZE];
+  const uint8_t *blocks[CRYPTO_SHA_MB_MAX_LANES];
+  struct MB_STATE_ROWS rows;
+  struct MB_ALGO algo;
+  int l;
+
+  if (get_algo(type, &algo) < 0) {
+    ssh_set_error("no multi-buffer implementation for hash type %d", type);
+    return -1;
+  }
+
+  if (init != NULL)
+    *out = *init;
+  else
+    state_set_iv(&algo, out);
+
+  memset(&rows, 0, sizeof(rows));
+  rows_set_lane(&algo, &rows, 0, out);
+  blocks[0] = block;
+  for (l = 1; l < algo.num_lanes; l++)
+    blocks[l] = zero_block;
+  algo.compress(&rows, blocks);
+  rows_get_lane(&algo, &rows, 0, out);
+  return 0;
+}
+
+/*
+ * Hash each message (prefix followed by data) starting from 'init',
+ * the state after hashing 'init_len' bytes (a multiple of the block
+ * size), or from the IV if 'init' is NULL.
+ */
+int crypto_sha_mb_hash(enum SSH_HASH_TYPE type, const union CRYPTO_SHA_MB_STATE *init, uint64_t init_len,
+                       struct CRYPTO_SHA_MB_MSG *msgs, int num_msgs)
+{
+  static const uint8_t zero_block[MAX_BLOCK_SIZE];
+  struct MB_LANE lanes[CRYPTO_SHA_MB_MAX_LANES];
+  const uint8_t *blocks[CRYPTO_SHA_MB_MAX_LANES];
+  struct MB_STATE_ROWS rows;
+  union CRYPTO_SHA_MB_STATE state;
+  struct MB_ALGO algo;
+  int first, n, l;
+
+  if (get_algo(type, &algo) < 0) {
+    ssh_set_error("no multi-buffer implementation for hash type %d", type);
+    return -1;
+  }
+  if (init != NULL)
+    state = *init;
+  else
+    state_set_iv(&algo, &state);
+
+  for (first = 0; first < num_msgs; first += n) {
+    size_t max_blocks = 0;
+    size_t k;
+
+    n = num_msgs - first;
+    if (n > algo.num_lanes)
+      n = algo.num_lanes;
+
+    memset(&rows, 0, sizeof(rows));
+    for (l = 0; l < n; l++) {
+      if (msgs[first+l].prefix_len > algo.block_size) {
+        ssh_set_error("multi-buffer hash prefix too large");
+        return -1;
+      }
+      lane_setup(&algo, &lanes[l], &msgs[first+l], init_len);
+      rows_set_lane(&algo, &rows, l, &state);
+      if (max_blocks < lanes[l].num_blocks)
+        max_blocks = lanes[l].num_blocks;
+    }
+
+    for (k = 0; k < max_blocks; k++) {
+      for (l = 0; l < algo.num_lanes; l++) {
+        if (l < n && k < lanes[l].num_blocks)
+          blocks[l] = lane_get_block(&algo, &lanes[l], k);
+        else
+          blocks[l] = zero_block;
+      }
+      algo.compress(&rows, blocks);
+
+      // lanes whose message ended with this block are done
+      for (l = 0; l < n; l++) {
+        if (lanes[l].num_blocks == k+1) {
+          union CRYPTO_SHA_MB_STATE out;
+          rows_get_lane(&algo, &rows, l, &out);
+          state_to_digest(&algo, &out, msgs[first+l].digest);
+        }
+      }
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,34 @@
+/* sha_mb.h */
+
+#ifndef CRYPTO_SHA_MB_H_FILE
+#define CRYPTO_SHA_MB_H_FILE
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "crypto/algorithms.h"
+
+#define CRYPTO_SHA_MB_MAX_LANES  16
+#define CRYPTO_SHA_MB_BLOCK_MAX  128
+#define CRYPTO_SHA_MB_DIGEST_MAX 64
+
+union CRYPTO_SHA_MB_STATE {
+  uint32_t sha256[8];
+  uint64_t sha512[8];
+};
+
+struct CRYPTO_SHA_MB_MSG {
+  const uint8_t *prefix;           // hashed before 'data', at most one block
+  size_t prefix_len;
+  const uint8_t *data;
+  size_t len;
+  uint8_t *digest;                 // output
+};
+
+int crypto_sha_mb_get_lanes(enum SSH_HASH_TYPE type);
+int crypto_sha_mb_hash_block(enum SSH_HASH_TYPE type, const union CRYPTO_SHA_MB_STATE *init, const uint8_t *block,
+                             union CRYPTO_SHA_MB_STATE *out);
+int crypto_sha_mb_hash(enum SSH_HASH_TYPE type, const union CRYPTO_SHA_MB_STATE *init, uint64_t init_len,
+                       struct CRYPTO_SHA_MB_MSG *msgs, int num_msgs);
+
+#endif /* CRYPTO_SHA_MB_H_FILE */
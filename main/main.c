@@ -13,8 +13,10 @@
 #include "main/term.h"
 #include "main/session.h"
 #include "ssh/ssh.h"
+#include "common/alloc.h"
 
 #define HOST_KEY_STORE_FILE "host_keys.store"
+#define ALGO_BENCH_CACHE_FILE "algo_bench.cache"
 
 static int read_password(const char *hostname, const char *username, char *password, size_t max_len, int retry)
 {
@@ -93,7 +95,12 @@ int main(int argc, char **argv)
   char *port;
   struct SSH_CHAN_CONFIG *chan_cfg;
   struct SSH_CONN_CONFIG conn_cfg;
+  struct SSH_RESOLVER_CONFIG resolver_cfg;
+  struct SSH_TRANSPORT_EMU_CONFIG net_emu_cfg;
   struct SSH_CONN *conn;
+  const char *net_emu;
+  const char *keepalive;
+  int ret = 0;
 
   if (argc < 2) {
     fprintf(stderr, "USAGE: %s [username@]server [port]\n", argv[0]);
@@ -109,6 +116,19 @@ int main(int argc, char **argv)
     return 1;
   }
 
+  // resolve the server while doing the rest of the setup
+  resolver_cfg.num_threads = 0;
+  resolver_cfg.positive_ttl = 0;
+  resolver_cfg.negative_ttl = 0;
+  resolver_cfg.hosts_file = getenv("EESSH_HOSTS_FILE");
+  if (ssh_resolver_set_config(&resolver_cfg) < 0
+      || ssh_resolver_prefetch(server, (port != NULL) ? port : "22") < 0)
+    ssh_log("WARNING: %s\n", ssh_get_error());
+
+  // order ciphers and MACs by speed on this machine
+  if (getenv("EESSH_ALGO_BENCH") != NULL && ssh_algo_bench_run(ALGO_BENCH_CACHE_FILE) < 0)
+    ssh_log("WARNING: error measuring algorithms: %s\n", ssh_get_error());
+
   // connection info
   conn_cfg.server = server;
   conn_cfg.port = port;
@@ -117,19 +137,41 @@ int main(int argc, char **argv)
   conn_cfg.version_comments = NULL;
   conn_cfg.server_identity_checker = check_server_identity;
   conn_cfg.password_reader = read_password;
+  conn_cfg.rate_limit = 0;
+  conn_cfg.transport = (getenv("EESSH_IO_URING") != NULL) ? SSH_TRANSPORT_IO_URING : SSH_TRANSPORT_SOCKET;
+  conn_cfg.net_emu = NULL;
+  conn_cfg.keep_alive_idle = 0;
+  conn_cfg.fast_open = (getenv("EESSH_FAST_OPEN") != NULL);
+  conn_cfg.check_allocs = (getenv("EESSH_CHECK_ALLOCS") != NULL);
+  conn_cfg.keepalive_interval = 0;
+  if ((keepalive = getenv("EESSH_KEEPALIVE")) != NULL)
+    conn_cfg.keepalive_interval = atoi(keepalive);
+  if ((net_emu = getenv("EESSH_NET_EMU")) != NULL) {
+    if (ssh_transport_emu_parse_config(&net_emu_cfg, net_emu) < 0) {
+      fprintf(stderr, "ERROR: bad EESSH_NET_EMU: %s\n", ssh_get_error());
+      return 1;
+    }
+    conn_cfg.net_emu = &net_emu_cfg;
+  }
 
   // connect
   conn = ssh_conn_open(&conn_cfg);
   if (conn == NULL) {
     fprintf(stderr, "Error connecting: %s\n", ssh_get_error());
+    ret = 1;
   } else {
     ssh_log("- connected!\n");
 
-    if (ssh_conn_run(conn, 1, chan_cfg) < 0)
+    if (ssh_conn_run(conn, 1, chan_cfg) < 0) {
       fprintf(stderr, "Error: %s\n", ssh_get_error());
+      ret = 1;
+    }
     ssh_conn_close(conn);
   }
-  
+
+#if DEBUG_ALLOC
+  ssh_alloc_dump_stats();
+#endif
   ssh_deinit();
-  return 0;
+  return ret;
 }
@@ -0,0 +1,1033 @@
+/* predict.c
+ *
+ * Predictive local echo for interactive sessions.
+ *
+ * All output sent to the terminal goes through a simple model of the
+ * terminal (character grid, cursor, scroll region and a few modes),
+ * so we know what the screen looks like after the server output.
+ *
+ * Keys typed by the user that edit the current line (printable
+ * characters, backspace and left/right arrows) are applied to a
+ * predicted copy of the line, which is drawn right away with the
+ * unconfirmed characters underlined.  Before any server output is
+ * written, the predicted characters are replaced by what the server
+ * last drew there; after it's written, the server's line is compared
+ * against the line predicted after each key, to find how many keys
+ * the server has echoed.  The keys still pending are drawn again on
+ * top of the new server state.
+ *
+ * Predictions are only drawn on a line after the server has echoed a
+ * predicted key on it, so nothing is shown at password prompts.  A
+ * wrong prediction or an unknown key (like Enter or the up arrow)
+ * stops the predictions until the server output catches up.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "main/predict.h"
+
+#include "common/alloc.h"
+#include "common/error.h"
+
+#define PREDICT_MAX_SIZE     1024      // max terminal width and height
+#define PREDICT_MAX_LEN      256       // max length of the predicted line
+#define PREDICT_MAX_STATES   64        // max keys pending confirmation, plus one
+#define PREDICT_MAX_PARAMS   16
+#define PREDICT_TIMEOUT      2000      // ms to wait for the server to echo a key
+
+#define CELL_BLANK  ' '
+#define CELL_OTHER  0x01               // non-ASCII character
+
+enum PARSER_STATE {
+  PARSER_GROUND,
+  PARSER_ESC,
+  PARSER_ESC_SKIP,                     // skip one byte (charset designation)
+  PARSER_CSI,
+  PARSER_STRING,                       // OSC, DCS, etc., until BEL or ST
+  PARSER_STRING_ESC,
+};
+
+enum KEY_TYPE {
+  KEY_CHAR,
+  KEY_BACKSPACE,
+  KEY_LEFT,
+  KEY_RIGHT,
+  KEY_OTHER,
+};
+
+struct PREDICT_LINE {
+  int len;
+  int cursor;
+  uint8_t text[PREDICT_MAX_LEN];
+};
+
+struct PREDICT_TERM {
+  int width;
+  int height;
+  uint8_t *screen;
+  uint8_t *saved_screen;               // main screen while the alternate screen is active
+  int alt_screen;
+  int row;
+  int col;
+  int wrap_pending;                    // last column written, next char goes to the next line
+  int saved_row;
+  int saved_col;
+  int scroll_top;
+  int scroll_bottom;
+  int insert_mode;
+  int origin_mode;
+  int underline;
+  int reliable;                        // model matches the screen
+
+  // output parser
+  enum PARSER_STATE state;
+  int params[PREDICT_MAX_PARAMS];
+  int num_params;
+  uint8_t private_marker;
+  uint8_t intermediate;
+  uint32_t utf8_char;
+  int utf8_left;
+};
+
+struct PREDICT {
+  struct PREDICT_TERM term;
+
+  int row;                             // predicted line position
+  int base_col;
+  int confirmed;                       // server echoed a predicted key on this line
+  int frozen;                          // don't predict until the server output catches up
+  int drawn_len;                       // predicted chars drawn on the screen (0 if none)
+  uint64_t pending_time;               // when the oldest pending key was predicted
+
+  // line after each key, lines[0] is the server state
+  struct PREDICT_LINE lines[PREDICT_MAX_STATES];
+  int num_lines;
+};
+
+static struct PREDICT *pred;
+
+static uint64_t get_time_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* ------- terminal model ------------------- */
+
+static uint8_t *term_cell(struct PREDICT_TERM *term, int row, int col)
+{
+  return term->screen + (size_t) row * term->width + col;
+}
+
+static void term_clear_cells(struct PREDICT_TERM *term, int row, int col_start, int col_end)
+{
+  if (col_start < col_end)
+    memset(term_cell(term, row, col_start), CELL_BLANK, col_end - col_start);
+}
+
+static void term_clear_rows(struct PREDICT_TERM *term, int row_start, int row_end)
+{
+  if (row_start < row_end)
+    memset(term_cell(term, row_start, 0), CELL_BLANK, (size_t) (row_end - row_start) * term->width);
+}
+
+static void term_scroll_up(struct PREDICT_TERM *term, int top, int bottom, int n)
+{
+  if (n > bottom - top + 1)
+    n = bottom - top + 1;
+  memmove(term_cell(term, top, 0), term_cell(term, top + n, 0), (size_t) (bottom - top + 1 - n) * term->width);
+  term_clear_rows(term, bottom + 1 - n, bottom + 1);
+}
+
+static void term_scroll_down(struct PREDICT_TERM *term, int top, int bottom, int n)
+{
+  if (n > bottom - top + 1)
+    n = bottom - top + 1;
+  memmove(term_cell(term, top + n, 0), term_cell(term, top, 0), (size_t) (bottom - top + 1 - n) * term->width);
+  term_clear_rows(term, top, top + n);
+}
+
+static void term_reset(struct PREDICT_TERM *term)
+{
+  term_clear_rows(term, 0, term->height);
+  term->alt_screen = 0;
+  term->row = term->col = 0;
+  term->wrap_pending = 0;
+  term->saved_row = term->saved_col = 0;
+  term->scroll_top = 0;
+  term->scroll_bottom = term->height - 1;
+  term->insert_mode = 0;
+  term->origin_mode = 0;
+  term->underline = 0;
+  term->reliable = 1;
+  term->state = PARSER_GROUND;
+  term->utf8_left = 0;
+}
+
+static void term_set_cursor(struct PREDICT_TERM *term, int row, int col)
+{
+  term->row = (row < 0) ? 0 : (row >= term->height) ? term->height - 1 : row;
+  term->col = (col < 0) ? 0 : (col >= term->width) ? term->width - 1 : col;
+  term->wrap_pending = 0;
+}
+
+static void term_line_feed(struct PREDICT_TERM *term)
+{
+  if (term->row == term->scroll_bottom)
+    term_scroll_up(term, term->scroll_top, term->scroll_bottom, 1);
+  else if (term->row < term->height - 1)
+    term->row++;
+}
+
+static void term_reverse_line_feed(struct PREDICT_TERM *term)
+{
+  if (term->row == term->scroll_top)
+    term_scroll_down(term, term->scroll_top, term->scroll_bottom, 1);
+  else if (term->row > 0)
+    term->row--;
+}
+
+static void term_set_alt_screen(struct PREDICT_TERM *term, int enable)
+{
+  size_t screen_size = (size_t) term->width * term->height;
+
+  if (enable == term->alt_screen)
+    return;
+  if (enable) {
+    memcpy(term->saved_screen, term->screen, screen_size);
+    term_clear_rows(term, 0, term->height);
+  } else {
+    memcpy(term->screen, term->saved_screen, screen_size);
+  }
+  term->alt_screen = enable;
+}
+
+/*
+ * Display width of a non-ASCII character: 0 for combining
+ * characters, 2 for East Asian wide characters and emoji, 1 for the
+ * rest.
+ */
+static int get_char_width(uint32_t c)
+{
+  if ((c >= 0x0300 && c <= 0x036f) || (c >= 0x1ab0 && c <= 0x1aff) || (c >= 0x1dc0 && c <= 0x1dff)
+      || (c >= 0x200b && c <= 0x200f) || (c >= 0x20d0 && c <= 0x20ff)
+      || (c >= 0xfe00 && c <= 0xfe0f) || (c >= 0xfe20 && c <= 0xfe2f))
+    return 0;
+  if ((c >= 0x1100 && c <= 0x115f) || (c >= 0x2e80 && c <= 0xa4cf) || (c >= 0xac00 && c <= 0xd7a3)
+      || (c >= 0xf900 && c <= 0xfaff) || (c >= 0xfe30 && c <= 0xfe4f) || (c >= 0xff00 && c <= 0xff60)
+      || (c >= 0xffe0 && c <= 0xffe6) || (c >= 0x1f300 && c <= 0x1f64f) || (c >= 0x1f900 && c <= 0x1f9ff)
+      || (c >= 0x20000 && c <= 0x3fffd))
+    return 2;
+  return 1;
+}
+
+static void term_print(struct PREDICT_TERM *term, uint8_t cell, int width)
+{
+  int i;
+
+  if (width == 0)
+    return;
+  if (term->wrap_pending || term->col + width > term->width) {
+    term->col = 0;
+    term->wrap_pending = 0;
+    term_line_feed(term);
+  }
+  if (term->insert_mode)
+    memmove(term_cell(term, term->row, term->col + width), term_cell(term, term->row, term->col), term->width - term->col - width);
+  for (i = 0; i < width; i++)
+    *term_cell(term, term->row, term->col + i) = cell;
+  if (term->col + width == term->width) {
+    term->col = term->width - 1;
+    term->wrap_pending = 1;
+  } else {
+    term->col += width;
+  }
+}
+
+static void term_control(struct PREDICT_TERM *term, uint8_t c)
+{
+  switch (c) {
+  case '\r':
+    term->col = 0;
+    term->wrap_pending = 0;
+    break;
+
+  case '\n':
+  case '\v':
+  case '\f':
+    term_line_feed(term);
+    term->wrap_pending = 0;
+    break;
+
+  case '\b':
+    if (term->col > 0 && ! term->wrap_pending)
+      term->col--;
+    term->wrap_pending = 0;
+    break;
+
+  case '\t':
+    term->col = (term->col / 8 + 1) * 8;
+    if (term->col >= term->width)
+      term->col = term->width - 1;
+    term->wrap_pending = 0;
+    break;
+  }
+}
+
+static int get_param(struct PREDICT_TERM *term, int index, int default_value)
+{
+  if (index >= term->num_params || term->params[index] == 0)
+    return default_value;
+  return term->params[index];
+}
+
+static void term_set_mode(struct PREDICT_TERM *term, int enable)
+{
+  int i;
+
+  for (i = 0; i < term->num_params; i++) {
+    if (term->private_marker == 0) {
+      if (term->params[i] == 4)
+        term->insert_mode = enable;
+      continue;
+    }
+    if (term->private_marker != '?')
+      continue;
+    switch (term->params[i]) {
+    case 6:
+      term->origin_mode = enable;
+      term_set_cursor(term, (enable) ? term->scroll_top : 0, 0);
+      break;
+
+    case 47:
+    case 1047:
+      term_set_alt_screen(term, enable);
+      break;
+
+    case 1049:
+      if (enable) {
+        term->saved_row = term->row;
+        term->saved_col = term->col;
+        term_set_alt_screen(term, 1);
+      } else {
+        term_set_alt_screen(term, 0);
+        term_set_cursor(term, term->saved_row, term->saved_col);
+      }
+      break;
+    }
+  }
+}
+
+static void term_set_attributes(struct PREDICT_TERM *term)
+{
+  int i;
+
+  if (term->num_params == 0)
+    term->underline = 0;
+  for (i = 0; i < term->num_params; i++) {
+    switch (term->params[i]) {
+    case 0:  term->underline = 0; break;
+    case 4:  term->underline = 1; break;
+    case 24: term->underline = 0; break;
+
+    case 38:
+    case 48:
+    case 58:
+      // skip color arguments
+      if (i + 1 < term->num_params)
+        i += (term->params[i+1] == 5) ? 2 : (term->params[i+1] == 2) ? 4 : 1;
+      break;
+    }
+  }
+}
+
+static void term_csi(struct PREDICT_TERM *term, uint8_t final)
+{
+  int n = get_param(term, 0, 1);
+  int top = (term->row >= term->scroll_top) ? term->scroll_top : 0;
+  int bottom = (term->row <= term->scroll_bottom) ? term->scroll_bottom : term->height - 1;
+
+  if (term->intermediate != 0) {
+    if (term->intermediate == '!' && final == 'p') {
+      // soft reset
+      term->insert_mode = 0;
+      term->origin_mode = 0;
+      term->scroll_top = 0;
+      term->scroll_bottom = term->height - 1;
+    }
+    return;
+  }
+  if (term->private_marker != 0 && final != 'h' && final != 'l')
+    return;
+
+  switch (final) {
+  case 'A': term_set_cursor(term, (term->row - n < top) ? top : term->row - n, term->col); break;
+  case 'B': term_set_cursor(term, (term->row + n > bottom) ? bottom : term->row + n, term->col); break;
+  case 'C': term_set_cursor(term, term->row, term->col + n); break;
+  case 'D': term_set_cursor(term, term->row, term->col - n); break;
+  case 'E': term_set_cursor(term, (term->row + n > bottom) ? bottom : term->row + n, 0); break;
+  case 'F': term_set_cursor(term, (term->row - n < top) ? top : term->row - n, 0); break;
+  case 'G':
+  case '`': term_set_cursor(term, term->row, n - 1); break;
+  case 'd': term_set_cursor(term, n - 1 + ((term->origin_mode) ? term->scroll_top : 0), term->col); break;
+
+  case 'H':
+  case 'f':
+    term_set_cursor(term, get_param(term, 0, 1) - 1 + ((term->origin_mode) ? term->scroll_top : 0), get_param(term, 1, 1) - 1);
+    break;
+
+  case 'J':
+    switch (get_param(term, 0, 0)) {
+    case 0:
+      term_clear_cells(term, term->row, term->col, term->width);
+      term_clear_rows(term, term->row + 1, term->height);
+      break;
+    case 1:
+      term_clear_rows(term, 0, term->row);
+      term_clear_cells(term, term->row, 0, term->col + 1);
+      break;
+    default:
+      term_clear_rows(term, 0, term->height);
+      term->reliable = 1;
+      break;
+    }
+    break;
+
+  case 'K':
+    switch (get_param(term, 0, 0)) {
+    case 0:  term_clear_cells(term, term->row, term->col, term->width); break;
+    case 1:  term_clear_cells(term, term->row, 0, term->col + 1); break;
+    default: term_clear_cells(term, term->row, 0, term->width); break;
+    }
+    break;
+
+  case 'X':
+    term_clear_cells(term, term->row, term->col, (term->col + n > term->width) ? term->width : term->col + n);
+    break;
+
+  case 'P':
+    if (n > term->width - term->col)
+      n = term->width - term->col;
+    memmove(term_cell(term, term->row, term->col), term_cell(term, term->row, term->col + n), term->width - term->col - n);
+    term_clear_cells(term, term->row, term->width - n, term->width);
+    break;
+
+  case '@':
+    if (n > term->width - term->col)
+      n = term->width - term->col;
+    memmove(term_cell(term, term->row, term->col + n), term_cell(term, term->row, term->col), term->width - term->col - n);
+    term_clear_cells(term, term->row, term->col, term->col + n);
+    break;
+
+  case 'L':
+    if (term->row >= term->scroll_top && term->row <= term->scroll_bottom)
+      term_scroll_down(term, term->row, term->scroll_bottom, n);
+    break;
+
+  case 'M':
+    if (term->row >= term->scroll_top && term->row <= term->scroll_bottom)
+      term_scroll_up(term, term->row, term->scroll_bottom, n);
+    break;
+
+  case 'S':
+    term_scroll_up(term, term->scroll_top, term->scroll_bottom, n);
+    break;
+
+  case 'T':
+    if (term->num_params <= 1)
+      term_scroll_down(term, term->scroll_top, term->scroll_bottom, n);
+    break;
+
+  case 'r':
+    top = get_param(term, 0, 1) - 1;
+    bottom = get_param(term, 1, term->height) - 1;
+    if (bottom >= term->height)
+      bottom = term->height - 1;
+    if (top < bottom) {
+      term->scroll_top = top;
+      term->scroll_bottom = bottom;
+      term_set_cursor(term, (term->origin_mode) ? top : 0, 0);
+    }
+    break;
+
+  case 's':
+    term->saved_row = term->row;
+    term->saved_col = term->col;
+    break;
+
+  case 'u':
+    term_set_cursor(term, term->saved_row, term->saved_col);
+    break;
+
+  case 'm': term_set_attributes(term); break;
+  case 'h': term_set_mode(term, 1); break;
+  case 'l': term_set_mode(term, 0); break;
+  }
+}
+
+static void term_esc(struct PREDICT_TERM *term, uint8_t c)
+{
+  term->state = PARSER_GROUND;
+  switch (c) {
+  case '[':
+    term->state = PARSER_CSI;
+    term->params[0] = 0;
+    term->num_params = 0;
+    term->private_marker = 0;
+    term->intermediate = 0;
+    break;
+
+  case ']':
+  case 'P':
+  case 'X':
+  case '^':
+  case '_':
+    term->state = PARSER_STRING;
+    break;
+
+  case '(': case ')': case '*': case '+': case '-': case '.': case '/': case '#': case '%':
+    term->state = PARSER_ESC_SKIP;
+    break;
+
+  case '7':
+    term->saved_row = term->row;
+    term->saved_col = term->col;
+    break;
+
+  case '8':
+    term_set_cursor(term, term->saved_row, term->saved_col);
+    break;
+
+  case 'D': term_line_feed(term); term->wrap_pending = 0; break;
+  case 'E': term_line_feed(term); term->col = 0; term->wrap_pending = 0; break;
+  case 'M': term_reverse_line_feed(term); term->wrap_pending = 0; break;
+  case 'c': term_reset(term); break;
+  }
+}
+
+static void term_csi_byte(struct PREDICT_TERM *term, uint8_t c)
+{
+  if (c >= '0' && c <= '9') {
+    if (term->num_params == 0)
+      term->num_params = 1;
+    if (term->params[term->num_params-1] < 100000)
+      term->params[term->num_params-1] = term->params[term->num_params-1] * 10 + (c - '0');
+  } else if (c == ';' || c == ':') {
+    if (term->num_params == 0)
+      term->num_params = 1;
+    if (term->num_params < PREDICT_MAX_PARAMS)
+      term->params[term->num_params++] = 0;
+  } else if (c >= '<' && c <= '?') {
+    term->private_marker = c;
+  } else if (c >= 0x20 && c <= 0x2f) {
+    term->intermediate = c;
+  } else if (c >= 0x40 && c <= 0x7e) {
+    term->state = PARSER_GROUND;
+    term_csi(term, c);
+  } else if (c < 0x20) {
+    term_control(term, c);
+  }
+}
+
+static void term_update(struct PREDICT_TERM *term, const uint8_t *data, size_t len)
+{
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    uint8_t c = data[i];
+
+    if (c == 0x18 || c == 0x1a) {     // CAN, SUB
+      term->state = PARSER_GROUND;
+      continue;
+    }
+
+    switch (term->state) {
+    case PARSER_GROUND:
+      if (c == 0x1b) {
+        term->state = PARSER_ESC;
+        term->utf8_left = 0;
+      } else if (c < 0x20 || c == 0x7f) {
+        term_control(term, c);
+      } else if (c < 0x80) {
+        term->utf8_left = 0;
+        term_print(term, c, 1);
+      } else if (c < 0xc0) {
+        if (term->utf8_left > 0) {
+          term->utf8_char = (term->utf8_char << 6) | (c & 0x3f);
+          if (--term->utf8_left == 0)
+            term_print(term, CELL_OTHER, get_char_width(term->utf8_char));
+        }
+      } else {
+        term->utf8_left = (c >= 0xf0) ? 3 : (c >= 0xe0) ? 2 : 1;
+        term->utf8_char = c & (0x3f >> term->utf8_left);
+      }
+      break;
+
+    case PARSER_ESC:
+      term_esc(term, c);
+      break;
+
+    case PARSER_ESC_SKIP:
+      term->state = PARSER_GROUND;
+      break;
+
+    case PARSER_CSI:
+      term_csi_byte(term, c);
+      break;
+
+    case PARSER_STRING:
+      if (c == 0x07)
+        term->state = PARSER_GROUND;
+      else if (c == 0x1b)
+        term->state = PARSER_STRING_ESC;
+      break;
+
+    case PARSER_STRING_ESC:
+      term->state = (c == '\\') ? PARSER_GROUND : PARSER_STRING;
+      break;
+    }
+  }
+}
+
+/* ------- predictions ---------------------- */
+
+static int append_cursor_move(struct SSH_BUFFER *out, int row, int col)
+{
+  char seq[32];
+
+  snprintf(seq, sizeof(seq), "\x1b[%d;%dH", row + 1, col + 1);
+  return ssh_buf_append_cstring(out, seq);
+}
+
+/*
+ * Read the server's state of the predicted line.  Returns -1 if the
+ * cursor is not in the line anymore.
+ */
+static int read_server_line(struct PREDICT_LINE *line)
+{
+  struct PREDICT_TERM *term = &pred->term;
+  int len;
+
+  if (! term->reliable || term->origin_mode || term->wrap_pending
+      || term->row != pred->row || term->col < pred->base_col)
+    return -1;
+  len = term->width - pred->base_col;
+  if (len > PREDICT_MAX_LEN)
+    len = PREDICT_MAX_LEN;
+  memcpy(line->text, term_cell(term, pred->row, pred->base_col), len);
+  while (len > 0 && line->text[len-1] == CELL_BLANK)
+    len--;
+  line->len = len;
+  line->cursor = term->col - pred->base_col;
+  return 0;
+}
+
+static int line_equals(const struct PREDICT_LINE *a, const struct PREDICT_LINE *b)
+{
+  return a->len == b->len && a->cursor == b->cursor && memcmp(a->text, b->text, a->len) == 0;
+}
+
+static int line_is_printable(const struct PREDICT_LINE *line)
+{
+  int i;
+
+  for (i = 0; i < line->len; i++)
+    if (line->text[i] < 0x20 || line->text[i] >= 0x7f)
+      return 0;
+  return 1;
+}
+
+static void clear_predictions(void)
+{
+  pred->num_lines = 0;
+  pred->drawn_len = 0;
+}
+
+/*
+ * Put back what the server drew under the predicted characters, and
+ * move the cursor back to the server's position.
+ */
+static int undraw_predictions(struct SSH_BUFFER *out)
+{
+  struct PREDICT_TERM *term = &pred->term;
+  int i;
+
+  if (pred->drawn_len == 0)
+    return 0;
+  if (append_cursor_move(out, pred->row, pred->base_col) < 0)
+    return -1;
+  for (i = 0; i < pred->drawn_len; i++) {
+    uint8_t c = *term_cell(term, pred->row, pred->base_col + i);
+    if (ssh_buf_append_u8(out, (c == CELL_OTHER) ? '?' : c) < 0)
+      return -1;
+  }
+  if (term->wrap_pending) {
+    // rewrite the last character to get the cursor in the same state
+    uint8_t c = *term_cell(term, term->row, term->width - 1);
+    if (append_cursor_move(out, term->row, term->width - 1) < 0
+        || ssh_buf_append_u8(out, (c == CELL_OTHER) ? ' ' : c) < 0)
+      return -1;
+  } else if (append_cursor_move(out, term->row, term->col) < 0) {
+    return -1;
+  }
+  pred->drawn_len = 0;
+  return 0;
+}
+
+/*
+ * Draw the line predicted after the last key, underlining the
+ * characters that differ from the server's line.
+ */
+static int draw_predictions(struct SSH_BUFFER *out)
+{
+  struct PREDICT_TERM *term = &pred->term;
+  const struct PREDICT_LINE *line = &pred->lines[pred->num_lines-1];
+  struct PREDICT_LINE server_line;
+  int i, underline, draw_len;
+
+  if (! pred->confirmed || pred->num_lines < 2 || read_server_line(&server_line) < 0)
+    return 0;
+
+  draw_len = (line->len > server_line.len) ? line->len : server_line.len;
+  underline = term->underline;
+  if (append_cursor_move(out, pred->row, pred->base_col) < 0)
+    return -1;
+  for (i = 0; i < draw_len; i++) {
+    uint8_t c = (i < line->len) ? line->text[i] : CELL_BLANK;
+    int predicted = (i >= server_line.len || server_line.text[i] != c);
+
+    if (predicted != underline) {
+      if (ssh_buf_append_cstring(out, (predicted) ? "\x1b[4m" : "\x1b[24m") < 0)
+        return -1;
+      underline = predicted;
+    }
+    if (ssh_buf_append_u8(out, c) < 0)
+      return -1;
+  }
+  if (underline != term->underline && ssh_buf_append_cstring(out, (term->underline) ? "\x1b[4m" : "\x1b[24m") < 0)
+    return -1;
+  if (append_cursor_move(out, pred->row, pred->base_col + line->cursor) < 0)
+    return -1;
+  pred->drawn_len = draw_len;
+  return 0;
+}
+
+/*
+ * Start predicting from the server's state of the line.
+ */
+static int start_predictions(void)
+{
+  struct PREDICT_TERM *term = &pred->term;
+
+  if (! term->reliable || term->origin_mode || term->wrap_pending)
+    return -1;
+
+  // keep the line if the server echoed keys on it before
+  if (pred->confirmed && read_server_line(&pred->lines[0]) == 0 && line_is_printable(&pred->lines[0])) {
+    pred->num_lines = 1;
+    return 0;
+  }
+
+  // start a new line at the cursor, if the rest of the line is blank
+  pred->confirmed = 0;
+  pred->row = term->row;
+  pred->base_col = term->col;
+  if (read_server_line(&pred->lines[0]) < 0 || pred->lines[0].len != 0)
+    return -1;
+  pred->num_lines = 1;
+  return 0;
+}
+
+static int predict_key(enum KEY_TYPE key, uint8_t c)
+{
+  struct PREDICT_LINE *line;
+  int max_len;
+
+  if (pred->num_lines == 0 && start_predictions() < 0)
+    return -1;
+  if (pred->num_lines == PREDICT_MAX_STATES)
+    return -1;
+
+  line = &pred->lines[pred->num_lines];
+  *line = pred->lines[pred->num_lines-1];
+  max_len = pred->term.width - 1 - pred->base_col;
+  if (max_len > PREDICT_MAX_LEN)
+    max_len = PREDICT_MAX_LEN;
+
+  if (line->cursor > line->len) {
+    // cursor after blanks at the end of the line
+    memset(line->text + line->len, CELL_BLANK, line->cursor - line->len);
+    line->len = line->cursor;
+  }
+
+  switch (key) {
+  case KEY_CHAR:
+    if (line->len >= max_len)
+      return -1;
+    memmove(line->text + line->cursor + 1, line->text + line->cursor, line->len - line->cursor);
+    line->text[line->cursor++] = c;
+    line->len++;
+    break;
+
+  case KEY_BACKSPACE:
+    if (line->cursor == 0)
+      return -1;
+    memmove(line->text + line->cursor - 1, line->text + line->cursor, line->len - line->cursor);
+    line->cursor--;
+    line->len--;
+    break;
+
+  case KEY_LEFT:
+    if (line->cursor == 0)
+      return -1;
+    line->cursor--;
+    break;
+
+  case KEY_RIGHT:
+    if (line->cursor >= line->len)
+      return -1;
+    line->cursor++;
+    break;
+
+  default:
+    return -1;
+  }
+
+  // blanks at the end of the line are not part of it, as in read_server_line()
+  while (line->len > 0 && line->text[line->len-1] == CELL_BLANK)
+    line->len--;
+
+  if (pred->num_lines == 1)
+    pred->pending_time = get_time_ms();
+  pred->num_lines++;
+  return 0;
+}
+
+/*
+ * Get the next key from the input, returning its length.
+ */
+static size_t read_key(const uint8_t *data, size_t len, enum KEY_TYPE *key)
+{
+  size_t i;
+
+  if (data[0] >= 0x20 && data[0] < 0x7f) {
+    *key = KEY_CHAR;
+    return 1;
+  }
+  if (data[0] == 0x7f || data[0] == '\b') {
+    *key = KEY_BACKSPACE;
+    return 1;
+  }
+  *key = KEY_OTHER;
+  if (data[0] != 0x1b || len < 2)
+    return 1;
+
+  if (data[1] == 'O' && len >= 3) {
+    *key = (data[2] == 'C') ? KEY_RIGHT : (data[2] == 'D') ? KEY_LEFT : KEY_OTHER;
+    return 3;
+  }
+  if (data[1] != '[')
+    return 2;
+  for (i = 2; i < len; i++) {
+    if (data[i] >= 0x40 && data[i] <= 0x7e) {
+      if (i == 2)
+        *key = (data[i] == 'C') ? KEY_RIGHT : (data[i] == 'D') ? KEY_LEFT : KEY_OTHER;
+      return i + 1;
+    }
+  }
+  return len;
+}
+
+/*
+ * Start predicting the echo of typed keys on the terminal.  The
+ * screen is cleared so the terminal model starts in a known state.
+ */
+int predict_init(int term_width, int term_height, struct SSH_BUFFER *out)
+{
+  size_t screen_size;
+
+  if (term_width <= 1 || term_height <= 0 || term_width > PREDICT_MAX_SIZE || term_height > PREDICT_MAX_SIZE) {
+    ssh_set_error("unsupported terminal size for prediction: %dx%d", term_width, term_height);
+    return -1;
+  }
+  if ((pred = ssh_alloc(sizeof(struct PREDICT))) == NULL)
+    return -1;
+  memset(pred, 0, sizeof(struct PREDICT));
+  screen_size = (size_t) term_width * term_height;
+  if ((pred->term.screen = ssh_alloc(screen_size)) == NULL
+      || (pred->term.saved_screen = ssh_alloc(screen_size)) == NULL) {
+    predict_deinit();
+    return -1;
+  }
+  pred->term.width = term_width;
+  pred->term.height = term_height;
+  term_reset(&pred->term);
+
+  if (ssh_buf_append_cstring(out, "\x1b[H\x1b[2J") < 0) {
+    predict_deinit();
+    return -1;
+  }
+  return 0;
+}
+
+void predict_deinit(void)
+{
+  if (pred == NULL)
+    return;
+  ssh_free(pred->term.screen);
+  ssh_free(pred->term.saved_screen);
+  ssh_free(pred);
+  pred = NULL;
+}
+
+/*
+ * Give up on keys the server didn't echo in time.
+ */
+static int expire_predictions(struct SSH_BUFFER *out)
+{
+  if (pred->num_lines > 1 && get_time_ms() - pred->pending_time > PREDICT_TIMEOUT) {
+    if (undraw_predictions(out) < 0)
+      return -1;
+    clear_predictions();
+    pred->confirmed = 0;
+  }
+  return 0;
+}
+
+/*
+ * Process keys typed by the user (before sending them to the server),
+ * adding the predicted echo to 'out'.
+ */
+int predict_input(const uint8_t *data, size_t len, struct SSH_BUFFER *out)
+{
+  int changed = 0;
+
+  if (pred == NULL)
+    return 0;
+
+  if (expire_predictions(out) < 0)
+    return -1;
+
+  while (len > 0) {
+    enum KEY_TYPE key;
+    size_t key_len = read_key(data, len, &key);
+
+    if (! pred->frozen) {
+      if (predict_key(key, data[0]) < 0)
+        pred->frozen = 1;
+      else
+        changed = 1;
+    }
+    data += key_len;
+    len -= key_len;
+  }
+
+  if (changed && pred->confirmed) {
+    if (undraw_predictions(out) < 0
+        || draw_predictions(out) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+/*
+ * Add output from the server to 'out', replacing the predictions
+ * drawn on the screen.
+ */
+int predict_output(const uint8_t *data, size_t len, struct SSH_BUFFER *out)
+{
+  struct PREDICT_LINE server_line;
+  int i;
+
+  if (pred == NULL)
+    return ssh_buf_append_data(out, data, len);
+
+  if (expire_predictions(out) < 0
+      || undraw_predictions(out) < 0
+      || ssh_buf_append_data(out, data, len) < 0)
+    return -1;
+  term_update(&pred->term, data, len);
+
+  if (pred->num_lines > 0) {
+    // find the last key already echoed by the server
+    i = -1;
+    if (read_server_line(&server_line) == 0) {
+      for (i = pred->num_lines - 1; i >= 0; i--)
+        if (line_equals(&server_line, &pred->lines[i]))
+          break;
+    }
+    if (i < 0) {
+      clear_predictions();
+      pred->confirmed = 0;
+    } else if (i > 0) {
+      memmove(&pred->lines[0], &pred->lines[i], (pred->num_lines - i) * sizeof(struct PREDICT_LINE));
+      pred->num_lines -= i;
+      pred->confirmed = 1;
+      pred->pending_time = get_time_ms();
+    }
+    if (pred->num_lines == 1)
+      pred->num_lines = 0;
+  } else if (read_server_line(&server_line) < 0) {
+    pred->confirmed = 0;
+  }
+  if (pred->num_lines == 0)
+    pred->frozen = 0;
+
+  return draw_predictions(out);
+}
+
+/*
+ * Remove predictions from the screen and stop predicting until the
+ * screen is cleared, for when something else writes to the terminal.
+ */
+int predict_reset(struct SSH_BUFFER *out)
+{
+  if (pred == NULL)
+    return 0;
+  if (undraw_predictions(out) < 0)
+    return -1;
+  clear_predictions();
+  pred->confirmed = 0;
+  pred->term.reliable = 0;
+  return 0;
+}
+
+/*
+ * Update the terminal size.  The terminal may have moved text around,
+ * so predictions stop until the screen is cleared.
+ */
+int predict_resize(int term_width, int term_height, struct SSH_BUFFER *out)
+{
+  size_t screen_size;
+
+  if (pred == NULL)
+    return 0;
+  if (undraw_predictions(out) < 0)
+    return -1;
+  clear_predictions();
+  pred->confirmed = 0;
+  if (term_width <= 1 || term_height <= 0 || term_width > PREDICT_MAX_SIZE || term_height > PREDICT_MAX_SIZE) {
+    predict_deinit();
+    return 0;
+  }
+
+  screen_size = (size_t) term_width * term_height;
+  ssh_free(pred->term.screen);
+  ssh_free(pred->term.saved_screen);
+  pred->term.screen = ssh_alloc(screen_size);
+  pred->term.saved_screen = ssh_alloc(screen_size);
+  if (pred->term.screen == NULL || pred->term.saved_screen == NULL) {
+    predict_deinit();
+    return -1;
+  }
+  pred->term.width = term_width;
+  pred->term.height = term_height;
+  term_reset(&pred->term);
+  pred->term.reliable = 0;
+  return 0;
+}
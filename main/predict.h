@@ -0,0 +1,18 @@
+/* predict.h */
+
+#ifndef PREDICT_H_FILE
+#define PREDICT_H_FILE
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "common/buffer.h"
+
+int predict_init(int term_width, int term_height, struct SSH_BUFFER *out);
+void predict_deinit(void);
+int predict_input(const uint8_t *data, size_t len, struct SSH_BUFFER *out);
+int predict_output(const uint8_t *data, size_t len, struct SSH_BUFFER *out);
+int predict_reset(struct SSH_BUFFER *out);
+int predict_resize(int term_width, int term_height, struct SSH_BUFFER *out);
+
+#endif /* PREDICT_H_FILE */
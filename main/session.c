@@ -1,23 +1,67 @@
-/* session.c */
+/* session.c
+ *
+ * Interactive session on the terminal.
+ *
+ * Typed keys are sent as soon as they're read.  When stdin data comes
+ * in faster than a person types (a paste or a macro), it's gathered
+ * for a short window (EESSH_COALESCE_US microseconds, 0 to disable)
+ * and sent in large packets instead of many small ones.
+ */
 
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <time.h>
 #include <sys/types.h>
+#include <sys/timerfd.h>
 
 #include "main/session.h"
 
 #include "main/term.h"
+#include "main/predict.h"
 #include "ssh/ssh.h"
+#include "common/timer_wheel.h"
+
+// stdin reads this close to the previous one are not typed keys
+#define SESS_COALESCE_GAP_US 2000
+
+// larger reads are not a single key (keys can be escape sequences)
+#define SESS_COALESCE_KEY_LEN 8
+
+#define SESS_COALESCE_DEFAULT_WINDOW_US 500
+
+// max stdin data gathered before sending it
+#define SESS_COALESCE_MAX_LEN (32*1024)
+
+// max stdin data buffered while the channel can't take it; stdin is
+// not read while the buffer is full
+#define SESS_STDIN_MAX_LEN SESS_COALESCE_MAX_LEN
+
+// ms between attempts to send stdin data the channel couldn't take
+#define SESS_STDIN_RETRY_MS 10
+
+// stdout and stderr data buffered while the terminal is slow: the
+// channel never makes us hold more than its local window, plus room
+// for the banner and predicted echo
+#define SESS_OUT_MAX_LEN (SSH_CHAN_MAX_LOCAL_WINDOW + 16*1024)
 
 struct SESS_DATA {
   struct SSH_BUFFER stdin_buf;
   struct SSH_BUFFER stdout_buf;
   struct SSH_BUFFER stderr_buf;
+  int predict;                     // predict echo of typed keys
+  int coalesce_window_us;          // time to gather fast input, 0 to disable
+  int coalesce_timer_fd;           // -1 if not coalescing input
+  int coalescing;                  // gathering input until the timer expires
+  uint64_t last_stdin_time;        // in microseconds
+  int stdin_paused;                // stdin_buf is full, not reading stdin
+  struct SSH_TIMER stdin_retry_timer;
+  struct SSH_CHAN *chan;
 };
 
 static struct SESS_DATA sess_data;
@@ -25,6 +69,8 @@ static struct SSH_CHAN_SESSION_CONFIG chan_session_cfg;
 static struct SSH_CHAN_CONFIG chan_cfg;
 static volatile sig_atomic_t got_sigwinch;
 
+static int sess_stdin_retry(struct SSH_TIMER *timer, void *data);
+
 static void handle_sigwinch(int signum)
 {
   got_sigwinch = 1;
@@ -46,6 +92,19 @@ static int set_fd_nonblock(int fd)
   return 0;
 }
 
+static int append_stdout(struct SESS_DATA *sess, const char *str)
+{
+  return predict_output((const uint8_t *) str, strlen(str), &sess->stdout_buf);
+}
+
+static uint64_t get_time_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 static int sess_init(struct SSH_CHAN *chan, void *userdata)
 {
   struct SESS_DATA *sess = userdata;
@@ -56,15 +115,40 @@ static int sess_init(struct SSH_CHAN *chan, void *userdata)
   sess->stdout_buf = ssh_buf_new();
   sess->stderr_buf = ssh_buf_new();
 
+  // reserve the buffers up front, so moving data doesn't allocate
+  if (ssh_buf_reserve(&sess->stdin_buf, SESS_STDIN_MAX_LEN) < 0
+      || ssh_buf_reserve(&sess->stdout_buf, SESS_OUT_MAX_LEN) < 0
+      || ssh_buf_reserve(&sess->stderr_buf, SESS_OUT_MAX_LEN) < 0)
+    return -1;
+
   // we want to be notified when STDIN_FILENO has data available to read:
   if (ssh_chan_watch_fd(chan, STDIN_FILENO, SSH_CHAN_FD_READ, 0) < 0
       || ssh_chan_watch_fd(chan, STDOUT_FILENO, SSH_CHAN_FD_WRITE, 0) < 0
       || ssh_chan_watch_fd(chan, STDERR_FILENO, SSH_CHAN_FD_WRITE, 0) < 0)
     return -1;
 
-  ssh_buf_append_cstring(&sess->stdout_buf, "=======================================================================\r\n");
-  ssh_buf_append_cstring(&sess->stdout_buf, "==== Press CTRL+Q to quit =============================================\r\n");
-  ssh_buf_append_cstring(&sess->stdout_buf, "=======================================================================\r\n");
+  sess->coalescing = 0;
+  sess->last_stdin_time = 0;
+  sess->stdin_paused = 0;
+  sess->chan = chan;
+  ssh_timer_init(&sess->stdin_retry_timer, sess_stdin_retry, sess);
+  sess->coalesce_timer_fd = -1;
+  if (sess->coalesce_window_us > 0
+      && (sess->coalesce_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC)) < 0)
+    ssh_log("WARNING: can't create timer, not coalescing input\n");
+
+  if (sess->predict) {
+    int term_width, term_height;
+
+    if (! isatty(STDIN_FILENO) || ! isatty(STDOUT_FILENO)
+        || term_get_window_size(&term_width, &term_height) < 0
+        || predict_init(term_width, term_height, &sess->stdout_buf) < 0)
+      ssh_log("WARNING: not predicting local echo\n");
+  }
+
+  append_stdout(sess, "=======================================================================\r\n");
+  append_stdout(sess, "==== Press CTRL+Q to quit =============================================\r\n");
+  append_stdout(sess, "=======================================================================\r\n");
   
   if (set_fd_nonblock(STDIN_FILENO) < 0
       || set_fd_nonblock(STDOUT_FILENO) < 0
@@ -94,10 +178,14 @@ static void sess_close(struct SSH_CHAN *data, void *userdata)
 
   ssh_log("- channel session closed\n");
   signal(SIGWINCH, SIG_IGN);
+  ssh_timer_cancel(&sess->stdin_retry_timer);
 
   ssh_buf_free(&sess->stdin_buf);
   ssh_buf_free(&sess->stdout_buf);
   ssh_buf_free(&sess->stderr_buf);
+  if (sess->coalesce_timer_fd >= 0)
+    close(sess->coalesce_timer_fd);
+  predict_deinit();
   term_restore();
 }
 
@@ -148,6 +236,104 @@ static int write_out_buffer(struct SSH_CHAN *chan, int out_fd, struct SSH_BUFFER
   return 0;
 }
 
+/*
+ * Write buffered output to 'out_fd', and let the channel open the
+ * window for the data that's gone.
+ */
+static int sess_write_output(struct SESS_DATA *sess, struct SSH_CHAN *chan, int out_fd)
+{
+  struct SSH_BUFFER *buf = (out_fd == STDERR_FILENO) ? &sess->stderr_buf : &sess->stdout_buf;
+
+  if (write_out_buffer(chan, out_fd, buf) < 0
+      || ssh_chan_set_recv_buffered(chan, sess->stdout_buf.len + sess->stderr_buf.len) < 0)
+    return -1;
+  return 0;
+}
+
+/*
+ * Send as much of the stdin data as the channel takes now, stopping
+ * the coalescing timer.
+ */
+static int sess_send_stdin(struct SESS_DATA *sess, struct SSH_CHAN *chan)
+{
+  ssize_t sent;
+
+  if (sess->coalescing) {
+    struct itimerspec stop = { { 0, 0 }, { 0, 0 } };
+
+    timerfd_settime(sess->coalesce_timer_fd, 0, &stop, NULL);
+    if (ssh_chan_watch_fd(chan, sess->coalesce_timer_fd, 0, SSH_CHAN_FD_READ) < 0)
+      return -1;
+    sess->coalescing = 0;
+  }
+
+  while (sess->stdin_buf.len > 0) {
+    if ((sent = ssh_chan_send_data(chan, sess->stdin_buf.data, sess->stdin_buf.len)) < 0)
+      return -1;
+    if (sent == 0)
+      break;
+    ssh_buf_remove_data(&sess->stdin_buf, 0, sent);
+  }
+  return 0;
+}
+
+/*
+ * Stop reading stdin while stdin_buf is full, and read again once
+ * there's room.  Data the channel couldn't take is retried from a
+ * timer, since more input may never come to send it.
+ */
+static int sess_update_stdin_watch(struct SESS_DATA *sess, struct SSH_CHAN *chan)
+{
+  if (sess->stdin_buf.len >= SESS_STDIN_MAX_LEN && ! sess->stdin_paused) {
+    if (ssh_chan_watch_fd(chan, STDIN_FILENO, 0, SSH_CHAN_FD_READ) < 0)
+      return -1;
+    sess->stdin_paused = 1;
+  } else if (sess->stdin_buf.len < SESS_STDIN_MAX_LEN && sess->stdin_paused) {
+    if (ssh_chan_watch_fd(chan, STDIN_FILENO, SSH_CHAN_FD_READ, 0) < 0)
+      return -1;
+    sess->stdin_paused = 0;
+  }
+  if (sess->stdin_paused || (sess->stdin_buf.len > 0 && ! sess->coalescing))
+    ssh_chan_set_timer(chan, &sess->stdin_retry_timer, SESS_STDIN_RETRY_MS);
+  return 0;
+}
+
+static int sess_stdin_retry(struct SSH_TIMER *timer, void *data)
+{
+  struct SESS_DATA *sess = data;
+
+  if (sess_send_stdin(sess, sess->chan) < 0
+      || sess_update_stdin_watch(sess, sess->chan) < 0)
+    return -1;
+  return 0;
+}
+
+/*
+ * Return 1 if the stdin data just read should be sent now, or 0 if
+ * it's part of fast input and the timer will send it.
+ */
+static int sess_check_send_stdin(struct SESS_DATA *sess, struct SSH_CHAN *chan, size_t read_len)
+{
+  struct itimerspec start = { { 0, 0 }, { 0, (long) sess->coalesce_window_us * 1000 } };
+  uint64_t now = get_time_us();
+  uint64_t gap = now - sess->last_stdin_time;
+
+  sess->last_stdin_time = now;
+  if (sess->coalesce_timer_fd < 0 || sess->stdin_buf.len >= SESS_COALESCE_MAX_LEN)
+    return 1;
+  if (sess->coalescing)
+    return 0;
+  if (gap >= SESS_COALESCE_GAP_US && read_len <= SESS_COALESCE_KEY_LEN)
+    return 1;
+
+  // start gathering input
+  if (timerfd_settime(sess->coalesce_timer_fd, 0, &start, NULL) < 0
+      || ssh_chan_watch_fd(chan, sess->coalesce_timer_fd, SSH_CHAN_FD_READ, 0) < 0)
+    return 1;
+  sess->coalescing = 1;
+  return 0;
+}
+
 static int sess_process_fd(struct SSH_CHAN *chan, void *userdata, int fd, uint8_t fd_flags)
 {
   struct SESS_DATA *sess = userdata;
@@ -155,8 +341,17 @@ static int sess_process_fd(struct SSH_CHAN *chan, void *userdata, int fd, uint8_
   //ssh_log("- processing fd %d with flags %d\n", fd, fd_flags);
   
   if (fd == STDIN_FILENO) {
-    ssize_t sent;
-    int r = read_stdin(&sess->stdin_buf, 1024);
+    size_t old_len = sess->stdin_buf.len;
+    size_t read_len = 1024;
+    int r;
+
+    if (old_len >= SESS_STDIN_MAX_LEN)
+      return sess_update_stdin_watch(sess, chan);
+
+    // read all pending input when it may be coalesced
+    if (sess->coalesce_timer_fd >= 0 || read_len > SESS_STDIN_MAX_LEN - old_len)
+      read_len = SESS_STDIN_MAX_LEN - old_len;
+    r = read_stdin(&sess->stdin_buf, read_len);
     if (r < 0) {
       ssh_log("ERROR: %s\n", ssh_get_error());
       ssh_chan_close(chan);
@@ -164,6 +359,8 @@ static int sess_process_fd(struct SSH_CHAN *chan, void *userdata, int fd, uint8_
     }
     if (r == 0 && (fd_flags & SSH_CHAN_FD_CLOSE) != 0) {
       ssh_log("- stdin was closed, closing channel\n");
+      if (sess_send_stdin(sess, chan) < 0)
+        return -1;
       ssh_chan_close(chan);
       return 0;
     }
@@ -172,14 +369,29 @@ static int sess_process_fd(struct SSH_CHAN *chan, void *userdata, int fd, uint8_
       ssh_chan_close(chan);
       return 0;
     }
-    if ((sent = ssh_chan_send_data(chan, sess->stdin_buf.data, sess->stdin_buf.len)) < 0)
+    if (predict_input(sess->stdin_buf.data + old_len, r, &sess->stdout_buf) < 0
+        || write_out_buffer(chan, STDOUT_FILENO, &sess->stdout_buf) < 0) {
+      ssh_log("ERROR: %s\n", ssh_get_error());
+      ssh_chan_close(chan);
+      return 0;
+    }
+    if (sess_check_send_stdin(sess, chan, r) && sess_send_stdin(sess, chan) < 0)
       return -1;
-    ssh_buf_remove_data(&sess->stdin_buf, 0, sent);
-    return 0;
+    return sess_update_stdin_watch(sess, chan);
+  }
+
+  if (fd == sess->coalesce_timer_fd) {
+    uint64_t expirations;
+
+    if (read(fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+      ssh_log("WARNING: error reading timer\n");
+    if (sess_send_stdin(sess, chan) < 0)
+      return -1;
+    return sess_update_stdin_watch(sess, chan);
   }
 
   if (fd == STDOUT_FILENO) {
-    if (write_out_buffer(chan, STDOUT_FILENO, &sess->stdout_buf) < 0) {
+    if (sess_write_output(sess, chan, STDOUT_FILENO) < 0) {
       ssh_log("ERROR: %s\n", ssh_get_error());
       ssh_chan_close(chan);
     }
@@ -187,7 +399,7 @@ static int sess_process_fd(struct SSH_CHAN *chan, void *userdata, int fd, uint8_
   }
   
   if (fd == STDERR_FILENO) {
-    if (write_out_buffer(chan, STDERR_FILENO, &sess->stderr_buf) < 0) {
+    if (sess_write_output(sess, chan, STDERR_FILENO) < 0) {
       ssh_log("ERROR: %s\n", ssh_get_error());
       ssh_chan_close(chan);
     }      
@@ -205,8 +417,8 @@ static void sess_got_data(struct SSH_CHAN *chan, void *userdata, void *data, siz
   if (data_len == 0)
     return;
   
-  if (ssh_buf_append_data(&sess->stdout_buf, data, data_len) < 0
-      || write_out_buffer(chan, STDOUT_FILENO, &sess->stdout_buf) < 0) {
+  if (predict_output(data, data_len, &sess->stdout_buf) < 0
+      || sess_write_output(sess, chan, STDOUT_FILENO) < 0) {
     ssh_log("ERROR: %s\n", ssh_get_error());
     ssh_chan_close(chan);
   }
@@ -221,8 +433,10 @@ static void sess_got_ext_data(struct SSH_CHAN *chan, void *userdata, uint32_t da
     return;
   }
   
-  if (ssh_buf_append_data(&sess->stderr_buf, data, data_len) < 0
-      || write_out_buffer(chan, STDERR_FILENO, &sess->stderr_buf) < 0) {
+  // stderr goes to the same terminal, out of order with stdout
+  if (predict_reset(&sess->stdout_buf) < 0
+      || ssh_buf_append_data(&sess->stderr_buf, data, data_len) < 0
+      || sess_write_output(sess, chan, STDERR_FILENO) < 0) {
     ssh_log("ERROR: %s\n", ssh_get_error());
     ssh_chan_close(chan);
   }
@@ -230,6 +444,7 @@ static void sess_got_ext_data(struct SSH_CHAN *chan, void *userdata, uint32_t da
 
 static int sess_got_signal(struct SSH_CHAN *chan, void *userdata)
 {
+  struct SESS_DATA *sess = userdata;
   int term_width, term_height;
 
   if (! got_sigwinch)
@@ -240,6 +455,10 @@ static int sess_got_signal(struct SSH_CHAN *chan, void *userdata)
     ssh_log("warning: can't get new terminal window size; ignoring");
     return 0;
   }
+  if (predict_resize(term_width, term_height, &sess->stdout_buf) < 0)
+    ssh_log("WARNING: %s\n", ssh_get_error());
+  if (write_out_buffer(chan, STDOUT_FILENO, &sess->stdout_buf) < 0)
+    return -1;
 
   return ssh_chan_session_new_term_size(chan, term_width, term_height);
 }
@@ -247,6 +466,7 @@ static int sess_got_signal(struct SSH_CHAN *chan, void *userdata)
 struct SSH_CHAN_CONFIG *get_session_channel_config(void)
 {
   int term_width, term_height;
+  const char *coalesce;
 
   if (term_get_window_size(&term_width, &term_height) < 0) {
     ssh_set_error("error reading terminal window size");
@@ -268,6 +488,17 @@ struct SSH_CHAN_CONFIG *get_session_channel_config(void)
   chan_session_cfg.term = getenv("TERM");
   chan_session_cfg.term_width = term_width;
   chan_session_cfg.term_height = term_height;
+  sess_data.predict = (getenv("EESSH_PREDICT") != NULL);
+  sess_data.coalesce_window_us = SESS_COALESCE_DEFAULT_WINDOW_US;
+  if ((coalesce = getenv("EESSH_COALESCE_US")) != NULL) {
+    char *end;
+    long window_us = strtol(coalesce, &end, 10);
+    if (*coalesce == '\0' || *end != '\0' || window_us < 0 || window_us >= 1000000) {
+      ssh_set_error("bad EESSH_COALESCE_US: '%s'", coalesce);
+      return NULL;
+    }
+    sess_data.coalesce_window_us = window_us;
+  }
 
   return &chan_cfg;
 }
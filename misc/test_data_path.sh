@@ -0,0 +1,51 @@
+#!/bin/sh
+
+# Moves DOWN bytes from the server and UP bytes to it through one
+# session channel with EESSH_CHECK_ALLOCS=1, and fails if the client
+# exits with an error, which includes any allocation in the data path
+# after warm-up.
+#
+# usage: EESSH_TEST_PASSWORD=... misc/test_data_path.sh [user@]server [port]
+
+DOWN=${DOWN:-1073741824}
+UP=${UP:-16777216}
+EESSH=${EESSH:-./eessh}
+TIMEOUT=${TIMEOUT:-1800}
+
+if [ -z "$1" ]; then
+  echo "usage: EESSH_TEST_PASSWORD=... $0 [user@]server [port]" >&2
+  exit 2
+fi
+SERVER=$1
+PORT=${2:-22}
+
+export EESSH_CHECK_ALLOCS=1
+export EESSH_NET_EMU=${EESSH_NET_EMU-seed=1,chunk=16384}
+
+TMP=$(mktemp -d) || exit 1
+trap 'rm -rf "$TMP"' EXIT
+mkfifo "$TMP/in" || exit 1
+
+timeout $TIMEOUT script -qfc "$EESSH $SERVER $PORT; echo EXIT=\$?" /dev/null < "$TMP/in" | tr -d '\000' > "$TMP/log" &
+CLIENT=$!
+
+(
+  sleep 3; printf '%s\r' "$EESSH_TEST_PASSWORD"; sleep 3
+  printf 'stty raw -echo; head -c %s /dev/zero & head -c %s >/dev/null; wait; exit\r' $DOWN $UP
+  sleep 1; head -c $UP /dev/zero | tr '\0' x
+  exec sleep $TIMEOUT
+) > "$TMP/in" &
+FEEDER=$!
+
+wait $CLIENT
+kill $FEEDER 2>/dev/null
+
+# go by the exit status: the client's messages may be lost while the
+# terminal is full (and the shell echoing it keeps script(1) from
+# losing the client's last output)
+grep -a "alloc\|Error\|EXIT" "$TMP/log"
+if ! grep -aq "EXIT=0" "$TMP/log"; then
+  echo "FAIL"
+  exit 1
+fi
+echo "OK"
@@ -0,0 +1,362 @@
+/* algo_bench.c
+ *
+ * Order the cipher and MAC lists sent in SSH_MSG_KEXINIT by how fast
+ * each algorithm runs on this machine.
+ *
+ * Each supported cipher and MAC is timed for a few milliseconds on
+ * packet-sized buffers, ciphers in both directions.  This measures
+ * the raw speed of each algorithm on its own: the combined cipher+MAC
+ * paths of ssh/stream.c are not timed, since the lists sent to the
+ * server order ciphers and MACs separately.  The results are cached
+ * in a file, one line per CPU and algorithm:
+ *
+ *   <cpu>\t<algorithm name>\t<bytes per second>
+ *
+ * where <cpu> is the CPU model name and the set of CPU features used
+ * by the crypto code, so the cache is only reused on the same kind
+ * of machine and with the same implementations.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ssh/algo_bench.h"
+
+#include "ssh/cipher_i.h"
+#include "ssh/mac_i.h"
+#include "crypto/cpu.h"
+
+#include "common/error.h"
+#include "common/debug.h"
+#include "common/alloc.h"
+
+// time spent measuring each algorithm
+#define BENCH_TIME_NS (5*1000000)
+
+#define BENCH_BUF_LEN (16*1024)
+
+#define MAX_ALGOS     16
+#define MAX_CPU_LEN   256
+#define MAX_LINE_LEN  512
+
+struct BENCH_RESULT {
+  int type;
+  const char *name;
+  uint64_t speed;             // bytes per second
+};
+
+static uint64_t bench_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Describe the CPU in 'cpu': model name and the crypto features used.
+ */
+static void bench_get_cpu(char *cpu, size_t cpu_size)
+{
+  char line[MAX_LINE_LEN];
+  char *model = "unknown";
+  unsigned int features = 0;
+  FILE *f;
+  char *p;
+  int i;
+
+  if ((f = fopen("/proc/cpuinfo", "r")) != NULL) {
+    while (fgets(line, sizeof(line), f) != NULL) {
+      if (strncmp(line, "model name", 10) == 0 && (p = strchr(line, ':')) != NULL) {
+        model = p + 1;
+        while (*model == ' ')
+          model++;
+        model[strcspn(model, "\n")] = '\0';
+        break;
+      }
+    }
+  }
+  for (i = 0; i < 32; i++)
+    if (crypto_cpu_has(1u<<i))
+      features |= 1u<<i;
+  snprintf(cpu, cpu_size, "%s/%x", model, features);
+  if (f != NULL)
+    fclose(f);
+
+  // the cpu is a field in the cache file
+  for (p = cpu; *p != '\0'; p++)
+    if (*p == '\t')
+      *p = ' ';
+}
+
+/*
+ * Time the cipher in one direction, adding the bytes processed and the
+ * time taken to '*ret_len' and '*ret_time'.
+ */
+static int bench_cipher_dir(enum SSH_CIPHER_TYPE type, enum SSH_CIPHER_DIRECTION dir, struct SSH_STRING *iv, struct SSH_STRING *key,
+                            uint8_t *buf, uint64_t *ret_len, uint64_t *ret_time)
+{
+  struct SSH_CIPHER_CTX *ctx;
+  uint64_t start, now, len;
+
+  if ((ctx = ssh_cipher_new(type, dir, iv, key)) == NULL)
+    return -1;
+
+  // warm up
+  if (ssh_cipher_crypt(ctx, buf, buf, BENCH_BUF_LEN) < 0)
+    goto err;
+  len = 0;
+  start = now = bench_now();
+  while (now - start < BENCH_TIME_NS) {
+    if (ssh_cipher_crypt(ctx, buf, buf, BENCH_BUF_LEN) < 0)
+      goto err;
+    len += BENCH_BUF_LEN;
+    now = bench_now();
+  }
+  ssh_cipher_free(ctx);
+  *ret_len += len;
+  *ret_time += now - start;
+  return 0;
+
+ err:
+  ssh_cipher_free(ctx);
+  return -1;
+}
+
+static int bench_cipher(enum SSH_CIPHER_TYPE type, uint8_t *buf, uint64_t *ret_speed)
+{
+  uint8_t key_data[64], iv_data[64];
+  struct SSH_STRING key, iv;
+  uint64_t len = 0, time = 0;
+  int key_len, iv_len;
+
+  if ((key_len = ssh_cipher_get_key_len(type)) < 0
+      || (iv_len = ssh_cipher_get_iv_len(type)) < 0)
+    return -1;
+  if (key_len > sizeof(key_data) || iv_len > sizeof(iv_data)) {
+    ssh_set_error("key too large");
+    return -1;
+  }
+  memset(key_data, 0x55, key_len);
+  memset(iv_data, 0xaa, iv_len);
+  key = ssh_str_new(key_data, key_len);
+  iv = ssh_str_new(iv_data, iv_len);
+
+  // the same preference list is used for sending and receiving
+  if (bench_cipher_dir(type, SSH_CIPHER_ENCRYPT, &iv, &key, buf, &len, &time) < 0
+      || bench_cipher_dir(type, SSH_CIPHER_DECRYPT, &iv, &key, buf, &len, &time) < 0)
+    return -1;
+  *ret_speed = len * 1000000000 / time;
+  return 0;
+}
+
+static int bench_mac(enum SSH_MAC_TYPE type, uint8_t *buf, uint64_t *ret_speed)
+{
+  uint8_t key_data[128], out[128];
+  struct SSH_STRING key;
+  struct SSH_MAC_CTX *mac;
+  uint64_t start, now, len;
+  uint32_t seq_num = 0;
+  int key_len;
+
+  if ((key_len = ssh_mac_get_key_len(type)) < 0)
+    return -1;
+  if (key_len > sizeof(key_data)) {
+    ssh_set_error("key too large");
+    return -1;
+  }
+  memset(key_data, 0x55, key_len);
+  key = ssh_str_new(key_data, key_len);
+  if ((mac = ssh_mac_new(type, &key)) == NULL)
+    return -1;
+
+  if (ssh_mac_compute(mac, out, seq_num++, buf, BENCH_BUF_LEN) < 0)
+    goto err;
+  len = 0;
+  start = now = bench_now();
+  while (now - start < BENCH_TIME_NS) {
+    if (ssh_mac_compute(mac, out, seq_num++, buf, BENCH_BUF_LEN) < 0)
+      goto err;
+    len += BENCH_BUF_LEN;
+    now = bench_now();
+  }
+  ssh_mac_free(mac);
+  *ret_speed = len * 1000000000 / (now - start);
+  return 0;
+
+ err:
+  ssh_mac_free(mac);
+  return -1;
+}
+
+/*
+ * Read the speeds cached for the CPU.  Return 1 if all results were
+ * found, 0 otherwise.
+ */
+static int bench_read_cache(const char *filename, const char *cpu, struct BENCH_RESULT *results, int num_results)
+{
+  char line[MAX_LINE_LEN];
+  size_t cpu_len = strlen(cpu);
+  int i, num_found = 0;
+  FILE *f;
+
+  if ((f = fopen(filename, "r")) == NULL)
+    return 0;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    char *name, *speed, *end;
+
+    if (strncmp(line, cpu, cpu_len) != 0 || line[cpu_len] != '\t')
+      continue;
+    name = line + cpu_len + 1;
+    if ((speed = strchr(name, '\t')) == NULL)
+      continue;
+    *speed++ = '\0';
+    for (i = 0; i < num_results; i++) {
+      if (results[i].speed == 0 && strcmp(results[i].name, name) == 0) {
+        results[i].speed = strtoull(speed, &end, 10);
+        if (results[i].speed != 0 && (*end == '\n' || *end == '\0'))
+          num_found++;
+        else
+          results[i].speed = 0;
+        break;
+      }
+    }
+  }
+  fclose(f);
+  return num_found == num_results;
+}
+
+/*
+ * Replace the lines of the cache file for the CPU with the new
+ * results, keeping the lines of other CPUs.
+ */
+static int bench_write_cache(const char *filename, const char *cpu, const struct BENCH_RESULT *results, int num_results)
+{
+  char line[MAX_LINE_LEN];
+  char tmp_filename[1024];
+  size_t cpu_len = strlen(cpu);
+  FILE *in, *out;
+  int i;
+
+  if (snprintf(tmp_filename, sizeof(tmp_filename), "%s.tmp", filename) >= sizeof(tmp_filename)) {
+    ssh_set_error("file name too long");
+    return -1;
+  }
+  if ((out = fopen(tmp_filename, "w")) == NULL) {
+    ssh_set_error("can't open '%s'", tmp_filename);
+    return -1;
+  }
+  if ((in = fopen(filename, "r")) != NULL) {
+    while (fgets(line, sizeof(line), in) != NULL) {
+      if (strncmp(line, cpu, cpu_len) != 0 || line[cpu_len] != '\t')
+        fputs(line, out);
+    }
+    fclose(in);
+  }
+  for (i = 0; i < num_results; i++)
+    fprintf(out, "%s\t%s\t%llu\n", cpu, results[i].name, (unsigned long long) results[i].speed);
+
+  if (fclose(out) != 0 || rename(tmp_filename, filename) < 0) {
+    unlink(tmp_filename);
+    ssh_set_error("error writing '%s'", filename);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Sort by speed, fastest first, keeping the default order for equal
+ * speeds.
+ */
+static void bench_sort_results(struct BENCH_RESULT *results, int num_results)
+{
+  int i, j;
+
+  for (i = 1; i < num_results; i++) {
+    struct BENCH_RESULT r = results[i];
+    for (j = i; j > 0 && results[j-1].speed < r.speed; j--)
+      results[j] = results[j-1];
+    results[j] = r;
+  }
+}
+
+static void bench_log_results(const char *what, const struct BENCH_RESULT *results, int num_results)
+{
+  int i;
+
+  ssh_log("* %s preference:", what);
+  for (i = 0; i < num_results; i++)
+    ssh_log(" %s (%llu MB/s)", results[i].name, (unsigned long long) results[i].speed / 1000000);
+  ssh_log("\n");
+}
+
+/*
+ * Measure the ciphers and MACs (or read the measurements from the
+ * cache file, if not NULL) and set the preferred order of the
+ * algorithms.
+ */
+int ssh_algo_bench_run(const char *cache_filename)
+{
+  enum SSH_CIPHER_TYPE cipher_types[MAX_ALGOS];
+  enum SSH_MAC_TYPE mac_types[MAX_ALGOS];
+  struct BENCH_RESULT results[2*MAX_ALGOS];
+  struct BENCH_RESULT *ciphers, *macs;
+  char cpu[MAX_CPU_LEN];
+  int num_ciphers, num_macs, i;
+  uint8_t *buf;
+
+  num_ciphers = ssh_cipher_get_algo_types(cipher_types, MAX_ALGOS);
+  num_macs = ssh_mac_get_algo_types(mac_types, MAX_ALGOS);
+  ciphers = results;
+  macs = results + num_ciphers;
+  for (i = 0; i < num_ciphers; i++) {
+    ciphers[i].type = cipher_types[i];
+    ciphers[i].name = ssh_cipher_get_name(cipher_types[i]);
+    ciphers[i].speed = 0;
+  }
+  for (i = 0; i < num_macs; i++) {
+    macs[i].type = mac_types[i];
+    macs[i].name = ssh_mac_get_name(mac_types[i]);
+    macs[i].speed = 0;
+  }
+
+  bench_get_cpu(cpu, sizeof(cpu));
+  if (cache_filename == NULL || ! bench_read_cache(cache_filename, cpu, results, num_ciphers + num_macs)) {
+    ssh_log("* measuring cipher and MAC speed\n");
+    if ((buf = ssh_alloc(BENCH_BUF_LEN)) == NULL)
+      return -1;
+    for (i = 0; i < num_ciphers; i++) {
+      if (bench_cipher(ciphers[i].type, buf, &ciphers[i].speed) < 0) {
+        ssh_free(buf);
+        return -1;
+      }
+    }
+    for (i = 0; i < num_macs; i++) {
+      if (bench_mac(macs[i].type, buf, &macs[i].speed) < 0) {
+        ssh_free(buf);
+        return -1;
+      }
+    }
+    ssh_free(buf);
+    if (cache_filename != NULL && bench_write_cache(cache_filename, cpu, results, num_ciphers + num_macs) < 0)
+      ssh_log("WARNING: %s\n", ssh_get_error());
+  }
+
+  bench_sort_results(ciphers, num_ciphers);
+  bench_sort_results(macs, num_macs);
+  for (i = 0; i < num_ciphers; i++)
+    cipher_types[i] = ciphers[i].type;
+  for (i = 0; i < num_macs; i++)
+    mac_types[i] = macs[i].type;
+  if (ssh_cipher_set_preferred_order(cipher_types, num_ciphers) < 0
+      || ssh_mac_set_preferred_order(mac_types, num_macs) < 0)
+    return -1;
+
+  bench_log_results("cipher", ciphers, num_ciphers);
+  bench_log_results("MAC", macs, num_macs);
+  return 0;
+}
@@ -0,0 +1,8 @@
+/* algo_bench.h */
+
+#ifndef ALGO_BENCH_H_FILE
+#define ALGO_BENCH_H_FILE
+
+int ssh_algo_bench_run(const char *cache_filename);
+
+#endif /* ALGO_BENCH_H_FILE */
@@ -1,6 +1,53 @@
-/* channel.c */
+/* channel.c
+ *
+ * Channels (RFC 4254).
+ *
+ * Outgoing channel data is not sent right away: each channel queues
+ * its data messages, and ssh_chan_send_queued() picks the next
+ * message to encrypt and send only when the socket has taken all the
+ * data already sent.  Other messages (window adjusts, requests,
+ * global messages) bypass the queues, so they never wait behind bulk
+ * data.
+ *
+ * Channels with little queued data (usually typed keys) are served
+ * first.  The other channels share the bandwidth with deficit round
+ * robin: in its turn, each channel may send up to 'weight' times
+ * CHAN_SCHED_QUANTUM bytes.
+ *
+ * Channels and the connection can have token bucket rate limits
+ * (common/rate_limit.c).  The scheduler skips channels over their
+ * limit, and when nothing can be sent the main loop polls with a
+ * timeout until the limits allow it, so data is paced instead of
+ * sent in bursts.  The connection limit is also given to the kernel
+ * with SO_MAX_PACING_RATE, and TCP_NOTSENT_LOWAT keeps the socket
+ * buffer from holding more than a little unsent data.
+ *
+ * Channels can be opened at any time with ssh_conn_open_channel(),
+ * also from other threads: the configs are queued and the main loop
+ * sends SSH_MSG_CHANNEL_OPEN for all of them without waiting for the
+ * previous confirmations.  Closing a channel sends its queued data
+ * and SSH_MSG_CHANNEL_CLOSE, and the channel is freed when the
+ * server closes it too, so its number can be reused.  The loop ends
+ * when no channels are left, unless the connection is kept alive
+ * while idle.
+ *
+ * The loop also runs the connection's timers (common/timer_wheel.c):
+ * poll() waits until the next one expires.  The connection uses one
+ * to send keepalives when the server is silent for too long.
+ *
+ * Received data the channel's owner still holds counts against the
+ * local window (see ssh_chan_set_recv_buffered()), so a slow consumer
+ * makes the server wait instead of making the owner's buffers grow.
+ * The data path buffers (the packet buffers, the channel queues and
+ * the owner's buffers) are reserved up front at their maximum sizes,
+ * so moving data doesn't allocate memory.  With 'check_allocs' set
+ * in the connection config, the loop's allocations are watched
+ * (common/alloc.c) after the first CHAN_ALLOC_CHECK_WARMUP_LEN bytes
+ * of data, and the connection fails if there were any.
+ */
 
 #include <stdlib.h>
+#include <unistd.h>
 #include <limits.h>
 #include <stdint.h>
 #include <string.h>
@@ -13,6 +60,7 @@
 #include "common/network_i.h"
 #include "ssh/connection_i.h"
 #include "ssh/channel_session_i.h"
+#include "ssh/message_i.h"
 
 #include "common/error.h"
 #include "common/debug.h"
@@ -20,6 +68,53 @@
 #include "ssh/debug.h"
 #include "ssh/ssh_constants.h"
 
+// max data queued per channel, including the message headers
+#define CHAN_MAX_QUEUED_DATA (256*1024)
+
+// queue space taken by a message besides its data: the length prefix
+// and the SSH_MSG_CHANNEL_EXTENDED_DATA header
+#define CHAN_QUEUED_MSG_OVERHEAD (4 + 13)
+
+// max data per message, even if the server takes more, so sent
+// packets always fit the stream's buffers
+#define CHAN_MAX_DATA_MSG_LEN (32*1024)
+
+// channels with at most this much data queued are interactive
+#define CHAN_INTERACTIVE_MAX_QUEUED 1024
+
+// bytes of bulk data sent per turn for each unit of weight
+#define CHAN_SCHED_QUANTUM (16*1024)
+
+#define CHAN_DEFAULT_WEIGHT 1
+
+// data queued by rate limited channels, in ms of sending at the limit
+#define CHAN_RATE_LIMIT_QUEUE_TIME 100
+
+// max data per message of rate limited channels, in ms of sending at
+// the limit, so slow channels send small messages often instead of
+// large messages in bursts
+#define CHAN_RATE_LIMIT_PACKET_TIME 10
+#define CHAN_RATE_LIMIT_MIN_PACKET  512
+
+// unsent data kept in the kernel's socket buffer
+#define CHAN_NOTSENT_LOWAT (16*1024)
+
+// keepalives without reply before giving up on the server
+#define CHAN_KEEPALIVE_MAX_MISSED 3
+
+// data sent or received before allocations are watched: the data
+// path buffers are reserved up front, so this only has to cover
+// what's set up the first time it's used, like the packet pool's
+// free lists; twice the largest buffer (the local window) is plenty
+#define CHAN_ALLOC_CHECK_WARMUP_LEN (2*SSH_CHAN_MAX_LOCAL_WINDOW)
+
+// fds polled by the main loop: the transport, the wake pipe and the
+// channels' fds
+#define CHAN_LOOP_MAX_POLL_FDS (2 + SSH_CONN_MAX_CHANNELS*MAX_POLL_FDS)
+
+#define MIN(a,b) (((a) < (b)) ? (a) : (b))
+#define MAX(a,b) (((a) > (b)) ? (a) : (b))
+
 static volatile sig_atomic_t signal_notified;
 
 typedef int (*chan_type_fn_opened)(struct SSH_CHAN *chan);
@@ -68,7 +163,7 @@ static int pollfd_events_to_chan_flags(short pollfd_events)
   return flags;
 }
 
-static int update_poll_fd_events(struct pollfd *poll_fds, nfds_t *num_poll_fds, int fd, short add_events, short remove_events)
+static int update_poll_fd_events(struct pollfd *poll_fds, nfds_t *num_poll_fds, nfds_t max_poll_fds, int fd, short add_events, short remove_events)
 {
   int i;
   
@@ -79,7 +174,7 @@ static int update_poll_fd_events(struct pollfd *poll_fds, nfds_t *num_poll_fds,
       return 0;
     }
   }
-  if (*num_poll_fds < MAX_POLL_FDS) {
+  if (*num_poll_fds < max_poll_fds) {
     poll_fds[*num_poll_fds].fd = fd;
     poll_fds[*num_poll_fds].events = add_events & ~remove_events;
     (*num_poll_fds)++;
@@ -95,13 +190,20 @@ static struct SSH_CHAN *chan_new(struct SSH_CONN *conn, const struct SSH_CHAN_CO
   uint32_t local_num;
   int i;
 
-  // allocate local number
+  if (conn->num_channels >= SSH_CONN_MAX_CHANNELS) {
+    ssh_set_error("too many channels");
+    return NULL;
+  }
+
+  // allocate the lowest local number not in use
   local_num = 0;
-  for (i = 0; i < conn->num_channels; i++) {
+  i = 0;
+  while (i < conn->num_channels) {
     if (conn->channels[i]->local_num == local_num) {
       local_num++;
       i = 0;
-    }
+    } else
+      i++;
   }
   
   if ((chan = ssh_alloc(sizeof(struct SSH_CHAN))) == NULL)
@@ -109,6 +211,8 @@ static struct SSH_CHAN *chan_new(struct SSH_CONN *conn, const struct SSH_CHAN_CO
   chan->conn = conn;
   chan->userdata = cfg->userdata;
   chan->status = SSH_CHAN_STATUS_REQUESTED;
+  chan->confirmed = 0;
+  chan->remote_closed = 0;
   chan->num_watch_fds = 0;
   
   chan->local_num = local_num;
@@ -127,6 +231,21 @@ static struct SSH_CHAN *chan_new(struct SSH_CONN *conn, const struct SSH_CHAN_CO
   chan->notify_received = cfg->notify_received;
   chan->notify_received_ext = cfg->notify_received_ext;
   chan->notify_signal = cfg->notify_signal;
+
+  chan->recv_buffered = 0;
+
+  chan->early_data = ssh_buf_new();
+  chan->early_eof = 0;
+  chan->out_queue = ssh_buf_new();
+  chan->out_queue_pos = 0;
+  if (ssh_buf_reserve(&chan->out_queue, CHAN_MAX_QUEUED_DATA) < 0) {
+    ssh_free(chan);
+    return NULL;
+  }
+  chan->weight = (cfg->weight != 0) ? cfg->weight : CHAN_DEFAULT_WEIGHT;
+  chan->deficit = 0;
+  ssh_rate_limit_init(&chan->rate_limit, cfg->rate_limit);
+  chan->num_pending_replies = 0;
   
   conn->channels[conn->num_channels++] = chan;
   return chan;
@@ -134,6 +253,8 @@ static struct SSH_CHAN *chan_new(struct SSH_CONN *conn, const struct SSH_CHAN_CO
 
 void ssh_chan_free(struct SSH_CHAN *chan)
 {
+  ssh_buf_free(&chan->early_data);
+  ssh_buf_free(&chan->out_queue);
   ssh_free(chan);
 }
 
@@ -163,18 +284,57 @@ static void chan_remove_closed_channels(struct SSH_CONN *conn)
   }
 }
 
+/*
+ * Count data sent or received, and start watching for allocations
+ * once the connection is warmed up.
+ */
+static void chan_count_data(struct SSH_CONN *conn, size_t len)
+{
+  if (conn->alloc_check_warmup == 0)
+    return;
+  if (len < conn->alloc_check_warmup) {
+    conn->alloc_check_warmup -= len;
+    return;
+  }
+  conn->alloc_check_warmup = 0;
+  memset(&conn->alloc_watch, 0, sizeof(conn->alloc_watch));
+  ssh_alloc_set_watch(&conn->alloc_watch);
+  conn->alloc_watch_started = 1;
+}
+
+/*
+ * Stop watching allocations, and fail if there were any since the
+ * connection was warmed up.
+ */
+static int chan_end_alloc_check(struct SSH_CONN *conn)
+{
+  struct SSH_ALLOC_WATCH *watch = &conn->alloc_watch;
+
+  if (! conn->check_allocs)
+    return 0;
+  if (! conn->alloc_watch_started) {
+    ssh_log("* WARNING: connection ended before the allocation check warmed up\n");
+    return 0;
+  }
+  ssh_alloc_set_watch(NULL);
+  if (watch->num_allocs != 0) {
+    ssh_set_error("%lu allocations in the data path after warm-up, the first at %s:%d",
+                  watch->num_allocs, (watch->first_file != NULL) ? watch->first_file : "(unknown)", watch->first_line);
+    return -1;
+  }
+  ssh_log("* no allocations in the data path after warm-up\n");
+  return 0;
+}
+
 static int chan_handle_global_request(struct SSH_CONN *conn, struct SSH_BUF_READER *pack)
 {
-  struct SSH_STRING req_name;
-  uint8_t want_reply;
+  struct SSH_MSG_global_request msg;
 
-  if (ssh_buf_read_skip(pack, 1) < 0  // packet type
-      || ssh_buf_read_string(pack, &req_name) < 0
-      || ssh_buf_read_u8(pack, &want_reply) < 0)
+  if (ssh_msg_parse_global_request(pack, &msg) < 0)
     return -1;
 
-  ssh_log("* received global request '%.*s' (want_reply=%d)\n", (int) req_name.len, req_name.str, want_reply);
-  if (want_reply) {
+  ssh_log("* received global request '%.*s' (want_reply=%d)\n", (int) msg.request_name.len, msg.request_name.str, msg.want_reply);
+  if (msg.want_reply) {
     struct SSH_BUFFER *reply = ssh_conn_new_packet(conn);
     if (reply == NULL
         || ssh_buf_write_u8(reply, SSH_MSG_REQUEST_FAILURE) < 0
@@ -187,21 +347,75 @@ static int chan_handle_global_request(struct SSH_CONN *conn, struct SSH_BUF_READ
 static int chan_send_channel_open(struct SSH_CONN *conn, struct SSH_CHAN *chan)
 {
   struct SSH_BUFFER *pack;
+  struct SSH_MSG_channel_open msg;
   const struct CHAN_TYPE_INFO *type_info = chan_get_type_info(chan->type);
 
-  if (type_info == NULL
-      || (pack = ssh_conn_new_packet(conn)) == NULL
-      || ssh_buf_write_u8(pack, SSH_MSG_CHANNEL_OPEN) < 0
-      || ssh_buf_write_cstring(pack, type_info->name) < 0
-      || ssh_buf_write_u32(pack, chan->local_num) < 0
-      || ssh_buf_write_u32(pack, chan->local_window_size) < 0
-      || ssh_buf_write_u32(pack, chan->local_max_packet_size) < 0
+  if (type_info == NULL)
+    return -1;
+  msg.channel_type = ssh_str_new_from_cstring(type_info->name);
+  msg.sender_channel = chan->local_num;
+  msg.initial_window_size = chan->local_window_size;
+  msg.max_packet_size = chan->local_max_packet_size;
+  if ((pack = ssh_conn_new_packet(conn)) == NULL
+      || ssh_msg_build_channel_open(pack, &msg) < 0
       || ssh_conn_send_packet(conn) < 0)
     return -1;
   return 0;
 }
 
-static int chan_check_adjust_local_window(struct SSH_CONN *conn, struct SSH_CHAN *chan, size_t len)
+static int chan_send_channel_close(struct SSH_CONN *conn, struct SSH_CHAN *chan)
+{
+  struct SSH_BUFFER *pack;
+  struct SSH_MSG_channel_close msg;
+
+  msg.recipient_channel = chan->remote_num;
+  if ((pack = ssh_conn_new_packet(conn)) == NULL
+      || ssh_msg_build_channel_close(pack, &msg) < 0
+      || ssh_conn_send_packet(conn) < 0)
+    return -1;
+  return 0;
+}
+
+/*
+ * Handle SSH_MSG_CHANNEL_CLOSE from the server.  Unless we already
+ * sent ours, the reply is sent by chan_send_pending_closes() after
+ * the channel's queued data, so it doesn't overtake it.
+ */
+static void chan_handle_remote_close(struct SSH_CHAN *chan)
+{
+  enum SSH_CHAN_STATUS status = chan->status;
+
+  if (status == SSH_CHAN_STATUS_OPEN)
+    chan->notify_closed(chan, chan->userdata);
+  else if (status == SSH_CHAN_STATUS_REQUESTED)
+    chan->notify_open_failed(chan, chan->userdata);
+  if (status == SSH_CHAN_STATUS_CLOSE_SENT) {
+    chan->status = SSH_CHAN_STATUS_CLOSED;
+    return;
+  }
+  chan->remote_closed = 1;
+  chan->status = SSH_CHAN_STATUS_CLOSING;
+}
+
+/*
+ * Pass a SSH_MSG_CHANNEL_SUCCESS or SSH_MSG_CHANNEL_FAILURE to the
+ * handler of the oldest request waiting for a reply.
+ */
+static int chan_handle_request_reply(struct SSH_CHAN *chan, int success)
+{
+  ssh_chan_fn_reply handle_reply;
+
+  if (chan->num_pending_replies == 0) {
+    ssh_log("WARNING: unexpected request reply for channel %u\n", chan->local_num);
+    return 0;
+  }
+  handle_reply = chan->pending_replies[0];
+  memmove(&chan->pending_replies[0], &chan->pending_replies[1], (chan->num_pending_replies-1) * sizeof(ssh_chan_fn_reply));
+  chan->num_pending_replies--;
+  return handle_reply(chan, success);
+}
+
+static void chan_consume_local_window(struct SSH_CHAN *chan, size_t len)
 {
   uint32_t consume_len;
 
@@ -218,95 +432,183 @@ static int chan_check_adjust_local_window(struct SSH_CONN *conn, struct SSH_CHAN
   } else {
     chan->local_window_size -= consume_len;
   }
+}
+
+static int chan_check_adjust_local_window(struct SSH_CONN *conn, struct SSH_CHAN *chan, size_t len)
+{
+  uint32_t buffered = chan->recv_buffered;
+
+  chan_consume_local_window(chan, len);
 
-  if (chan->local_window_size < 512*1024) {
+  // data still held by the owner counts against the window
+  if (chan->local_window_size + buffered < SSH_CHAN_MAX_LOCAL_WINDOW/4) {
     struct SSH_BUFFER *pack;
-    uint32_t bytes_to_add = 2*1024*1024 - chan->local_window_size;
+    struct SSH_MSG_channel_window_adjust msg;
 
-    //ssh_log("* adjusting local window size: +%u bytes\n", bytes_to_add);
+    msg.recipient_channel = chan->remote_num;
+    msg.bytes_to_add = SSH_CHAN_MAX_LOCAL_WINDOW - buffered - chan->local_window_size;
+    //ssh_log("* adjusting local window size: +%u bytes\n", msg.bytes_to_add);
     if ((pack = ssh_conn_new_packet(conn)) == NULL
-        || ssh_buf_write_u8(pack, SSH_MSG_CHANNEL_WINDOW_ADJUST) < 0
-        || ssh_buf_write_u32(pack, chan->remote_num) < 0
-        || ssh_buf_write_u32(pack, bytes_to_add) < 0
+        || ssh_msg_build_channel_window_adjust(pack, &msg) < 0
         || ssh_conn_send_packet(conn) < 0)
       return -1;
-    chan->local_window_size += bytes_to_add;
+    chan->local_window_size += msg.bytes_to_add;
   }
   return 0;
 }
 
+/*
+ * Mark the channel open and tell its owner, then pass it the data
+ * and EOF the server sent before it was open.
+ */
+int ssh_chan_set_open(struct SSH_CHAN *chan)
+{
+  size_t len = chan->early_data.len;
+
+  chan->status = SSH_CHAN_STATUS_OPEN;
+  if (chan->notify_open(chan, chan->userdata) < 0) {
+    ssh_chan_close(chan);
+    return 0;
+  }
+  if (len > 0) {
+    chan->notify_received(chan, chan->userdata, chan->early_data.data, len);
+    ssh_buf_clear(&chan->early_data);
+    if (chan_check_adjust_local_window(chan->conn, chan, 0) < 0)
+      return -1;
+  }
+  if (chan->early_eof && chan->status == SSH_CHAN_STATUS_OPEN)
+    chan->notify_received(chan, chan->userdata, NULL, 0);
+  return 0;
+}
+
 static int chan_process_channel_packet(struct SSH_CONN *conn, struct SSH_BUF_READER *pack)
 {
   struct SSH_CHAN *chan;
-  uint8_t pack_type;
-  uint32_t local_num;
-  
-  if (ssh_buf_read_u8(pack, &pack_type) < 0
-      || ssh_buf_read_u32(pack, &local_num) < 0
-      || (chan = chan_get_by_num(conn, local_num)) == NULL)
-    return -1;
+  int pack_type = ssh_packet_get_type(pack);
 
   switch (pack_type) {
   case SSH_MSG_CHANNEL_WINDOW_ADJUST:
     {
-      uint32_t bytes_to_add;
-      
-      if (ssh_buf_read_u32(pack, &bytes_to_add) < 0)
-        return 1;
-      //ssh_log("* adjusting remote window size: +%u bytes\n", bytes_to_add);
-      if (chan->remote_window_size + bytes_to_add < chan->remote_window_size) {
-        ssh_log("remote window size overflow: %u + %u\n", chan->remote_window_size, bytes_to_add);
+      struct SSH_MSG_channel_window_adjust msg;
+
+      if (ssh_msg_parse_channel_window_adjust(pack, &msg) < 0
+          || (chan = chan_get_by_num(conn, msg.recipient_channel)) == NULL)
+        return -1;
+      //ssh_log("* adjusting remote window size: +%u bytes\n", msg.bytes_to_add);
+      if (chan->remote_window_size + msg.bytes_to_add < chan->remote_window_size) {
+        ssh_log("remote window size overflow: %u + %u\n", chan->remote_window_size, msg.bytes_to_add);
         chan->remote_window_size = 0xffffffffu;
       } else {
-        chan->remote_window_size += bytes_to_add;
+        chan->remote_window_size += msg.bytes_to_add;
       }
     }
     break;
 
   case SSH_MSG_CHANNEL_OPEN_CONFIRMATION:
     {
-      const struct CHAN_TYPE_INFO *type_info = chan_get_type_info(chan->type);
-      if (type_info == NULL)
-        return -1;
-      
-      if (ssh_buf_read_u32(pack, &chan->remote_num) < 0
-          || ssh_buf_read_u32(pack, &chan->remote_window_size) < 0
-          || ssh_buf_read_u32(pack, &chan->remote_max_packet_size) < 0)
+      struct SSH_MSG_channel_open_confirmation msg;
+      const struct CHAN_TYPE_INFO *type_info;
+
+      if (ssh_msg_parse_channel_open_confirmation(pack, &msg) < 0
+          || (chan = chan_get_by_num(conn, msg.recipient_channel)) == NULL
+          || (type_info = chan_get_type_info(chan->type)) == NULL)
         return -1;
 
-      if (type_info->opened(chan) < 0)
+      chan->confirmed = 1;
+      chan->remote_num = msg.sender_channel;
+      chan->remote_window_size = msg.initial_window_size;
+      chan->remote_max_packet_size = msg.max_packet_size;
+
+      // if it was closed while waiting, it's closed in the main loop
+      if (chan->status == SSH_CHAN_STATUS_REQUESTED && type_info->opened(chan) < 0)
         return -1;
     }
     break;
     
   case SSH_MSG_CHANNEL_OPEN_FAILURE:
-    chan->notify_open_failed(chan, chan->userdata);
-    ssh_chan_close(chan);
+    {
+      struct SSH_MSG_channel_open_failure msg;
+
+      if (ssh_msg_parse_channel_open_failure(pack, &msg) < 0
+          || (chan = chan_get_by_num(conn, msg.recipient_channel)) == NULL)
+        return -1;
+      if (chan->status == SSH_CHAN_STATUS_REQUESTED)
+        chan->notify_open_failed(chan, chan->userdata);
+      chan->status = SSH_CHAN_STATUS_CLOSED;
+    }
     break;
 
   case SSH_MSG_CHANNEL_DATA:
     {
-      struct SSH_STRING data;
-      if (ssh_buf_read_string(pack, &data) < 0)
+      struct SSH_MSG_channel_data msg;
+
+      if (ssh_msg_parse_channel_data(pack, &msg) < 0
+          || (chan = chan_get_by_num(conn, msg.recipient_channel)) == NULL)
         return -1;
-      chan->notify_received(chan, chan->userdata, data.str, data.len);
-      if (chan_check_adjust_local_window(conn, chan, data.len) < 0)
+      chan_count_data(conn, msg.data.len);
+      if (chan->status == SSH_CHAN_STATUS_REQUESTED) {
+        // confirmed but not open yet (e.g., the shell started before
+        // the reply to its request): keep it until the channel opens,
+        // without opening the window for more
+        if (ssh_buf_append_data(&chan->early_data, msg.data.str, msg.data.len) < 0)
+          return -1;
+        chan_consume_local_window(chan, msg.data.len);
+        break;
+      }
+      if (chan->status == SSH_CHAN_STATUS_OPEN)
+        chan->notify_received(chan, chan->userdata, msg.data.str, msg.data.len);
+      if (chan_check_adjust_local_window(conn, chan, msg.data.len) < 0)
         return -1;
     }
     break;
 
   case SSH_MSG_CHANNEL_EOF:
-    chan->notify_received(chan, chan->userdata, NULL, 0);
+    {
+      struct SSH_MSG_channel_eof msg;
+
+      if (ssh_msg_parse_channel_eof(pack, &msg) < 0
+          || (chan = chan_get_by_num(conn, msg.recipient_channel)) == NULL)
+        return -1;
+      if (chan->status == SSH_CHAN_STATUS_REQUESTED)
+        chan->early_eof = 1;
+      else if (chan->status == SSH_CHAN_STATUS_OPEN)
+        chan->notify_received(chan, chan->userdata, NULL, 0);
+    }
     break;
 
   case SSH_MSG_CHANNEL_CLOSE:
-    ssh_chan_close(chan);
+    {
+      struct SSH_MSG_channel_close msg;
+
+      if (ssh_msg_parse_channel_close(pack, &msg) < 0
+          || (chan = chan_get_by_num(conn, msg.recipient_channel)) == NULL)
+        return -1;
+      chan_handle_remote_close(chan);
+    }
+    break;
+
+  case SSH_MSG_CHANNEL_SUCCESS:
+  case SSH_MSG_CHANNEL_FAILURE:
+    {
+      uint32_t local_num;
+
+      if (ssh_buf_read_u8(pack, NULL) < 0
+          || ssh_buf_read_u32(pack, &local_num) < 0
+          || (chan = chan_get_by_num(conn, local_num)) == NULL
+          || chan_handle_request_reply(chan, pack_type == SSH_MSG_CHANNEL_SUCCESS) < 0)
+        return -1;
+    }
     break;
 
   default:
     {
-      const struct CHAN_TYPE_INFO *type_info = chan_get_type_info(chan->type);
-      if (type_info == NULL
+      const struct CHAN_TYPE_INFO *type_info;
+      uint32_t local_num;
+
+      if (ssh_buf_read_u8(pack, NULL) < 0
+          || ssh_buf_read_u32(pack, &local_num) < 0
+          || (chan = chan_get_by_num(conn, local_num)) == NULL
+          || (type_info = chan_get_type_info(chan->type)) == NULL
           || type_info->process_packet(chan, pack) < 0)
         return -1;
     }
@@ -316,6 +618,32 @@ static int chan_process_channel_packet(struct SSH_CONN *conn, struct SSH_BUF_REA
   return 0;
 }
 
+/*
+ * Send a keepalive (a global request the server must reply to) when
+ * the server was silent for the keepalive interval, and fail when it
+ * didn't answer too many of them.
+ */
+static int chan_keepalive_expired(struct SSH_TIMER *timer, void *data)
+{
+  struct SSH_CONN *conn = data;
+  struct SSH_MSG_global_request msg;
+  struct SSH_BUFFER *pack;
+
+  if (conn->keepalive_missed >= CHAN_KEEPALIVE_MAX_MISSED) {
+    ssh_set_error("server not responding");
+    return -1;
+  }
+  msg.request_name = ssh_str_new_from_cstring("keepalive@openssh.com");
+  msg.want_reply = 1;
+  if ((pack = ssh_conn_new_packet(conn)) == NULL
+      || ssh_msg_build_global_request(pack, &msg) < 0
+      || ssh_conn_send_packet(conn) < 0)
+    return -1;
+  conn->keepalive_missed++;
+  ssh_conn_set_timer(conn, timer, conn->keepalive_interval);
+  return 0;
+}
+
 static int chan_process_packets(struct SSH_CONN *conn)
 {
   uint8_t pack_type;
@@ -328,6 +656,11 @@ static int chan_process_packets(struct SSH_CONN *conn)
       return -1;
     }
 
+    if (conn->keepalive_interval != 0) {
+      conn->keepalive_missed = 0;
+      ssh_conn_set_timer(conn, &conn->keepalive_timer, conn->keepalive_interval);
+    }
+
     pack_type = ssh_packet_get_type(pack);
 
     // channel packet
@@ -344,6 +677,9 @@ static int chan_process_packets(struct SSH_CONN *conn)
         return -1;
       break;
 
+    case SSH_MSG_REQUEST_SUCCESS:
+    case SSH_MSG_REQUEST_FAILURE:
+      // reply to a keepalive
     case SSH_MSG_IGNORE:
     case SSH_MSG_UNIMPLEMENTED:
     case SSH_MSG_DEBUG:
@@ -362,6 +698,8 @@ static int chan_notify_channels_watch_fds(struct SSH_CONN *conn, struct pollfd *
 
   for (i = 0; i < conn->num_channels; i++) {
     struct SSH_CHAN *chan = conn->channels[i];
+    if (chan->status != SSH_CHAN_STATUS_OPEN)
+      continue;
     for (j = 0; j < chan->num_watch_fds; j++) {
       if (poll_fd->revents != 0 && poll_fd->fd == chan->watch_fds[j].fd) {
         if (chan->notify_fd_ready(chan, chan->userdata, poll_fd->fd,
@@ -377,9 +715,11 @@ static void chan_collect_channel_poll_fds(struct SSH_CHAN *chan, struct pollfd *
 {
   int i;
   
+  if (chan->status != SSH_CHAN_STATUS_OPEN)
+    return;
   for (i = 0; i < chan->num_watch_fds; i++) {
     struct pollfd *chan_fd = &chan->watch_fds[i];
-    update_poll_fd_events(ret_poll_fds, ret_num_poll_fds, chan_fd->fd, chan_fd->events, 0);
+    update_poll_fd_events(ret_poll_fds, ret_num_poll_fds, CHAN_LOOP_MAX_POLL_FDS, chan_fd->fd, chan_fd->events, 0);
   }
 }
 
@@ -394,21 +734,255 @@ static int chan_handle_signal_notification(struct SSH_CONN *conn)
   signal_notified = 0;
   for (i = 0; i < conn->num_channels; i++) {
     struct SSH_CHAN *chan = conn->channels[i];
-    if (chan->notify_signal(chan, chan->userdata) < 0)
+    if (chan->status == SSH_CHAN_STATUS_OPEN && chan->notify_signal(chan, chan->userdata) < 0)
       return -1;
   }
   return 0;
 }
 
+/*
+ * Output scheduling
+ */
+
+static size_t chan_queued_len(struct SSH_CHAN *chan)
+{
+  return chan->out_queue.len - chan->out_queue_pos;
+}
+
+static uint32_t chan_queued_head_len(struct SSH_CHAN *chan)
+{
+  return ssh_buf_load_be32(chan->out_queue.data + chan->out_queue_pos);
+}
+
+/*
+ * Send the message at the head of the channel's queue.
+ */
+static int chan_send_queued_head(struct SSH_CONN *conn, struct SSH_CHAN *chan)
+{
+  struct SSH_BUFFER *pack;
+  uint32_t len = chan_queued_head_len(chan);
+  uint8_t *p;
+
+  if ((pack = ssh_conn_new_packet(conn)) == NULL
+      || (p = ssh_buf_get_write_pointer(pack, len)) == NULL)
+    return -1;
+  memcpy(p, chan->out_queue.data + chan->out_queue_pos + 4, len);
+  chan->out_queue_pos += 4 + len;
+  if (chan->out_queue_pos == chan->out_queue.len) {
+    ssh_buf_clear(&chan->out_queue);
+    chan->out_queue_pos = 0;
+  }
+  chan_count_data(conn, len);
+  return ssh_conn_send_packet(conn);
+}
+
+/*
+ * Return 1 if the channel has data queued and its rate limit allows
+ * sending it now.  Otherwise, update '*wait' with the time until it
+ * can send, if it has data.
+ */
+static int chan_can_send(struct SSH_CHAN *chan, uint64_t now, uint64_t *wait)
+{
+  uint64_t chan_wait;
+
+  if (chan_queued_len(chan) == 0)
+    return 0;
+  if (ssh_rate_limit_can_send(&chan->rate_limit, now))
+    return 1;
+  chan_wait = ssh_rate_limit_get_wait(&chan->rate_limit, now);
+  if (*wait == 0 || chan_wait < *wait)
+    *wait = chan_wait;
+  return 0;
+}
+
+/*
+ * Return the next channel to send data, or NULL if no channel can
+ * send now.  If some channel has data but is waiting for its rate
+ * limit, '*wait' is set to the time until one can send.
+ */
+static struct SSH_CHAN *chan_schedule_next(struct SSH_CONN *conn, uint64_t now, uint64_t *wait)
+{
+  struct SSH_CHAN *chan;
+  int i, num_skipped;
+
+  // interactive channels first
+  for (i = 0; i < conn->num_channels; i++) {
+    chan = conn->channels[i];
+    if (chan_queued_len(chan) <= CHAN_INTERACTIVE_MAX_QUEUED && chan_can_send(chan, now, wait))
+      return chan;
+  }
+
+  // deficit round robin for bulk channels
+  num_skipped = 0;
+  while (num_skipped < conn->num_channels) {
+    if (conn->sched_chan >= conn->num_channels)
+      conn->sched_chan = 0;
+    chan = conn->channels[conn->sched_chan];
+    if (! chan_can_send(chan, now, wait)) {
+      if (chan_queued_len(chan) == 0)
+        chan->deficit = 0;
+      conn->sched_chan++;
+      num_skipped++;
+      continue;
+    }
+    num_skipped = 0;
+    if (chan->deficit >= chan_queued_head_len(chan)) {
+      chan->deficit -= chan_queued_head_len(chan);
+      return chan;
+    }
+    chan->deficit += chan->weight * CHAN_SCHED_QUANTUM;
+    conn->sched_chan++;
+  }
+  return NULL;
+}
+
+int ssh_chan_has_queued_data(struct SSH_CONN *conn)
+{
+  int i;
+
+  for (i = 0; i < conn->num_channels; i++)
+    if (chan_queued_len(conn->channels[i]) > 0)
+      return 1;
+  return 0;
+}
+
+/*
+ * Flush pending output and send queued channel data until the socket
+ * would block, the rate limits are reached or there's nothing left to
+ * send.  Each message is only encrypted when all previous data was
+ * written, so higher priority messages queued later don't wait behind
+ * it.
+ *
+ * If sending stops because of a rate limit, conn->send_resume_time is
+ * set to when it can continue.
+ */
+int ssh_chan_send_queued(struct SSH_CONN *conn)
+{
+  struct SSH_CHAN *chan;
+  uint64_t now, wait;
+
+  conn->send_resume_time = 0;
+  if (ssh_conn_send_flush(conn) < 0)
+    return -1;
+  now = ssh_rate_limit_now();
+  while (! ssh_conn_send_is_pending(conn)) {
+    wait = 0;
+    if (! ssh_rate_limit_can_send(&conn->rate_limit, now)) {
+      if (ssh_chan_has_queued_data(conn))
+        wait = ssh_rate_limit_get_wait(&conn->rate_limit, now);
+      chan = NULL;
+    } else
+      chan = chan_schedule_next(conn, now, &wait);
+    if (chan == NULL) {
+      if (wait != 0)
+        conn->send_resume_time = now + wait;
+      break;
+    }
+
+    ssh_rate_limit_consume(&conn->rate_limit, chan_queued_head_len(chan));
+    ssh_rate_limit_consume(&chan->rate_limit, chan_queued_head_len(chan));
+    if (chan_send_queued_head(conn, chan) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+/*
+ * Return the poll() timeout until queued data can be sent, -1 if
+ * there's no need to wait.
+ */
+static int chan_get_send_timeout(struct SSH_CONN *conn)
+{
+  uint64_t now;
+
+  if (conn->send_resume_time == 0)
+    return -1;
+  now = ssh_rate_limit_now();
+  if (now >= conn->send_resume_time)
+    return 0;
+  return (conn->send_resume_time - now + 999999) / 1000000;
+}
+
+/*
+ * Return the shortest of two poll() timeouts, where -1 means no
+ * timeout.
+ */
+static int chan_min_timeout(int a, int b)
+{
+  if (a < 0)
+    return b;
+  if (b < 0)
+    return a;
+  return MIN(a, b);
+}
+
+/*
+ * Send SSH_MSG_CHANNEL_CLOSE for the channels being closed, once the
+ * server confirmed them and their queued data was sent.
+ */
+static int chan_send_pending_closes(struct SSH_CONN *conn)
+{
+  int i;
+
+  for (i = 0; i < conn->num_channels; i++) {
+    struct SSH_CHAN *chan = conn->channels[i];
+    if (chan->status == SSH_CHAN_STATUS_CLOSING && chan->confirmed && chan_queued_len(chan) == 0) {
+      if (chan_send_channel_close(conn, chan) < 0)
+        return -1;
+      chan->status = (chan->remote_closed) ? SSH_CHAN_STATUS_CLOSED : SSH_CHAN_STATUS_CLOSE_SENT;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Open the channels queued by ssh_chan_queue_open(), as many as
+ * there's room for.  '*keep_running' is set if the loop must keep
+ * running even with no channels.
+ */
+static int chan_open_queued(struct SSH_CONN *conn, int *keep_running)
+{
+  int i, num_open, ret = 0;
+
+  pthread_mutex_lock(&conn->open_lock);
+  num_open = MIN(conn->num_open_queue, SSH_CONN_MAX_CHANNELS - conn->num_channels);
+  for (i = 0; i < num_open; i++) {
+    struct SSH_CHAN *chan = chan_new(conn, &conn->open_queue[i]);
+    if (chan == NULL || chan_send_channel_open(conn, chan) < 0) {
+      ret = -1;
+      break;
+    }
+  }
+  memmove(&conn->open_queue[0], &conn->open_queue[i], (conn->num_open_queue-i) * sizeof(struct SSH_CHAN_CONFIG));
+  conn->num_open_queue -= i;
+  *keep_running = conn->keep_alive_idle || conn->num_open_queue > 0;
+  pthread_mutex_unlock(&conn->open_lock);
+  return ret;
+}
+
+static void chan_drain_wake_pipe(struct SSH_CONN *conn)
+{
+  uint8_t buf[64];
+  ssize_t r;
+
+  do {
+    r = read(conn->wake_fds[0], buf, sizeof(buf));
+  } while (r > 0 || (r < 0 && errno == EINTR));
+}
+
 static int chan_loop(struct SSH_CONN *conn)
 {
-  struct pollfd poll_fds[MAX_POLL_FDS];
+  struct pollfd poll_fds[CHAN_LOOP_MAX_POLL_FDS];
   nfds_t num_poll_fds;
-  int i;
+  int i, timeout, poll_timeout, want_write, transport_flags, keep_running;
 
   while (1) {
+    if (chan_send_pending_closes(conn) < 0)
+      return -1;
     chan_remove_closed_channels(conn);
-    if (conn->num_channels == 0)
+    if (chan_open_queued(conn, &keep_running) < 0)
+      return -1;
+    if (conn->num_channels == 0 && ! keep_running)
       break;
 
     if (signal_notified) {
@@ -416,72 +990,158 @@ static int chan_loop(struct SSH_CONN *conn)
         return -1;
     }
     
-    poll_fds[0].fd = conn->sock;
-    poll_fds[0].events = POLLIN;
-    if (ssh_conn_send_is_pending(conn))
-      poll_fds[0].events |= POLLOUT;
-    num_poll_fds = 1;
+    // wait for the transport if there's data to send, or for the rate
+    // limits if it's waiting for them
+    timeout = chan_get_send_timeout(conn);
+    want_write = ssh_conn_send_is_pending(conn) || (timeout < 0 && ssh_chan_has_queued_data(conn));
+    poll_timeout = chan_min_timeout(timeout, ssh_timer_wheel_get_timeout(&conn->timers, ssh_timer_now()));
+    if (ssh_transport_poll_prepare(conn->transport, &poll_fds[0], want_write, &poll_timeout) < 0)
+      return -1;
+    poll_fds[1].fd = conn->wake_fds[0];
+    poll_fds[1].events = POLLIN;
+    num_poll_fds = 2;
 
     for (i = 0; i < conn->num_channels; i++)
       chan_collect_channel_poll_fds(conn->channels[i], poll_fds, &num_poll_fds);
 
     //ssh_log("* polling %d fds\n", (int) num_poll_fds); for (i = 0; i < num_poll_fds; i++) ssh_log(" -> fd %d with flags %d\n", poll_fds[i].fd, poll_fds[i].events);
-    if (poll(poll_fds, num_poll_fds, -1) < 0) {
+    if (poll(poll_fds, num_poll_fds, poll_timeout) < 0) {
       if (errno == EINTR)
         continue;
       return -1;
     }
     //ssh_log("* got poll result:\n"); for (i = 0; i < num_poll_fds; i++) ssh_log(" -> fd %d has flags %d\n", poll_fds[i].fd, poll_fds[i].revents);
 
-    if ((poll_fds[0].revents & POLLIN) != 0) {
+    if ((transport_flags = ssh_transport_poll_result(conn->transport, &poll_fds[0])) < 0)
+      return -1;
+    if ((transport_flags & SSH_TRANSPORT_CAN_READ) != 0) {
       if (chan_process_packets(conn) < 0)
         return -1;
     }
-    if ((poll_fds[0].revents & POLLOUT) != 0) {
-      if (ssh_conn_send_flush(conn) < 0 && errno != EWOULDBLOCK)
+    if ((want_write && (transport_flags & SSH_TRANSPORT_CAN_WRITE) != 0)
+        || (timeout >= 0 && chan_get_send_timeout(conn) == 0)) {
+      if (ssh_chan_send_queued(conn) < 0 && errno != EWOULDBLOCK)
         return -1;
     }
 
-    for (i = 1; i < num_poll_fds; i++) {
+    if ((poll_fds[1].revents & POLLIN) != 0)
+      chan_drain_wake_pipe(conn);
+
+    for (i = 2; i < num_poll_fds; i++) {
       if (chan_notify_channels_watch_fds(conn, &poll_fds[i]) < 0)
         return -1;
     }
+
+    if (ssh_timer_wheel_run(&conn->timers, ssh_timer_now()) < 0)
+      return -1;
   }
 
   return 0;
 }
 
+/*
+ * Drop all channels without waiting for the server to close them,
+ * when the connection ends.
+ */
 static void chan_close_all_channels(struct SSH_CONN *conn)
 {
   int i;
   
-  for (i = 0; i < conn->num_channels; i++)
-    ssh_chan_close(conn->channels[i]);
+  for (i = 0; i < conn->num_channels; i++) {
+    struct SSH_CHAN *chan = conn->channels[i];
+    ssh_chan_close(chan);
+    chan->status = SSH_CHAN_STATUS_CLOSED;
+  }
   chan_remove_closed_channels(conn);
 }
 
 int ssh_chan_run_connection(struct SSH_CONN *conn, int num_channels, const struct SSH_CHAN_CONFIG *channel_cfgs)
 {
-  int i;
+  int i, ret;
 
-  if (ssh_net_set_sock_blocking(conn->sock, 0) < 0)
+  if (ssh_transport_set_blocking(conn->transport, 0) < 0)
     return -1;
+  if (ssh_net_set_notsent_lowat(conn->transport->sock, CHAN_NOTSENT_LOWAT) < 0)
+    ssh_log("WARNING: %s\n", ssh_get_error());
   
   for (i = 0; i < num_channels; i++) {
-    struct SSH_CHAN *chan = chan_new(conn, &channel_cfgs[i]);
-    if (chan == NULL)
-      return -1;
-    if (chan_send_channel_open(conn, chan) < 0)
+    if (ssh_chan_queue_open(conn, &channel_cfgs[i]) < 0)
       return -1;
-    chan->status = SSH_CHAN_STATUS_REQUESTED;
+  }
+
+  if (conn->keepalive_interval != 0) {
+    conn->keepalive_missed = 0;
+    ssh_timer_init(&conn->keepalive_timer, chan_keepalive_expired, conn);
+    ssh_conn_set_timer(conn, &conn->keepalive_timer, conn->keepalive_interval);
+  }
+  // size the packet buffers for the data path up front
+  if (ssh_stream_reserve_buffers(&conn->in_stream) < 0
+      || ssh_stream_reserve_buffers(&conn->out_stream) < 0)
+    return -1;
+  if (conn->check_allocs) {
+    conn->alloc_check_warmup = CHAN_ALLOC_CHECK_WARMUP_LEN;
+    conn->alloc_watch_started = 0;
   }
   
-  if (chan_loop(conn) < 0) {
-    chan_close_all_channels(conn);
+  ret = chan_loop(conn);
+  if (conn->keepalive_interval != 0)
+    ssh_timer_cancel(&conn->keepalive_timer);
+  if (chan_end_alloc_check(conn) < 0)
+    ret = -1;
+  chan_close_all_channels(conn);
+  return ret;
+}
+
+/*
+ * Queue a channel to be opened by chan_loop().  Can be called from
+ * any thread.
+ */
+int ssh_chan_queue_open(struct SSH_CONN *conn, const struct SSH_CHAN_CONFIG *cfg)
+{
+  struct SSH_CHAN_CONFIG *open_queue;
+
+  if (chan_get_type_info(cfg->type) == NULL)
+    return -1;
+
+  pthread_mutex_lock(&conn->open_lock);
+  open_queue = ssh_realloc(conn->open_queue, (conn->num_open_queue+1) * sizeof(struct SSH_CHAN_CONFIG));
+  if (open_queue == NULL) {
+    pthread_mutex_unlock(&conn->open_lock);
     return -1;
   }
+  conn->open_queue = open_queue;
+  conn->open_queue[conn->num_open_queue++] = *cfg;
+  pthread_mutex_unlock(&conn->open_lock);
 
-  chan_close_all_channels(conn);
+  ssh_chan_wake_loop(conn);
+  return 0;
+}
+
+/*
+ * Wake chan_loop() if it's waiting in poll().  Can be called from
+ * any thread.
+ */
+void ssh_chan_wake_loop(struct SSH_CONN *conn)
+{
+  uint8_t b = 0;
+
+  // if the pipe is full the loop will wake up anyway
+  while (write(conn->wake_fds[1], &b, 1) < 0 && errno == EINTR)
+    ;
+}
+
+/*
+ * Register the handler for the reply to a channel request sent with
+ * want_reply set.  Must be called when the request is sent, since
+ * the server replies in the same order.
+ */
+int ssh_chan_expect_reply(struct SSH_CHAN *chan, ssh_chan_fn_reply handle_reply)
+{
+  if (chan->num_pending_replies >= SSH_CHAN_MAX_PENDING_REPLIES) {
+    ssh_set_error("too many channel requests waiting for reply");
+    return -1;
+  }
+  chan->pending_replies[chan->num_pending_replies++] = handle_reply;
   return 0;
 }
 
@@ -502,56 +1162,117 @@ void ssh_chan_notify_signal(void)
   signal_notified = 1;
 }
 
-ssize_t ssh_chan_send_data(struct SSH_CHAN *chan, void *data, size_t data_len)
+/*
+ * Return how much of 'data_len' bytes of data the channel can queue
+ * now.
+ */
+static size_t chan_get_send_len(struct SSH_CHAN *chan, size_t data_len)
 {
-  struct SSH_BUFFER *pack;
-  size_t process_len = data_len;
+  size_t max_queued = CHAN_MAX_QUEUED_DATA;
+  size_t max_msg_len = MIN(chan->remote_max_packet_size, CHAN_MAX_DATA_MSG_LEN);
+  size_t queued_len = chan_queued_len(chan) + CHAN_QUEUED_MSG_OVERHEAD;
+  size_t queue_room;
+
+  // keep the queue of rate limited channels short, so data doesn't
+  // wait long
+  if (chan->rate_limit.rate != 0) {
+    uint64_t queue_len = chan->rate_limit.rate * CHAN_RATE_LIMIT_QUEUE_TIME / 1000;
+    uint64_t packet_len = chan->rate_limit.rate * CHAN_RATE_LIMIT_PACKET_TIME / 1000;
+
+    max_queued = MAX(MIN(queue_len, CHAN_MAX_QUEUED_DATA), max_msg_len + CHAN_QUEUED_MSG_OVERHEAD);
+    packet_len = MAX(packet_len, CHAN_RATE_LIMIT_MIN_PACKET);
+    if (data_len > packet_len)
+      data_len = packet_len;
+  }
+  queue_room = max_queued - MIN(queued_len, max_queued);
+
+  if (data_len > chan->remote_window_size)
+    data_len = chan->remote_window_size;
+  if (data_len > max_msg_len)
+    data_len = max_msg_len;
+  if (data_len > queue_room)
+    data_len = queue_room;
+  if (data_len > SSIZE_MAX)
+    data_len = SSIZE_MAX;
+  return data_len;
+}
 
-  if (process_len > chan->remote_window_size)
-    process_len = chan->remote_window_size;
-  if (process_len > chan->remote_max_packet_size)
-    process_len = chan->remote_max_packet_size;
-  if (process_len > SSIZE_MAX)
-    process_len = SSIZE_MAX;
+/*
+ * Reserve space for the length of a message with 'data_len' bytes of
+ * data in the channel's queue, returning the offset of the message.
+ * If it wouldn't fit after the end of the queue, the messages already
+ * sent are dropped first, so the queue never outgrows the space
+ * reserved for it.
+ */
+static ssize_t chan_queue_start_msg(struct SSH_CHAN *chan, size_t data_len)
+{
+  size_t offset;
 
-  if (process_len == 0)
+  if (chan->out_queue_pos > 0 && chan->out_queue.len + data_len + CHAN_QUEUED_MSG_OVERHEAD > chan->out_queue.cap) {
+    if (ssh_buf_remove_data(&chan->out_queue, 0, chan->out_queue_pos) < 0)
+      return -1;
+    chan->out_queue_pos = 0;
+  }
+  offset = chan->out_queue.len;
+  if (ssh_buf_append_u32(&chan->out_queue, 0) < 0)
+    return -1;
+  return offset;
+}
+
+static int chan_queue_finish_msg(struct SSH_CHAN *chan, size_t offset)
+{
+  ssh_buf_store_be32(chan->out_queue.data + offset, chan->out_queue.len - offset - 4);
+
+  // send right away if the connection is idle
+  if (! ssh_conn_send_is_pending(chan->conn))
+    return ssh_chan_send_queued(chan->conn);
+  return 0;
+}
+
+ssize_t ssh_chan_send_data(struct SSH_CHAN *chan, void *data, size_t data_len)
+{
+  struct SSH_MSG_channel_data msg;
+  size_t process_len;
+  ssize_t offset;
+
+  if ((process_len = chan_get_send_len(chan, data_len)) == 0)
     return 0;
   
-  if ((pack = ssh_conn_new_packet(chan->conn)) == NULL
-      || ssh_buf_write_u8(pack, SSH_MSG_CHANNEL_DATA) < 0
-      || ssh_buf_write_u32(pack, chan->remote_num) < 0
-      || ssh_buf_write_data(pack, data, process_len) < 0
-      || ssh_conn_send_packet(chan->conn) < 0)
+  msg.recipient_channel = chan->remote_num;
+  msg.data = ssh_str_new(data, process_len);
+  if ((offset = chan_queue_start_msg(chan, process_len)) < 0
+      || ssh_msg_build_channel_data(&chan->out_queue, &msg) < 0) {
+    if (offset >= 0)
+      chan->out_queue.len = offset;
     return -1;
-
+  }
   chan->remote_window_size -= process_len;
+  if (chan_queue_finish_msg(chan, offset) < 0)
+    return -1;
   return process_len;
 }
 
 ssize_t ssh_chan_send_ext_data(struct SSH_CHAN *chan, uint32_t data_type_code, void *data, size_t data_len)
 {
-  struct SSH_BUFFER *pack;
-  size_t process_len = data_len;
-
-  if (process_len > chan->remote_window_size)
-    process_len = chan->remote_window_size;
-  if (process_len > chan->remote_max_packet_size)
-    process_len = chan->remote_max_packet_size;
-  if (process_len > SSIZE_MAX)
-    process_len = SSIZE_MAX;
+  struct SSH_MSG_channel_extended_data msg;
+  size_t process_len;
+  ssize_t offset;
 
-  if (process_len == 0)
+  if ((process_len = chan_get_send_len(chan, data_len)) == 0)
     return 0;
   
-  if ((pack = ssh_conn_new_packet(chan->conn)) == NULL
-      || ssh_buf_write_u8(pack, SSH_MSG_CHANNEL_EXTENDED_DATA) < 0
-      || ssh_buf_write_u32(pack, chan->remote_num) < 0
-      || ssh_buf_write_u32(pack, data_type_code) < 0
-      || ssh_buf_write_data(pack, data, process_len) < 0
-      || ssh_conn_send_packet(chan->conn) < 0)
+  msg.recipient_channel = chan->remote_num;
+  msg.data_type_code = data_type_code;
+  msg.data = ssh_str_new(data, process_len);
+  if ((offset = chan_queue_start_msg(chan, process_len)) < 0
+      || ssh_msg_build_channel_extended_data(&chan->out_queue, &msg) < 0) {
+    if (offset >= 0)
+      chan->out_queue.len = offset;
     return -1;
-
+  }
   chan->remote_window_size -= process_len;
+  if (chan_queue_finish_msg(chan, offset) < 0)
+    return -1;
   return process_len;
 }
 
@@ -563,7 +1284,7 @@ int ssh_chan_watch_fd(struct SSH_CHAN  *chan, int fd, uint8_t enable_fd_flags, u
 
   //ssh_log("watch fd %d with events (%d,%d)\n", fd, enable_fd_flags, disable_fd_flags);
   
-  if (update_poll_fd_events(chan->watch_fds, &chan->num_watch_fds, fd, enable_events, disable_events) < 0) {
+  if (update_poll_fd_events(chan->watch_fds, &chan->num_watch_fds, MAX_POLL_FDS, fd, enable_events, disable_events) < 0) {
     if (enable_events != 0) // no error if there's no space to add only disable_events
       return -1;
   }
@@ -580,10 +1301,60 @@ int ssh_chan_watch_fd(struct SSH_CHAN  *chan, int fd, uint8_t enable_fd_flags, u
   return 0;
 }
 
+/*
+ * Limit the data sent by the channel to 'rate' bytes per second, or
+ * remove the limit if 'rate' is 0.  Can be called at any time.
+ */
+void ssh_chan_set_rate_limit(struct SSH_CHAN *chan, uint64_t rate)
+{
+  ssh_rate_limit_set_rate(&chan->rate_limit, rate);
+  chan->conn->send_resume_time = 0;
+}
+
+/*
+ * Tell the channel how much of the data passed to its
+ * notify_received() and notify_received_ext() handlers the owner
+ * still holds (e.g., waiting to be written to a slow fd).  The server
+ * can only send more as the owner consumes it, so the owner never
+ * holds more than SSH_CHAN_MAX_LOCAL_WINDOW bytes.
+ */
+int ssh_chan_set_recv_buffered(struct SSH_CHAN *chan, size_t len)
+{
+  chan->recv_buffered = MIN(len, SSH_CHAN_MAX_LOCAL_WINDOW);
+  if (chan->status != SSH_CHAN_STATUS_OPEN)
+    return 0;
+  return chan_check_adjust_local_window(chan->conn, chan, 0);
+}
+
+/*
+ * Schedule a timer on the channel's connection (see
+ * ssh_conn_set_timer()).  The caller must cancel it when the channel
+ * is closed.
+ */
+void ssh_chan_set_timer(struct SSH_CHAN *chan, struct SSH_TIMER *timer, uint32_t delay_ms)
+{
+  ssh_conn_set_timer(chan->conn, timer, delay_ms);
+}
+
+/*
+ * Close the channel.  No more callbacks are called for it, but it's
+ * only freed after sending its queued data and exchanging
+ * SSH_MSG_CHANNEL_CLOSE with the server.
+ */
 void ssh_chan_close(struct SSH_CHAN  *chan)
 {
-  if (chan->status == SSH_CHAN_STATUS_OPEN) {
+  switch (chan->status) {
+  case SSH_CHAN_STATUS_OPEN:
+    chan->status = SSH_CHAN_STATUS_CLOSING;
     chan->notify_closed(chan, chan->userdata);
-    chan->status = SSH_CHAN_STATUS_CLOSED;
+    break;
+
+  case SSH_CHAN_STATUS_CREATED:
+  case SSH_CHAN_STATUS_REQUESTED:
+    chan->status = SSH_CHAN_STATUS_CLOSING;
+    break;
+
+  default:
+    break;
   }
 }
@@ -12,12 +12,16 @@ enum SSH_CHAN_TYPE {
 
 struct SSH_CHAN;
 struct SSH_CONN;
+struct SSH_TIMER;
 
 /* watch fd_flags */
 #define SSH_CHAN_FD_READ  (1<<0)
 #define SSH_CHAN_FD_WRITE (1<<1)
 #define SSH_CHAN_FD_CLOSE (1<<2)
 
+/* max data the server can send before the owner consumes it */
+#define SSH_CHAN_MAX_LOCAL_WINDOW (2*1024*1024)
+
 typedef int (*ssh_chan_fn_open)(struct SSH_CHAN *chan, void *userdata);
 typedef void (*ssh_chan_fn_open_failed)(struct SSH_CHAN *chan, void *userdata);
 typedef void (*ssh_chan_fn_closed)(struct SSH_CHAN *chan, void *userdata);
@@ -37,6 +41,8 @@ struct SSH_CHAN_CONFIG {
   ssh_chan_fn_received_ext notify_received_ext;
   ssh_chan_fn_signal notify_signal;
   void *type_config;
+  uint32_t weight;          // share of the bandwidth for bulk data (0 for default)
+  uint64_t rate_limit;      // bytes per second of data (0 for no limit)
 };
 
 /* type_config for SSH_CHAN_SESSION */
@@ -52,9 +58,12 @@ struct SSH_CHAN_SESSION_CONFIG {
 uint32_t ssh_chan_get_num(struct SSH_CHAN  *chan);
 int ssh_chan_watch_fd(struct SSH_CHAN  *chan, int fd, uint8_t enable_fd_flags, uint8_t disable_fd_flags);
 void ssh_chan_close(struct SSH_CHAN  *chan);
+void ssh_chan_set_rate_limit(struct SSH_CHAN *chan, uint64_t rate);
 ssize_t ssh_chan_send_data(struct SSH_CHAN *chan, void *data, size_t data_len);
 ssize_t ssh_chan_send_ext_data(struct SSH_CHAN *chan, uint32_t data_type_code, void *data, size_t data_len);
 void ssh_chan_notify_signal(void);
+void ssh_chan_set_timer(struct SSH_CHAN *chan, struct SSH_TIMER *timer, uint32_t delay_ms);
+int ssh_chan_set_recv_buffered(struct SSH_CHAN *chan, size_t len);
 
 int ssh_chan_session_new_term_size(struct SSH_CHAN *chan, uint32_t new_term_width, uint32_t new_term_height);
 
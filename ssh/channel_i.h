@@ -6,20 +6,31 @@
 #include <poll.h>
 
 #include "ssh/channel.h"
+#include "common/buffer.h"
+#include "common/rate_limit.h"
 
 #define MAX_POLL_FDS  8
 
+// requests sent with want_reply waiting for the reply, per channel
+#define SSH_CHAN_MAX_PENDING_REPLIES 8
+
 enum SSH_CHAN_STATUS {
   SSH_CHAN_STATUS_CREATED,
   SSH_CHAN_STATUS_REQUESTED,
   SSH_CHAN_STATUS_OPEN,
+  SSH_CHAN_STATUS_CLOSING,     // close requested, SSH_MSG_CHANNEL_CLOSE not sent yet
+  SSH_CHAN_STATUS_CLOSE_SENT,  // waiting for the server's SSH_MSG_CHANNEL_CLOSE
   SSH_CHAN_STATUS_CLOSED,
 };
 
+typedef int (*ssh_chan_fn_reply)(struct SSH_CHAN *chan, int success);
+
 struct SSH_CHAN {
   struct SSH_CONN *conn;
   void *userdata;
   enum SSH_CHAN_STATUS status;
+  int confirmed;                   // server sent SSH_MSG_CHANNEL_OPEN_CONFIRMATION
+  int remote_closed;               // server sent SSH_MSG_CHANNEL_CLOSE
   struct pollfd watch_fds[MAX_POLL_FDS];
   nfds_t num_watch_fds;
 
@@ -29,6 +40,25 @@ struct SSH_CHAN {
   uint32_t local_window_size;
   uint32_t remote_max_packet_size;
   uint32_t remote_window_size;
+  uint32_t recv_buffered;          // received data the owner still holds
+
+  // data and EOF received after the server confirmed the channel,
+  // but before it's open
+  struct SSH_BUFFER early_data;
+  int early_eof;
+
+  // outgoing data messages, each preceded by its length, waiting for
+  // the scheduler to send them (see ssh_chan_send_queued())
+  struct SSH_BUFFER out_queue;
+  size_t out_queue_pos;            // data before this offset was already sent
+  uint32_t weight;                 // share of the bandwidth for bulk data
+  uint32_t deficit;                // bytes the channel can send in its current turn
+  struct SSH_RATE_LIMIT rate_limit;
+
+  // handlers for the replies to requests sent with want_reply, in
+  // the order the requests were sent
+  ssh_chan_fn_reply pending_replies[SSH_CHAN_MAX_PENDING_REPLIES];
+  int num_pending_replies;
 
   enum SSH_CHAN_TYPE type;
   void *type_config;
@@ -43,5 +73,11 @@ struct SSH_CHAN {
 
 int ssh_chan_run_connection(struct SSH_CONN *conn, int num_channels, const struct SSH_CHAN_CONFIG *channel_cfgs);
 void ssh_chan_free(struct SSH_CHAN *chan);
+int ssh_chan_queue_open(struct SSH_CONN *conn, const struct SSH_CHAN_CONFIG *cfg);
+void ssh_chan_wake_loop(struct SSH_CONN *conn);
+int ssh_chan_set_open(struct SSH_CHAN *chan);
+int ssh_chan_expect_reply(struct SSH_CHAN *chan, ssh_chan_fn_reply handle_reply);
+int ssh_chan_has_queued_data(struct SSH_CONN *conn);
+int ssh_chan_send_queued(struct SSH_CONN *conn);
 
 #endif /* CHANNEL_I_H_FILE */
@@ -7,48 +7,81 @@
 
 #include "ssh/connection_i.h"
 #include "ssh/channel_i.h"
+#include "ssh/message_i.h"
 
 #include "common/debug.h"
 #include "ssh/debug.h"
 #include "ssh/ssh_constants.h"
 
+static int session_pty_reply(struct SSH_CHAN *chan, int success)
+{
+  if (! success)
+    ssh_log("WARNING: server refused to allocate a pty\n");
+  return 0;
+}
+
+static int session_start_reply(struct SSH_CHAN *chan, int success)
+{
+  if (chan->status != SSH_CHAN_STATUS_REQUESTED)
+    return 0;
+  if (! success) {
+    chan->notify_open_failed(chan, chan->userdata);
+    ssh_chan_close(chan);
+    return 0;
+  }
+  return ssh_chan_set_open(chan);
+}
+
+/*
+ * Send the pty and shell or exec requests without waiting for the
+ * replies; the channel is open when the shell or command starts.
+ */
 int ssh_chan_session_opened(struct SSH_CHAN *chan)
 {
   struct SSH_CHAN_SESSION_CONFIG *cfg = chan->type_config;
   struct SSH_BUFFER *pack;
   
   if (cfg->alloc_pty) {
+    struct SSH_MSG_channel_request_pty msg = {
+      .recipient_channel = chan->remote_num,
+      .request_type = ssh_str_new_from_cstring("pty-req"),
+      .want_reply = 1,
+      .term = ssh_str_new_from_cstring(cfg->term),
+      .term_width = cfg->term_width,
+      .term_height = cfg->term_height,
+      .term_width_pixels = 0,
+      .term_height_pixels = 0,
+      .term_modes = ssh_str_new_from_cstring(""),
+    };
     if ((pack = ssh_conn_new_packet(chan->conn)) == NULL
-        || ssh_buf_write_u8(pack, SSH_MSG_CHANNEL_REQUEST) < 0
-        || ssh_buf_write_u32(pack, chan->remote_num) < 0
-        || ssh_buf_write_cstring(pack, "pty-req") < 0
-        || ssh_buf_write_u8(pack, 0) < 0
-        || ssh_buf_write_cstring(pack, cfg->term) < 0
-        || ssh_buf_write_u32(pack, cfg->term_width) < 0
-        || ssh_buf_write_u32(pack, cfg->term_height) < 0
-        || ssh_buf_write_u32(pack, 0) < 0   // width pixels
-        || ssh_buf_write_u32(pack, 0) < 0   // height pixels
-        || ssh_buf_write_cstring(pack, "") < 0
-        || ssh_conn_send_packet(chan->conn) < 0)
+        || ssh_msg_build_channel_request_pty(pack, &msg) < 0
+        || ssh_conn_send_packet(chan->conn) < 0
+        || ssh_chan_expect_reply(chan, session_pty_reply) < 0)
       return -1;
   }
   
   if (cfg->run_command == NULL) {
+    struct SSH_MSG_channel_request msg = {
+      .recipient_channel = chan->remote_num,
+      .request_type = ssh_str_new_from_cstring("shell"),
+      .want_reply = 1,
+    };
     if ((pack = ssh_conn_new_packet(chan->conn)) == NULL
-        || ssh_buf_write_u8(pack, SSH_MSG_CHANNEL_REQUEST) < 0
-        || ssh_buf_write_u32(pack, chan->remote_num) < 0
-        || ssh_buf_write_cstring(pack, "shell") < 0
-        || ssh_buf_write_u8(pack, 1) < 0
-        || ssh_conn_send_packet(chan->conn) < 0)
+        || ssh_msg_build_channel_request(pack, &msg) < 0
+        || ssh_conn_send_packet(chan->conn) < 0
+        || ssh_chan_expect_reply(chan, session_start_reply) < 0)
       return -1;
   } else {
+    struct SSH_MSG_channel_request_exec msg = {
+      .recipient_channel = chan->remote_num,
+      .request_type = ssh_str_new_from_cstring("exec"),
+      .want_reply = 1,
+      .command = ssh_str_new_from_cstring(cfg->run_command),
+    };
     if ((pack = ssh_conn_new_packet(chan->conn)) == NULL
-        || ssh_buf_write_u8(pack, SSH_MSG_CHANNEL_REQUEST) < 0
-        || ssh_buf_write_u32(pack, chan->remote_num) < 0
-        || ssh_buf_write_cstring(pack, "exec") < 0
-        || ssh_buf_write_u8(pack, 1) < 0
-        || ssh_buf_write_cstring(pack, cfg->run_command) < 0
-        || ssh_conn_send_packet(chan->conn) < 0)
+        || ssh_msg_build_channel_request_exec(pack, &msg) < 0
+        || ssh_conn_send_packet(chan->conn) < 0
+        || ssh_chan_expect_reply(chan, session_start_reply) < 0)
       return -1;
   }
 
@@ -58,12 +91,6 @@ int ssh_chan_session_opened(struct SSH_CHAN *chan)
 int ssh_chan_session_process_packet(struct SSH_CHAN *chan, struct SSH_BUF_READER *pack)
 {
   switch (ssh_packet_get_type(pack)) {
-  case SSH_MSG_CHANNEL_SUCCESS:
-    chan->status = SSH_CHAN_STATUS_OPEN;
-    if (chan->notify_open(chan, chan->userdata) < 0)
-      ssh_chan_close(chan);
-    break;
-
   default:
     dump_packet_reader("unhandled channel packet", pack, chan->conn->in_stream.mac_len);
   }
@@ -74,16 +101,18 @@ int ssh_chan_session_process_packet(struct SSH_CHAN *chan, struct SSH_BUF_READER
 int ssh_chan_session_new_term_size(struct SSH_CHAN *chan, uint32_t new_term_width, uint32_t new_term_height)
 {
   struct SSH_BUFFER *pack;
+  struct SSH_MSG_channel_request_window_change msg = {
+    .recipient_channel = chan->remote_num,
+    .request_type = ssh_str_new_from_cstring("window-change"),
+    .want_reply = 0,
+    .term_width = new_term_width,
+    .term_height = new_term_height,
+    .term_width_pixels = 0,
+    .term_height_pixels = 0,
+  };
 
   if ((pack = ssh_conn_new_packet(chan->conn)) == NULL
-      || ssh_buf_write_u8(pack, SSH_MSG_CHANNEL_REQUEST) < 0
-      || ssh_buf_write_u32(pack, chan->remote_num) < 0
-      || ssh_buf_write_cstring(pack, "window-change") < 0
-      || ssh_buf_write_u8(pack, 0) < 0
-      || ssh_buf_write_u32(pack, new_term_width) < 0
-      || ssh_buf_write_u32(pack, new_term_height) < 0
-      || ssh_buf_write_u32(pack, 0) < 0  // width pixels
-      || ssh_buf_write_u32(pack, 0) < 0 // height pixels
+      || ssh_msg_build_channel_request_window_change(pack, &msg) < 0
       || ssh_conn_send_packet(chan->conn) < 0)
     return -1;
 
@@ -16,6 +16,7 @@ struct SSH_CIPHER_CTX {
 };
 
 typedef struct CRYPTO_CIPHER_CTX *(*func_new)(enum SSH_CIPHER_TYPE type, enum SSH_CIPHER_DIRECTION dir, const struct SSH_STRING *iv, const struct SSH_STRING *key);
+typedef int (*func_rekey)(struct CRYPTO_CIPHER_CTX *ctx, enum SSH_CIPHER_TYPE type, enum SSH_CIPHER_DIRECTION dir, const struct SSH_STRING *iv, const struct SSH_STRING *key);
 typedef void (*func_free)(struct CRYPTO_CIPHER_CTX *ctx);
 typedef int (*func_crypt)(struct CRYPTO_CIPHER_CTX *ctx, uint8_t *out, uint8_t *data, uint32_t len);
 
@@ -26,13 +27,21 @@ static const struct CIPHER_ALGO {
   uint32_t key_len;
   uint32_t iv_len;
   func_new new;
+  func_rekey rekey;
   func_free free;
   func_crypt crypt;
 } cipher_algos[] = {
-  { "aes128-ctr", SSH_CIPHER_AES128_CTR, 16, 16, 16, crypto_aes_new, crypto_aes_free, crypto_aes_crypt },
-  { "aes128-cbc", SSH_CIPHER_AES128_CBC, 16, 16, 16, crypto_aes_new, crypto_aes_free, crypto_aes_crypt },
+  { "aes128-ctr", SSH_CIPHER_AES128_CTR, 16, 16, 16, crypto_aes_new, crypto_aes_rekey, crypto_aes_free, crypto_aes_crypt },
+  { "aes256-ctr", SSH_CIPHER_AES256_CTR, 16, 32, 16, crypto_aes_new, crypto_aes_rekey, crypto_aes_free, crypto_aes_crypt },
+  { "aes128-cbc", SSH_CIPHER_AES128_CBC, 16, 16, 16, crypto_aes_new, crypto_aes_rekey, crypto_aes_free, crypto_aes_crypt },
 };
 
+#define NUM_CIPHER_ALGOS (sizeof(cipher_algos)/sizeof(cipher_algos[0]))
+
+// order of cipher_algos[] in the list sent to the server, if set
+static int cipher_order[NUM_CIPHER_ALGOS];
+static int cipher_order_set;
+
 enum SSH_CIPHER_TYPE ssh_cipher_get_by_name(const char *name)
 {
   return ssh_cipher_get_by_name_n((uint8_t *) name, strlen(name));
@@ -61,11 +70,59 @@ int ssh_cipher_get_supported_algos(struct SSH_BUFFER *ret)
   int i;
 
   ssh_buf_clear(ret);
-  for (i = 0; i < sizeof(cipher_algos)/sizeof(cipher_algos[0]); i++) {
+  for (i = 0; i < NUM_CIPHER_ALGOS; i++) {
+    const char *name = cipher_algos[(cipher_order_set) ? cipher_order[i] : i].name;
     if ((i > 0 && ssh_buf_append_u8(ret, ',') < 0)
-        || ssh_buf_append_data(ret, (uint8_t *) cipher_algos[i].name, strlen(cipher_algos[i].name)) < 0)
+        || ssh_buf_append_data(ret, (uint8_t *) name, strlen(name)) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+/*
+ * Store the types of all supported algorithms in 'types', returning
+ * how many there are.
+ */
+int ssh_cipher_get_algo_types(enum SSH_CIPHER_TYPE *types, int max_types)
+{
+  int i;
+
+  for (i = 0; i < NUM_CIPHER_ALGOS && i < max_types; i++)
+    types[i] = cipher_algos[i].type;
+  return i;
+}
+
+/*
+ * Set the order of the algorithms in the list sent to the server:
+ * first the ones in 'types', then the others in the default order.
+ */
+int ssh_cipher_set_preferred_order(const enum SSH_CIPHER_TYPE *types, int num_types)
+{
+  int order[NUM_CIPHER_ALGOS];
+  int used[NUM_CIPHER_ALGOS];
+  int i, j, n;
+
+  memset(used, 0, sizeof(used));
+  n = 0;
+  for (i = 0; i < num_types; i++) {
+    for (j = 0; j < NUM_CIPHER_ALGOS; j++)
+      if (cipher_algos[j].type == types[i])
+        break;
+    if (j == NUM_CIPHER_ALGOS) {
+      ssh_set_error("invalid cipher type: %d", types[i]);
       return -1;
+    }
+    if (! used[j]) {
+      order[n++] = j;
+      used[j] = 1;
+    }
   }
+  for (j = 0; j < NUM_CIPHER_ALGOS; j++)
+    if (! used[j])
+      order[n++] = j;
+
+  memcpy(cipher_order, order, sizeof(order));
+  cipher_order_set = 1;
   return 0;
 }
 
@@ -80,6 +137,14 @@ static const struct CIPHER_ALGO *cipher_get_algo(enum SSH_CIPHER_TYPE type)
   return NULL;
 }
 
+const char *ssh_cipher_get_name(enum SSH_CIPHER_TYPE type)
+{
+  const struct CIPHER_ALGO *algo = cipher_get_algo(type);
+  if (algo == NULL)
+    return NULL;
+  return algo->name;
+}
+
 int ssh_cipher_get_block_len(enum SSH_CIPHER_TYPE type)
 {
   const struct CIPHER_ALGO *algo = cipher_get_algo(type);
@@ -93,7 +158,7 @@ int ssh_cipher_get_key_len(enum SSH_CIPHER_TYPE type)
   const struct CIPHER_ALGO *algo = cipher_get_algo(type);
   if (algo == NULL)
     return -1;
-  return algo->iv_len;
+  return algo->key_len;
 }
 
 int ssh_cipher_get_iv_len(enum SSH_CIPHER_TYPE type)
@@ -101,7 +166,7 @@ int ssh_cipher_get_iv_len(enum SSH_CIPHER_TYPE type)
   const struct CIPHER_ALGO *algo = cipher_get_algo(type);
   if (algo == NULL)
     return -1;
-  return algo->key_len;
+  return algo->iv_len;
 }
 
 struct SSH_CIPHER_CTX *ssh_cipher_new(enum SSH_CIPHER_TYPE type, enum SSH_CIPHER_DIRECTION dir, const struct SSH_STRING *iv, const struct SSH_STRING *key)
@@ -129,6 +194,31 @@ struct SSH_CIPHER_CTX *ssh_cipher_new(enum SSH_CIPHER_TYPE type, enum SSH_CIPHER
   return ret;
 }
 
+/*
+ * Install a new key and IV, reusing the existing crypto context if
+ * the new algorithm has the same implementation.
+ */
+int ssh_cipher_rekey(struct SSH_CIPHER_CTX *ctx, enum SSH_CIPHER_TYPE type, enum SSH_CIPHER_DIRECTION dir, const struct SSH_STRING *iv, const struct SSH_STRING *key)
+{
+  struct CRYPTO_CIPHER_CTX *crypto_ctx;
+  
+  const struct CIPHER_ALGO *algo = cipher_get_algo(type);
+  if (algo == NULL)
+    return -1;
+
+  if (algo->rekey == ctx->algo->rekey) {
+    if (algo->rekey(ctx->ctx, type, dir, iv, key) < 0)
+      return -1;
+  } else {
+    if ((crypto_ctx = algo->new(type, dir, iv, key)) == NULL)
+      return -1;
+    ctx->algo->free(ctx->ctx);
+    ctx->ctx = crypto_ctx;
+  }
+  ctx->algo = algo;
+  return 0;
+}
+
 void ssh_cipher_free(struct SSH_CIPHER_CTX *ctx)
 {
   ctx->algo->free(ctx->ctx);
@@ -139,3 +229,12 @@ int ssh_cipher_crypt(struct SSH_CIPHER_CTX *ctx, uint8_t *out, uint8_t *data, ui
 {
   return ctx->algo->crypt(ctx->ctx, out, data, len);
 }
+
+/*
+ * Get the underlying crypto context, for callers that call the
+ * algorithm's crypt function directly.
+ */
+struct CRYPTO_CIPHER_CTX *ssh_cipher_get_crypto_ctx(struct SSH_CIPHER_CTX *ctx)
+{
+  return ctx->ctx;
+}
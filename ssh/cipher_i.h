@@ -14,13 +14,18 @@ enum SSH_CIPHER_TYPE ssh_cipher_get_by_name(const char *name);
 enum SSH_CIPHER_TYPE ssh_cipher_get_by_name_n(const uint8_t *name, size_t name_len);
 enum SSH_CIPHER_TYPE ssh_cipher_get_by_name_str(const struct SSH_STRING *name);
 int ssh_cipher_get_supported_algos(struct SSH_BUFFER *ret);
+int ssh_cipher_get_algo_types(enum SSH_CIPHER_TYPE *types, int max_types);
+int ssh_cipher_set_preferred_order(const enum SSH_CIPHER_TYPE *types, int num_types);
+const char *ssh_cipher_get_name(enum SSH_CIPHER_TYPE type);
 
 int ssh_cipher_get_block_len(enum SSH_CIPHER_TYPE type);
 int ssh_cipher_get_key_len(enum SSH_CIPHER_TYPE type);
 int ssh_cipher_get_iv_len(enum SSH_CIPHER_TYPE type);
 
 struct SSH_CIPHER_CTX *ssh_cipher_new(enum SSH_CIPHER_TYPE type, enum SSH_CIPHER_DIRECTION dir, const struct SSH_STRING *key, const struct SSH_STRING *iv);
+int ssh_cipher_rekey(struct SSH_CIPHER_CTX *ctx, enum SSH_CIPHER_TYPE type, enum SSH_CIPHER_DIRECTION dir, const struct SSH_STRING *iv, const struct SSH_STRING *key);
 void ssh_cipher_free(struct SSH_CIPHER_CTX *ctx);
 int ssh_cipher_crypt(struct SSH_CIPHER_CTX *ctx, uint8_t *out, uint8_t *data, uint32_t len);
+struct CRYPTO_CIPHER_CTX *ssh_cipher_get_crypto_ctx(struct SSH_CIPHER_CTX *ctx);
 
 #endif /* CIPHER_I_H_FILE */
@@ -15,6 +15,7 @@
 #include "ssh/kex_i.h"
 #include "ssh/userauth_i.h"
 #include "ssh/channel_i.h"
+#include "ssh/message_i.h"
 
 #include "common/error.h"
 #include "common/alloc.h"
@@ -28,20 +29,52 @@
 
 #define CLIENT_SOFTWARE "eessh_0.1"
 
+#define KEX_ARENA_BLOCK_SIZE (16*1024)
+
 static struct SSH_CONN *conn_new(void)
 {
   struct SSH_CONN *conn = ssh_alloc(sizeof(struct SSH_CONN));
   if (conn == NULL)
     return NULL;
-  conn->sock = -1;
+  conn->transport = NULL;
+  ssh_pool_init(&conn->packet_pool);
+  ssh_arena_init(&conn->kex_arena, KEX_ARENA_BLOCK_SIZE);
   conn->client_version_string.len = 0;
   conn->server_version_string.len = 0;
   conn->server_hostname = ssh_str_new_empty();
   conn->session_id = ssh_str_new_empty();
-  ssh_stream_init(&conn->in_stream, SSH_STREAM_TYPE_READ);
-  ssh_stream_init(&conn->out_stream, SSH_STREAM_TYPE_WRITE);
+  ssh_stream_init(&conn->in_stream, SSH_STREAM_TYPE_READ, ssh_pool_get_allocator(&conn->packet_pool));
+  ssh_stream_init(&conn->out_stream, SSH_STREAM_TYPE_WRITE, ssh_pool_get_allocator(&conn->packet_pool));
 
   conn->num_channels = 0;
+  conn->sched_chan = 0;
+  ssh_rate_limit_init(&conn->rate_limit, 0);
+  conn->send_resume_time = 0;
+  ssh_timer_wheel_init(&conn->timers, ssh_timer_now());
+  conn->keepalive_interval = 0;
+  conn->keepalive_missed = 0;
+  conn->check_allocs = 0;
+  conn->alloc_check_warmup = 0;
+  conn->alloc_watch_started = 0;
+
+  pthread_mutex_init(&conn->open_lock, NULL);
+  conn->open_queue = NULL;
+  conn->num_open_queue = 0;
+  conn->keep_alive_idle = 0;
+  if (pipe(conn->wake_fds) < 0) {
+    ssh_set_error("can't create pipe");
+    pthread_mutex_destroy(&conn->open_lock);
+    ssh_free(conn);
+    return NULL;
+  }
+  if (ssh_net_set_sock_blocking(conn->wake_fds[0], 0) < 0
+      || ssh_net_set_sock_blocking(conn->wake_fds[1], 0) < 0) {
+    close(conn->wake_fds[0]);
+    close(conn->wake_fds[1]);
+    pthread_mutex_destroy(&conn->open_lock);
+    ssh_free(conn);
+    return NULL;
+  }
   
   conn->server_identity_checker = NULL;
 
@@ -56,12 +89,19 @@ static void conn_free(struct SSH_CONN *conn)
 
   for (i = 0; i < conn->num_channels; i++)
     ssh_chan_free(conn->channels[i]);
+  ssh_free(conn->open_queue);
+  pthread_mutex_destroy(&conn->open_lock);
+  close(conn->wake_fds[0]);
+  close(conn->wake_fds[1]);
 
+  ssh_transport_free(conn->transport);
   ssh_stream_close(&conn->in_stream);
   ssh_stream_close(&conn->out_stream);
   ssh_str_free(&conn->session_id);
   ssh_str_free(&conn->server_hostname);
   ssh_str_free(&conn->username);
+  ssh_arena_release(&conn->kex_arena);
+  ssh_pool_destroy(&conn->packet_pool);
   ssh_free(conn);
 }
 
@@ -71,7 +111,6 @@ void ssh_conn_close(struct SSH_CONN *conn)
   
   for (i = 0; i < conn->num_channels; i++)
     ssh_chan_close(conn->channels[i]);
-  close(conn->sock);
   conn_free(conn);
 }
 
@@ -105,6 +144,13 @@ int ssh_conn_set_mac(struct SSH_CONN *conn, enum SSH_CONN_DIRECTION dir, enum SS
   return ssh_stream_set_mac(stream, type, key);
 }
 
+/* start using the ciphers and MACs set with ssh_conn_set_cipher() and ssh_conn_set_mac() */
+void ssh_conn_newkeys(struct SSH_CONN *conn)
+{
+  ssh_stream_newkeys(&conn->in_stream);
+  ssh_stream_newkeys(&conn->out_stream);
+}
+
 void ssh_conn_set_session_id(struct SSH_CONN *conn, struct SSH_STRING *session_id)
 {
   conn->session_id = *session_id;
@@ -116,6 +162,11 @@ struct SSH_STRING *ssh_conn_get_session_id(struct SSH_CONN *conn)
   return &conn->session_id;
 }
 
+struct SSH_ARENA *ssh_conn_get_kex_arena(struct SSH_CONN *conn)
+{
+  return &conn->kex_arena;
+}
+
 int ssh_conn_check_server_identity(struct SSH_CONN *conn, struct SSH_STRING *server_host_key)
 {
   if (conn->server_identity_checker != NULL)
@@ -142,13 +193,14 @@ ssh_conn_password_reader ssh_conn_get_password_reader(struct SSH_CONN *conn)
 int ssh_conn_send_ignore_msg(struct SSH_CONN *conn, const char *msg)
 {
   struct SSH_BUFFER *pack;
+  struct SSH_MSG_ignore ignore;
   
   pack = ssh_conn_new_packet(conn);
   if (pack == NULL)
     return -1;
 
-  if (ssh_buf_write_u8(pack, SSH_MSG_IGNORE) < 0
-      || ssh_buf_write_cstring(pack, msg))
+  ignore.data = ssh_str_new_from_cstring(msg);
+  if (ssh_msg_build_ignore(pack, &ignore) < 0)
     return -1;
   
   if (ssh_conn_send_packet(conn) < 0)
@@ -157,16 +209,33 @@ int ssh_conn_send_ignore_msg(struct SSH_CONN *conn, const char *msg)
   return 0;
 }
 
-static int conn_setup(struct SSH_CONN *conn)
+/*
+ * Write the line with the client version string to 'line'.
+ */
+static size_t conn_get_version_line(struct SSH_CONN *conn, uint8_t *line)
+{
+  memcpy(line, conn->client_version_string.buf, conn->client_version_string.len);
+  memcpy(line + conn->client_version_string.len, "\r\n", 2);
+  return conn->client_version_string.len + 2;
+}
+
+/*
+ * Exchange version strings.  'version_sent' is how much of the
+ * client version line was already sent with TCP Fast Open.
+ */
+static int conn_setup(struct SSH_CONN *conn, size_t version_sent)
 {
   struct SSH_VERSION_STRING *server_version;
+  uint8_t line[SSH_VERSION_STRING_MAX_SIZE + 2];
+  size_t line_len;
 
-  if (ssh_net_write(conn->sock, conn->client_version_string.buf, conn->client_version_string.len) < 0
-      || ssh_net_write(conn->sock, "\r\n", 2) < 0)
+  line_len = conn_get_version_line(conn, line);
+  if (version_sent < line_len
+      && ssh_transport_write(conn->transport, line + version_sent, line_len - version_sent) < 0)
     return -1;
 
   server_version = &conn->server_version_string;
-  if (ssh_version_string_read(server_version, conn->sock, &conn->in_stream.net.read.buf) < 0)
+  if (ssh_version_string_read(server_version, conn->transport, &conn->in_stream.net.read.buf) < 0)
     return -1;
   
   ssh_log("* got server version '%.*s'\n", (int) server_version->version.len, server_version->version.str);
@@ -204,6 +273,9 @@ static int conn_set_client_software(struct SSH_CONN *conn, const char *software,
 static int conn_connect(struct SSH_CONN *conn, const struct SSH_CONN_CONFIG *cfg)
 {
   const char *client_software, *client_comments, *port;
+  uint8_t version_line[SSH_VERSION_STRING_MAX_SIZE + 2];
+  size_t version_len, version_sent;
+  int sock;
 
   if (cfg->server == NULL) {
     ssh_set_error("server must not be NULL");
@@ -219,6 +291,10 @@ static int conn_connect(struct SSH_CONN *conn, const struct SSH_CONN_CONFIG *cfg
     return -1;
   conn->password_reader = cfg->password_reader;
   conn->server_identity_checker = cfg->server_identity_checker;
+  ssh_rate_limit_set_rate(&conn->rate_limit, cfg->rate_limit);
+  conn->keep_alive_idle = cfg->keep_alive_idle;
+  conn->keepalive_interval = cfg->keepalive_interval * 1000;
+  conn->check_allocs = cfg->check_allocs;
   
   client_software = (cfg->version_software != NULL) ? cfg->version_software : CLIENT_SOFTWARE;
   client_comments = (cfg->version_comments != NULL) ? cfg->version_comments : "--";
@@ -230,16 +306,32 @@ static int conn_connect(struct SSH_CONN *conn, const struct SSH_CONN_CONFIG *cfg
   port = (cfg->port != NULL) ? cfg->port : "22";
   ssh_log("* connecting to server %s port %s\n", cfg->server, port);
   
-  conn->sock = ssh_net_connect(cfg->server, port);
-  if (conn->sock < 0)
+  // with TCP Fast Open, the version line can go in the SYN
+  version_sent = 0;
+  if (cfg->fast_open) {
+    version_len = conn_get_version_line(conn, version_line);
+    sock = ssh_net_connect_fast_open(cfg->server, port, version_line, version_len, &version_sent);
+    if (sock >= 0 && ssh_net_syn_data_acked(sock))
+      ssh_log("* sent version string with TCP Fast Open\n");
+  } else
+    sock = ssh_net_connect(cfg->server, port);
+  if (sock < 0)
+    return -1;
+  if ((conn->transport = ssh_transport_new(cfg->transport, sock)) == NULL) {
+    close(sock);
     return -1;
+  }
+  if (cfg->net_emu != NULL && (conn->transport = ssh_transport_emu_new(conn->transport, cfg->net_emu)) == NULL)
+    return -1;
+  ssh_log("* using %s transport\n", ssh_transport_get_name(conn->transport));
+
+  if (cfg->rate_limit != 0 && ssh_net_set_pacing_rate(conn->transport->sock, cfg->rate_limit) < 0)
+    ssh_log("WARNING: %s\n", ssh_get_error());
 
-  if (conn_setup(conn) < 0
+  if (conn_setup(conn, version_sent) < 0
       || ssh_kex_run(conn) < 0
-      || ssh_userauth_run(conn) < 0) {
-    close(conn->sock);
+      || ssh_userauth_run(conn) < 0)
     return -1;
-  }
 
   return 0;
 }
@@ -258,11 +350,59 @@ struct SSH_CONN *ssh_conn_open(const struct SSH_CONN_CONFIG *cfg)
   return conn;
 }
 
+/*
+ * Limit the channel data sent to 'rate' bytes per second, or remove
+ * the limit if 'rate' is 0.  Can be called at any time.
+ */
+int ssh_conn_set_rate_limit(struct SSH_CONN *conn, uint64_t rate)
+{
+  ssh_rate_limit_set_rate(&conn->rate_limit, rate);
+  conn->send_resume_time = 0;
+  return ssh_net_set_pacing_rate(conn->transport->sock, rate);
+}
+
 int ssh_conn_run(struct SSH_CONN *conn, int num_channels, const struct SSH_CHAN_CONFIG *channel_cfgs)
 {
   return ssh_chan_run_connection(conn, num_channels, channel_cfgs);
 }
 
+/*
+ * Open a new channel.  Can be called at any time, from channel
+ * callbacks or from other threads while ssh_conn_run() is running:
+ * the channel is opened by the connection loop, and the config is
+ * copied, but 'cfg->type_config' must stay valid until the channel
+ * is open or fails to open.
+ */
+int ssh_conn_open_channel(struct SSH_CONN *conn, const struct SSH_CHAN_CONFIG *cfg)
+{
+  return ssh_chan_queue_open(conn, cfg);
+}
+
+/*
+ * Set whether ssh_conn_run() keeps running when there are no open
+ * channels, waiting for new channels.  Can be called from any
+ * thread; clearing it makes ssh_conn_run() return once all channels
+ * are closed.
+ */
+void ssh_conn_set_keep_alive_idle(struct SSH_CONN *conn, int keep_alive)
+{
+  pthread_mutex_lock(&conn->open_lock);
+  conn->keep_alive_idle = keep_alive;
+  pthread_mutex_unlock(&conn->open_lock);
+  ssh_chan_wake_loop(conn);
+}
+
+/*
+ * Schedule a timer to expire 'delay_ms' milliseconds from now,
+ * replacing its previous schedule.  Timers run in the connection
+ * loop, so this must only be called from it (e.g., from channel or
+ * timer callbacks).  Cancel with ssh_timer_cancel().
+ */
+void ssh_conn_set_timer(struct SSH_CONN *conn, struct SSH_TIMER *timer, uint32_t delay_ms)
+{
+  ssh_timer_add(&conn->timers, timer, ssh_timer_now() + delay_ms);
+}
+
 struct SSH_BUFFER *ssh_conn_new_packet(struct SSH_CONN *conn)
 {
   return ssh_stream_new_packet(&conn->out_stream);
@@ -270,7 +410,7 @@ struct SSH_BUFFER *ssh_conn_new_packet(struct SSH_CONN *conn)
 
 int ssh_conn_send_packet(struct SSH_CONN *conn)
 {
-  return ssh_stream_send_packet(&conn->out_stream, conn->sock);
+  return ssh_stream_send_packet(&conn->out_stream, conn->transport);
 }
 
 int ssh_conn_send_is_pending(struct SSH_CONN *conn)
@@ -280,19 +420,19 @@ int ssh_conn_send_is_pending(struct SSH_CONN *conn)
 
 int ssh_conn_send_flush(struct SSH_CONN *conn)
 {
-  return ssh_stream_send_flush(&conn->out_stream, conn->sock);
+  return ssh_stream_send_flush(&conn->out_stream, conn->transport);
 }
 
 /*
  * Read packet.
  *
- * Will fail with errno=EWOULDBLOCK if sock is non-blocking and
+ * Will fail with errno=EWOULDBLOCK if the transport is non-blocking and
  * there's no data to read, in which case it's OK to try again
  * later.
  */
 struct SSH_BUF_READER *ssh_conn_recv_packet(struct SSH_CONN *conn)
 {
-  if (ssh_stream_recv_packet(&conn->in_stream, conn->sock) < 0)
+  if (ssh_stream_recv_packet(&conn->in_stream, conn->transport) < 0)
     return NULL;
   conn->last_pack_read = ssh_buf_reader_new_from_buffer(&conn->in_stream.pack);
   ssh_buf_read_u32(&conn->last_pack_read, NULL);  // skip packet length
@@ -303,7 +443,7 @@ struct SSH_BUF_READER *ssh_conn_recv_packet(struct SSH_CONN *conn)
 struct SSH_BUF_READER *ssh_conn_recv_packet_skip_ignore(struct SSH_CONN *conn)
 {
   while (1) {
-    uint32_t reason_code;
+    struct SSH_MSG_disconnect disconnect;
     struct SSH_BUF_READER *pack;
 
     if ((pack = ssh_conn_recv_packet(conn)) == NULL)
@@ -317,8 +457,8 @@ struct SSH_BUF_READER *ssh_conn_recv_packet_skip_ignore(struct SSH_CONN *conn)
 
     case SSH_MSG_DISCONNECT:
       ssh_log("* RECEIVED SSH_MSG_DISCONNECT\n");
-      if (ssh_buf_read_u32(pack, &reason_code) >= 0)
-        ssh_set_error("server disconnect (%s)", ssh_const_get_disconnect_reason(reason_code));
+      if (ssh_msg_parse_disconnect(pack, &disconnect) >= 0)
+        ssh_set_error("server disconnect (%s)", ssh_const_get_disconnect_reason(disconnect.reason_code));
       else
         ssh_set_error("server disconnect");
       return NULL;
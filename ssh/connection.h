@@ -3,7 +3,11 @@
 #ifndef CONNECTION_H_FILE
 #define CONNECTION_H_FILE
 
+#include <stdint.h>
+
 #include "common/buffer.h"
+#include "common/transport.h"
+#include "common/timer_wheel.h"
 #include "ssh/version_string.h"
 #include "ssh/channel.h"
 
@@ -20,6 +24,13 @@ struct SSH_CONN_CONFIG {
   const char *version_comments;
   ssh_conn_host_identity_checker server_identity_checker;
   ssh_conn_password_reader password_reader;
+  uint64_t rate_limit;      // bytes per second of channel data (0 for no limit)
+  enum SSH_TRANSPORT_TYPE transport;
+  const struct SSH_TRANSPORT_EMU_CONFIG *net_emu;  // network conditions to emulate (NULL for none)
+  int keep_alive_idle;      // keep ssh_conn_run() running when no channels are open
+  uint32_t keepalive_interval;  // seconds of server silence before sending a keepalive (0 for none)
+  int fast_open;            // send the version string in the SYN with TCP Fast Open
+  int check_allocs;         // fail if the data path allocates memory once warmed up
 };
 
 struct SSH_CONN;
@@ -27,7 +38,11 @@ struct SSH_CONN;
 struct SSH_CONN *ssh_conn_open(const struct SSH_CONN_CONFIG *config);
 void ssh_conn_close(struct SSH_CONN *conn);
 
+int ssh_conn_set_rate_limit(struct SSH_CONN *conn, uint64_t rate);
 int ssh_conn_run(struct SSH_CONN *conn, int num_channels, const struct SSH_CHAN_CONFIG *channel_cfgs);
+int ssh_conn_open_channel(struct SSH_CONN *conn, const struct SSH_CHAN_CONFIG *cfg);
+void ssh_conn_set_keep_alive_idle(struct SSH_CONN *conn, int keep_alive);
+void ssh_conn_set_timer(struct SSH_CONN *conn, struct SSH_TIMER *timer, uint32_t delay_ms);
 
 struct SSH_VERSION_STRING *ssh_conn_get_client_version_string(struct SSH_CONN *conn);
 struct SSH_VERSION_STRING *ssh_conn_get_server_version_string(struct SSH_CONN *conn);
@@ -3,15 +3,25 @@
 #ifndef CONNECTION_I_H_FILE
 #define CONNECTION_I_H_FILE
 
+#include <pthread.h>
+
 #include "ssh/connection.h"
+#include "common/alloc.h"
+#include "common/arena.h"
+#include "common/pool.h"
+#include "common/rate_limit.h"
+#include "common/timer_wheel.h"
+#include "common/transport_i.h"
 #include "crypto/algorithms.h"
 #include "ssh/mac_i.h"
 #include "ssh/stream_i.h"
 
-#define SSH_CONN_MAX_CHANNELS 4
+#define SSH_CONN_MAX_CHANNELS 16
 
 struct SSH_CONN {
-  int sock;
+  struct SSH_TRANSPORT *transport;
+  struct SSH_POOL packet_pool;  // packet buffers
+  struct SSH_ARENA kex_arena;   // scratch data for key exchange
   struct SSH_STRING server_hostname;
   struct SSH_VERSION_STRING client_version_string;
   struct SSH_VERSION_STRING server_version_string;
@@ -21,6 +31,26 @@ struct SSH_CONN {
   struct SSH_BUF_READER last_pack_read;
   int num_channels;
   struct SSH_CHAN *channels[SSH_CONN_MAX_CHANNELS];
+  int sched_chan;               // channel whose turn it is to send bulk data
+  struct SSH_RATE_LIMIT rate_limit;  // for channel data
+  uint64_t send_resume_time;    // when rate limits allow sending queued data again, 0 if not limited
+  struct SSH_TIMER_WHEEL timers;  // run by the channel loop
+
+  uint32_t keepalive_interval;  // ms of server silence before a keepalive (0 for none)
+  int keepalive_missed;         // keepalives sent since the last packet received
+  struct SSH_TIMER keepalive_timer;
+
+  int check_allocs;             // watch allocations in the data path
+  uint64_t alloc_check_warmup;  // data bytes left before watching
+  int alloc_watch_started;
+  struct SSH_ALLOC_WATCH alloc_watch;
+
+  // channels to open and idle mode, set from any thread
+  pthread_mutex_t open_lock;    // for the 3 fields below
+  struct SSH_CHAN_CONFIG *open_queue;
+  int num_open_queue;
+  int keep_alive_idle;
+  int wake_fds[2];              // pipe to wake the channel loop
 
   ssh_conn_host_identity_checker server_identity_checker;
 
@@ -39,8 +69,10 @@ ssh_conn_password_reader ssh_conn_get_password_reader(struct SSH_CONN *conn);
 
 void ssh_conn_set_session_id(struct SSH_CONN *conn, struct SSH_STRING *session_id);
 struct SSH_STRING *ssh_conn_get_session_id(struct SSH_CONN *conn);
+struct SSH_ARENA *ssh_conn_get_kex_arena(struct SSH_CONN *conn);
 int ssh_conn_set_cipher(struct SSH_CONN *conn, enum SSH_CONN_DIRECTION dir, enum SSH_CIPHER_TYPE type, struct SSH_STRING *iv, struct SSH_STRING *key);
 int ssh_conn_set_mac(struct SSH_CONN *conn, enum SSH_CONN_DIRECTION dir, enum SSH_MAC_TYPE type, struct SSH_STRING *key);
+void ssh_conn_newkeys(struct SSH_CONN *conn);
 int ssh_conn_check_server_identity(struct SSH_CONN *conn, struct SSH_STRING *server_host_key);
 
 struct SSH_BUFFER *ssh_conn_new_packet(struct SSH_CONN *conn);
@@ -90,3 +90,93 @@ int ssh_hash_compute(enum SSH_HASH_TYPE type, struct SSH_STRING *out, const stru
     return -1;
   }
 }
+
+int ssh_hash_init(struct SSH_HASH_CTX *ctx, enum SSH_HASH_TYPE type)
+{
+  ctx->type = type;
+  switch (type) {
+  case SSH_HASH_SHA1:
+    ctx->crypto_ctx = crypto_sha1_new(type);
+    break;
+
+  case SSH_HASH_SHA2_256:
+  case SSH_HASH_SHA2_512:
+    ctx->crypto_ctx = crypto_sha2_new(type);
+    break;
+
+  default:
+    ctx->crypto_ctx = NULL;
+    ssh_set_error("invalid hash type: %d", type);
+    return -1;
+  }
+  return (ctx->crypto_ctx == NULL) ? -1 : 0;
+}
+
+void ssh_hash_close(struct SSH_HASH_CTX *ctx)
+{
+  if (ctx->crypto_ctx == NULL)
+    return;
+  if (ctx->type == SSH_HASH_SHA1)
+    crypto_sha1_free(ctx->crypto_ctx);
+  else
+    crypto_sha2_free(ctx->crypto_ctx);
+  ctx->crypto_ctx = NULL;
+}
+
+/*
+ * Copy the state of 'from' to 'to'.  Both must be initialized with the
+ * same hash type.  The copy reuses the memory of 'to'.
+ */
+int ssh_hash_copy(struct SSH_HASH_CTX *to, const struct SSH_HASH_CTX *from)
+{
+  if (to->type != from->type) {
+    ssh_set_error("can't copy hash of different types");
+    return -1;
+  }
+  if (from->type == SSH_HASH_SHA1)
+    return crypto_sha1_copy_ctx(to->crypto_ctx, from->crypto_ctx);
+  return crypto_sha2_copy_ctx(to->crypto_ctx, from->crypto_ctx);
+}
+
+int ssh_hash_update(struct SSH_HASH_CTX *ctx, const void *data, uint32_t len)
+{
+  if (ctx->type == SSH_HASH_SHA1)
+    return crypto_sha1_update(ctx->crypto_ctx, data, len);
+  return crypto_sha2_update(ctx->crypto_ctx, data, len);
+}
+
+/*
+ * Hash 'str' in SSH string format (length followed by data).
+ */
+int ssh_hash_update_string(struct SSH_HASH_CTX *ctx, const struct SSH_STRING *str)
+{
+  uint8_t len[4];
+
+  len[0] = str->len >> 24;
+  len[1] = str->len >> 16;
+  len[2] = str->len >> 8;
+  len[3] = str->len;
+  if (ssh_hash_update(ctx, len, 4) < 0
+      || ssh_hash_update(ctx, str->str, str->len) < 0)
+    return -1;
+  return 0;
+}
+
+/*
+ * Write the digest to 'digest', which must have room for
+ * SSH_HASH_MAX_LEN bytes.
+ */
+int ssh_hash_final(struct SSH_HASH_CTX *ctx, struct SSH_STRING *digest)
+{
+  uint32_t digest_len;
+
+  if (ctx->type == SSH_HASH_SHA1) {
+    if (crypto_sha1_final(ctx->crypto_ctx, digest->str, &digest_len) < 0)
+      return -1;
+  } else {
+    if (crypto_sha2_final(ctx->crypto_ctx, digest->str, &digest_len) < 0)
+      return -1;
+  }
+  digest->len = digest_len;
+  return 0;
+}
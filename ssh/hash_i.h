@@ -10,9 +10,21 @@
 
 #define SSH_HASH_MAX_LEN 256
 
+struct SSH_HASH_CTX {
+  enum SSH_HASH_TYPE type;
+  struct CRYPTO_HASH_CTX *crypto_ctx;
+};
+
 enum SSH_HASH_TYPE ssh_hash_get_by_name(const char *name);
 int ssh_hash_get_len(enum SSH_HASH_TYPE type);
 int ssh_hash_get_block_size(enum SSH_HASH_TYPE type);
 int ssh_hash_compute(enum SSH_HASH_TYPE type, struct SSH_STRING *digest, const struct SSH_STRING *data);
 
+int ssh_hash_init(struct SSH_HASH_CTX *ctx, enum SSH_HASH_TYPE type);
+void ssh_hash_close(struct SSH_HASH_CTX *ctx);
+int ssh_hash_copy(struct SSH_HASH_CTX *to, const struct SSH_HASH_CTX *from);
+int ssh_hash_update(struct SSH_HASH_CTX *ctx, const void *data, uint32_t len);
+int ssh_hash_update_string(struct SSH_HASH_CTX *ctx, const struct SSH_STRING *str);
+int ssh_hash_final(struct SSH_HASH_CTX *ctx, struct SSH_STRING *digest);
+
 #endif /* HASH_I_H_FILE */
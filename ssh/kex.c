@@ -9,6 +9,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <openssl/crypto.h>
+
 #include "ssh/kex_i.h"
 
 #include "ssh/kex_dh_i.h"
@@ -18,6 +20,7 @@
 
 #include "common/error.h"
 #include "common/alloc.h"
+#include "common/arena.h"
 #include "common/debug.h"
 #include "ssh/ssh_constants.h"
 #include "ssh/debug.h"
@@ -28,6 +31,9 @@
 #include "common/disable_debug_i.h"
 #endif
 
+// large enough for any cipher IV, cipher key or MAC key
+#define KEX_MAX_KEY_LEN 128
+
 typedef int (*func_kex_run)(struct SSH_CONN *conn, struct SSH_KEX *kex);
 
 static const struct KEX_ALGO {
@@ -109,7 +115,7 @@ static int kex_send_init_msg(struct SSH_CONN *conn, struct SSH_KEX *kex)
   if ((pack = ssh_conn_new_packet(conn)) == NULL)
     return -1;
 
-  algo_list = ssh_buf_new();
+  algo_list = ssh_buf_new_with_allocator(kex->allocator);
   if (ssh_buf_write_u8(pack, SSH_MSG_KEXINIT) < 0
       || (p = ssh_buf_get_write_pointer(pack, 16)) == NULL
       || crypto_random_gen(p, 16) < 0
@@ -181,97 +187,57 @@ static int kex_recv_init_msg(struct SSH_CONN *conn, struct SSH_KEX *kex)
 }
 
 /*
- * Generate 'gen_key_len' bytes of data in 'ret_key' according to
+ * Generate 'key_len' bytes of data in 'key' according to
  * RFC 4253 section 7.2 (https://tools.ietf.org/html/rfc4253#section-7.2)
+ *
+ * 'base' has already hashed K || H, and is copied to 'hash' for each
+ * round, so the shared secret is hashed only once for all keys.
  */
-static int gen_key(struct SSH_STRING *ret_key, uint32_t gen_key_len, uint8_t key_id, struct SSH_CONN *conn, struct SSH_KEX *kex)
+static int gen_key(uint8_t *key, uint32_t key_len, uint8_t key_id, const struct SSH_STRING *session_id,
+                   const struct SSH_HASH_CTX *base, struct SSH_HASH_CTX *hash)
 {
-  struct SSH_BUFFER data;
-  struct SSH_STRING data_str;
-  struct SSH_BUFFER hash;
-  struct SSH_STRING hash_str;
-  struct SSH_STRING *session_id = ssh_conn_get_session_id(conn);
-  
-  //ssh_log("---------------------------\n");
-  //dump_mem(conn->shared_secret.str, conn->shared_secret.len, "shared secret");
-  //dump_mem(conn->exchange_hash.str, conn->exchange_hash.len, "hash");
-  //dump_mem(&key_id, 1, "id");
-  //dump_mem(conn->session_id.str, conn->session_id.len, "session_id");
+  uint8_t digest_data[SSH_HASH_MAX_LEN];
+  struct SSH_STRING digest = ssh_str_new(digest_data, 0);
+  uint32_t len, n;
 
   // K[1] = HASH(K || H || X || session_id)    (X is e.g., "A")
-  data = ssh_buf_new();
-  if (ssh_buf_write_string(&data, &kex->shared_secret) < 0
-      || ssh_buf_append_string(&data, &kex->exchange_hash) < 0
-      || ssh_buf_append_u8(&data, key_id) < 0
-      || ssh_buf_append_string(&data, session_id) < 0) {
-    ssh_buf_free(&data);
+  if (ssh_hash_copy(hash, base) < 0
+      || ssh_hash_update(hash, &key_id, 1) < 0
+      || ssh_hash_update(hash, session_id->str, session_id->len) < 0
+      || ssh_hash_final(hash, &digest) < 0)
     return -1;
-  }
 
-  hash = ssh_buf_new();
-  if (ssh_buf_grow(&hash, SSH_HASH_MAX_LEN) < 0) {
-    ssh_buf_free(&data);
-    ssh_buf_free(&hash);
-    return -1;
-  }
-  hash_str = ssh_str_new_from_buffer(&hash);
-  data_str = ssh_str_new_from_buffer(&data);
-  if (ssh_hash_compute(kex->hash_type, &hash_str, &data_str) < 0) {
-    ssh_buf_free(&hash);
-    ssh_buf_free(&data);
-    return -1;
-  }
-  hash.len = hash_str.len;
-
-  // K[n] = HASH(K || H || K[1] || ... || K[n-1])
-  while (hash.len < gen_key_len) {
-    //ssh_log("digesting %d/%d\n", (int) hash.len, (int) gen_key_len);
-    ssh_buf_clear(&data);
-    if (ssh_buf_write_string(&data, &kex->shared_secret) < 0
-        || ssh_buf_append_string(&data, &kex->exchange_hash) < 0
-        || ssh_buf_append_buffer(&data, &hash) < 0) {
-      ssh_buf_free(&data);
-      ssh_buf_free(&hash);
-      return -1;
-    }
-    
-    if (ssh_buf_grow(&hash, SSH_HASH_MAX_LEN) < 0) {
-      ssh_buf_free(&data);
-      ssh_buf_free(&hash);
-      return -1;
-    }
-    hash_str = ssh_str_new(hash.data + hash.len, 0);
-    data_str = ssh_str_new_from_buffer(&data);
-    if (ssh_hash_compute(kex->hash_type, &hash_str, &data_str) < 0) {
-      ssh_buf_free(&data);
-      ssh_buf_free(&hash);
+  len = 0;
+  while (1) {
+    n = (digest.len < key_len - len) ? digest.len : key_len - len;
+    memcpy(key + len, digest_data, n);
+    len += n;
+    if (len >= key_len)
+      break;
+
+    // K[n] = HASH(K || H || K[1] || ... || K[n-1])
+    if (ssh_hash_copy(hash, base) < 0
+        || ssh_hash_update(hash, key, len) < 0
+        || ssh_hash_final(hash, &digest) < 0) {
+      OPENSSL_cleanse(digest_data, sizeof(digest_data));
       return -1;
     }
-    hash.len += hash_str.len;
   }
-  ssh_buf_free(&data);
 
   //ssh_log("key for '%c' ", key_id);
-  //dump_mem(hash.data, gen_key_len, "");
-  
-  // key = K[1] || .. || K[n]
-  hash_str = ssh_str_new(hash.data, gen_key_len);
-  if (ssh_str_dup_string(ret_key, &hash_str)) {
-    ssh_buf_free(&hash);
-    return -1;
-  }
-  ssh_buf_free(&hash);
+  //dump_mem(key, key_len, "");
+  OPENSSL_cleanse(digest_data, sizeof(digest_data));
   return 0;
 }
 
 static int kex_generate_keys(struct SSH_CONN *conn, struct SSH_KEX *kex)
 {
-  struct SSH_STRING cipher_iv_cts = ssh_str_new_empty();
-  struct SSH_STRING cipher_iv_stc = ssh_str_new_empty();
-  struct SSH_STRING cipher_key_cts = ssh_str_new_empty();
-  struct SSH_STRING cipher_key_stc = ssh_str_new_empty();
-  struct SSH_STRING mac_key_cts = ssh_str_new_empty();
-  struct SSH_STRING mac_key_stc = ssh_str_new_empty();
+  uint8_t key_data[6][KEX_MAX_KEY_LEN];
+  struct SSH_STRING cipher_iv_cts, cipher_iv_stc;
+  struct SSH_STRING cipher_key_cts, cipher_key_stc;
+  struct SSH_STRING mac_key_cts, mac_key_stc;
+  struct SSH_STRING *session_id = ssh_conn_get_session_id(conn);
+  struct SSH_HASH_CTX base, hash;
   int cipher_iv_cts_len, cipher_iv_stc_len;
   int cipher_key_cts_len, cipher_key_stc_len;
   int mac_key_cts_len, mac_key_stc_len;
@@ -283,30 +249,53 @@ static int kex_generate_keys(struct SSH_CONN *conn, struct SSH_KEX *kex)
       || (cipher_iv_stc_len = ssh_cipher_get_iv_len(kex->cipher_type_stc)) < 0
       || (cipher_key_cts_len = ssh_cipher_get_key_len(kex->cipher_type_cts)) < 0
       || (cipher_key_stc_len = ssh_cipher_get_key_len(kex->cipher_type_stc)) < 0
-      || (mac_key_cts_len = ssh_mac_get_len(kex->mac_type_cts)) < 0
-      || (mac_key_stc_len = ssh_mac_get_len(kex->mac_type_stc)) < 0)
+      || (mac_key_cts_len = ssh_mac_get_key_len(kex->mac_type_cts)) < 0
+      || (mac_key_stc_len = ssh_mac_get_key_len(kex->mac_type_stc)) < 0)
+    return -1;
+  if (cipher_iv_cts_len > KEX_MAX_KEY_LEN || cipher_iv_stc_len > KEX_MAX_KEY_LEN
+      || cipher_key_cts_len > KEX_MAX_KEY_LEN || cipher_key_stc_len > KEX_MAX_KEY_LEN
+      || mac_key_cts_len > KEX_MAX_KEY_LEN || mac_key_stc_len > KEX_MAX_KEY_LEN) {
+    ssh_set_error("key too large");
     return -1;
+  }
+  cipher_iv_cts = ssh_str_new(key_data[0], cipher_iv_cts_len);
+  cipher_iv_stc = ssh_str_new(key_data[1], cipher_iv_stc_len);
+  cipher_key_cts = ssh_str_new(key_data[2], cipher_key_cts_len);
+  cipher_key_stc = ssh_str_new(key_data[3], cipher_key_stc_len);
+  mac_key_cts = ssh_str_new(key_data[4], mac_key_cts_len);
+  mac_key_stc = ssh_str_new(key_data[5], mac_key_stc_len);
+
+  // hash K || H once for all keys
+  hash.crypto_ctx = NULL;
+  if (ssh_hash_init(&base, kex->hash_type) < 0)
+    return -1;
+  if (ssh_hash_update_string(&base, &kex->shared_secret) < 0
+      || ssh_hash_update(&base, kex->exchange_hash.str, kex->exchange_hash.len) < 0
+      || ssh_hash_init(&hash, kex->hash_type) < 0) {
+    ssh_hash_close(&hash);
+    ssh_hash_close(&base);
+    return -1;
+  }
 
-  if (gen_key(&cipher_iv_cts, cipher_iv_cts_len, 'A', conn, kex) < 0
-      || gen_key(&cipher_iv_stc, cipher_iv_stc_len, 'B', conn, kex) < 0
-      || gen_key(&cipher_key_cts, cipher_key_cts_len, 'C', conn, kex) < 0
-      || gen_key(&cipher_key_stc, cipher_key_stc_len, 'D', conn, kex) < 0
-      || gen_key(&mac_key_cts, mac_key_cts_len, 'E', conn, kex) < 0
-      || gen_key(&mac_key_stc, mac_key_stc_len, 'F', conn, kex) < 0
+  if (gen_key(cipher_iv_cts.str, cipher_iv_cts.len, 'A', session_id, &base, &hash) < 0
+      || gen_key(cipher_iv_stc.str, cipher_iv_stc.len, 'B', session_id, &base, &hash) < 0
+      || gen_key(cipher_key_cts.str, cipher_key_cts.len, 'C', session_id, &base, &hash) < 0
+      || gen_key(cipher_key_stc.str, cipher_key_stc.len, 'D', session_id, &base, &hash) < 0
+      || gen_key(mac_key_cts.str, mac_key_cts.len, 'E', session_id, &base, &hash) < 0
+      || gen_key(mac_key_stc.str, mac_key_stc.len, 'F', session_id, &base, &hash) < 0
       || ssh_conn_set_cipher(conn, SSH_CONN_CTS, kex->cipher_type_cts, &cipher_iv_cts, &cipher_key_cts) < 0
       || ssh_conn_set_cipher(conn, SSH_CONN_STC, kex->cipher_type_stc, &cipher_iv_stc, &cipher_key_stc) < 0
       || ssh_conn_set_mac(conn, SSH_CONN_CTS, kex->mac_type_cts, &mac_key_cts) < 0
       || ssh_conn_set_mac(conn, SSH_CONN_STC, kex->mac_type_stc, &mac_key_stc) < 0)
     ret = -1;
-  else
+  else {
+    ssh_conn_newkeys(conn);
     ret = 0;
+  }
 
-  ssh_str_free(&cipher_iv_cts);
-  ssh_str_free(&cipher_iv_stc);
-  ssh_str_free(&cipher_key_cts);
-  ssh_str_free(&cipher_key_stc);
-  ssh_str_free(&mac_key_cts);
-  ssh_str_free(&mac_key_stc);
+  ssh_hash_close(&hash);
+  ssh_hash_close(&base);
+  OPENSSL_cleanse(key_data, sizeof(key_data));
   return ret;
 }
 
@@ -460,26 +449,32 @@ int ssh_kex_finish(struct SSH_CONN *conn, struct SSH_KEX *kex, struct SSH_STRING
 /* === RUN ========================================================================================== */
 /* ================================================================================================== */
 
+/*
+ * The kex struct and all scratch buffers used during the key
+ * exchange are allocated from the connection's kex arena, which is
+ * released (and wiped) as a whole when the key exchange ends.
+ */
 static struct SSH_KEX *kex_new(struct SSH_CONN *conn)
 {
+  struct SSH_ARENA *arena = ssh_conn_get_kex_arena(conn);
   struct SSH_KEX *kex;
 
-  if ((kex = ssh_alloc(sizeof(struct SSH_KEX))) == NULL)
+  if ((kex = ssh_arena_alloc(arena, sizeof(struct SSH_KEX))) == NULL)
     return NULL;
+  memset(kex, 0, sizeof(struct SSH_KEX));
+  kex->allocator = ssh_arena_get_allocator(arena);
   kex->exchange_hash = ssh_str_new_empty();
   kex->shared_secret = ssh_str_new_empty();
-  kex->client_kexinit = ssh_buf_new();
-  kex->server_kexinit = ssh_buf_new();
+  kex->client_kexinit = ssh_buf_new_with_allocator(kex->allocator);
+  kex->server_kexinit = ssh_buf_new_with_allocator(kex->allocator);
   return kex;
 }
 
-static void kex_free(struct SSH_KEX *kex)
+static void kex_free(struct SSH_CONN *conn, struct SSH_KEX *kex)
 {
   ssh_str_free(&kex->exchange_hash);
   ssh_str_free(&kex->shared_secret);
-  ssh_buf_free(&kex->client_kexinit);
-  ssh_buf_free(&kex->server_kexinit);
-  ssh_free(kex);
+  ssh_arena_release(ssh_conn_get_kex_arena(conn));
 }
 
 int ssh_kex_run(struct SSH_CONN *conn)
@@ -490,10 +485,10 @@ int ssh_kex_run(struct SSH_CONN *conn)
   if ((kex = kex_new(conn)) == NULL)
     return -1;
   if (kex_start(conn, kex) < 0) {
-    kex_free(kex);
+    kex_free(conn, kex);
     return -1;
   }
-  kex_free(kex);
+  kex_free(conn, kex);
   ssh_log("* key exchange finalized\n");
   return 0;
 }
@@ -12,6 +12,7 @@
 #include "ssh/connection_i.h"
 #include "ssh/hash_i.h"
 #include "ssh/pubkey_i.h"
+#include "ssh/message_i.h"
 #include "ssh/connection_i.h"
 
 #include "common/error.h"
@@ -72,6 +73,7 @@ static int dh_kex_send_init_msg(struct CRYPTO_DH *dh, struct SSH_CONN *conn)
 {
   struct SSH_STRING e;
   struct SSH_BUFFER *pack;
+  struct SSH_MSG_kexdh_init msg;
  
   if (crypto_dh_get_pubkey(dh, &e) < 0)
     return -1;
@@ -82,8 +84,8 @@ static int dh_kex_send_init_msg(struct CRYPTO_DH *dh, struct SSH_CONN *conn)
   if (pack == NULL)
     return -1;
 
-  if (ssh_buf_write_u8(pack, SSH_MSG_KEXDH_INIT) < 0
-      || ssh_buf_write_string(pack, &e) < 0)
+  msg.e = e;
+  if (ssh_msg_build_kexdh_init(pack, &msg) < 0)
     return -1;
   
   if (ssh_conn_send_packet(conn) < 0)
@@ -109,7 +111,7 @@ static int dh_kex_hash(struct SSH_STRING *ret_hash, enum SSH_HASH_TYPE hash_type
   client_version = ssh_conn_get_client_version_string(conn);
   server_version = ssh_conn_get_server_version_string(conn);
   
-  data = ssh_buf_new();
+  data = ssh_buf_new_with_allocator(kex->allocator);
   if (ssh_buf_write_data(&data, (uint8_t *) client_version->buf, client_version->len) < 0
       || ssh_buf_write_data(&data, (uint8_t *) server_version->buf, server_version->len) < 0
       || ssh_buf_write_buffer(&data, &kex->client_kexinit) < 0
@@ -139,6 +141,7 @@ static int dh_kex_hash(struct SSH_STRING *ret_hash, enum SSH_HASH_TYPE hash_type
 static int dh_kex_read_reply(struct CRYPTO_DH *dh, struct SSH_CONN *conn, struct SSH_KEX *kex)
 {
   struct SSH_BUF_READER *pack;
+  struct SSH_MSG_kexdh_reply msg;
   struct SSH_STRING server_host_key;
   struct SSH_STRING client_pubkey;
   struct SSH_STRING server_pubkey;
@@ -154,11 +157,11 @@ static int dh_kex_read_reply(struct CRYPTO_DH *dh, struct SSH_CONN *conn, struct
     return -1;
   }
   ssh_log("* got SSH_MSG_KEXDH_REPLY\n");
-  if (ssh_buf_read_u8(pack, NULL) < 0
-      || ssh_buf_read_string(pack, &server_host_key) < 0
-      || ssh_buf_read_string(pack, &server_pubkey) < 0
-      || ssh_buf_read_string(pack, &server_hash_sig) < 0)
+  if (ssh_msg_parse_kexdh_reply(pack, &msg) < 0)
     return -1;
+  server_host_key = msg.server_host_key;
+  server_pubkey = msg.f;
+  server_hash_sig = msg.signature;
   //dump_string("* server_host_key", &server_host_key);
   //dump_string("* server_pubkey", &server_pubkey);
   //dump_string("* hash_sig", &server_hash_sig);
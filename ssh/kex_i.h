@@ -28,6 +28,7 @@ struct SSH_KEX {
   struct SSH_STRING exchange_hash;
   struct SSH_BUFFER server_kexinit;
   struct SSH_BUFFER client_kexinit;
+  struct SSH_ALLOCATOR *allocator;  // scratch allocator, released after kex
 };
 
 enum SSH_KEX_TYPE ssh_kex_get_by_name_n(const uint8_t *name, size_t len);
@@ -5,44 +5,46 @@
 
 #include "ssh/mac_i.h"
 
-#include "ssh/hash_i.h"
-
 #include "common/error.h"
 #include "common/alloc.h"
 #include "crypto/algorithms.h"
-#include "crypto/sha2.h"
+#include "crypto/hmac.h"
 
-typedef struct CRYPTO_HASH_CTX *(*func_hash_new)(uint32_t bits);
-typedef int (*func_hash_single)(enum SSH_HASH_TYPE type, void *out, uint32_t *out_len, const void *data, uint32_t len);
-typedef void (*func_hash_free)(struct CRYPTO_HASH_CTX *crypto_ctx);
-typedef int (*func_hash_copy_ctx)(struct CRYPTO_HASH_CTX *crypto_to_ctx, const struct CRYPTO_HASH_CTX *crypto_from_ctx);
-typedef int (*func_hash_update)(struct CRYPTO_HASH_CTX *crypto_ctx, const void *data, uint32_t len);
-typedef int (*func_hash_final)(struct CRYPTO_HASH_CTX *crypto_ctx, void *out, uint32_t *out_len);
+typedef struct CRYPTO_HMAC_CTX *(*func_new)(enum SSH_HASH_TYPE type, const struct SSH_STRING *key);
+typedef int (*func_set_key)(struct CRYPTO_HMAC_CTX *ctx, enum SSH_HASH_TYPE type, const struct SSH_STRING *key);
+typedef void (*func_free)(struct CRYPTO_HMAC_CTX *ctx);
+typedef int (*func_init)(struct CRYPTO_HMAC_CTX *ctx);
+typedef int (*func_update)(struct CRYPTO_HMAC_CTX *ctx, const void *data, uint32_t len);
+typedef int (*func_final)(struct CRYPTO_HMAC_CTX *ctx, void *out, uint32_t out_size);
 
-#define LIST_HASH_FUNCS(algo) crypto_##algo##_single, crypto_##algo##_new, crypto_##algo##_free, crypto_##algo##_copy_ctx, crypto_##algo##_update, crypto_##algo##_final
+#define LIST_MAC_FUNCS(algo) crypto_##algo##_new, crypto_##algo##_set_key, crypto_##algo##_free, crypto_##algo##_init, crypto_##algo##_update, crypto_##algo##_final
 
 static const struct MAC_ALGO {
   const char *name;
   enum SSH_MAC_TYPE type;
   enum SSH_HASH_TYPE hash_type;
   uint32_t len;
-  func_hash_single hash_single;
-  func_hash_new hash_new;
-  func_hash_free hash_free;
-  func_hash_copy_ctx hash_copy_ctx;
-  func_hash_update hash_update;
-  func_hash_final hash_final;
+  uint32_t key_len;
+  func_new new;
+  func_set_key set_key;
+  func_free free;
+  func_init init;
+  func_update update;
+  func_final final;
 } mac_algos[] = {
-  { "hmac-sha2-256", SSH_MAC_HMAC_SHA2_256, SSH_HASH_SHA2_256, 32, LIST_HASH_FUNCS(sha2) },
-  { "hmac-sha2-512", SSH_MAC_HMAC_SHA2_512, SSH_HASH_SHA2_512, 64, LIST_HASH_FUNCS(sha2) },
+  { "hmac-sha2-256", SSH_MAC_HMAC_SHA2_256, SSH_HASH_SHA2_256, 32, 32, LIST_MAC_FUNCS(hmac) },
+  { "hmac-sha2-512", SSH_MAC_HMAC_SHA2_512, SSH_HASH_SHA2_512, 64, 64, LIST_MAC_FUNCS(hmac) },
 };
 
+#define NUM_MAC_ALGOS (sizeof(mac_algos)/sizeof(mac_algos[0]))
+
+// order of mac_algos[] in the list sent to the server, if set
+static int mac_order[NUM_MAC_ALGOS];
+static int mac_order_set;
+
 struct SSH_MAC_CTX {
   const struct MAC_ALGO *algo;
-  struct CRYPTO_HASH_CTX *ctx;
-  struct CRYPTO_HASH_CTX *ictx;
-  struct CRYPTO_HASH_CTX *octx;
-  uint32_t block_size;
+  struct CRYPTO_HMAC_CTX *ctx;
 };
 
 enum SSH_MAC_TYPE ssh_mac_get_by_name(const char *name)
@@ -73,14 +75,62 @@ int ssh_mac_get_supported_algos(struct SSH_BUFFER *ret)
   int i;
 
   ssh_buf_clear(ret);
-  for (i = 0; i < sizeof(mac_algos)/sizeof(mac_algos[0]); i++) {
+  for (i = 0; i < NUM_MAC_ALGOS; i++) {
+    const char *name = mac_algos[(mac_order_set) ? mac_order[i] : i].name;
     if ((i > 0 && ssh_buf_append_u8(ret, ',') < 0)
-        || ssh_buf_append_data(ret, (uint8_t *) mac_algos[i].name, strlen(mac_algos[i].name)) < 0)
+        || ssh_buf_append_data(ret, (uint8_t *) name, strlen(name)) < 0)
       return -1;
   }
   return 0;
 }
 
+/*
+ * Store the types of all supported algorithms in 'types', returning
+ * how many there are.
+ */
+int ssh_mac_get_algo_types(enum SSH_MAC_TYPE *types, int max_types)
+{
+  int i;
+
+  for (i = 0; i < NUM_MAC_ALGOS && i < max_types; i++)
+    types[i] = mac_algos[i].type;
+  return i;
+}
+
+/*
+ * Set the order of the algorithms in the list sent to the server:
+ * first the ones in 'types', then the others in the default order.
+ */
+int ssh_mac_set_preferred_order(const enum SSH_MAC_TYPE *types, int num_types)
+{
+  int order[NUM_MAC_ALGOS];
+  int used[NUM_MAC_ALGOS];
+  int i, j, n;
+
+  memset(used, 0, sizeof(used));
+  n = 0;
+  for (i = 0; i < num_types; i++) {
+    for (j = 0; j < NUM_MAC_ALGOS; j++)
+      if (mac_algos[j].type == types[i])
+        break;
+    if (j == NUM_MAC_ALGOS) {
+      ssh_set_error("invalid mac type: %d", types[i]);
+      return -1;
+    }
+    if (! used[j]) {
+      order[n++] = j;
+      used[j] = 1;
+    }
+  }
+  for (j = 0; j < NUM_MAC_ALGOS; j++)
+    if (! used[j])
+      order[n++] = j;
+
+  memcpy(mac_order, order, sizeof(order));
+  mac_order_set = 1;
+  return 0;
+}
+
 static const struct MAC_ALGO *mac_get_algo(enum SSH_MAC_TYPE type)
 {
   int i;
@@ -92,6 +142,14 @@ static const struct MAC_ALGO *mac_get_algo(enum SSH_MAC_TYPE type)
   return NULL;
 }
 
+const char *ssh_mac_get_name(enum SSH_MAC_TYPE type)
+{
+  const struct MAC_ALGO *algo = mac_get_algo(type);
+  if (algo == NULL)
+    return NULL;
+  return algo->name;
+}
+
 int ssh_mac_get_len(enum SSH_MAC_TYPE type)
 {
   const struct MAC_ALGO *algo = mac_get_algo(type);
@@ -100,129 +158,86 @@ int ssh_mac_get_len(enum SSH_MAC_TYPE type)
   return algo->len;
 }
 
-static int mac_set_key(struct SSH_MAC_CTX *mac, const struct SSH_STRING *key)
+int ssh_mac_get_key_len(enum SSH_MAC_TYPE type)
 {
-  const struct MAC_ALGO *algo = mac->algo;
-  uint8_t key_data[SSH_HASH_MAX_LEN];
-  int i;
-
-  //ssh_log("setting mac key: block size is %d\n", mac->block_size);
-  
-  // fit key in digest, hashing or filling 0s as necessary
-  if (key->len > mac->block_size) {
-    //ssh_log("- hash key to fit\n");
-    if (algo->hash_single(algo->hash_type, key_data, NULL, key->str, key->len) < 0)
-      return -1;
-  } else {
-    //ssh_log("- copying key\n");
-    memcpy(key_data, key->str, key->len);
-    if (key->len < mac->block_size)
-      memset(key_data + key->len, 0, mac->block_size - key->len);
-  }
-
-  //dump_mem(key_data, mac->block_size, ">>>>> SET MAC KEY");
-  
-  // init ictx
-  for (i = 0; i < mac->block_size; i++)
-    key_data[i] ^= 0x36;
-  //dump_mem(key_data, mac->block_size, ">>>>> UPDATE ICTX");
-  if (algo->hash_update(mac->ictx, key_data, mac->block_size) < 0) {
-    memset(key_data, 0, mac->block_size);
-    return -1;
-  }
-
-  // init octx
-  for (i = 0; i < mac->block_size; i++)
-    key_data[i] ^= 0x36 ^ 0x5c; // 0x36 to undo ictx preparation
-  //dump_mem(key_data, mac->block_size, ">>>>> UPDATE OCTX");
-  if (algo->hash_update(mac->octx, key_data, mac->block_size) < 0) {
-    memset(key_data, 0, mac->block_size);
+  const struct MAC_ALGO *algo = mac_get_algo(type);
+  if (algo == NULL)
     return -1;
-  }
-  
-  memset(key_data, 0, mac->block_size);
-  return 0;
+  return algo->key_len;
 }
 
 struct SSH_MAC_CTX *ssh_mac_new(enum SSH_MAC_TYPE type, const struct SSH_STRING *key)
 {
   struct SSH_MAC_CTX *mac;
-  int block_size;
   const struct MAC_ALGO *algo = mac_get_algo(type);
   if (algo == NULL)
     return NULL;
 
-  block_size = ssh_hash_get_block_size(algo->hash_type);
-  if (block_size < 0)
-    return NULL;
-
   mac = ssh_alloc(sizeof(struct SSH_MAC_CTX));
   if (mac == NULL)
     return NULL;
 
   mac->algo = algo;
-  mac->ctx = NULL;
-  mac->ictx = NULL;
-  mac->octx = NULL;
-  mac->block_size = block_size;
-
-  if ((mac->ctx = algo->hash_new(algo->hash_type)) == NULL
-      || (mac->ictx = algo->hash_new(algo->hash_type)) == NULL
-      || (mac->octx = algo->hash_new(algo->hash_type)) == NULL
-      || mac_set_key(mac, key) < 0) {
-    ssh_mac_free(mac);
+  if ((mac->ctx = algo->new(algo->hash_type, key)) == NULL) {
+    ssh_free(mac);
     return NULL;
   }
-
   return mac;
 }
 
+/*
+ * Install a new key, reusing the existing crypto context if the new
+ * algorithm has the same implementation.
+ */
+int ssh_mac_rekey(struct SSH_MAC_CTX *mac, enum SSH_MAC_TYPE type, const struct SSH_STRING *key)
+{
+  struct CRYPTO_HMAC_CTX *crypto_ctx;
+  const struct MAC_ALGO *algo = mac_get_algo(type);
+  if (algo == NULL)
+    return -1;
+
+  if (algo->set_key == mac->algo->set_key) {
+    if (algo->set_key(mac->ctx, algo->hash_type, key) < 0)
+      return -1;
+  } else {
+    if ((crypto_ctx = algo->new(algo->hash_type, key)) == NULL)
+      return -1;
+    mac->algo->free(mac->ctx);
+    mac->ctx = crypto_ctx;
+  }
+  mac->algo = algo;
+  return 0;
+}
+
 void ssh_mac_free(struct SSH_MAC_CTX *mac)
 {
   if (mac->ctx != NULL)
-    mac->algo->hash_free(mac->ctx);
-  if (mac->ictx != NULL)
-    mac->algo->hash_free(mac->ictx);
-  if (mac->octx != NULL)
-    mac->algo->hash_free(mac->octx);
+    mac->algo->free(mac->ctx);
   ssh_free(mac);
 }
 
 int ssh_mac_compute(struct SSH_MAC_CTX *mac, uint8_t *out, uint32_t seq_num, const uint8_t *data, uint32_t len)
 {
   const struct MAC_ALGO *algo = mac->algo;
-  uint8_t buf[SSH_HASH_MAX_LEN];
   uint8_t seq_num_buf[4];
-  uint32_t buf_len;
 
   //ssh_log("SEQNO FOR HASH: %u\n", seq_num);
   //dump_mem(data, len, "PACKDATA FOR HASH");
 
-  ssh_buf_set_u32(seq_num_buf, seq_num);
-
-  // inner hash
-  if (algo->hash_copy_ctx(mac->ctx, mac->ictx) < 0)
+  ssh_buf_store_be32(seq_num_buf, seq_num);
+  if (algo->init(mac->ctx) < 0
+      || algo->update(mac->ctx, seq_num_buf, 4) < 0
+      || algo->update(mac->ctx, data, len) < 0
+      || algo->final(mac->ctx, out, algo->len) < 0)
     return -1;
-  if (algo->hash_update(mac->ctx, seq_num_buf, 4) < 0)
-    return -1;
-  if (algo->hash_update(mac->ctx, data, len) < 0)
-    return -1;
-  if (algo->hash_final(mac->ctx, buf, &buf_len) < 0)
-    return -1;
-  //dump_mem(buf, buf_len, ">>>>> INNER HASH");
-
-  // outer hash
-  if (algo->hash_copy_ctx(mac->ctx, mac->octx) < 0)
-    return -1;
-  if (algo->hash_update(mac->ctx, buf, algo->len) < 0)
-    return -1;
-  if (algo->hash_final(mac->ctx, out, &buf_len) < 0)
-    return -1;
-  //dump_mem(out, buf_len, ">>>>> OUTER HASH");
-
-  //dump_mem(out, algo->len, ">>>>>>>>>>>>>>>>> COMPUTED HASH");
-  //memset(out, 0, algo->len);
-  
-  memset(buf, 0, algo->len);
   return 0;
 }
+
+/*
+ * Get the underlying crypto context, for callers that call the
+ * algorithm's functions directly.
+ */
+struct CRYPTO_HMAC_CTX *ssh_mac_get_crypto_ctx(struct SSH_MAC_CTX *mac)
+{
+  return mac->ctx;
+}
@@ -17,16 +17,23 @@ enum SSH_MAC_TYPE {
 };
 
 struct SSH_MAC_CTX;
+struct CRYPTO_HMAC_CTX;
 
 enum SSH_MAC_TYPE ssh_mac_get_by_name(const char *name);
 enum SSH_MAC_TYPE ssh_mac_get_by_name_n(const uint8_t *name, size_t name_len);
 enum SSH_MAC_TYPE ssh_mac_get_by_name_str(const struct SSH_STRING *name);
 int ssh_mac_get_supported_algos(struct SSH_BUFFER *ret);
+int ssh_mac_get_algo_types(enum SSH_MAC_TYPE *types, int max_types);
+int ssh_mac_set_preferred_order(const enum SSH_MAC_TYPE *types, int num_types);
+const char *ssh_mac_get_name(enum SSH_MAC_TYPE type);
 
 int ssh_mac_get_len(enum SSH_MAC_TYPE type);
+int ssh_mac_get_key_len(enum SSH_MAC_TYPE type);
 
 struct SSH_MAC_CTX *ssh_mac_new(enum SSH_MAC_TYPE type, const struct SSH_STRING *key);
+int ssh_mac_rekey(struct SSH_MAC_CTX *mac, enum SSH_MAC_TYPE type, const struct SSH_STRING *key);
 void ssh_mac_free(struct SSH_MAC_CTX *mac);
 int ssh_mac_compute(struct SSH_MAC_CTX *mac, uint8_t *out, uint32_t seq_num, const uint8_t *data, uint32_t len);
+struct CRYPTO_HMAC_CTX *ssh_mac_get_crypto_ctx(struct SSH_MAC_CTX *mac);
 
 #endif /* MAC_I_H_FILE */
@@ -0,0 +1,106 @@
+/* message.c
+ *
+ * Builders and parsers for the messages in message_i.h, generated
+ * from the schemas.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "ssh/message_i.h"
+
+#include "common/error.h"
+
+/* size of the fixed part of each field type */
+#define FIELD_FIXED_SIZE_U8      1
+#define FIELD_FIXED_SIZE_BOOL    1
+#define FIELD_FIXED_SIZE_U32     4
+#define FIELD_FIXED_SIZE_STRING  4
+
+/* size of the variable part of each field type */
+#define FIELD_VAR_SIZE_U8(v)      0
+#define FIELD_VAR_SIZE_BOOL(v)    0
+#define FIELD_VAR_SIZE_U32(v)     0
+#define FIELD_VAR_SIZE_STRING(v)  (v).len
+
+#define FIELD_STORE_U8(p, v)    (*(p)++ = (v))
+#define FIELD_STORE_BOOL(p, v)  (*(p)++ = ((v) != 0))
+#define FIELD_STORE_U32(p, v)   do { ssh_buf_store_be32(p, v); (p) += 4; } while (0)
+#define FIELD_STORE_STRING(p, v)                                        \
+  do {                                                                  \
+    ssh_buf_store_be32(p, (uint32_t) (v).len);                          \
+    if ((v).len > 0)                                                    \
+      memcpy((p) + 4, (v).str, (v).len);                                \
+    (p) += 4 + (v).len;                                                 \
+  } while (0)
+
+/*
+ * 'avail' is the number of bytes left in the message after
+ * discounting the fixed size of all fields, so only string contents
+ * need to be checked.
+ */
+#define FIELD_LOAD_U8(p, v, avail)    ((v) = *(p)++)
+#define FIELD_LOAD_BOOL(p, v, avail)  ((v) = (*(p)++ != 0))
+#define FIELD_LOAD_U32(p, v, avail)   do { (v) = ssh_buf_load_be32(p); (p) += 4; } while (0)
+#define FIELD_LOAD_STRING(p, v, avail)                                  \
+  do {                                                                  \
+    uint32_t str_len_ = ssh_buf_load_be32(p);                           \
+    if (str_len_ > (avail))                                             \
+      return msg_error_truncated();                                     \
+    (v).str = (uint8_t *) (p) + 4;                                      \
+    (v).len = str_len_;                                                 \
+    (p) += 4 + str_len_;                                                \
+    (avail) -= str_len_;                                                \
+  } while (0)
+
+#define ADD_FIXED_SIZE(type, name)  + FIELD_FIXED_SIZE_##type
+#define ADD_VAR_SIZE(type, name)    + FIELD_VAR_SIZE_##type(msg->name)
+#define STORE_FIELD(type, name)     FIELD_STORE_##type(p, msg->name);
+#define LOAD_FIELD(type, name)      FIELD_LOAD_##type(p, msg->name, avail);
+
+static int msg_error_truncated(void)
+{
+  ssh_set_error("message too short");
+  return -1;
+}
+
+#define DEFINE_MSG_FUNCS(name, msg_type)                                \
+  int ssh_msg_build_##name(struct SSH_BUFFER *pack, const struct SSH_MSG_##name *msg) \
+  {                                                                     \
+    size_t len = 1 SSH_MSG_FIELDS_##name(ADD_FIXED_SIZE) SSH_MSG_FIELDS_##name(ADD_VAR_SIZE); \
+    uint8_t *p;                                                         \
+                                                                        \
+    if (len > UINT32_MAX) {                                             \
+      ssh_set_error("message too large");                               \
+      return -1;                                                        \
+    }                                                                   \
+    if ((p = ssh_buf_get_write_pointer(pack, len)) == NULL)             \
+      return -1;                                                        \
+    *p++ = msg_type;                                                    \
+    SSH_MSG_FIELDS_##name(STORE_FIELD)                                  \
+    return 0;                                                           \
+  }                                                                     \
+                                                                        \
+  int ssh_msg_parse_##name(struct SSH_BUF_READER *pack, struct SSH_MSG_##name *msg) \
+  {                                                                     \
+    const size_t min_len = 1 SSH_MSG_FIELDS_##name(ADD_FIXED_SIZE);     \
+    const uint8_t *p;                                                   \
+    size_t avail;                                                       \
+                                                                        \
+    if (pack->pos > pack->len || pack->len - pack->pos < min_len)       \
+      return msg_error_truncated();                                     \
+    p = pack->data + pack->pos;                                         \
+    if (*p != msg_type) {                                               \
+      ssh_set_error("unexpected message type: %d (expected %d)", *p, msg_type); \
+      return -1;                                                        \
+    }                                                                   \
+    p++;                                                                \
+    avail = pack->len - pack->pos - min_len;                            \
+    SSH_MSG_FIELDS_##name(LOAD_FIELD)                                   \
+    (void) avail;  /* unused if there are no strings */                 \
+    pack->pos = p - pack->data;                                         \
+    return 0;                                                           \
+  }
+
+SSH_MSG_SCHEMAS(DEFINE_MSG_FUNCS)
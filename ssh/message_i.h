@@ -0,0 +1,160 @@
+/* message_i.h
+ *
+ * Message schemas.  Each message listed in SSH_MSG_SCHEMAS gets a
+ * struct with its fields (struct SSH_MSG_<name>) and a pair of
+ * functions to build and parse it:
+ *
+ *   int ssh_msg_build_<name>(struct SSH_BUFFER *pack, const struct SSH_MSG_<name> *msg);
+ *   int ssh_msg_parse_<name>(struct SSH_BUF_READER *pack, struct SSH_MSG_<name> *msg);
+ *
+ * The builder computes the message size up front and grows the
+ * buffer once; the parser checks the message type and does a single
+ * length check for all fixed-size fields, plus one for the contents
+ * of each string.  Parsed strings point into the packet.
+ */
+
+#ifndef MESSAGE_I_H_FILE
+#define MESSAGE_I_H_FILE
+
+#include <stdint.h>
+
+#include "common/buffer.h"
+#include "ssh/ssh_constants.h"
+
+/* field types */
+#define SSH_MSG_CTYPE_U8      uint8_t
+#define SSH_MSG_CTYPE_BOOL    uint8_t
+#define SSH_MSG_CTYPE_U32     uint32_t
+#define SSH_MSG_CTYPE_STRING  struct SSH_STRING
+
+/* transport */
+#define SSH_MSG_FIELDS_disconnect(F)                                    \
+  F(U32, reason_code)                                                   \
+  F(STRING, description)                                                \
+  F(STRING, language_tag)
+#define SSH_MSG_FIELDS_ignore(F)                                        \
+  F(STRING, data)
+#define SSH_MSG_FIELDS_service_request(F)                               \
+  F(STRING, service_name)
+#define SSH_MSG_FIELDS_service_accept(F)                                \
+  F(STRING, service_name)
+#define SSH_MSG_FIELDS_kexdh_init(F)                                    \
+  F(STRING, e)
+#define SSH_MSG_FIELDS_kexdh_reply(F)                                   \
+  F(STRING, server_host_key)                                            \
+  F(STRING, f)                                                          \
+  F(STRING, signature)
+
+/* userauth */
+#define SSH_MSG_FIELDS_userauth_request_none(F)                         \
+  F(STRING, username)                                                   \
+  F(STRING, service_name)                                               \
+  F(STRING, method_name)
+#define SSH_MSG_FIELDS_userauth_request_password(F)                     \
+  F(STRING, username)                                                   \
+  F(STRING, service_name)                                               \
+  F(STRING, method_name)                                                \
+  F(BOOL, change_password)                                              \
+  F(STRING, password)
+#define SSH_MSG_FIELDS_userauth_failure(F)                              \
+  F(STRING, methods)                                                    \
+  F(BOOL, partial_success)
+
+/* connection */
+#define SSH_MSG_FIELDS_global_request(F)                                \
+  F(STRING, request_name)                                               \
+  F(BOOL, want_reply)
+#define SSH_MSG_FIELDS_channel_open(F)                                  \
+  F(STRING, channel_type)                                               \
+  F(U32, sender_channel)                                                \
+  F(U32, initial_window_size)                                           \
+  F(U32, max_packet_size)
+#define SSH_MSG_FIELDS_channel_open_confirmation(F)                     \
+  F(U32, recipient_channel)                                             \
+  F(U32, sender_channel)                                                \
+  F(U32, initial_window_size)                                           \
+  F(U32, max_packet_size)
+#define SSH_MSG_FIELDS_channel_open_failure(F)                          \
+  F(U32, recipient_channel)                                             \
+  F(U32, reason_code)                                                   \
+  F(STRING, description)                                                \
+  F(STRING, language_tag)
+#define SSH_MSG_FIELDS_channel_window_adjust(F)                         \
+  F(U32, recipient_channel)                                             \
+  F(U32, bytes_to_add)
+#define SSH_MSG_FIELDS_channel_data(F)                                  \
+  F(U32, recipient_channel)                                             \
+  F(STRING, data)
+#define SSH_MSG_FIELDS_channel_extended_data(F)                         \
+  F(U32, recipient_channel)                                             \
+  F(U32, data_type_code)                                                \
+  F(STRING, data)
+#define SSH_MSG_FIELDS_channel_eof(F)                                   \
+  F(U32, recipient_channel)
+#define SSH_MSG_FIELDS_channel_close(F)                                 \
+  F(U32, recipient_channel)
+#define SSH_MSG_FIELDS_channel_request(F)                               \
+  F(U32, recipient_channel)                                             \
+  F(STRING, request_type)                                               \
+  F(BOOL, want_reply)
+#define SSH_MSG_FIELDS_channel_request_pty(F)                           \
+  F(U32, recipient_channel)                                             \
+  F(STRING, request_type)                                               \
+  F(BOOL, want_reply)                                                   \
+  F(STRING, term)                                                       \
+  F(U32, term_width)                                                    \
+  F(U32, term_height)                                                   \
+  F(U32, term_width_pixels)                                             \
+  F(U32, term_height_pixels)                                            \
+  F(STRING, term_modes)
+#define SSH_MSG_FIELDS_channel_request_exec(F)                          \
+  F(U32, recipient_channel)                                             \
+  F(STRING, request_type)                                               \
+  F(BOOL, want_reply)                                                   \
+  F(STRING, command)
+#define SSH_MSG_FIELDS_channel_request_window_change(F)                 \
+  F(U32, recipient_channel)                                             \
+  F(STRING, request_type)                                               \
+  F(BOOL, want_reply)                                                   \
+  F(U32, term_width)                                                    \
+  F(U32, term_height)                                                   \
+  F(U32, term_width_pixels)                                             \
+  F(U32, term_height_pixels)
+
+/* (name, message type) */
+#define SSH_MSG_SCHEMAS(MSG)                                            \
+  MSG(disconnect,                    SSH_MSG_DISCONNECT)                \
+  MSG(ignore,                        SSH_MSG_IGNORE)                    \
+  MSG(service_request,               SSH_MSG_SERVICE_REQUEST)           \
+  MSG(service_accept,                SSH_MSG_SERVICE_ACCEPT)            \
+  MSG(kexdh_init,                    SSH_MSG_KEXDH_INIT)                \
+  MSG(kexdh_reply,                   SSH_MSG_KEXDH_REPLY)               \
+  MSG(userauth_request_none,         SSH_MSG_USERAUTH_REQUEST)          \
+  MSG(userauth_request_password,     SSH_MSG_USERAUTH_REQUEST)          \
+  MSG(userauth_failure,              SSH_MSG_USERAUTH_FAILURE)          \
+  MSG(global_request,                SSH_MSG_GLOBAL_REQUEST)            \
+  MSG(channel_open,                  SSH_MSG_CHANNEL_OPEN)              \
+  MSG(channel_open_confirmation,     SSH_MSG_CHANNEL_OPEN_CONFIRMATION) \
+  MSG(channel_open_failure,          SSH_MSG_CHANNEL_OPEN_FAILURE)      \
+  MSG(channel_window_adjust,         SSH_MSG_CHANNEL_WINDOW_ADJUST)     \
+  MSG(channel_data,                  SSH_MSG_CHANNEL_DATA)              \
+  MSG(channel_extended_data,         SSH_MSG_CHANNEL_EXTENDED_DATA)     \
+  MSG(channel_eof,                   SSH_MSG_CHANNEL_EOF)               \
+  MSG(channel_close,                 SSH_MSG_CHANNEL_CLOSE)             \
+  MSG(channel_request,               SSH_MSG_CHANNEL_REQUEST)           \
+  MSG(channel_request_pty,           SSH_MSG_CHANNEL_REQUEST)           \
+  MSG(channel_request_exec,          SSH_MSG_CHANNEL_REQUEST)           \
+  MSG(channel_request_window_change, SSH_MSG_CHANNEL_REQUEST)
+
+#define SSH_MSG_DECLARE_FIELD(type, name)  SSH_MSG_CTYPE_##type name;
+
+#define SSH_MSG_DECLARE(name, msg_type)                                 \
+  struct SSH_MSG_##name {                                               \
+    SSH_MSG_FIELDS_##name(SSH_MSG_DECLARE_FIELD)                        \
+  };                                                                    \
+  int ssh_msg_build_##name(struct SSH_BUFFER *pack, const struct SSH_MSG_##name *msg); \
+  int ssh_msg_parse_##name(struct SSH_BUF_READER *pack, struct SSH_MSG_##name *msg);
+
+SSH_MSG_SCHEMAS(SSH_MSG_DECLARE)
+
+#endif /* MESSAGE_I_H_FILE */
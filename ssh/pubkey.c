@@ -1,8 +1,20 @@
-/* pubkey.c */
+/* pubkey.c
+ *
+ * Server host key signature verification.
+ *
+ * Parsed host keys are kept in a small per-process cache keyed by the
+ * SHA-256 of the key blob.  Connecting again to a known server then
+ * skips parsing the key and only verifies the signature.  The cache
+ * says nothing about whether the key is trusted: the connection's
+ * identity checker still runs on every key exchange.  Entries expire
+ * after PUBKEY_CACHE_TTL seconds.
+ */
 
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "ssh/pubkey_i.h"
 
@@ -10,24 +22,49 @@
 
 #include "common/error.h"
 #include "common/debug.h"
+#include "common/alloc.h"
 #include "crypto/rsa.h"
 
-#define DECLARE_VERIFY_FUNC(name) static int name(enum SSH_PUBKEY_TYPE key_type, struct SSH_BUF_READER *key_buf, struct SSH_STRING *signature, struct SSH_STRING *data)
-typedef int (*verify_func)(enum SSH_PUBKEY_TYPE key_type, struct SSH_BUF_READER *key_buf, struct SSH_STRING *signature, struct SSH_STRING *data);
+#define PUBKEY_CACHE_SIZE     16
+#define PUBKEY_CACHE_TTL      3600   // seconds
+#define PUBKEY_CACHE_HASH     SSH_HASH_SHA2_256
+#define PUBKEY_CACHE_HASH_LEN 32
 
+#define DECLARE_PARSE_FUNC(name) static void *name(struct SSH_BUF_READER *key_buf)
+#define DECLARE_FREE_FUNC(name) static void name(void *key)
+#define DECLARE_VERIFY_FUNC(name) static int name(enum SSH_PUBKEY_TYPE key_type, const void *key, struct SSH_STRING *signature, struct SSH_STRING *data)
+typedef void *(*parse_func)(struct SSH_BUF_READER *key_buf);
+typedef void (*free_func)(void *key);
+typedef int (*verify_func)(enum SSH_PUBKEY_TYPE key_type, const void *key, struct SSH_STRING *signature, struct SSH_STRING *data);
+
+DECLARE_PARSE_FUNC(rsa_parse);
+DECLARE_FREE_FUNC(rsa_free);
 DECLARE_VERIFY_FUNC(rsa_verify);
 
 static const struct SSH_PUBKEY_ALGO {
   const char *name;
   enum SSH_PUBKEY_TYPE type;
   enum SSH_HASH_TYPE hash_type;
+  parse_func parse;
+  free_func free;
   verify_func verify;
 } pubkey_algos[] = {
-  { "ssh-rsa",      SSH_PUBKEY_RSA, SSH_HASH_SHA1,     rsa_verify },
-  { "rsa-sha2-512", SSH_PUBKEY_RSA, SSH_HASH_SHA2_512, rsa_verify },
-  { "rsa-sha2-256", SSH_PUBKEY_RSA, SSH_HASH_SHA2_256, rsa_verify },
+  { "ssh-rsa",      SSH_PUBKEY_RSA, SSH_HASH_SHA1,     rsa_parse, rsa_free, rsa_verify },
+  { "rsa-sha2-512", SSH_PUBKEY_RSA, SSH_HASH_SHA2_512, rsa_parse, rsa_free, rsa_verify },
+  { "rsa-sha2-256", SSH_PUBKEY_RSA, SSH_HASH_SHA2_256, rsa_parse, rsa_free, rsa_verify },
+};
+
+struct PUBKEY_CACHE_ENTRY {
+  uint8_t key_hash[PUBKEY_CACHE_HASH_LEN];
+  const struct SSH_PUBKEY_ALGO *algo;
+  void *key;                           // parsed key
+  uint32_t refs;                       // one for the cache, one for each user
+  time_t expires;
 };
 
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct PUBKEY_CACHE_ENTRY *cache[PUBKEY_CACHE_SIZE];
+
 static const struct SSH_PUBKEY_ALGO *get_pubkey_algo(enum SSH_PUBKEY_TYPE key_type)
 {
   int i;
@@ -73,11 +110,144 @@ int ssh_pubkey_get_supported_algos(struct SSH_BUFFER *ret)
   return 0;
 }
 
+static time_t get_time(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+static int hash_key(uint8_t *key_hash, const struct SSH_STRING *key)
+{
+  struct SSH_STRING hash = ssh_str_new(key_hash, 0);
+
+  return ssh_hash_compute(PUBKEY_CACHE_HASH, &hash, key);
+}
+
+/*
+ * Drop a reference to an entry.  Must be called with the cache lock
+ * held.
+ */
+static void cache_entry_release(struct PUBKEY_CACHE_ENTRY *entry)
+{
+  if (--entry->refs > 0)
+    return;
+  entry->algo->free(entry->key);
+  ssh_free(entry);
+}
+
+/*
+ * Return the cache slot for the key, or -1.  Expired entries found on
+ * the way are dropped.  Must be called with the cache lock held.
+ */
+static int cache_find(const uint8_t *key_hash, time_t now)
+{
+  int i, found = -1;
+
+  for (i = 0; i < PUBKEY_CACHE_SIZE; i++) {
+    if (cache[i] == NULL)
+      continue;
+    if (cache[i]->expires <= now) {
+      cache_entry_release(cache[i]);
+      cache[i] = NULL;
+      continue;
+    }
+    if (memcmp(cache[i]->key_hash, key_hash, PUBKEY_CACHE_HASH_LEN) == 0)
+      found = i;
+  }
+  return found;
+}
+
+/*
+ * Return a reference to the cached entry for the key, or NULL.
+ */
+static struct PUBKEY_CACHE_ENTRY *cache_get(const uint8_t *key_hash)
+{
+  struct PUBKEY_CACHE_ENTRY *entry = NULL;
+  int i;
+
+  pthread_mutex_lock(&cache_lock);
+  if ((i = cache_find(key_hash, get_time())) >= 0) {
+    entry = cache[i];
+    entry->refs++;
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return entry;
+}
+
+static void cache_put(struct PUBKEY_CACHE_ENTRY *entry)
+{
+  pthread_mutex_lock(&cache_lock);
+  cache_entry_release(entry);
+  pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * Add a new entry to the cache, replacing the entry closest to expiring
+ * if the cache is full.  The caller keeps its reference.
+ */
+static void cache_add(struct PUBKEY_CACHE_ENTRY *entry)
+{
+  int i, slot;
+
+  pthread_mutex_lock(&cache_lock);
+  slot = cache_find(entry->key_hash, get_time());
+  if (slot < 0) {
+    slot = 0;
+    for (i = 0; i < PUBKEY_CACHE_SIZE; i++) {
+      if (cache[i] == NULL) {
+        slot = i;
+        break;
+      }
+      if (cache[i]->expires < cache[slot]->expires)
+        slot = i;
+    }
+  }
+  if (cache[slot] != NULL)
+    cache_entry_release(cache[slot]);
+  cache[slot] = entry;
+  entry->refs++;
+  pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * Return a reference to the parsed key, from the cache or parsing it.
+ */
+static struct PUBKEY_CACHE_ENTRY *get_key(const struct SSH_PUBKEY_ALGO *algo, const uint8_t *key_hash, struct SSH_BUF_READER *key_buf)
+{
+  struct PUBKEY_CACHE_ENTRY *entry;
+
+  if ((entry = cache_get(key_hash)) != NULL) {
+    if (entry->algo->type == algo->type)
+      return entry;
+    cache_put(entry);
+    ssh_set_error("cached key algorithm doesn't match negotiated algorithm");
+    return NULL;
+  }
+
+  if ((entry = ssh_alloc(sizeof(struct PUBKEY_CACHE_ENTRY))) == NULL)
+    return NULL;
+  if ((entry->key = algo->parse(key_buf)) == NULL) {
+    ssh_free(entry);
+    return NULL;
+  }
+  memcpy(entry->key_hash, key_hash, PUBKEY_CACHE_HASH_LEN);
+  entry->algo = algo;
+  entry->refs = 1;
+  entry->expires = get_time() + PUBKEY_CACHE_TTL;
+  cache_add(entry);
+  return entry;
+}
+
 int ssh_pubkey_verify_signature(enum SSH_PUBKEY_TYPE key_type, struct SSH_STRING *key, struct SSH_STRING *signature, struct SSH_STRING *data)
 {
   struct SSH_BUF_READER key_buf;
   struct SSH_STRING key_type_str;
   const struct SSH_PUBKEY_ALGO *key_algo;
+  struct PUBKEY_CACHE_ENTRY *entry;
+  uint8_t key_hash[SSH_HASH_MAX_LEN];
+  int ret;
   
   key_buf = ssh_buf_reader_new_from_string(key);
   if (ssh_buf_read_string(&key_buf, &key_type_str) < 0)
@@ -93,25 +263,41 @@ int ssh_pubkey_verify_signature(enum SSH_PUBKEY_TYPE key_type, struct SSH_STRING
     ssh_set_error("invalid public key type: %d", key_type);
     return -1;
   }
-  
-  return key_algo->verify(key_type, &key_buf, signature, data);
+
+  if (hash_key(key_hash, key) < 0
+      || (entry = get_key(key_algo, key_hash, &key_buf)) == NULL)
+    return -1;
+  ret = key_algo->verify(key_type, entry->key, signature, data);
+
+  cache_put(entry);
+  return ret;
 }
 
-static int rsa_verify(enum SSH_PUBKEY_TYPE key_type, struct SSH_BUF_READER *key, struct SSH_STRING *signature, struct SSH_STRING *data)
+static void *rsa_parse(struct SSH_BUF_READER *key)
+{
+  struct SSH_STRING e, n;
+
+  // read (e, n) from key
+  if (ssh_buf_read_string(key, &e) < 0
+      || ssh_buf_read_string(key, &n) < 0)
+    return NULL;
+  return crypto_rsa_pubkey_new(&e, &n);
+}
+
+static void rsa_free(void *key)
+{
+  crypto_rsa_pubkey_free(key);
+}
+
+static int rsa_verify(enum SSH_PUBKEY_TYPE key_type, const void *key, struct SSH_STRING *signature, struct SSH_STRING *data)
 {
   struct SSH_BUF_READER sig_buf;
   struct SSH_STRING sig_type;
   struct SSH_STRING sig_data;
-  struct SSH_STRING e, n;
   const struct SSH_PUBKEY_ALGO *pubkey_algo;
   struct SSH_STRING hash;
   uint8_t hash_data[SSH_HASH_MAX_LEN];
   
-  // read (e, n) from key
-  if (ssh_buf_read_string(key, &e) < 0
-      || ssh_buf_read_string(key, &n) < 0)
-    return -1;
-
   // read hash type from signature
   sig_buf = ssh_buf_reader_new_from_string(signature);
   if (ssh_buf_read_string(&sig_buf, &sig_type) < 0)
@@ -137,7 +323,7 @@ static int rsa_verify(enum SSH_PUBKEY_TYPE key_type, struct SSH_BUF_READER *key,
     return -1;
 
   // verify
-  if (crypto_rsa_verify(pubkey_algo->hash_type, &e, &n, &sig_data, &hash) < 0)
+  if (crypto_rsa_verify_key(pubkey_algo->hash_type, key, &sig_data, &hash) < 0)
     return -1;
 
   return 0;
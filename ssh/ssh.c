@@ -21,5 +21,6 @@ int ssh_init(uint32_t flags)
 
 void ssh_deinit(void)
 {
+  ssh_resolver_deinit();
   crypto_deinit();
 }
@@ -8,7 +8,9 @@
 #include "common/error.h"
 #include "common/debug.h"
 #include "common/host_key_store.h"
+#include "common/resolver.h"
 #include "ssh/connection.h"
+#include "ssh/algo_bench.h"
 #include "ssh/ssh_constants.h"
 
 #define SSH_INIT_NO_SIGNALS (1<<0)
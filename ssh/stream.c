@@ -7,34 +7,100 @@
 #include <string.h>
 #include <errno.h>
 
+#include <openssl/crypto.h>
+
 #include "ssh/stream_i.h"
 
-#include "common/network_i.h"
+#include "common/transport_i.h"
 #include "ssh/hash_i.h"
+#include "crypto/aes.h"
+#include "crypto/hmac.h"
+#include "crypto/aes_hmac.h"
 
 #include "common/error.h"
 #include "common/debug.h"
 #include "crypto/random.h"
 #include "ssh/debug.h"
+#include "ssh/ssh_constants.h"
 
 #define MIN(a,b) (((a) < (b)) ? (a) : (b))
 
 #define MAX_PACKET_LEN (128*1024)
 
-void ssh_stream_init(struct SSH_STREAM *stream, enum SSH_STREAM_TYPE type)
+// buffer space for the largest packet and its MAC
+#define PACKET_BUF_LEN (MAX_PACKET_LEN + 4 + SSH_HASH_MAX_LEN)
+
+// how much encrypted data to read from the network in advance
+#define READ_AHEAD_LEN (256*1024)
+
+// max packets decrypted and verified together by recv_batch()
+#define MAX_RECV_BATCH 32
+#define MAX_RECV_BATCH_MAC_LEN 64
+
+// CTR keystream generated at a time when decrypting a batch
+#define BATCH_KEYSTREAM_LEN 4096
+
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+/*
+ * Cipher and MAC implementations the packet routines can be
+ * specialized for.  STREAM_*_GENERIC dispatches at runtime through
+ * ssh_cipher_crypt()/ssh_mac_compute() and works for any algorithm.
+ */
+enum STREAM_CIPHER_IMPL {
+  STREAM_CIPHER_IMPL_NONE,
+  STREAM_CIPHER_IMPL_GENERIC,
+  STREAM_CIPHER_IMPL_AES,
+};
+
+enum STREAM_MAC_IMPL {
+  STREAM_MAC_IMPL_NONE,
+  STREAM_MAC_IMPL_GENERIC,
+  STREAM_MAC_IMPL_HMAC,
+  STREAM_MAC_IMPL_STITCHED,   // computed with the cipher by crypto_aes_hmac_*() (AES-CTR only)
+};
+
+static int stream_send_packet_none(struct SSH_STREAM *stream);
+static int stream_recv_packet_none(struct SSH_STREAM *stream, struct SSH_TRANSPORT *transport);
+static int stream_send_packet_generic(struct SSH_STREAM *stream);
+static int stream_recv_packet_generic(struct SSH_STREAM *stream, struct SSH_TRANSPORT *transport);
+static int stream_send_packet_aes_hmac(struct SSH_STREAM *stream);
+static int stream_recv_packet_aes_hmac(struct SSH_STREAM *stream, struct SSH_TRANSPORT *transport);
+static int stream_send_packet_aes_ctr_hmac_sha256(struct SSH_STREAM *stream);
+static int stream_recv_packet_aes_ctr_hmac_sha256(struct SSH_STREAM *stream, struct SSH_TRANSPORT *transport);
+
+static const struct STREAM_SUITE {
+  enum SSH_CIPHER_TYPE cipher_type;
+  enum SSH_MAC_TYPE mac_type;
+  ssh_stream_fn_send_packet send_packet;
+  ssh_stream_fn_recv_packet recv_packet;
+} stream_suites[] = {
+  { SSH_CIPHER_NONE,       SSH_MAC_NONE,          stream_send_packet_none,     stream_recv_packet_none },
+  { SSH_CIPHER_AES128_CTR, SSH_MAC_HMAC_SHA2_256, stream_send_packet_aes_ctr_hmac_sha256, stream_recv_packet_aes_ctr_hmac_sha256 },
+  { SSH_CIPHER_AES128_CTR, SSH_MAC_HMAC_SHA2_512, stream_send_packet_aes_hmac, stream_recv_packet_aes_hmac },
+  { SSH_CIPHER_AES256_CTR, SSH_MAC_HMAC_SHA2_256, stream_send_packet_aes_ctr_hmac_sha256, stream_recv_packet_aes_ctr_hmac_sha256 },
+  { SSH_CIPHER_AES256_CTR, SSH_MAC_HMAC_SHA2_512, stream_send_packet_aes_hmac, stream_recv_packet_aes_hmac },
+  { SSH_CIPHER_AES128_CBC, SSH_MAC_HMAC_SHA2_256, stream_send_packet_aes_hmac, stream_recv_packet_aes_hmac },
+  { SSH_CIPHER_AES128_CBC, SSH_MAC_HMAC_SHA2_512, stream_send_packet_aes_hmac, stream_recv_packet_aes_hmac },
+};
+
+void ssh_stream_init(struct SSH_STREAM *stream, enum SSH_STREAM_TYPE type, struct SSH_ALLOCATOR *allocator)
 {
   stream->seq_num = 0;
-  stream->pack = ssh_buf_new();
+  stream->pack = ssh_buf_new_with_allocator(allocator);
 
   stream->type = type;
   switch (type) {
   case SSH_STREAM_TYPE_WRITE:
-    stream->net.write.buf_enc = ssh_buf_new();
+    stream->net.write.buf_enc = ssh_buf_new_with_allocator(allocator);
     break;
 
   case SSH_STREAM_TYPE_READ:
-    stream->net.read.buf = ssh_buf_new();
-    stream->net.read.buf_enc = ssh_buf_new();
+    stream->net.read.buf = ssh_buf_new_with_allocator(allocator);
+    stream->net.read.buf_enc = ssh_buf_new_with_allocator(allocator);
+    stream->net.read.enc_start = 0;
+    stream->net.read.num_verified = 0;
+    stream->net.read.verified_pos = 0;
     break;
   }
 
@@ -45,6 +111,9 @@ void ssh_stream_init(struct SSH_STREAM *stream, enum SSH_STREAM_TYPE type)
   stream->mac_type = SSH_MAC_NONE;
   stream->mac_len = 0;
   stream->mac_ctx = NULL;
+
+  stream->send_packet = stream_send_packet_none;
+  stream->recv_packet = stream_recv_packet_none;
 }
 
 void ssh_stream_close(struct SSH_STREAM *stream)
@@ -67,6 +136,35 @@ void ssh_stream_close(struct SSH_STREAM *stream)
   }
 }
 
+/*
+ * Make the buffers large enough for anything the packet routines put
+ * in them, so sending and receiving packets doesn't allocate memory:
+ * a packet, plus the read-ahead for reading or the messages queued
+ * behind one being sent for writing.
+ */
+int ssh_stream_reserve_buffers(struct SSH_STREAM *stream)
+{
+  if (ssh_buf_reserve(&stream->pack, PACKET_BUF_LEN) < 0)
+    return -1;
+  switch (stream->type) {
+  case SSH_STREAM_TYPE_WRITE:
+    return ssh_buf_reserve(&stream->net.write.buf_enc, 2*PACKET_BUF_LEN);
+
+  case SSH_STREAM_TYPE_READ:
+    // a batch decrypts all of 'buf_enc' after the start of a packet
+    if (ssh_buf_reserve(&stream->net.read.buf_enc, READ_AHEAD_LEN + PACKET_BUF_LEN) < 0
+        || ssh_buf_reserve(&stream->net.read.buf, READ_AHEAD_LEN + 2*PACKET_BUF_LEN) < 0)
+      return -1;
+    break;
+  }
+  return 0;
+}
+
+/*
+ * The cipher and MAC setters copy the key material into the crypto
+ * contexts; the caller keeps ownership of 'iv' and 'key' and must
+ * wipe them.
+ */
 int ssh_stream_set_cipher(struct SSH_STREAM *stream, enum SSH_CIPHER_TYPE type, enum SSH_CIPHER_DIRECTION dir, struct SSH_STRING *iv, struct SSH_STRING *key)
 {
   int cipher_block_len;
@@ -75,15 +173,16 @@ int ssh_stream_set_cipher(struct SSH_STREAM *stream, enum SSH_CIPHER_TYPE type,
   if (cipher_block_len < 0)
     return -1;
   
-  if (stream->cipher_ctx != NULL)
-    ssh_cipher_free(stream->cipher_ctx);
-  if ((stream->cipher_ctx = ssh_cipher_new(type, dir, iv, key)) == NULL)
+  if (stream->cipher_ctx != NULL) {
+    if (ssh_cipher_rekey(stream->cipher_ctx, type, dir, iv, key) < 0)
+      return -1;
+  } else if ((stream->cipher_ctx = ssh_cipher_new(type, dir, iv, key)) == NULL)
     return -1;
  
   stream->cipher_type = type;
   stream->cipher_block_len = cipher_block_len;
-  ssh_str_free(iv);
-  ssh_str_free(key);
+  stream->send_packet = stream_send_packet_generic;
+  stream->recv_packet = stream_recv_packet_generic;
   return 0;
 }
 
@@ -95,17 +194,78 @@ int ssh_stream_set_mac(struct SSH_STREAM *stream, enum SSH_MAC_TYPE type, struct
   if (mac_len < 0)
     return -1;
 
-  if (stream->mac_ctx != NULL)
-    ssh_mac_free(stream->mac_ctx);
-  if ((stream->mac_ctx = ssh_mac_new(type, key)) == NULL)
+  if (stream->mac_ctx != NULL) {
+    if (ssh_mac_rekey(stream->mac_ctx, type, key) < 0)
+      return -1;
+  } else if ((stream->mac_ctx = ssh_mac_new(type, key)) == NULL)
     return -1;
   
   stream->mac_type = type;
   stream->mac_len = mac_len;
-  ssh_str_free(key);
+  stream->send_packet = stream_send_packet_generic;
+  stream->recv_packet = stream_recv_packet_generic;
   return 0;
 }
 
+/*
+ * Select the packet routines for the current cipher and MAC.  Must be
+ * called once the new keys are installed, otherwise all packets go
+ * through the (slower) generic routines.
+ */
+void ssh_stream_newkeys(struct SSH_STREAM *stream)
+{
+  int i;
+
+  for (i = 0; i < sizeof(stream_suites)/sizeof(stream_suites[0]); i++) {
+    const struct STREAM_SUITE *suite = &stream_suites[i];
+    if (suite->cipher_type == stream->cipher_type && suite->mac_type == stream->mac_type) {
+      stream->send_packet = suite->send_packet;
+      stream->recv_packet = suite->recv_packet;
+      return;
+    }
+  }
+  stream->send_packet = stream_send_packet_generic;
+  stream->recv_packet = stream_recv_packet_generic;
+}
+
+static ALWAYS_INLINE int stream_has_cipher(struct SSH_STREAM *stream, enum STREAM_CIPHER_IMPL cipher)
+{
+  if (cipher == STREAM_CIPHER_IMPL_GENERIC)
+    return stream->cipher_type != SSH_CIPHER_NONE;
+  return cipher != STREAM_CIPHER_IMPL_NONE;
+}
+
+static ALWAYS_INLINE int stream_has_mac(struct SSH_STREAM *stream, enum STREAM_MAC_IMPL mac)
+{
+  if (mac == STREAM_MAC_IMPL_GENERIC)
+    return stream->mac_type != SSH_MAC_NONE;
+  return mac != STREAM_MAC_IMPL_NONE;
+}
+
+static ALWAYS_INLINE int stream_crypt(struct SSH_STREAM *stream, enum STREAM_CIPHER_IMPL cipher, uint8_t *out, uint8_t *data, uint32_t len)
+{
+  if (cipher == STREAM_CIPHER_IMPL_AES)
+    return crypto_aes_crypt(ssh_cipher_get_crypto_ctx(stream->cipher_ctx), out, data, len);
+  return ssh_cipher_crypt(stream->cipher_ctx, out, data, len);
+}
+
+static ALWAYS_INLINE int stream_compute_mac(struct SSH_STREAM *stream, enum STREAM_MAC_IMPL mac, uint8_t *out, const uint8_t *data, uint32_t len)
+{
+  if (mac == STREAM_MAC_IMPL_HMAC) {
+    struct CRYPTO_HMAC_CTX *ctx = ssh_mac_get_crypto_ctx(stream->mac_ctx);
+    uint8_t seq_num_buf[4];
+
+    ssh_buf_store_be32(seq_num_buf, stream->seq_num);
+    if (crypto_hmac_init(ctx) < 0
+        || crypto_hmac_update(ctx, seq_num_buf, 4) < 0
+        || crypto_hmac_update(ctx, data, len) < 0
+        || crypto_hmac_final(ctx, out, stream->mac_len) < 0)
+      return -1;
+    return 0;
+  }
+  return ssh_mac_compute(stream->mac_ctx, out, stream->seq_num, data, len);
+}
+
 static uint8_t calc_pad_len(uint32_t pack_len_before_padding, uint8_t block_size)
 {
   uint8_t pad_len;
@@ -136,7 +296,7 @@ struct SSH_BUFFER *ssh_stream_new_packet(struct SSH_STREAM *stream)
   return &stream->pack;
 }
 
-static int finish_packet(struct SSH_STREAM *stream)
+static ALWAYS_INLINE int finish_packet(struct SSH_STREAM *stream, enum STREAM_CIPHER_IMPL cipher, enum STREAM_MAC_IMPL mac)
 {
   uint8_t pad_len;
   uint8_t *p;
@@ -145,43 +305,55 @@ static int finish_packet(struct SSH_STREAM *stream)
   pad_len = calc_pad_len(stream->pack.len, stream->cipher_block_len);
   if ((p = ssh_buf_get_write_pointer(&stream->pack, pad_len)) == NULL)
     return -1;
-  if (stream->cipher_type == SSH_CIPHER_NONE)
+  if (! stream_has_cipher(stream, cipher))
     memset(p, 0xff, pad_len);
   else
     crypto_random_gen(p, pad_len);
 
-  ssh_buf_set_u32(stream->pack.data, stream->pack.len-4);
+  ssh_buf_store_be32(stream->pack.data, stream->pack.len-4);
   stream->pack.data[4] = pad_len;
 
+  // encrypt and compute MAC in one pass
+  if (mac == STREAM_MAC_IMPL_STITCHED) {
+    uint8_t seq_num_buf[4];
+
+    if ((p = ssh_buf_get_write_pointer(&stream->net.write.buf_enc, stream->pack.len + stream->mac_len)) == NULL)
+      return -1;
+    ssh_buf_store_be32(seq_num_buf, stream->seq_num);
+    return crypto_aes_hmac_encrypt(ssh_cipher_get_crypto_ctx(stream->cipher_ctx), ssh_mac_get_crypto_ctx(stream->mac_ctx),
+                                   seq_num_buf, 4, p, stream->pack.data, stream->pack.len,
+                                   p + stream->pack.len, stream->mac_len);
+  }
+
   // write packet to network buffer (encrypting if necessary)
   if ((p = ssh_buf_get_write_pointer(&stream->net.write.buf_enc, stream->pack.len)) == NULL)
     return -1;
-  if (stream->cipher_type != SSH_CIPHER_NONE) {
-    if (ssh_cipher_crypt(stream->cipher_ctx, p, stream->pack.data, stream->pack.len) < 0)
+  if (stream_has_cipher(stream, cipher)) {
+    if (stream_crypt(stream, cipher, p, stream->pack.data, stream->pack.len) < 0)
       return -1;
   } else {
     memcpy(p, stream->pack.data, stream->pack.len);
   }
 
   // write mac to network buffer
-  if (stream->mac_type != SSH_MAC_NONE) {
+  if (stream_has_mac(stream, mac)) {
     if ((p = ssh_buf_get_write_pointer(&stream->net.write.buf_enc, stream->mac_len)) == NULL)
       return -1;
     // calculate MAC
-    if (ssh_mac_compute(stream->mac_ctx, p, stream->seq_num, stream->pack.data, stream->pack.len) < 0)
+    if (stream_compute_mac(stream, mac, p, stream->pack.data, stream->pack.len) < 0)
       return -1;
   }
 
   return 0;
 }
 
-int ssh_stream_send_packet(struct SSH_STREAM *stream, int sock)
+int ssh_stream_send_packet(struct SSH_STREAM *stream, struct SSH_TRANSPORT *transport)
 {
-  if (finish_packet(stream) < 0)
+  if (stream->send_packet(stream) < 0)
     return -1;
   stream->seq_num++;
 
-  return ssh_stream_send_flush(stream, sock);
+  return ssh_stream_send_flush(stream, transport);
 }
 
 int ssh_stream_send_is_pending(struct SSH_STREAM *stream)
@@ -189,11 +361,11 @@ int ssh_stream_send_is_pending(struct SSH_STREAM *stream)
   return stream->net.write.buf_enc.len > 0;
 }
 
-int ssh_stream_send_flush(struct SSH_STREAM *stream, int sock)
+int ssh_stream_send_flush(struct SSH_STREAM *stream, struct SSH_TRANSPORT *transport)
 {
   ssize_t len;
   
-  if ((len = ssh_net_write(sock, stream->net.write.buf_enc.data, stream->net.write.buf_enc.len)) < 0
+  if ((len = ssh_transport_write(transport, stream->net.write.buf_enc.data, stream->net.write.buf_enc.len)) < 0
       || ssh_buf_remove_data(&stream->net.write.buf_enc, 0, len) < 0)
     return -1;
   return 0;
@@ -205,11 +377,11 @@ int ssh_stream_send_flush(struct SSH_STREAM *stream, int sock)
  * ==================================================================
  */
 
-static int verify_read_packet(struct SSH_STREAM *stream)
+static int check_read_padding(struct SSH_STREAM *stream)
 {
   uint8_t block_len;
 
-  // check padding
+
   if (stream->pack.data[4] < 4 || stream->pack.data[4] > stream->pack.len-5) {
     ssh_set_error("bad padding length: packet_length=%d, pad_length=%d", (int) stream->pack.len-4, stream->pack.data[4]);
     return -1;
@@ -220,15 +392,28 @@ static int verify_read_packet(struct SSH_STREAM *stream)
                   (int) stream->pack.len, block_len, (int) (stream->pack.len % block_len));
     return -1;
   }
+  return 0;
+}
+
+static ALWAYS_INLINE int verify_read_packet(struct SSH_STREAM *stream, enum STREAM_MAC_IMPL mac)
+{
+  if (check_read_padding(stream) < 0)
+    return -1;
 
   // check mac
-  if (stream->mac_type != SSH_MAC_NONE) {
-    uint8_t digest[SSH_HASH_MAX_LEN];
+  if (stream_has_mac(stream, mac)) {
+    uint8_t digest_buf[SSH_HASH_MAX_LEN];
+    uint8_t *digest;
 
     // verify MAC
-    if (ssh_mac_compute(stream->mac_ctx, digest, stream->seq_num, stream->pack.data, stream->pack.len) < 0)
-      return -1;
-    if (memcmp(digest, stream->pack.data + stream->pack.len, stream->mac_len) != 0) {  // [TODO: prevent timing attack]
+    if (mac == STREAM_MAC_IMPL_STITCHED) {
+      digest = stream->net.read.mac;   // already computed by stream_recv_fill_buffer()
+    } else {
+      digest = digest_buf;
+      if (stream_compute_mac(stream, mac, digest, stream->pack.data, stream->pack.len) < 0)
+        return -1;
+    }
+    if (CRYPTO_memcmp(digest, stream->pack.data + stream->pack.len, stream->mac_len) != 0) {
       ssh_log("input packet has bad MAC:\n");
       dump_mem("received MAC", stream->pack.data + stream->pack.len, stream->mac_len);
       dump_mem("computed MAC", digest, stream->mac_len);
@@ -240,42 +425,70 @@ static int verify_read_packet(struct SSH_STREAM *stream)
   return 0;
 }
 
+/*
+ * Mark 'len' bytes at the start of the encrypted data as consumed.
+ * They are removed from the buffer just before the next read (see
+ * stream_recv_fill_buffer()), when there's little data left to move.
+ */
+static void consume_enc_data(struct SSH_STREAM *stream, size_t len)
+{
+  stream->net.read.enc_start += len;
+  if (stream->net.read.enc_start == stream->net.read.buf_enc.len) {
+    stream->net.read.buf_enc.len = 0;
+    stream->net.read.enc_start = 0;
+  }
+}
+
 /*
  * Read data from network (decrypting if necessary) until there are
  * 'len' bytes of unencrypted data available.
  */
-static int stream_recv_fill_buffer(struct SSH_STREAM *stream, int sock, size_t ciphertext_len, size_t plaintext_len)
+static ALWAYS_INLINE int stream_recv_fill_buffer(struct SSH_STREAM *stream, enum STREAM_CIPHER_IMPL cipher, enum STREAM_MAC_IMPL mac,
+                                                 struct SSH_TRANSPORT *transport, size_t ciphertext_len, size_t plaintext_len)
 {
   size_t total_len;
   size_t read_len;
+  size_t have_len;
   struct SSH_BUFFER *read_buf;
+  uint8_t *read_data;
 
   total_len = ciphertext_len + plaintext_len;
   
-  if (stream->cipher_type != SSH_CIPHER_NONE) {
+  if (stream_has_cipher(stream, cipher)) {
     read_buf = &stream->net.read.buf_enc;
-    if (total_len < stream->net.read.buf.len + read_buf->len)
-      read_len = 0;
-    else
-      read_len = total_len - stream->net.read.buf.len - read_buf->len;
+    have_len = stream->net.read.buf.len + read_buf->len - stream->net.read.enc_start;
   } else {
     read_buf = &stream->net.read.buf;
-    if (total_len < read_buf->len)
-      read_len = 0;
-    else
-      read_len = total_len - read_buf->len;
+    have_len = read_buf->len;
   }
+  read_len = (total_len < have_len) ? 0 : total_len - have_len;
 
   // read from network to fill 'read_buf' up to 'len' bytes
   if (read_len > 0) {
+    size_t max_len = read_len;
     ssize_t r;
 
+    // with a cipher, data stays encrypted in 'read_buf' until it's
+    // needed, so we can read ahead whatever is available (even past a
+    // NEWKEYS, which only changes the keys for decrypting it)
+    if (stream_has_cipher(stream, cipher)) {
+      if (max_len < READ_AHEAD_LEN)
+        max_len = READ_AHEAD_LEN;
+      if (stream->net.read.enc_start > 0) {
+        if (ssh_buf_remove_data(read_buf, 0, stream->net.read.enc_start) < 0) {
+          errno = 0;
+          return -1;
+        }
+        stream->net.read.enc_start = 0;
+      }
+    }
+
     // can't use ssh_buf_get_write_pointer() here because it's OK for the read to fail with EWOULDBLOCK
-    if (ssh_buf_grow(read_buf, read_len) < 0) {
+    if (ssh_buf_grow(read_buf, max_len) < 0) {
       errno = 0;
       return -1;
     }
-    if ((r = ssh_net_read(sock, read_buf->data + read_buf->len, read_len)) < 0)
+    if ((r = ssh_transport_read_ahead(transport, read_buf->data + read_buf->len, read_len, max_len)) < 0)
       return -1;
     read_buf->len += r;
     if (r < read_len) {
@@ -285,15 +498,33 @@ static int stream_recv_fill_buffer(struct SSH_STREAM *stream, int sock, size_t c
   }
 
   // decrypt data if cipher is set
-  if (stream->cipher_type != SSH_CIPHER_NONE && total_len > stream->net.read.buf.len) {
+  if (stream_has_cipher(stream, cipher) && total_len > stream->net.read.buf.len) {
     uint8_t *p;
     size_t consume_len = total_len - stream->net.read.buf.len;
 
-    if (plaintext_len < consume_len) {
+    read_data = read_buf->data + stream->net.read.enc_start;
+    if (mac == STREAM_MAC_IMPL_STITCHED && plaintext_len > 0) {
+      // reading the MAC: decrypt the rest of the packet and compute
+      // its MAC (over the part decrypted earlier, then the rest)
+      size_t dec_len = (plaintext_len < consume_len) ? consume_len - plaintext_len : 0;
+      uint8_t seq_num_buf[4];
+
+      if ((p = ssh_buf_get_write_pointer(&stream->net.read.buf, dec_len)) == NULL) {
+        errno = 0;
+        return -1;
+      }
+      ssh_buf_store_be32(seq_num_buf, stream->seq_num);
+      if (crypto_aes_hmac_decrypt(ssh_cipher_get_crypto_ctx(stream->cipher_ctx), ssh_mac_get_crypto_ctx(stream->mac_ctx),
+                                  seq_num_buf, 4, stream->net.read.buf.data, stream->net.read.buf.len - dec_len,
+                                  p, read_data, dec_len, stream->net.read.mac, stream->mac_len) < 0) {
+        errno = 0;
+        return -1;
+      }
+    } else if (plaintext_len < consume_len) {
       size_t dec_len = consume_len - plaintext_len;
       
       if ((p = ssh_buf_get_write_pointer(&stream->net.read.buf, dec_len)) == NULL
-          || ssh_cipher_crypt(stream->cipher_ctx, p, read_buf->data, dec_len) < 0) {
+          || stream_crypt(stream, cipher, p, read_data, dec_len) < 0) {
         errno = 0;
         return -1;
       }
@@ -306,37 +537,252 @@ static int stream_recv_fill_buffer(struct SSH_STREAM *stream, int sock, size_t c
         errno = 0;
         return -1;
       }
-      memcpy(p, read_buf->data + consume_len - copy_len, copy_len);
+      memcpy(p, read_data + consume_len - copy_len, copy_len);
     }
-    if (ssh_buf_remove_data(read_buf, 0, consume_len) < 0) {
+    consume_enc_data(stream, consume_len);
+  }
+  
+  return 0;
+}
+
+/*
+ * Return the next packet verified by recv_batch().
+ */
+static int pop_verified_packet(struct SSH_STREAM *stream)
+{
+  struct SSH_BUFFER *buf = &stream->net.read.buf;
+  uint8_t *data = buf->data + stream->net.read.verified_pos;
+  size_t pack_data_len = ssh_buf_load_be32(data) + 4;
+
+  ssh_buf_clear(&stream->pack);
+  if (ssh_buf_reserve(&stream->pack, pack_data_len + stream->mac_len) < 0
+      || ssh_buf_append_data(&stream->pack, data, pack_data_len) < 0) {
+    errno = 0;
+    return -1;
+  }
+  memcpy(stream->pack.data + stream->pack.len, data + pack_data_len, stream->mac_len);
+  stream->net.read.verified_pos += pack_data_len + stream->mac_len;
+
+  // remove the whole batch when it's done, leaving only the start
+  // of the next packet (if any) to be moved
+  if (--stream->net.read.num_verified == 0) {
+    if (ssh_buf_remove_data(buf, 0, stream->net.read.verified_pos) < 0) {
       errno = 0;
       return -1;
     }
+    stream->net.read.verified_pos = 0;
+  }
+
+  if (check_read_padding(stream) < 0) {
+    errno = 0;
+    return -1;
+  }
+  stream->seq_num++;
+  return 0;
+}
+
+/*
+ * Keystream for decrypting the packets of a batch in CTR mode.  The
+ * keystream is continuous across packets (the MACs aren't encrypted),
+ * so it's generated a few KB at a time instead of with a cipher call
+ * for the first block and another for the rest of each packet.
+ */
+struct BATCH_KEYSTREAM {
+  uint8_t data[BATCH_KEYSTREAM_LEN];
+  size_t pos;
+  size_t len;
+};
+
+/*
+ * Decrypt 'len' bytes (a multiple of the block size) for a batch, with
+ * the keystream if 'ks' is not NULL.
+ */
+static ALWAYS_INLINE int batch_crypt(struct SSH_STREAM *stream, enum STREAM_CIPHER_IMPL cipher, struct BATCH_KEYSTREAM *ks,
+                                     uint8_t *out, uint8_t *in, size_t len)
+{
+  struct CRYPTO_CIPHER_CTX *ctx = ssh_cipher_get_crypto_ctx(stream->cipher_ctx);
+
+  if (ks == NULL)
+    return (len > 0) ? stream_crypt(stream, cipher, out, in, len) : 0;
+
+  while (len > 0) {
+    size_t i, n;
+
+    // long runs are faster straight through the cipher
+    if (ks->pos == ks->len) {
+      if (len >= sizeof(ks->data))
+        return crypto_aes_crypt(ctx, out, in, len);
+      if (crypto_aes_ctr_keystream(ctx, ks->data, sizeof(ks->data)) < 0)
+        return -1;
+      ks->pos = 0;
+      ks->len = sizeof(ks->data);
+    }
+
+    n = MIN(len, ks->len - ks->pos);
+    for (i = 0; i < n; i += 8) {   // n is a multiple of the block size
+      uint64_t a, b;
+
+      memcpy(&a, in + i, 8);
+      memcpy(&b, ks->data + ks->pos + i, 8);
+      a ^= b;
+      memcpy(out + i, &a, 8);
+    }
+    ks->pos += n;
+    out += n;
+    in += n;
+    len -= n;
   }
-  
   return 0;
 }
 
 /*
- * Read packet fom socket.
+ * Decrypt all complete packets in the read-ahead buffer (up to
+ * MAX_RECV_BATCH) and verify their MACs in one batch.  The packets
+ * are left in 'net.read.buf' to be returned by pop_verified_packet().
  *
- * Will fail with errno=EWOULDBLOCK if sock is non-blocking and
- * there's no data to read, in which case it's OK to try again
- * later.
+ * With AES-CTR, the packets are decrypted with a shared keystream
+ * (see struct BATCH_KEYSTREAM).  Otherwise a batch is only worth it
+ * if the HMAC can process several packets in parallel.
+ *
+ * This stops after a NEWKEYS packet, since the packets after it use
+ * new keys.  Anything it can't handle (incomplete or invalid packets)
+ * is left for the normal path.
  */
-int ssh_stream_recv_packet(struct SSH_STREAM *stream, int sock)
+static ALWAYS_INLINE int recv_batch(struct SSH_STREAM *stream, enum STREAM_CIPHER_IMPL cipher, enum STREAM_MAC_IMPL mac)
+{
+  struct CRYPTO_HMAC_CTX *hmac = ssh_mac_get_crypto_ctx(stream->mac_ctx);
+  struct SSH_BUFFER *buf = &stream->net.read.buf;
+  struct SSH_BUFFER *buf_enc = &stream->net.read.buf_enc;
+  struct CRYPTO_HMAC_MSG msgs[MAX_RECV_BATCH];
+  uint8_t seq_nums[MAX_RECV_BATCH][4];
+  uint8_t macs[MAX_RECV_BATCH][MAX_RECV_BATCH_MAC_LEN];
+  size_t offsets[MAX_RECV_BATCH];
+  struct BATCH_KEYSTREAM ks_buf, *ks;
+  size_t block_len = stream->cipher_block_len;
+  uint8_t *enc_data = buf_enc->data + stream->net.read.enc_start;
+  size_t enc_len = buf_enc->len - stream->net.read.enc_start;
+  size_t enc_pos, pos;
+  int max_batch, n, i, err;
+
+  if (stream->mac_len > MAX_RECV_BATCH_MAC_LEN)
+    return 0;
+  max_batch = crypto_hmac_get_batch_size(hmac);
+  if (stream->cipher_type == SSH_CIPHER_AES128_CTR || stream->cipher_type == SSH_CIPHER_AES256_CTR) {
+    // the stitched code is faster than decrypting and verifying
+    // separately, unless the HMAC can be done in parallel
+    if (mac == STREAM_MAC_IMPL_STITCHED && max_batch < 2)
+      return 0;
+    ks = &ks_buf;
+    ks->pos = ks->len = 0;
+    max_batch = MAX_RECV_BATCH;
+  } else {
+    if (max_batch < 2)
+      return 0;
+    ks = NULL;
+    if (max_batch > MAX_RECV_BATCH)
+      max_batch = MAX_RECV_BATCH;
+  }
+
+  // 'buf' is empty or has the first block of the next packet
+  err = 0;
+  n = 0;
+  pos = 0;
+  enc_pos = 0;
+  while (n < max_batch) {
+    uint32_t pack_len;
+    size_t rest_len;
+    uint8_t *p;
+
+    if (buf->len == pos) {
+      if (enc_len - enc_pos < block_len)
+        break;
+      if ((p = ssh_buf_get_write_pointer(buf, block_len)) == NULL
+          || batch_crypt(stream, cipher, ks, p, enc_data + enc_pos, block_len) < 0) {
+        err = 1;
+        break;
+      }
+      enc_pos += block_len;
+    }
+
+    pack_len = ssh_buf_load_be32(buf->data + pos);
+    if (pack_len < 12 || pack_len > MAX_PACKET_LEN || pack_len + 4 < block_len || (pack_len + 4) % block_len != 0)
+      break;
+    rest_len = pack_len + 4 - block_len;
+    if (enc_len - enc_pos < rest_len + stream->mac_len)
+      break;
+
+    // decrypt the rest of the packet and copy the MAC after it
+    if ((p = ssh_buf_get_write_pointer(buf, rest_len + stream->mac_len)) == NULL
+        || batch_crypt(stream, cipher, ks, p, enc_data + enc_pos, rest_len) < 0) {
+      err = 1;
+      break;
+    }
+    memcpy(p + rest_len, enc_data + enc_pos + rest_len, stream->mac_len);
+    enc_pos += rest_len + stream->mac_len;
+
+    offsets[n++] = pos;
+    pos = buf->len;
+    if (buf->data[offsets[n-1] + 5] == SSH_MSG_NEWKEYS)
+      break;
+  }
+
+  // give back the keystream we didn't use
+  if (ks != NULL && ks->pos < ks->len
+      && crypto_aes_ctr_rewind(ssh_cipher_get_crypto_ctx(stream->cipher_ctx), ks->len - ks->pos) < 0)
+    err = 1;
+  if (err)
+    return -1;
+  consume_enc_data(stream, enc_pos);
+  if (n == 0)
+    return 0;
+
+  for (i = 0; i < n; i++) {
+    ssh_buf_store_be32(seq_nums[i], stream->seq_num + i);
+    msgs[i].prefix = seq_nums[i];
+    msgs[i].prefix_len = 4;
+    msgs[i].data = buf->data + offsets[i];
+    msgs[i].len = ssh_buf_load_be32(buf->data + offsets[i]) + 4;
+    msgs[i].mac = macs[i];
+  }
+  if (crypto_hmac_batch(hmac, msgs, n, MAX_RECV_BATCH_MAC_LEN) < 0)
+    return -1;
+  for (i = 0; i < n; i++) {
+    if (CRYPTO_memcmp(macs[i], msgs[i].data + msgs[i].len, stream->mac_len) != 0) {
+      ssh_log("input packet has bad MAC:\n");
+      dump_mem("received MAC", msgs[i].data + msgs[i].len, stream->mac_len);
+      dump_mem("computed MAC", macs[i], stream->mac_len);
+      ssh_set_error("bad mac in incoming packet");
+      return -1;
+    }
+  }
+
+  stream->net.read.num_verified = n;
+  return 0;
+}
+
+static ALWAYS_INLINE int recv_packet(struct SSH_STREAM *stream, struct SSH_TRANSPORT *transport, enum STREAM_CIPHER_IMPL cipher, enum STREAM_MAC_IMPL mac)
 {
   uint32_t pack_len;
   size_t min_len, pack_data_len;
 
+  // return packets verified in a batch, making a new batch if possible
+  if (mac == STREAM_MAC_IMPL_HMAC || mac == STREAM_MAC_IMPL_STITCHED) {
+    if (stream->net.read.num_verified == 0 && recv_batch(stream, cipher, mac) < 0) {
+      errno = 0;
+      return -1;
+    }
+    if (stream->net.read.num_verified > 0)
+      return pop_verified_packet(stream);
+  }
+
   // ensure we have enough to read the packet len
-  min_len = (stream->cipher_type == SSH_CIPHER_NONE) ? 4 : stream->cipher_block_len;
+  min_len = (! stream_has_cipher(stream, cipher)) ? 4 : stream->cipher_block_len;
   if (stream->net.read.buf.len < min_len
-      && stream_recv_fill_buffer(stream, sock, min_len, 0) < 0)
+      && stream_recv_fill_buffer(stream, cipher, mac, transport, min_len, 0) < 0)
     return -1;
 
   // get packet len
-  pack_len = ssh_buf_get_u32(stream->net.read.buf.data);
+  pack_len = ssh_buf_load_be32(stream->net.read.buf.data);
   if (pack_len < 12 || pack_len > MAX_PACKET_LEN) {
     ssh_set_error("invalid packet size (%u=0x%x)", pack_len, pack_len);
     errno = 0;
@@ -345,13 +791,13 @@ int ssh_stream_recv_packet(struct SSH_STREAM *stream, int sock)
 
   // read rest of the packet
   pack_data_len = pack_len + 4;
-  if (stream_recv_fill_buffer(stream, sock, pack_data_len, stream->mac_len) < 0)
+  if (stream_recv_fill_buffer(stream, cipher, mac, transport, pack_data_len, stream->mac_len) < 0)
     return -1;
 
   // return the packet
   ssh_buf_clear(&stream->pack);
-  if (ssh_buf_append_data(&stream->pack, stream->net.read.buf.data, pack_data_len) < 0
-      || ssh_buf_grow(&stream->pack, stream->mac_len) < 0) {
+  if (ssh_buf_reserve(&stream->pack, pack_data_len + stream->mac_len) < 0
+      || ssh_buf_append_data(&stream->pack, stream->net.read.buf.data, pack_data_len) < 0) {
     errno = 0;
     return -1;
   }
@@ -361,7 +807,7 @@ int ssh_stream_recv_packet(struct SSH_STREAM *stream, int sock)
     return -1;
   }
   
-  if (verify_read_packet(stream) < 0) {
+  if (verify_read_packet(stream, mac) < 0) {
     errno = 0;
     return -1;
   }
@@ -369,3 +815,36 @@ int ssh_stream_recv_packet(struct SSH_STREAM *stream, int sock)
   stream->seq_num++;
   return 0;
 }
+
+/*
+ * Read packet fom the transport.
+ *
+ * Will fail with errno=EWOULDBLOCK if the transport is non-blocking and
+ * there's no data to read, in which case it's OK to try again
+ * later.
+ */
+int ssh_stream_recv_packet(struct SSH_STREAM *stream, struct SSH_TRANSPORT *transport)
+{
+  return stream->recv_packet(stream, transport);
+}
+
+/*
+ * ==================================================================
+ * specialized packet routines
+ * ==================================================================
+ */
+
+#define DEFINE_STREAM_SUITE(name, cipher, mac)                          \
+  static int stream_send_packet_##name(struct SSH_STREAM *stream)       \
+  {                                                                     \
+    return finish_packet(stream, cipher, mac);                          \
+  }                                                                     \
+  static int stream_recv_packet_##name(struct SSH_STREAM *stream, struct SSH_TRANSPORT *transport) \
+  {                                                                     \
+    return recv_packet(stream, transport, cipher, mac);                      \
+  }
+
+DEFINE_STREAM_SUITE(none,           STREAM_CIPHER_IMPL_NONE,    STREAM_MAC_IMPL_NONE)
+DEFINE_STREAM_SUITE(generic,        STREAM_CIPHER_IMPL_GENERIC, STREAM_MAC_IMPL_GENERIC)
+DEFINE_STREAM_SUITE(aes_hmac,       STREAM_CIPHER_IMPL_AES,     STREAM_MAC_IMPL_HMAC)
+DEFINE_STREAM_SUITE(aes_ctr_hmac_sha256, STREAM_CIPHER_IMPL_AES, STREAM_MAC_IMPL_STITCHED)
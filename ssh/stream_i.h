@@ -4,8 +4,10 @@
 #define STREAM_I_H_FILE
 
 #include "common/buffer.h"
+#include "common/transport_i.h"
 #include "ssh/cipher_i.h"
 #include "ssh/mac_i.h"
+#include "ssh/hash_i.h"
 
 #include <stdint.h>
 
@@ -21,8 +23,17 @@ struct SSH_STREAM_WRITE_DATA {
 struct SSH_STREAM_READ_DATA {
   struct SSH_BUFFER buf;
   struct SSH_BUFFER buf_enc;
+  size_t enc_start;                // data in 'buf_enc' before this offset was already consumed
+  uint8_t mac[SSH_HASH_MAX_LEN];   // MAC computed while decrypting (stitched cipher+MAC)
+  uint32_t num_verified;           // packets in 'buf' already decrypted and verified...
+  size_t verified_pos;             // ...starting at this offset
 };
 
+struct SSH_STREAM;
+
+typedef int (*ssh_stream_fn_send_packet)(struct SSH_STREAM *stream);
+typedef int (*ssh_stream_fn_recv_packet)(struct SSH_STREAM *stream, struct SSH_TRANSPORT *transport);
+
 struct SSH_STREAM {
   uint32_t seq_num;
   struct SSH_BUFFER pack;
@@ -40,19 +51,25 @@ struct SSH_STREAM {
   enum SSH_MAC_TYPE mac_type;
   struct SSH_MAC_CTX *mac_ctx;
   uint32_t mac_len;
+
+  // packet routines for the current cipher and MAC
+  ssh_stream_fn_send_packet send_packet;
+  ssh_stream_fn_recv_packet recv_packet;
 };
 
-void ssh_stream_init(struct SSH_STREAM *stream, enum SSH_STREAM_TYPE type);
+void ssh_stream_init(struct SSH_STREAM *stream, enum SSH_STREAM_TYPE type, struct SSH_ALLOCATOR *allocator);
 void ssh_stream_close(struct SSH_STREAM *stream);
+int ssh_stream_reserve_buffers(struct SSH_STREAM *stream);
 
 int ssh_stream_set_cipher(struct SSH_STREAM *stream, enum SSH_CIPHER_TYPE type, enum SSH_CIPHER_DIRECTION dir, struct SSH_STRING *iv, struct SSH_STRING *key);
 int ssh_stream_set_mac(struct SSH_STREAM *stream, enum SSH_MAC_TYPE type, struct SSH_STRING *key);
+void ssh_stream_newkeys(struct SSH_STREAM *stream);
 
 struct SSH_BUFFER *ssh_stream_new_packet(struct SSH_STREAM *stream);
-int ssh_stream_send_packet(struct SSH_STREAM *stream, int sock);
+int ssh_stream_send_packet(struct SSH_STREAM *stream, struct SSH_TRANSPORT *transport);
 int ssh_stream_send_is_pending(struct SSH_STREAM *stream);
-int ssh_stream_send_flush(struct SSH_STREAM *stream, int sock);
+int ssh_stream_send_flush(struct SSH_STREAM *stream, struct SSH_TRANSPORT *transport);
 
-int ssh_stream_recv_packet(struct SSH_STREAM *stream, int sock);
+int ssh_stream_recv_packet(struct SSH_STREAM *stream, struct SSH_TRANSPORT *transport);
 
 #endif /* STREAM_I_H_FILE */
@@ -10,6 +10,7 @@
 #include "ssh/userauth_i.h"
 
 #include "ssh/connection_i.h"
+#include "ssh/message_i.h"
 
 #include "common/error.h"
 #include "common/debug.h"
@@ -33,11 +34,12 @@ static int userauth_init(struct SSH_CONN *conn)
 {
   struct SSH_BUFFER *wpack;
   struct SSH_BUF_READER *rpack;
-  struct SSH_STRING accept_service;
+  struct SSH_MSG_service_request request;
+  struct SSH_MSG_service_accept accept;
   
+  request.service_name = ssh_str_new_from_cstring("ssh-userauth");
   if ((wpack = ssh_conn_new_packet(conn)) == NULL
-      || ssh_buf_write_u8(wpack, SSH_MSG_SERVICE_REQUEST) < 0
-      || ssh_buf_write_cstring(wpack, "ssh-userauth") < 0
+      || ssh_msg_build_service_request(wpack, &request) < 0
       || ssh_conn_send_packet(conn) < 0) {
     return -1;
   }
@@ -48,9 +50,8 @@ static int userauth_init(struct SSH_CONN *conn)
     ssh_set_error("unexpected packet type: %d (expected SSH_MSG_SERVICE_ACCEPT=%d)", ssh_packet_get_type(rpack), SSH_MSG_SERVICE_ACCEPT);
     return -1;
   }
-  if (ssh_buf_read_u8(rpack, NULL) < 0
-      || ssh_buf_read_string(rpack, &accept_service) < 0
-      || ssh_str_cmp_cstring(&accept_service, "ssh-userauth") != 0) {
+  if (ssh_msg_parse_service_accept(rpack, &accept) < 0
+      || ssh_str_cmp_cstring(&accept.service_name, "ssh-userauth") != 0) {
     dump_packet_reader("ERROR PACKET:", rpack, 0);
     ssh_set_error("invalid SSH_MSG_SERVICE_ACCEPT response");
     return -1;
@@ -62,8 +63,8 @@ static int userauth_init(struct SSH_CONN *conn)
 static int userauth_read_response(struct SSH_CONN *conn, enum SSH_USERAUTH_RESULT *result)
 {
   struct SSH_BUF_READER *pack;
+  struct SSH_MSG_userauth_failure failure;
   uint8_t pack_type;
-  uint8_t partial_success;
   
   ssh_log("* reading userauth response\n");
   if ((pack = ssh_conn_recv_packet_skip_ignore(conn)) == NULL)
@@ -77,9 +78,9 @@ static int userauth_read_response(struct SSH_CONN *conn, enum SSH_USERAUTH_RESUL
     return 0;
 
   case SSH_MSG_USERAUTH_FAILURE:
-    if (ssh_buf_read_u8(pack, &partial_success) < 0)
+    if (ssh_msg_parse_userauth_failure(pack, &failure) < 0)
       return -1;
-    *result = (partial_success) ? SSH_USERAUTH_RESULT_PARTIAL_FAILURE : SSH_USERAUTH_RESULT_FAILURE;
+    *result = (failure.partial_success) ? SSH_USERAUTH_RESULT_PARTIAL_FAILURE : SSH_USERAUTH_RESULT_FAILURE;
     return 0;
 
   default:
@@ -91,6 +92,7 @@ static int userauth_read_response(struct SSH_CONN *conn, enum SSH_USERAUTH_RESUL
 static int userauth_method_password(struct SSH_CONN *conn, enum SSH_USERAUTH_RESULT *result)
 {
   struct SSH_BUFFER *pack;
+  struct SSH_MSG_userauth_request_password msg;
   struct SSH_STRING server_hostname;
   struct SSH_STRING username;
   ssh_conn_password_reader password_reader;
@@ -101,18 +103,19 @@ static int userauth_method_password(struct SSH_CONN *conn, enum SSH_USERAUTH_RES
   username = ssh_conn_get_username(conn);
   password_reader = ssh_conn_get_password_reader(conn);
 
+  msg.username = username;
+  msg.service_name = ssh_str_new_from_cstring("ssh-connection");
+  msg.method_name = ssh_str_new_from_cstring("password");
+  msg.change_password = 0;
+
   for (num_tries = 0; num_tries < MAX_PASSWORD_TRIES; num_tries++) {
     if (password_reader((char *) server_hostname.str, (char *) username.str, password, sizeof(password), num_tries != 0) < 0) {
       *result = SSH_USERAUTH_RESULT_FAILURE;
       return 0;
     }
+    msg.password = ssh_str_new_from_cstring(password);
     if ((pack = ssh_conn_new_packet(conn)) == NULL
-        || ssh_buf_write_u8(pack, SSH_MSG_USERAUTH_REQUEST) < 0
-        || ssh_buf_write_string(pack, &username) < 0
-        || ssh_buf_write_cstring(pack, "ssh-connection") < 0
-        || ssh_buf_write_cstring(pack, "password") < 0
-        || ssh_buf_write_u8(pack, 0) < 0
-        || ssh_buf_write_cstring(pack, password) < 0
+        || ssh_msg_build_userauth_request_password(pack, &msg) < 0
         || ssh_conn_send_packet(conn) < 0
         || userauth_read_response(conn, result) < 0)
       return -1;
@@ -126,14 +129,13 @@ static int userauth_method_password(struct SSH_CONN *conn, enum SSH_USERAUTH_RES
 static int userauth_method_none(struct SSH_CONN *conn, enum SSH_USERAUTH_RESULT *result)
 {
   struct SSH_BUFFER *pack;
-  struct SSH_STRING username;
+  struct SSH_MSG_userauth_request_none msg;
   
-  username = ssh_conn_get_username(conn);
+  msg.username = ssh_conn_get_username(conn);
+  msg.service_name = ssh_str_new_from_cstring("ssh-connection");
+  msg.method_name = ssh_str_new_from_cstring("none");
   if ((pack = ssh_conn_new_packet(conn)) == NULL
-      || ssh_buf_write_u8(pack, SSH_MSG_USERAUTH_REQUEST) < 0
-      || ssh_buf_write_string(pack, &username) < 0
-      || ssh_buf_write_cstring(pack, "ssh-connection") < 0
-      || ssh_buf_write_cstring(pack, "none") < 0
+      || ssh_msg_build_userauth_request_none(pack, &msg) < 0
       || ssh_conn_send_packet(conn) < 0)
     return -1;
 
@@ -7,7 +7,7 @@
 
 #include "ssh/version_string_i.h"
 
-#include "common/network_i.h"
+#include "common/transport_i.h"
 
 #include "common/error.h"
 #include "common/debug.h"
@@ -57,7 +57,7 @@ static int get_version_line(const uint8_t *in, size_t in_len, const uint8_t **ve
   return 0;
 }
 
-static int read_line(int sock, struct SSH_VERSION_STRING *ver_str, struct SSH_BUFFER *buf)
+static int read_line(struct SSH_TRANSPORT *transport, struct SSH_VERSION_STRING *ver_str, struct SSH_BUFFER *buf)
 {
   ssize_t read_len;
   const uint8_t *ver, *rest;
@@ -67,7 +67,7 @@ static int read_line(int sock, struct SSH_VERSION_STRING *ver_str, struct SSH_BU
   while (1) {
     if (ssh_buf_grow(buf, VERSION_BUF_LEN) < 0)
       return -1;
-    read_len = ssh_net_read(sock, buf->data + buf->len, VERSION_BUF_LEN);
+    read_len = ssh_transport_read(transport, buf->data + buf->len, VERSION_BUF_LEN);
     if (read_len < 0)
       return -1;
     buf->len += read_len;
@@ -125,12 +125,12 @@ static int parse_line(struct SSH_VERSION_STRING *ver_str)
 }
 
 /*
- * Read version string from the socket. Any extra data read from the
- * socket is put in 'rest'.
+ * Read version string from the transport. Any extra data read from the
+ * transport is put in 'rest'.
  */
-int ssh_version_string_read(struct SSH_VERSION_STRING *ver_str, int sock, struct SSH_BUFFER *rest)
+int ssh_version_string_read(struct SSH_VERSION_STRING *ver_str, struct SSH_TRANSPORT *transport, struct SSH_BUFFER *rest)
 {
-  if (read_line(sock, ver_str, rest) < 0
+  if (read_line(transport, ver_str, rest) < 0
       || parse_line(ver_str) < 0)
     return -1;
   return 0;